@@ -0,0 +1,322 @@
+/*
+ * Auto-learned blacklist.
+ * Buckets of AB_WAYS 64 bit slots fill one cache line, a slot holds the
+ * source in its high half and its state in the low half, so every
+ * change of a slot is one cmpxchg and the packet path takes no lock.
+ * The CLOCK hand of a bucket clears the referenced bit and halves the
+ * count of the slots it passes, and evicts the first slot found without
+ * the bit, so counts decay and a flood of spoofed sources only ever
+ * recycles the slots of sources that were not seen again.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include "log.h"
+#include "autoblock.h"
+
+#define AB_WAYS         8
+#define AB_BLOCKED      (1ULL << 31)
+#define AB_REF          (1ULL << 30)
+#define AB_COUNT        0xffffULL
+#define AB_IP(s)        ((u32)((s) >> 32))
+#define AB_SHOW_MAX     256       /* blocked sources listed by show */
+
+struct ab_table {
+    u32 buckets;          /* power of 2 */
+    u32 seed;
+    u8 *hands;            /* CLOCK hand of each bucket */
+    u64 *slots;           /* buckets * AB_WAYS */
+};
+
+struct ab_stat {
+    u64 inserted;         /* sources taking a free slot */
+    u64 evicted;          /* sources losing their slot to a new one */
+    u64 evicted_blocked;  /* of those, sources that were blocked */
+    u64 promoted;         /* sources reaching the threshold */
+    u64 blocked;          /* packets dropped */
+    u64 missed;           /* hits not counted, the bucket kept changing */
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_autoblock_key);
+static DEFINE_PER_CPU(struct ab_stat, ab_stat);
+
+static struct ab_table __rcu *ab_table;
+static DEFINE_MUTEX(ab_mutex);
+static unsigned int ab_size = 65536;       /* slots */
+static unsigned int ab_threshold = 100;    /* hits to block a source */
+
+static struct ab_table *ab_table_new( unsigned int size )
+{
+    struct ab_table *t;
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if( !t ) return NULL;
+    t->buckets = size / AB_WAYS;
+    t->seed = get_random_u32();
+    t->hands = kvzalloc(t->buckets, GFP_KERNEL);
+    t->slots = kvzalloc(array_size(size, sizeof(u64)), GFP_KERNEL);
+    if( !t->hands || !t->slots ){
+        kvfree(t->hands);
+        kvfree(t->slots);
+        kfree(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void ab_table_free( struct ab_table *t )
+{
+    if( !t ) return;
+    kvfree(t->hands);
+    kvfree(t->slots);
+    kfree(t);
+}
+
+static inline u64 *ab_bucket( struct ab_table *t, u32 ip, u32 *b )
+{
+    *b = jhash_1word(ip, t->seed) & (t->buckets - 1);
+    return &t->slots[(size_t)*b * AB_WAYS];
+}
+
+int __fw_autoblock_test( u32 ip )
+{
+    struct ab_table *t;
+    u64 *slot;
+    u64 s;
+    u32 b;
+    int i, ret = 0;
+    rcu_read_lock();
+    t = rcu_dereference(ab_table);
+    if( !t ) goto out;
+    slot = ab_bucket(t, ip, &b);
+    for( i=0; i<AB_WAYS; i++ ){
+        s = READ_ONCE(slot[i]);
+        if( AB_IP(s) != ip || !(s & AB_BLOCKED) ) continue;
+        /* the line is only written when the bit is missing */
+        if( !(s & AB_REF) )
+            cmpxchg64(&slot[i], s, s | AB_REF);
+        this_cpu_inc(ab_stat.blocked);
+        ret = 1;
+        break;
+    }
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * One more hit of the source of slot value [s], blocked at once if [block].
+ * */
+static inline u64 ab_count( u64 s, int block, int *promoted )
+{
+    u64 count = s & AB_COUNT;
+    if( count < AB_COUNT ) count++;
+    s = (s & ~AB_COUNT) | count | AB_REF;
+    *promoted = 0;
+    if( !(s & AB_BLOCKED) && (block || count >= READ_ONCE(ab_threshold)) ){
+        s |= AB_BLOCKED;
+        *promoted = 1;
+    }
+    return s;
+}
+
+static int ab_hit( struct ab_table *t, u32 ip, int block )
+{
+    u64 *slot;
+    u64 s, new;
+    u32 b;
+    int i, hand, promoted;
+    int free = -1;
+
+    slot = ab_bucket(t, ip, &b);
+    for( i=0; i<AB_WAYS; i++ ){
+        s = READ_ONCE(slot[i]);
+        if( s == 0 ){
+            if( free < 0 ) free = i;
+            continue;
+        }
+        if( AB_IP(s) != ip ) continue;
+        new = ab_count(s, block, &promoted);
+        if( cmpxchg64(&slot[i], s, new) != s ) return -EAGAIN;
+        if( promoted ) this_cpu_inc(ab_stat.promoted);
+        return 0;
+    }
+    new = ab_count((u64)ip << 32, block, &promoted);
+    if( free >= 0 ){
+        if( cmpxchg64(&slot[free], 0, new) != 0 ) return -EAGAIN;
+        this_cpu_inc(ab_stat.inserted);
+        if( promoted ) this_cpu_inc(ab_stat.promoted);
+        return 0;
+    }
+    /* two turns of the hand find a slot without the referenced bit */
+    hand = READ_ONCE(t->hands[b]);
+    for( i=0; i<2*AB_WAYS; i++ ){
+        hand = (hand + 1) % AB_WAYS;
+        s = READ_ONCE(slot[hand]);
+        if( s & AB_REF ){
+            cmpxchg64(&slot[hand], s, (s & ~(AB_REF | AB_COUNT)) | ((s & AB_COUNT) >> 1));
+            continue;
+        }
+        if( cmpxchg64(&slot[hand], s, new) != s ) continue;
+        WRITE_ONCE(t->hands[b], hand);
+        this_cpu_inc(ab_stat.evicted);
+        if( s & AB_BLOCKED ) this_cpu_inc(ab_stat.evicted_blocked);
+        if( promoted ) this_cpu_inc(ab_stat.promoted);
+        return 0;
+    }
+    WRITE_ONCE(t->hands[b], hand);
+    return -EAGAIN;
+}
+
+static void ab_feed( u32 ip, int block )
+{
+    struct ab_table *t;
+    int tries;
+    /* address 0 marks a free slot */
+    if( ip == 0 ) return;
+    rcu_read_lock();
+    t = rcu_dereference(ab_table);
+    if( t ){
+        for( tries=0; tries<3; tries++ )
+            if( ab_hit(t, ip, block) == 0 ) break;
+        if( tries == 3 )
+            this_cpu_inc(ab_stat.missed);
+    }
+    rcu_read_unlock();
+}
+
+void __fw_autoblock_hit( u32 ip )
+{
+    ab_feed(ip, 0);
+}
+
+void __fw_autoblock_block( u32 ip )
+{
+    ab_feed(ip, 1);
+}
+
+/*
+ * Replace the table by an empty one of ab_size slots.
+ * */
+static int ab_reset( void )
+{
+    struct ab_table *t, *old;
+    t = ab_table_new(ab_size);
+    if( !t ) return -ENOMEM;
+    old = rcu_dereference_protected(ab_table, lockdep_is_held(&ab_mutex));
+    rcu_assign_pointer(ab_table, t);
+    synchronize_rcu();
+    ab_table_free(old);
+    return 0;
+}
+
+/*
+ * "1" to learn and block, "0" to stop, "flush" to forget all sources,
+ * "threshold <hits>" to block a source, "size <slots>" of the table.
+ * */
+int fw_autoblock_write( char *buf )
+{
+    unsigned int n;
+    int ret = 0;
+    mutex_lock(&ab_mutex);
+    if( strcmp(buf, "1") == 0 ){
+        if( !rcu_access_pointer(ab_table) )
+            ret = ab_reset();
+        if( !ret )
+            static_branch_enable(&fw_autoblock_key);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_autoblock_key);
+    }else if( strcmp(buf, "flush") == 0 ){
+        if( rcu_access_pointer(ab_table) )
+            ret = ab_reset();
+    }else if( sscanf(buf, "threshold %u", &n) == 1 ){
+        if( n == 0 || n > AB_COUNT ) ret = -EINVAL;
+        else WRITE_ONCE(ab_threshold, n);
+    }else if( sscanf(buf, "size %u", &n) == 1 ){
+        if( n < 1024 || n > (1 << 24) ){
+            ret = -EINVAL;
+        }else{
+            ab_size = roundup_pow_of_two(n);
+            if( rcu_access_pointer(ab_table) )
+                ret = ab_reset();
+        }
+    }else{
+        ret = -EINVAL;
+    }
+    mutex_unlock(&ab_mutex);
+    return ret;
+}
+
+int fw_autoblock_show( struct seq_file *m, void *v )
+{
+    struct ab_stat sum = {0};
+    struct ab_stat *st;
+    struct ab_table *t;
+    size_t i, used = 0, blocked = 0;
+    u64 s;
+    u32 ip;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&ab_stat, cpu);
+        sum.inserted += st->inserted;
+        sum.evicted += st->evicted;
+        sum.evicted_blocked += st->evicted_blocked;
+        sum.promoted += st->promoted;
+        sum.blocked += st->blocked;
+        sum.missed += st->missed;
+    }
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_autoblock_key));
+    seq_printf(m, "threshold %u\n", ab_threshold);
+    seq_printf(m, "size %u\n", ab_size);
+    mutex_lock(&ab_mutex);
+    t = rcu_dereference_protected(ab_table, lockdep_is_held(&ab_mutex));
+    if( t ){
+        for( i=0; i<(size_t)t->buckets * AB_WAYS; i++ ){
+            s = READ_ONCE(t->slots[i]);
+            if( !s ) continue;
+            used++;
+            if( s & AB_BLOCKED ) blocked++;
+        }
+    }
+    seq_printf(m, "used %zu\n", used);
+    seq_printf(m, "blocked %zu\n", blocked);
+    seq_printf(m, "inserted %llu\n", sum.inserted);
+    seq_printf(m, "evicted %llu\n", sum.evicted);
+    seq_printf(m, "evicted_blocked %llu\n", sum.evicted_blocked);
+    seq_printf(m, "promoted %llu\n", sum.promoted);
+    seq_printf(m, "dropped %llu\n", sum.blocked);
+    seq_printf(m, "missed %llu\n", sum.missed);
+    if( t ){
+        blocked = 0;
+        for( i=0; i<(size_t)t->buckets * AB_WAYS && blocked < AB_SHOW_MAX; i++ ){
+            s = READ_ONCE(t->slots[i]);
+            if( !(s & AB_BLOCKED) ) continue;
+            ip = AB_IP(s);
+            seq_printf(m, "%pI4h %llu\n", &ip, s & AB_COUNT);
+            blocked++;
+        }
+    }
+    mutex_unlock(&ab_mutex);
+    return 0;
+}
+
+void fw_autoblock_exit( void )
+{
+    struct ab_table *t;
+    static_branch_disable(&fw_autoblock_key);
+    mutex_lock(&ab_mutex);
+    t = rcu_dereference_protected(ab_table, lockdep_is_held(&ab_mutex));
+    RCU_INIT_POINTER(ab_table, NULL);
+    mutex_unlock(&ab_mutex);
+    synchronize_rcu();
+    ab_table_free(t);
+}
@@ -0,0 +1,57 @@
+#ifndef _AUTOBLOCK_H
+#define _AUTOBLOCK_H
+
+/*
+ * Auto-learned blacklist, switched by /proc/simplefirewall/autoblock.
+ * Sources dropped by the default verdict or by the connection limit, but
+ * for those an IP or CIDR whitelist accepted, are counted in a table of
+ * fixed size, a source reaching the threshold is blocked until it is
+ * evicted. The table never grows: when the slots of a bucket are taken
+ * the CLOCK hand evicts one, and sources seen again since the last pass
+ * of the hand survive.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_autoblock_key);
+
+int __fw_autoblock_test( u32 ip );
+void __fw_autoblock_hit( u32 ip );
+void __fw_autoblock_block( u32 ip );
+
+/*
+ * 1 if [ip] is blocked.
+ * */
+static inline int fw_autoblock_test( u32 ip )
+{
+    if( static_branch_unlikely(&fw_autoblock_key) )
+        return __fw_autoblock_test(ip);
+    return 0;
+}
+
+/*
+ * Count a bad packet from [ip].
+ * */
+static inline void fw_autoblock_hit( u32 ip )
+{
+    if( static_branch_unlikely(&fw_autoblock_key) )
+        __fw_autoblock_hit(ip);
+}
+
+/*
+ * Block [ip] without waiting for the threshold.
+ * */
+static inline void fw_autoblock_block( u32 ip )
+{
+    if( static_branch_unlikely(&fw_autoblock_key) )
+        __fw_autoblock_block(ip);
+}
+
+int fw_autoblock_show( struct seq_file *m, void *v );
+int fw_autoblock_write( char *buf );
+
+void fw_autoblock_exit( void );
+
+#endif
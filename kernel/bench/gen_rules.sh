@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Load a generated ruleset into simplefirewall.
+#
+# Address plan, shared with run.sh:
+#   10.0.0.0 + i           ip blacklist, i < RULES_IP
+#   11.0.0.0 + i           ip whitelist, i < RULES_IP
+#   96.0.0.0 + (i << 12)   cidr blacklist, i < RULES_CIDR, lengths from CIDR_LENS
+#   1000 + 10*i ... +4     port whitelist, i < RULES_PORT
+#
+# usage: gen_rules.sh
+# environment: RULES_IP RULES_CIDR CIDR_LENS RULES_PORT
+
+set -e
+
+PROC=/proc/simplefirewall
+RULES_IP=${RULES_IP:-100000}
+RULES_CIDR=${RULES_CIDR:-10000}
+CIDR_LENS=${CIDR_LENS:-"20 24 28 32"}
+RULES_PORT=${RULES_PORT:-100}
+CHUNK=4000
+
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+# load <file> <proc file>, whole lines per write
+load() {
+    split -l $CHUNK "$1" "$1."
+    for f in "$1".*; do
+        cat "$f" > "$2"
+    done
+}
+
+ips() {
+    awk -v base=$1 -v n=$2 'BEGIN {
+        for (i = 0; i < n; i++) {
+            a = base + i
+            printf "%d.%d.%d.%d\n", int(a / 16777216) % 256, int(a / 65536) % 256, int(a / 256) % 256, a % 256
+        }
+    }'
+}
+
+ips $((10 << 24)) $RULES_IP > $TMP/black
+ips $((11 << 24)) $RULES_IP > $TMP/white
+
+awk -v n=$RULES_CIDR -v lens="$CIDR_LENS" 'BEGIN {
+    m = split(lens, len, " ")
+    for (i = 0; i < n; i++) {
+        a = 96 * 16777216 + i * 4096
+        printf "%d.%d.%d.%d/%d\n", int(a / 16777216) % 256, int(a / 65536) % 256, int(a / 256) % 256, a % 256, len[i % m + 1]
+    }
+}' > $TMP/cidr
+
+awk -v n=$RULES_PORT 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "%d-%d\n", 1000 + 10 * i, 1004 + 10 * i
+}' > $TMP/port
+
+load $TMP/black $PROC/ip/blacklist/add
+load $TMP/white $PROC/ip/whitelist/add
+load $TMP/cidr $PROC/cidr/blacklist/add
+load $TMP/port $PROC/port/whitelist/add
+
+echo "rules: ip $RULES_IP+$RULES_IP cidr $RULES_CIDR ($CIDR_LENS) port $RULES_PORT"
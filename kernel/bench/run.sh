@@ -0,0 +1,153 @@
+#!/bin/bash
+#
+# Packet rate benchmark of simplefirewall, no external network needed.
+#
+# pktgen sends UDP from vb1 in the private netns $NS to vb0 in the init
+# netns, where the module hooks PRE_ROUTING. The same traffic is measured
+# without the module and with the module loaded with a generated ruleset.
+#
+# Traffic classes, mixed by packet count (MIX is black:cidr:white:other):
+#   black  sources in the ip blacklist
+#   cidr   sources in the blocks of the cidr blacklist
+#   white  sources in the ip whitelist
+#   other  unmatched sources, half of them to whitelisted ports
+#
+# usage: run.sh <simplefirewall.ko>
+# environment:
+#   PKTS      packets per run (default 5000000)
+#   PKT_SIZE  packet size (default 64)
+#   MIX       percent of each class (default 20:20:20:40)
+#   CPU       cpu of the pktgen thread (default 0)
+#   RULES_IP RULES_CIDR CIDR_LENS RULES_PORT, see gen_rules.sh
+#
+# Output per run: packets/s received on vb0, packets dropped before UDP,
+# and cycles per packet of the whole system if perf is installed.
+# The difference of the two runs is the cost of the module.
+
+set -e
+
+KO=${1:?usage: run.sh <simplefirewall.ko>}
+DIR=$(cd "$(dirname "$0")" && pwd)
+NS=fwbench
+PKTS=${PKTS:-5000000}
+PKT_SIZE=${PKT_SIZE:-64}
+MIX=${MIX:-20:20:20:40}
+CPU=${CPU:-0}
+RULES_IP=${RULES_IP:-100000}
+RULES_CIDR=${RULES_CIDR:-10000}
+RULES_PORT=${RULES_PORT:-100}
+export RULES_IP RULES_CIDR RULES_PORT CIDR_LENS
+
+DST=198.51.100.1
+SRC=198.51.100.2
+
+if [ $(id -u) -ne 0 ]; then
+    echo "run.sh must run as root" >&2
+    exit 1
+fi
+
+RP_ALL=$(sysctl -n net.ipv4.conf.all.rp_filter)
+
+cleanup() {
+    rmmod simplefirewall 2>/dev/null || true
+    iptables -t raw -D PREROUTING -i vb0 -j NOTRACK 2>/dev/null || true
+    ip link del vb0 2>/dev/null || true
+    ip netns del $NS 2>/dev/null || true
+    sysctl -qw net.ipv4.conf.all.rp_filter=$RP_ALL
+}
+trap cleanup EXIT
+
+nsx() {
+    ip netns exec $NS "$@"
+}
+
+pgset() {
+    nsx sh -c "echo '$2' > /proc/net/pktgen/$1"
+}
+
+setup() {
+    modprobe pktgen
+    ip netns add $NS
+    ip link add vb0 type veth peer name vb1
+    ip link set vb1 netns $NS
+    ip addr add $DST/24 dev vb0
+    ip link set vb0 up
+    nsx ip addr add $SRC/24 dev vb1
+    nsx ip link set vb1 up
+    # spoofed sources must reach the hook and UDP
+    sysctl -qw net.ipv4.conf.all.rp_filter=0
+    sysctl -qw net.ipv4.conf.vb0.rp_filter=0
+    # untracked packets go through every stage instead of the conntrack bypass
+    iptables -t raw -I PREROUTING -i vb0 -j NOTRACK 2>/dev/null || \
+        echo "iptables not found, tracked packets bypass the filter stages"
+}
+
+# device <index> <count> <src_min> <src_max> <dport_min> <dport_max>
+device() {
+    local dev=vb1@$1
+    [ $2 -gt 0 ] || return 0
+    pgset kpktgend_$CPU "add_device $dev"
+    pgset $dev "count $2"
+    pgset $dev "pkt_size $PKT_SIZE"
+    pgset $dev "clone_skb 0"
+    pgset $dev "delay 0"
+    pgset $dev "dst $DST"
+    pgset $dev "dst_mac $(cat /sys/class/net/vb0/address)"
+    pgset $dev "src_min $3"
+    pgset $dev "src_max $4"
+    pgset $dev "flag IPSRC_RND"
+    pgset $dev "udp_dst_min $5"
+    pgset $dev "udp_dst_max $6"
+    pgset $dev "flag UDPDST_RND"
+}
+
+ip_of() {
+    local a=$1
+    echo "$((a >> 24 & 255)).$((a >> 16 & 255)).$((a >> 8 & 255)).$((a & 255))"
+}
+
+pktgen_setup() {
+    local black cidr white other
+    IFS=: read black cidr white other <<< "$MIX"
+    pgset kpktgend_$CPU "rem_device_all"
+    device 0 $((PKTS * black / 100)) 10.0.0.0 $(ip_of $(((10 << 24) + RULES_IP - 1))) 9 9
+    device 1 $((PKTS * cidr / 100)) 96.0.0.0 $(ip_of $(((96 << 24) + RULES_CIDR * 4096 - 1))) 9 9
+    device 2 $((PKTS * white / 100)) 11.0.0.0 $(ip_of $(((11 << 24) + RULES_IP - 1))) 9 9
+    device 3 $((PKTS * other / 100)) 192.0.2.0 192.0.2.255 1000 $((1000 + RULES_PORT * 10 - 1))
+}
+
+udp_in() {
+    awk '/^Udp:/ && $2 ~ /^[0-9]/ { print $2 + $3 + $4 }' /proc/net/snmp
+}
+
+rx() {
+    cat /sys/class/net/vb0/statistics/rx_packets
+}
+
+# measure <label>
+measure() {
+    local rx0 udp0 rx1 udp1 t0 t1 cycles out
+    pktgen_setup
+    rx0=$(rx); udp0=$(udp_in)
+    t0=$(date +%s%N)
+    if command -v perf > /dev/null; then
+        out=$(perf stat -a -x, -e cycles -- sh -c "ip netns exec $NS sh -c 'echo start > /proc/net/pktgen/pgctrl'" 2>&1 >/dev/null)
+        cycles=$(echo "$out" | awk -F, '/cycles/ { print $1 }')
+    else
+        pgset pgctrl start
+        cycles=
+    fi
+    t1=$(date +%s%N)
+    rx1=$(rx); udp1=$(udp_in)
+    awk -v l="$1" -v p=$((rx1 - rx0)) -v u=$((udp1 - udp0)) -v ns=$((t1 - t0)) -v c="$cycles" 'BEGIN {
+        printf "%-10s %12.0f pps %10d drops %10s cycles/pkt\n", l, p / ns * 1e9, p - u,
+            (c != "" && p > 0) ? sprintf("%.0f", c / p) : "-"
+    }'
+}
+
+setup
+echo "packets $PKTS size $PKT_SIZE mix black:cidr:white:other $MIX"
+measure unloaded
+insmod "$KO"
+"$DIR/gen_rules.sh"
+measure loaded
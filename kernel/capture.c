@@ -0,0 +1,369 @@
+/*
+ * Drop capture.
+ * Each cpu writes the sampled drops into its own ring, a record is
+ * guarded by a sequence count, odd while written, so the packet path
+ * takes no lock and never waits for readers. Readers keep their own
+ * position in every ring, a reader falling behind by more than a ring
+ * loses the overwritten records. Readers poll the rings, the packet path
+ * never wakes anybody up.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
+#include <linux/netdevice.h>
+#include <linux/timekeeping.h>
+#include "log.h"
+#include "capture.h"
+
+#define CAP_RECS 256               /* records per cpu, power of 2 */
+#define CAP_SNAP_MAX 256
+#define CAP_SNAP_DEFAULT 128
+#define CAP_COMMENT_MAX 64
+#define CAP_BLOCK_MAX (32 + CAP_SNAP_MAX + 4 + CAP_COMMENT_MAX + 8)
+
+/* pcapng block types and options */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_TSRESOL 9
+#define LINKTYPE_RAW 101           /* packets start at the IP header */
+
+struct cap_rec {
+    unsigned int seq;              /* odd while the record is written */
+    unsigned long idx;             /* position in the ring when written */
+    u8 stage;
+    u16 caplen;
+    u32 len;
+    u64 ts;                        /* ns since the epoch */
+    char dev[IFNAMSIZ];
+    u8 data[CAP_SNAP_MAX];
+};
+
+struct cap_ring {
+    unsigned long head;            /* records written, only by the owning cpu */
+    unsigned int countdown;        /* drops until the next sample */
+    struct cap_rec recs[CAP_RECS];
+};
+
+struct cap_reader {
+    unsigned long *tail;           /* next record to read, by cpu */
+    int cpu;                       /* ring to look at first */
+    size_t off;
+    size_t len;                    /* bytes of buf not read yet from off */
+    struct cap_rec rec;
+    u8 buf[CAP_BLOCK_MAX];
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_capture_key);
+
+static DEFINE_PER_CPU(struct cap_ring *, cap_ring);
+static DEFINE_MUTEX(cap_mutex);
+static unsigned int cap_rate;      /* one in cap_rate drops, 0 disabled */
+static unsigned int cap_snaplen = CAP_SNAP_DEFAULT;
+
+void __fw_capture_drop( struct sk_buff *skb, enum fw_stage stage )
+{
+    struct cap_ring *r;
+    struct cap_rec *rec;
+    unsigned int seq, rate;
+
+    r = get_cpu_var(cap_ring);
+    if( !r || --r->countdown ) goto out;
+    rate = READ_ONCE(cap_rate);
+    r->countdown = rate ? rate : 1;
+
+    rec = &r->recs[r->head & (CAP_RECS - 1)];
+    seq = rec->seq + 1;
+    WRITE_ONCE(rec->seq, seq);
+    smp_wmb();
+    rec->idx = r->head;
+    rec->stage = stage;
+    rec->len = skb->len;
+    rec->caplen = min_t(u32, skb->len, READ_ONCE(cap_snaplen));
+    rec->ts = ktime_get_real_ns();
+    if( skb->dev )
+        memcpy(rec->dev, skb->dev->name, IFNAMSIZ);
+    else
+        rec->dev[0] = 0;
+    /* skb->data is the IP header in PRE_ROUTING */
+    if( skb_copy_bits(skb, 0, rec->data, rec->caplen) )
+        rec->caplen = 0;
+    smp_wmb();
+    WRITE_ONCE(rec->seq, seq + 1);
+    smp_store_release(&r->head, r->head + 1);
+out:
+    put_cpu_var(cap_ring);
+}
+
+static inline u8 *put16( u8 *p, u16 v )
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline u8 *put32( u8 *p, u32 v )
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static u8 *put_pad( u8 *p, const void *data, size_t len )
+{
+    size_t pad = ALIGN(len, 4) - len;
+    memcpy(p, data, len);
+    memset(p + len, 0, pad);
+    return p + len + pad;
+}
+
+/*
+ * Section header and the one interface, in host byte order
+ * which the byte-order magic tells the reader.
+ * */
+static size_t cap_put_header( u8 *buf )
+{
+    u8 *p = buf;
+    u8 tsresol = 9;     /* nanoseconds */
+
+    p = put32(p, PCAPNG_SHB);
+    p = put32(p, 28);
+    p = put32(p, PCAPNG_MAGIC);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    p = put32(p, 0xffffffff);      /* section length unknown */
+    p = put32(p, 0xffffffff);
+    p = put32(p, 28);
+
+    p = put32(p, PCAPNG_IDB);
+    p = put32(p, 32);
+    p = put16(p, LINKTYPE_RAW);
+    p = put16(p, 0);
+    p = put32(p, CAP_SNAP_MAX);
+    p = put16(p, PCAPNG_OPT_TSRESOL);
+    p = put16(p, 1);
+    p = put_pad(p, &tsresol, 1);
+    p = put16(p, PCAPNG_OPT_END);
+    p = put16(p, 0);
+    p = put32(p, 32);
+    return p - buf;
+}
+
+static size_t cap_put_packet( u8 *buf, struct cap_rec *rec, int cpu )
+{
+    char comment[CAP_COMMENT_MAX];
+    size_t clen, len;
+    u8 *p = buf;
+
+    clen = scnprintf(comment, sizeof(comment), "drop stage=%s dev=%.*s cpu=%d",
+            fw_stage_name(rec->stage), IFNAMSIZ, rec->dev, cpu);
+    len = 28 + ALIGN(rec->caplen, 4) + 4 + ALIGN(clen, 4) + 4 + 4;
+    p = put32(p, PCAPNG_EPB);
+    p = put32(p, len);
+    p = put32(p, 0);
+    p = put32(p, rec->ts >> 32);
+    p = put32(p, (u32)rec->ts);
+    p = put32(p, rec->caplen);
+    p = put32(p, rec->len);
+    p = put_pad(p, rec->data, rec->caplen);
+    p = put16(p, PCAPNG_OPT_COMMENT);
+    p = put16(p, clen);
+    p = put_pad(p, comment, clen);
+    p = put16(p, PCAPNG_OPT_END);
+    p = put16(p, 0);
+    p = put32(p, len);
+    return p - buf;
+}
+
+/*
+ * Copy record [idx] of [r], fails if it is being written or was overwritten.
+ * */
+static int cap_fetch( struct cap_ring *r, unsigned long idx, struct cap_rec *out )
+{
+    struct cap_rec *rec = &r->recs[idx & (CAP_RECS - 1)];
+    unsigned int seq = READ_ONCE(rec->seq);
+    smp_rmb();
+    if( seq & 1 ) return 0;
+    memcpy(out, rec, sizeof(*out));
+    smp_rmb();
+    return READ_ONCE(rec->seq) == seq && out->idx == idx;
+}
+
+/*
+ * Format the next record into the buffer of [rd], the rings are
+ * visited in turn so a busy cpu does not starve the others.
+ * */
+static int cap_next( struct cap_reader *rd )
+{
+    struct cap_ring *r;
+    unsigned long head, idx;
+    int i, cpu;
+
+    for( i=0; i<nr_cpu_ids; i++ ){
+        cpu = (rd->cpu + i) % nr_cpu_ids;
+        if( !cpu_possible(cpu) ) continue;
+        r = READ_ONCE(per_cpu(cap_ring, cpu));
+        if( !r ) continue;
+        head = smp_load_acquire(&r->head);
+        while( rd->tail[cpu] < head ){
+            idx = rd->tail[cpu]++;
+            if( head - idx > CAP_RECS || !cap_fetch(r, idx, &rd->rec) )
+                continue;
+            rd->len = cap_put_packet(rd->buf, &rd->rec, cpu);
+            rd->off = 0;
+            rd->cpu = cpu + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cap_open( struct inode *inode, struct file *file )
+{
+    struct cap_reader *rd;
+    struct cap_ring *r;
+    unsigned long head;
+    int cpu;
+
+    rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+    if( !rd ) return -ENOMEM;
+    rd->tail = kcalloc(nr_cpu_ids, sizeof(*rd->tail), GFP_KERNEL);
+    if( !rd->tail ){
+        kfree(rd);
+        return -ENOMEM;
+    }
+    /* start with what the rings still hold */
+    for_each_possible_cpu(cpu) {
+        r = READ_ONCE(per_cpu(cap_ring, cpu));
+        if( !r ) continue;
+        head = smp_load_acquire(&r->head);
+        rd->tail[cpu] = head > CAP_RECS ? head - CAP_RECS : 0;
+    }
+    rd->len = cap_put_header(rd->buf);
+    file->private_data = rd;
+    return nonseekable_open(inode, file);
+}
+
+/*
+ * Blocks until a record arrives, polling the rings every 100 ms.
+ * */
+static ssize_t cap_read( struct file *file, char __user *user_buffer, size_t count, loff_t *ppos )
+{
+    struct cap_reader *rd = file->private_data;
+    size_t copied = 0;
+    size_t n;
+
+    while( copied < count ){
+        if( rd->off < rd->len ){
+            n = min(count - copied, rd->len - rd->off);
+            if( copy_to_user(user_buffer + copied, rd->buf + rd->off, n) )
+                return copied ? copied : -EFAULT;
+            rd->off += n;
+            copied += n;
+            continue;
+        }
+        if( cap_next(rd) ) continue;
+        if( copied ) break;
+        if( file->f_flags & O_NONBLOCK ) return -EAGAIN;
+        schedule_timeout_interruptible(HZ / 10);
+        if( signal_pending(current) ) return -ERESTARTSYS;
+    }
+    return copied;
+}
+
+static int cap_release( struct inode *inode, struct file *file )
+{
+    struct cap_reader *rd = file->private_data;
+    kfree(rd->tail);
+    kfree(rd);
+    return 0;
+}
+
+const struct file_operations fw_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = cap_open,
+    .read = cap_read,
+    .llseek = no_llseek,
+    .release = cap_release,
+};
+
+/*
+ * Rings are allocated on the node of their cpu when the capture is
+ * first enabled and kept until the module is unloaded.
+ * */
+static int cap_alloc_rings( void )
+{
+    struct cap_ring *r;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        if( per_cpu(cap_ring, cpu) ) continue;
+        r = kvzalloc_node(sizeof(*r), GFP_KERNEL, cpu_to_node(cpu));
+        if( !r ) return -ENOMEM;
+        r->countdown = 1;
+        smp_store_release(&per_cpu(cap_ring, cpu), r);
+    }
+    return 0;
+}
+
+/*
+ * "<N> [snaplen]" samples one in N drops, "0" stops the capture.
+ * */
+int fw_capture_write( char *buf )
+{
+    unsigned int rate, snaplen = READ_ONCE(cap_snaplen);
+    int ret = 0;
+    if( sscanf(buf, "%u %u", &rate, &snaplen) < 1 ) return -EINVAL;
+    if( snaplen == 0 || snaplen > CAP_SNAP_MAX ) return -EINVAL;
+    mutex_lock(&cap_mutex);
+    if( rate ){
+        ret = cap_alloc_rings();
+        if( ret ) goto out;
+    }
+    WRITE_ONCE(cap_snaplen, snaplen);
+    WRITE_ONCE(cap_rate, rate);
+    if( rate )
+        static_branch_enable(&fw_capture_key);
+    else
+        static_branch_disable(&fw_capture_key);
+out:
+    mutex_unlock(&cap_mutex);
+    return ret;
+}
+
+int fw_capture_show( struct seq_file *m, void *v )
+{
+    struct cap_ring *r;
+    unsigned long captured = 0;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        r = READ_ONCE(per_cpu(cap_ring, cpu));
+        if( r ) captured += READ_ONCE(r->head);
+    }
+    seq_printf(m, "rate %u\n", cap_rate);
+    seq_printf(m, "snaplen %u\n", cap_snaplen);
+    seq_printf(m, "captured %lu\n", captured);
+    seq_printf(m, "ring %d per cpu\n", CAP_RECS);
+    return 0;
+}
+
+/*
+ * Called after the hook and the proc files are gone.
+ * */
+void fw_capture_exit( void )
+{
+    int cpu;
+    static_branch_disable(&fw_capture_key);
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu(cap_ring, cpu));
+        per_cpu(cap_ring, cpu) = NULL;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+/*
+ * Sampled capture of dropped packets.
+ * "echo '<N> [snaplen]' > /proc/simplefirewall/capture" keeps the first
+ * snaplen bytes of one in N dropped packets in a per-cpu ring,
+ * /proc/simplefirewall/capture.pcapng streams them as pcapng with the
+ * deciding stage in the packet comment:
+ *   cat /proc/simplefirewall/capture.pcapng | tcpdump -r -
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+#include <linux/skbuff.h>
+#include <linux/fs.h>
+#include <linux/netfilter.h>
+#include "stat.h"
+
+#define FW_CAPTURE_FILE "capture.pcapng"
+
+DECLARE_STATIC_KEY_FALSE(fw_capture_key);
+
+void __fw_capture_drop( struct sk_buff *skb, enum fw_stage stage );
+
+static inline void fw_capture( struct sk_buff *skb, enum fw_stage stage, unsigned int verdict )
+{
+    if( static_branch_unlikely(&fw_capture_key) && verdict == NF_DROP )
+        __fw_capture_drop(skb, stage);
+}
+
+extern const struct file_operations fw_capture_fops;
+
+int fw_capture_show( struct seq_file *m, void *v );
+int fw_capture_write( char *buf );
+
+void fw_capture_exit( void );
+
+#endif
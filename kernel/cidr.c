@@ -1,252 +1,330 @@
 #include <linux/inet.h>
 #include <linux/jhash.h>
 #include <linux/list.h>
-#include <linux/percpu-defs.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/prefetch.h>
 #include "ip.h"
 #include "log.h"
+#include "mem.h"
+#include "trace.h"
 
 
 /*
- * CIDR address is organized in hlist, the head is indexed by hash function. 
+ * CIDR address is organized in hlist, the head is indexed by hash function.
  * Format: 192.168.1.0/24
  * */
-struct hlist_head *cidr_hash = NULL;
-static DEFINE_PER_CPU(cidr_desc *, cidrcache) = NULL;
+/*
+ * Last hit of a cpu, cached by value and valid for one table generation.
+ * */
+struct cidr_cache {
+    u32 ip;
+    u32 __mask;
+    unsigned long gen;
+};
+
+struct cidr_table {
+    struct fw_table table;
+    struct hlist_head *hash;
+    u64 prefixes;                 /* bit n set if some entry is a /n */
+    u32 prefix_num[33];           /* entries of each prefix length */
+    struct cidr_cache __percpu *cache;
+};
+
+#define to_cidr_table(t) container_of(t, struct cidr_table, table)
 
 #define bucketshift 16
 #define bucket_num (1<<bucketshift)
 
 
-static inline u16 hashfn( u32 ip )
+static inline u32 hashfn( u32 ip, u8 mask )
 {
-    return jhash(&ip, 4, 0);
+    return jhash_2words(ip, mask, 0) & (bucket_num - 1);
 }
 
-static unsigned char cidr_mask_array[32] = {0};
+static inline u32 netmask( u8 mask )
+{
+    return mask ? ~0U << (32 - mask) : 0;
+}
 
-/* 
- * cidr masks are stored in descend order in array
- * */
-static inline void insert_mask_array( u8 mask )
+int ip_in_cidr_whitelist( u32 ip )
 {
-    int i = 0;
-    int pos = 0;
-    while( cidr_mask_array[pos] > mask ){ pos++; } /* find the position to insert */
-    if(cidr_mask_array[pos] == mask ) return;
-    i = pos;
-    while(cidr_mask_array[i] > 0 ) { i++; } /* find the last valid value */
-    while( i > pos ) {
-        cidr_mask_array[i] = cidr_mask_array[i-1];
-        i--;
-    } /* find the last valid value */
-    cidr_mask_array[pos] = mask;
+    return fw_set_test(fw_lists[F_CIDR_WHITELIST], ip);
 }
 
-static inline void remove_mask_array( u8 mask )
+int ip_in_cidr_blacklist( u32 ip )
 {
-    int pos;
-    while( cidr_mask_array[pos] > mask ){ pos++; } /* find the position to insert */
-    if(cidr_mask_array[pos] == mask ) {
-        while(cidr_mask_array[pos] != 0 ) {
-            cidr_mask_array[pos] = cidr_mask_array[pos+1];
-            pos++;
-        } /* find the last valid value */
+    return fw_set_test(fw_lists[F_CIDR_BLACKLIST], ip);
+}
+
+/*
+ * Try every prefix length in use, longest first.
+ * */
+static int cidr_table_test( struct fw_table *t, u32 ip )
+{
+    struct cidr_table *ct = to_cidr_table(t);
+    struct cidr_cache *cache;
+    cidr_desc *desc;
+    unsigned long gen = READ_ONCE(t->gen);
+    u64 prefixes;
+    u32 net;
+    u8 mask;
+    int ret = 1;
+    cache = get_cpu_ptr(ct->cache);
+    if( cache->gen == gen && cache->ip == (ip & cache->__mask) ) goto out;
+    prefixes = READ_ONCE(ct->prefixes);
+    while( prefixes ){
+        mask = fls64(prefixes) - 1;
+        prefixes &= ~(1ULL << mask);
+        net = ip & netmask(mask);
+        hlist_for_each_entry_rcu( desc, &ct->hash[hashfn(net, mask)], node) {
+            if( desc->ip == net && desc->mask == mask ){
+                cache->ip = net;
+                cache->__mask = netmask(mask);
+                cache->gen = gen;
+                goto out;
+            }
+        }
     }
+    ret = 0;
+out:
+    put_cpu_ptr(ct->cache);
+    return ret;
+}
 
-    cidr_mask_array[pos] = mask;
+/*
+ * The bucket heads test reads for [ip], one per prefix length in use.
+ * */
+static void cidr_table_prefetch( struct fw_table *t, u32 ip )
+{
+    struct cidr_table *ct = to_cidr_table(t);
+    u64 prefixes = READ_ONCE(ct->prefixes);
+    u8 mask;
+    while( prefixes ){
+        mask = fls64(prefixes) - 1;
+        prefixes &= ~(1ULL << mask);
+        prefetch(&ct->hash[hashfn(ip & netmask(mask), mask)]);
+    }
 }
 
 /* *
- * Insert a cide address to hash list, 
+ * Insert a cide address to hash list,
  * format: 3.3.3.0/24
  * */
-int insert_cidr( void *_p)
+static int cidr_table_insert( struct fw_table *t, void *_p)
 {
-    u16 hash;
+    struct cidr_table *ct = to_cidr_table(t);
+    u32 hash;
     cidr_desc *desc;
     cidr_desc *p = _p;
-    p->__mask = (1<<p->mask) -1;
-    p->ip &= ~p->__mask; 
-    hash = hashfn(p->ip);
+    if( p->mask > 32 ) return -EINVAL;
+    p->__mask = netmask(p->mask);
+    p->ip &= p->__mask;
+    hash = hashfn(p->ip, p->mask);
     logs("insert cidr ip %x mask %d hash %d", p->ip, p->mask, hash);
-    rcu_read_lock();
-    hlist_for_each_entry_rcu( desc, &cidr_hash[hash], node) {
+    trace_fw_rule_ip(FW_RULE_ADD, p->flags, p->ip, p->mask);
+    hlist_for_each_entry( desc, &ct->hash[hash], node) {
         if( (desc->ip == p->ip) && (desc->mask == p->mask)){
             desc->flags |= p->flags;
-            rcu_read_unlock();
             return 0;
         }
     }
-    rcu_read_unlock();
-    if( desc == NULL ) {
-        desc = kmalloc(sizeof(*desc), GFP_KERNEL);
-        desc->ip = p->ip;
-        desc->mask = p->mask;
-        desc->__mask = p->__mask;
-        desc->flags = p->flags;
-		hlist_add_head_rcu(&desc->node, &cidr_hash[hash]);
-        insert_mask_array(p->mask);
+    desc = fw_node_alloc(FW_NODE_CIDR);
+    if( !desc ){
+        logs("Fails to alloc cidr ip %x mask %d", p->ip, p->mask);
+        return -ENOMEM;
     }
+    desc->ip = p->ip;
+    desc->mask = p->mask;
+    desc->__mask = p->__mask;
+    desc->flags = p->flags;
+    hlist_add_head_rcu(&desc->node, &ct->hash[hash]);
+    if( ct->prefix_num[p->mask]++ == 0 )
+        WRITE_ONCE(ct->prefixes, ct->prefixes | (1ULL << p->mask));
+    t->num++;
     return 0;
 }
 
-int delete_cidr( void *_p)
+static int cidr_table_delete( struct fw_table *t, void *_p)
 {
-    u16 hash;
+    struct cidr_table *ct = to_cidr_table(t);
+    u32 hash;
     cidr_desc *desc;
     cidr_desc *p = _p;
-    p->ip &= ~( (1<<p->mask) -1 ); 
-    hash = hashfn(p->ip);
+    if( p->mask > 32 ) return -EINVAL;
+    p->ip &= netmask(p->mask);
+    hash = hashfn(p->ip, p->mask);
     logs("delete cidr ip %x mask %d hash %d", p->ip, p->mask, hash);
-    rcu_read_lock();
-    hlist_for_each_entry_rcu( desc, &cidr_hash[hash], node) {
+    trace_fw_rule_ip(FW_RULE_DELETE, p->flags, p->ip, p->mask);
+    hlist_for_each_entry( desc, &ct->hash[hash], node) {
         if( (desc->ip == p->ip) && (desc->mask == p->mask)){
-            desc->flags &= ~p->flags;
-            if(desc->flags == 0) {
-                hlist_del_rcu(&desc->node);
-                synchronize_rcu();
-                remove_mask_array(desc->mask);
-                kfree(desc);
-                logs("Success delete cidr ip %x mask %d hash %d", p->ip, p->mask, hash);
-            }
+            hlist_del_rcu(&desc->node);
+            if( --ct->prefix_num[p->mask] == 0 )
+                WRITE_ONCE(ct->prefixes, ct->prefixes & ~(1ULL << p->mask));
+            t->num--;
+            WRITE_ONCE(t->gen, t->gen + 1);
+            fw_node_free_rcu(FW_NODE_CIDR, desc);
+            logs("Success delete cidr ip %x mask %d hash %d", p->ip, p->mask, hash);
+            return 0;
         }
     }
-    rcu_read_unlock();
-    return 0;
+    return -ENOENT;
 }
 
-
-int ip_in_cidr_whitelist( u32 ip )
+static int cidr_table_dump( struct fw_table *t, char *str, int len )
 {
-    int i;
-    u16 hash;
+    struct cidr_table *ct = to_cidr_table(t);
     cidr_desc *desc;
-    desc = this_cpu_read( cidrcache);
-    if( desc && (desc->flags & CIDR_WHITELIST_MASK)) {
-        if( desc->ip == (ip & desc->__mask) ) return 1;
-    }
-    for( i=0; i<32; i++ ){
-        if(cidr_mask_array[i] != 0) {
-            ip &= ~( (1<<cidr_mask_array[i]) -1 ); 
-            hash = hashfn(ip);
-            rcu_read_lock();
-            hlist_for_each_entry_rcu( desc, &cidr_hash[hash], node) {
-                if( desc->ip == ip ){
-                    this_cpu_write( cidrcache, desc);
-                    if( desc->flags & CIDR_WHITELIST_MASK) {
-                        rcu_read_unlock();
-                        return 1;
-                    }
-                }
+    char *end = str + len;
+    int i;
+    int num = 0;
+    str[0] = 0;
+    rcu_read_lock();
+    for(i=0; i<bucket_num; i++) {
+        hlist_for_each_entry_rcu( desc, &ct->hash[i], node) {
+            if( end - str < 20 ){
+                logs("str lengh is not enough");
+                goto out;
             }
-            rcu_read_unlock();
+            str += sprintf(str, "%x/%d\n", desc->ip, desc->mask);
+            num++;
         }
     }
-    return 0;
+out:
+    rcu_read_unlock();
+    return num;
 }
 
-int ip_in_cidr_blacklist( u32 ip )
+static int cidr_table_walk( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg )
 {
-    int i;
-    u16 hash;
+    struct cidr_table *ct = to_cidr_table(t);
     cidr_desc *desc;
-    desc = this_cpu_read( cidrcache);
-    if( desc && (desc->flags & CIDR_BLACKLIST_MASK)) {
-        if( desc->ip == (ip & desc->__mask) ) return 1;
-    }
-    for( i=0; i<32; i++ ){
-        if(cidr_mask_array[i] != 0) {
-            ip &= ~( (1<<cidr_mask_array[i]) -1 ); 
-            hash = hashfn(ip);
-            rcu_read_lock();
-            hlist_for_each_entry_rcu( desc, &cidr_hash[hash], node) {
-                if( desc->ip == ip ){
-                    this_cpu_write( cidrcache, desc);
-                    if( desc->flags & CIDR_BLACKLIST_MASK) {
-                        rcu_read_unlock();
-                        return 1;
-                    }
-                }
-            }
-            rcu_read_unlock();
+    int i, ret;
+    for(i=0; i<bucket_num; i++) {
+        hlist_for_each_entry( desc, &ct->hash[i], node) {
+            ret = fn(desc, arg);
+            if( ret ) return ret;
         }
     }
     return 0;
 }
 
-int get_cidr_whitelist( char *str, int len )
+static size_t cidr_table_memory( struct fw_table *t )
 {
-    cidr_desc *desc;
-    char *end = str + len;
-    int i;
-    int index;
-    str[0] = 0;
-    for(i=0; i<bucket_num; i++) {
-        rcu_read_lock();
-        hlist_for_each_entry_rcu( desc, &cidr_hash[i], node) {
-            if( desc->flags & CIDR_WHITELIST_MASK) {
-                index = sprintf(str, "%x/%d\n", desc->ip, desc->mask); /*!! maybe out of bound*/
-                if( index > 0 ) str+= index;
-                if( str > end ){
-                    logs("str lengh is not enough");
-                    return i;
-                }
-            }
-        }
-        rcu_read_unlock();
-    }
-    return i;
+    struct cidr_table *ct = to_cidr_table(t);
+    return sizeof(*ct) + bucket_num * sizeof(*ct->hash)
+        + num_possible_cpus() * sizeof(struct cidr_cache);
 }
 
-int get_cidr_blacklist( char *str, int len )
+int parse_str_cidr( char *str, void *_desc)
 {
-    cidr_desc *desc;
-    char *end = str + len;
-    int i;
-    int index;
-    str[0] = 0;
-    for(i=0; i<bucket_num; i++) {
-        rcu_read_lock();
-        hlist_for_each_entry_rcu( desc, &cidr_hash[i], node) {
-            if( desc->flags & CIDR_BLACKLIST_MASK) {
-                index = sprintf(str, "%x/%d\n", desc->ip, desc->mask); /*!! maybe out of bound*/
-                if( index > 0 ) str+= index;
-                if( str > end ){
-                    logs("str lengh is not enough");
-                    return i;
-                }
-            }
-        }
-        rcu_read_unlock();
+    cidr_desc *desc = _desc;
+    char *p = str;
+    if(strlen(str) == 0) return 0;
+    while( *p != '/' ){
+        if( *p == 0 ) return 0;
+        p++;
+        if( (p-str) > 18 ) return 0; /* out of bound */
     }
-    return i;
+    *p = 0;
+    p++;
+    if(in4_pton(str, -1, (u8 *)&desc->ip, -1, NULL) == 0){
+        return 0;
+    }
+    desc->ip = ntohl( desc->ip);
+    if( kstrtou8( p, 10, &desc->mask) != 0 || desc->mask > 32 ){
+        logs("Failt to parse ip/mask %s", p);
+        return 0;
+    }
+    return 1;
 }
 
-void fw_cidr_init(void)
+static struct fw_table *cidr_table_create( void )
 {
+    struct cidr_table *ct;
     int i;
-    cidr_hash = kmalloc(bucket_num * sizeof(*cidr_hash), GFP_KERNEL);
-    if( !cidr_hash ){
+    ct = kzalloc(sizeof(*ct), GFP_KERNEL);
+    if( !ct ) return NULL;
+    ct->hash = kvmalloc_array(bucket_num, sizeof(*ct->hash), GFP_KERNEL);
+    ct->cache = alloc_percpu(struct cidr_cache);
+    if( !ct->hash || !ct->cache ){
         logs("Fails to kmalloc cidr hash");
-        return;
+        kvfree(ct->hash);
+        free_percpu(ct->cache);
+        kfree(ct);
+        return NULL;
     }
     for (i = 0; i < bucket_num; i++)
-        INIT_HLIST_HEAD(&cidr_hash[i]);
+        INIT_HLIST_HEAD(&ct->hash[i]);
+    /* the caches start zeroed, generation 0 is never valid */
+    ct->table.gen = 1;
+    ct->table.ops = &cidr_set_ops;
+    return &ct->table;
 }
 
-void fw_cidr_exit(void)
+static void cidr_table_destroy( struct fw_table *t )
 {
+    struct cidr_table *ct = to_cidr_table(t);
     int i;
     cidr_desc *desc;
     struct hlist_node *tmp;
     for(i=0; i<bucket_num; i++) {
-        hlist_for_each_entry_safe( desc, tmp, &cidr_hash[i], node) {
-            hlist_del_rcu(&desc->node);
-            synchronize_rcu();
-            logs("Success delete cidr ip %x mask %d hash %d", desc->ip, desc->mask, i);
-            kfree(desc);
+        hlist_for_each_entry_safe( desc, tmp, &ct->hash[i], node) {
+            hlist_del(&desc->node);
+            fw_node_free(FW_NODE_CIDR, desc);
+        }
+    }
+    kvfree(ct->hash);
+    free_percpu(ct->cache);
+    kfree(ct);
+}
+
+/*
+ * Copy the hash with buckets and entries allocated on the local node.
+ * */
+static struct fw_table *cidr_table_clone( struct fw_table *t )
+{
+    struct cidr_table *ct = to_cidr_table(t);
+    struct cidr_table *copy;
+    struct fw_table *c;
+    cidr_desc *desc, *desc_new;
+    int i;
+    c = cidr_table_create();
+    if( !c ) return NULL;
+    copy = to_cidr_table(c);
+    for(i=0; i<bucket_num; i++) {
+        hlist_for_each_entry( desc, &ct->hash[i], node) {
+            desc_new = fw_node_alloc_node(FW_NODE_CIDR, numa_node_id());
+            if( !desc_new ){
+                cidr_table_destroy(c);
+                return NULL;
+            }
+            desc_new->ip = desc->ip;
+            desc_new->mask = desc->mask;
+            desc_new->__mask = desc->__mask;
+            desc_new->flags = desc->flags;
+            hlist_add_head(&desc_new->node, &copy->hash[i]);
         }
     }
-    kfree(cidr_hash);
+    memcpy(copy->prefix_num, ct->prefix_num, sizeof(ct->prefix_num));
+    copy->prefixes = ct->prefixes;
+    c->num = t->num;
+    return c;
 }
 
+const struct fw_set_ops cidr_set_ops = {
+    .name = CIDR_NAME,
+    .kind = FW_SET_CIDR,
+    .node = FW_NODE_CIDR,
+    .create = cidr_table_create,
+    .clone = cidr_table_clone,
+    .destroy = cidr_table_destroy,
+    .insert = cidr_table_insert,
+    .delete = cidr_table_delete,
+    .test = cidr_table_test,
+    .prefetch_key = cidr_table_prefetch,
+    .dump = cidr_table_dump,
+    .walk = cidr_table_walk,
+    .memory = cidr_table_memory,
+    .parse = parse_str_cidr,
+};
@@ -0,0 +1,422 @@
+/*
+ * Connection limits.
+ * The connections of each (rule, source prefix) are counted in a bounded
+ * open addressing table of 64 bit slots, tag in the high half and count
+ * in the low half, so a lookup and an update are one cmpxchg and the
+ * packet path takes no lock. A slot whose count drops to 0 is free again.
+ * Counters are decremented by the conntrack destroy event, whose notifier
+ * is registered only while rules exist; the event notifier of a netns may
+ * be taken by ctnetlink, and a connection may be
+ * counted and then dropped before conntrack confirms it, so the whole
+ * table is also rebuilt from the conntrack table every few seconds,
+ * which expires whatever the events missed.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <net/net_namespace.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
+#include "log.h"
+#include "connlimit.h"
+
+#define CL_MAX_RULES 16
+#define CL_BITS 16
+#define CL_SLOTS (1 << CL_BITS)
+#define CL_PROBES 8
+#define CL_RECOUNT 10            /* seconds between rebuilds without events */
+#define CL_RECOUNT_EVENTS 300    /* seconds between rebuilds with events */
+
+#define CL_TAG(v) ((u32)((v) >> 32))
+#define CL_COUNT(v) ((u32)(v))
+
+struct cl_rule {
+    u16 port;         /* 0 for any port */
+    u8 prefixlen;
+    u32 mask;
+    u32 max;
+};
+
+struct cl_rules {
+    int num;
+    struct cl_rule rules[];
+};
+
+struct cl_counts {
+    atomic_long_t untracked;   /* connections not counted, their slots were taken */
+    u64 slots[CL_SLOTS];
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_connlimit_key);
+
+static struct cl_rules __rcu *cl_rules;
+static struct cl_counts __rcu *cl_counts;
+static DEFINE_MUTEX(cl_mutex);
+static struct delayed_work cl_work;
+static u32 cl_seed __read_mostly;
+static int cl_events;         /* destroy events are delivered */
+static u64 cl_recount_ns;     /* duration of the last rebuild */
+
+static inline u32 cl_tag( int rule, u32 net )
+{
+    return jhash_2words(net, rule, cl_seed);
+}
+
+/*
+ * Count one connection of [tag].
+ * Return 1 if counted, 0 if the probed slots are all taken by other keys,
+ * -1 if the count already reached [max].
+ * */
+static int cl_inc( struct cl_counts *counts, u32 tag, u32 max )
+{
+    u64 *slot, *empty;
+    u64 v, empty_v;
+    int i;
+    if( max == 0 ) return -1;
+retry:
+    empty = NULL;
+    empty_v = 0;
+    for( i=0; i<CL_PROBES; i++ ){
+        slot = &counts->slots[(tag + i) & (CL_SLOTS - 1)];
+        v = READ_ONCE(*slot);
+        if( CL_COUNT(v) == 0 ){
+            if( !empty ){
+                empty = slot;
+                empty_v = v;
+            }
+            continue;
+        }
+        if( CL_TAG(v) != tag ) continue;
+        if( CL_COUNT(v) >= max ) return -1;
+        if( cmpxchg64(slot, v, v + 1) != v ) goto retry;
+        return 1;
+    }
+    if( !empty ){
+        atomic_long_inc(&counts->untracked);
+        return 0;
+    }
+    /* racing claimers of a key pick the same first free slot, one wins */
+    if( cmpxchg64(empty, empty_v, ((u64)tag << 32) | 1) != empty_v ) goto retry;
+    return 1;
+}
+
+static void cl_dec( struct cl_counts *counts, u32 tag )
+{
+    u64 *slot;
+    u64 v;
+    int i;
+retry:
+    for( i=0; i<CL_PROBES; i++ ){
+        slot = &counts->slots[(tag + i) & (CL_SLOTS - 1)];
+        v = READ_ONCE(*slot);
+        if( CL_COUNT(v) == 0 || CL_TAG(v) != tag ) continue;
+        if( cmpxchg64(slot, v, v - 1) != v ) goto retry;
+        return;
+    }
+}
+
+static inline int cl_match( struct cl_rule *rule, u16 port )
+{
+    return rule->port == 0 || rule->port == port;
+}
+
+int __fw_connlimit_check( u32 ip, u16 port )
+{
+    struct cl_rules *rules;
+    struct cl_counts *counts;
+    struct cl_rule *rule;
+    u32 counted[CL_MAX_RULES];
+    u32 tag;
+    int i, n = 0, ret = 0;
+
+    rcu_read_lock();
+    rules = rcu_dereference(cl_rules);
+    counts = rcu_dereference(cl_counts);
+    if( !rules || !counts ) goto out;
+    for( i=0; i<rules->num; i++ ){
+        rule = &rules->rules[i];
+        if( !cl_match(rule, port) ) continue;
+        tag = cl_tag(i, ip & rule->mask);
+        ret = cl_inc(counts, tag, rule->max);
+        if( ret < 0 ){
+            /* a dropped connection counts for no rule */
+            while( n-- )
+                cl_dec(counts, counted[n]);
+            ret = 1;
+            goto out;
+        }
+        if( ret > 0 )
+            counted[n++] = tag;
+    }
+    ret = 0;
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Source and destination port of a TCP connection of init_net.
+ * */
+static int cl_conn_key( const struct nf_conn *ct, u32 *ip, u16 *port )
+{
+    const struct nf_conntrack_tuple *tuple = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+    if( !net_eq(nf_ct_net(ct), &init_net) ) return 0;
+    if( tuple->src.l3num != NFPROTO_IPV4 || tuple->dst.protonum != IPPROTO_TCP )
+        return 0;
+    *ip = ntohl(tuple->src.u3.ip);
+    *port = ntohs(tuple->dst.u.tcp.port);
+    return 1;
+}
+
+static void cl_release( struct nf_conn *ct )
+{
+    struct cl_rules *rules;
+    struct cl_counts *counts;
+    struct cl_rule *rule;
+    u32 ip;
+    u16 port;
+    int i;
+    if( !cl_conn_key(ct, &ip, &port) ) return;
+    rcu_read_lock();
+    rules = rcu_dereference(cl_rules);
+    counts = rcu_dereference(cl_counts);
+    if( rules && counts ){
+        for( i=0; i<rules->num; i++ ){
+            rule = &rules->rules[i];
+            if( cl_match(rule, port) )
+                cl_dec(counts, cl_tag(i, ip & rule->mask));
+        }
+    }
+    rcu_read_unlock();
+}
+
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+static int cl_event( unsigned int events, struct nf_ct_event *item )
+{
+    if( events & (1 << IPCT_DESTROY) )
+        cl_release(item->ct);
+    return 0;
+}
+
+static struct nf_ct_event_notifier cl_notifier = {
+    .fcn = cl_event,
+};
+
+/*
+ * The notifier is the only one of the netns and ctnetlink or conntrackd
+ * may want it, so it is only held while rules exist. Under cl_mutex.
+ * */
+static void cl_events_hold( int on )
+{
+    if( on && !cl_events ){
+        if( nf_conntrack_register_notifier(&init_net, &cl_notifier) == 0 )
+            cl_events = 1;
+        else
+            logs("conntrack events are taken, connlimit recounts every %d s", CL_RECOUNT);
+    }else if( !on && cl_events ){
+        nf_conntrack_unregister_notifier(&init_net, &cl_notifier);
+        cl_events = 0;
+    }
+}
+#else
+static inline void cl_events_hold( int on )
+{
+}
+#endif
+
+struct cl_recount_arg {
+    struct cl_rules *rules;
+    struct cl_counts *counts;
+};
+
+static int cl_recount_one( struct nf_conn *ct, void *data )
+{
+    struct cl_recount_arg *arg = data;
+    struct cl_rule *rule;
+    u32 ip;
+    u16 port;
+    int i;
+    if( !cl_conn_key(ct, &ip, &port) ) return 0;
+    for( i=0; i<arg->rules->num; i++ ){
+        rule = &arg->rules->rules[i];
+        if( cl_match(rule, port) )
+            cl_inc(arg->counts, cl_tag(i, ip & rule->mask), U32_MAX);
+    }
+    /* keep the connection */
+    return 0;
+}
+
+/*
+ * Count the connections of conntrack for [rules] into a new table
+ * and publish both, called with cl_mutex held.
+ * Packets counted in the old table while the new one is built are lost,
+ * which the next rebuild corrects.
+ * */
+static int cl_rebuild( struct cl_rules *rules )
+{
+    struct cl_recount_arg arg;
+    struct cl_counts *counts = NULL;
+    struct cl_counts *old_counts;
+    struct cl_rules *old_rules;
+    ktime_t start = ktime_get();
+
+    if( rules ){
+        counts = kvzalloc(sizeof(*counts), GFP_KERNEL);
+        if( !counts ) return -ENOMEM;
+        arg.rules = rules;
+        arg.counts = counts;
+        nf_ct_iterate_cleanup_net(&init_net, cl_recount_one, &arg, 0, 0);
+    }
+    old_rules = rcu_dereference_protected(cl_rules, lockdep_is_held(&cl_mutex));
+    old_counts = rcu_dereference_protected(cl_counts, lockdep_is_held(&cl_mutex));
+    rcu_assign_pointer(cl_rules, rules);
+    rcu_assign_pointer(cl_counts, counts);
+    cl_recount_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    synchronize_rcu();
+    if( old_rules != rules ) kfree(old_rules);
+    kvfree(old_counts);
+    return 0;
+}
+
+static unsigned long cl_interval( void )
+{
+    return (cl_events ? CL_RECOUNT_EVENTS : CL_RECOUNT) * HZ;
+}
+
+static void cl_recount( struct work_struct *work )
+{
+    struct cl_rules *rules;
+    mutex_lock(&cl_mutex);
+    rules = rcu_dereference_protected(cl_rules, lockdep_is_held(&cl_mutex));
+    if( rules ){
+        cl_rebuild(rules);
+        schedule_delayed_work(&cl_work, cl_interval());
+    }
+    mutex_unlock(&cl_mutex);
+}
+
+/*
+ * One rule per line, "<port> <prefixlen> <max>",
+ * the written rules replace the old ones, an empty write removes all.
+ * */
+int fw_connlimit_write( char *buf )
+{
+    struct cl_rules *rules;
+    struct cl_rule *rule;
+    unsigned int port, prefixlen, max;
+    char *line;
+    int ret;
+
+    rules = kzalloc(sizeof(*rules) + CL_MAX_RULES * sizeof(struct cl_rule), GFP_KERNEL);
+    if( !rules ) return -ENOMEM;
+    while( (line = strsep(&buf, "\n")) != NULL ){
+        line = strim(line);
+        if( *line == 0 || *line == '#' ) continue;
+        if( sscanf(line, "%u %u %u", &port, &prefixlen, &max) != 3
+                || port > 65535 || prefixlen > 32 ){
+            logs("Fails to parse connlimit %s", line);
+            kfree(rules);
+            return -EINVAL;
+        }
+        if( rules->num == CL_MAX_RULES ){
+            logs("Too many connlimit rules, at most %d", CL_MAX_RULES);
+            kfree(rules);
+            return -ENOSPC;
+        }
+        rule = &rules->rules[rules->num++];
+        rule->port = port;
+        rule->prefixlen = prefixlen;
+        rule->mask = prefixlen ? ~0U << (32 - prefixlen) : 0;
+        rule->max = max;
+    }
+    if( rules->num == 0 ){
+        kfree(rules);
+        rules = NULL;
+    }
+
+    mutex_lock(&cl_mutex);
+    /* before the recount, so no destroy after it is missed */
+    if( rules )
+        cl_events_hold(1);
+    /* tags depend on the rule index, so counts are rebuilt for the new rules */
+    ret = cl_rebuild(rules);
+    if( ret ){
+        cl_events_hold(rcu_access_pointer(cl_rules) != NULL);
+        mutex_unlock(&cl_mutex);
+        kfree(rules);
+        return ret;
+    }
+    if( rules ){
+        static_branch_enable(&fw_connlimit_key);
+        mod_delayed_work(system_wq, &cl_work, cl_interval());
+    }else{
+        static_branch_disable(&fw_connlimit_key);
+        cl_events_hold(0);
+    }
+    mutex_unlock(&cl_mutex);
+    return 0;
+}
+
+int fw_connlimit_show( struct seq_file *m, void *v )
+{
+    struct cl_rules *rules;
+    struct cl_counts *counts;
+    struct cl_rule *rule;
+    unsigned long sources = 0;
+    u64 conns = 0;
+    u64 s;
+    int i;
+
+    mutex_lock(&cl_mutex);
+    rules = rcu_dereference_protected(cl_rules, lockdep_is_held(&cl_mutex));
+    counts = rcu_dereference_protected(cl_counts, lockdep_is_held(&cl_mutex));
+    seq_printf(m, "%-8s %-10s %s\n", "port", "prefixlen", "max");
+    for( i=0; rules && i<rules->num; i++ ){
+        rule = &rules->rules[i];
+        seq_printf(m, "%-8u %-10u %u\n", rule->port, rule->prefixlen, rule->max);
+    }
+    if( counts ){
+        for( i=0; i<CL_SLOTS; i++ ){
+            s = READ_ONCE(counts->slots[i]);
+            if( CL_COUNT(s) ){
+                sources++;
+                conns += CL_COUNT(s);
+            }
+        }
+        seq_printf(m, "sources %lu/%d\n", sources, CL_SLOTS);
+        seq_printf(m, "connections %llu\n", conns);
+        seq_printf(m, "untracked %ld\n", atomic_long_read(&counts->untracked));
+    }
+    seq_printf(m, "events %s\n", cl_events ? "destroy" : "none, recount only");
+    seq_printf(m, "recount_us %llu\n", cl_recount_ns / NSEC_PER_USEC);
+    mutex_unlock(&cl_mutex);
+    return 0;
+}
+
+void fw_connlimit_init( void )
+{
+    get_random_bytes(&cl_seed, sizeof(cl_seed));
+    INIT_DELAYED_WORK(&cl_work, cl_recount);
+}
+
+/*
+ * Called after the hook is unregistered.
+ * */
+void fw_connlimit_exit( void )
+{
+    mutex_lock(&cl_mutex);
+    static_branch_disable(&fw_connlimit_key);
+    cl_events_hold(0);
+    cl_rebuild(NULL);
+    mutex_unlock(&cl_mutex);
+    cancel_delayed_work_sync(&cl_work);
+}
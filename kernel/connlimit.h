@@ -0,0 +1,38 @@
+#ifndef _CONNLIMIT_H
+#define _CONNLIMIT_H
+
+/*
+ * Limits of concurrent TCP connections, configured by
+ * /proc/simplefirewall/connlimit.
+ * A rule "<port> <prefixlen> <max>" allows at most <max> connections
+ * from each source /<prefixlen> to <port>, port 0 matches every port.
+ * Only the first packet of a new connection is checked and counted,
+ * packets of known connections never reach the counters.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_connlimit_key);
+
+int __fw_connlimit_check( u32 ip, u16 port );
+
+/*
+ * Count a new connection of [ip] to [port].
+ * Return 1 if a rule is exceeded, the connection is not counted then.
+ * */
+static inline int fw_connlimit_check( u32 ip, u16 port )
+{
+    if( static_branch_unlikely(&fw_connlimit_key) )
+        return __fw_connlimit_check(ip, port);
+    return 0;
+}
+
+int fw_connlimit_show( struct seq_file *m, void *v );
+int fw_connlimit_write( char *buf );
+
+void fw_connlimit_init( void );
+void fw_connlimit_exit( void );
+
+#endif
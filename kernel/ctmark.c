@@ -0,0 +1,98 @@
+/*
+ * Ruleset generation in the conntrack mark.
+ * The stamp of generation g is (g mod M) + 1 shifted into the mask,
+ * M being the largest value the mask holds, so 0, the mark of
+ * connections never seen, is always stale. With the default 8 bit mask
+ * a flow is missed only if exactly a multiple of 255 changes happened
+ * since its last packet.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include "log.h"
+#include "ctmark.h"
+
+DEFINE_STATIC_KEY_FALSE(fw_ctmark_key);
+
+static unsigned int ct_mark_mask = 0xff000000;
+module_param(ct_mark_mask, uint, 0444);
+MODULE_PARM_DESC(ct_mark_mask, "Contiguous bits of the conntrack mark holding the ruleset generation");
+
+u32 fw_ctmark_mask;
+u32 fw_ctmark_cur;
+static unsigned long ctmark_gen;
+static DEFINE_SPINLOCK(ctmark_lock);
+
+/* a contiguous run of set bits */
+static int ctmark_valid( u32 mask )
+{
+    return mask && ((mask >> __ffs(mask)) & ((mask >> __ffs(mask)) + 1)) == 0;
+}
+
+static void ctmark_update( void )
+{
+    u32 shift = __ffs(fw_ctmark_mask);
+    u32 max = fw_ctmark_mask >> shift;
+    WRITE_ONCE(fw_ctmark_cur, (u32)(ctmark_gen % max + 1) << shift);
+}
+
+/*
+ * Called once rules were added, e.g. at the end of a write to a list.
+ * */
+void fw_ruleset_changed( void )
+{
+    spin_lock(&ctmark_lock);
+    ctmark_gen++;
+    ctmark_update();
+    spin_unlock(&ctmark_lock);
+}
+
+/*
+ * "1" to recheck established flows, "0" to stop,
+ * "mask <bits>" to move the stamp within the mark.
+ * */
+int fw_ctmark_write( char *buf )
+{
+    u32 mask;
+    if( strcmp(buf, "1") == 0 ){
+        static_branch_enable(&fw_ctmark_key);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_ctmark_key);
+    }else if( sscanf(buf, "mask %i", &mask) == 1 ){
+        if( !ctmark_valid(mask) || mask == 1 << __ffs(mask) ) return -EINVAL;
+        spin_lock(&ctmark_lock);
+        WRITE_ONCE(fw_ctmark_mask, mask);
+        ctmark_update();
+        spin_unlock(&ctmark_lock);
+    }else{
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int fw_ctmark_show( struct seq_file *m, void *v )
+{
+#ifndef CONFIG_NF_CONNTRACK_MARK
+    seq_puts(m, "conntrack mark not built in the kernel\n");
+#endif
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_ctmark_key));
+    seq_printf(m, "mask 0x%08x\n", fw_ctmark_mask);
+    seq_printf(m, "generation %lu\n", ctmark_gen);
+    seq_printf(m, "stamp 0x%08x\n", fw_ctmark_cur);
+    return 0;
+}
+
+int fw_ctmark_init( void )
+{
+    /* one bit can not tell a stale stamp from the current one */
+    if( !ctmark_valid(ct_mark_mask) || ct_mark_mask == 1 << __ffs(ct_mark_mask) ){
+        logs("Invalid ct_mark_mask %x", ct_mark_mask);
+        return -EINVAL;
+    }
+    fw_ctmark_mask = ct_mark_mask;
+    ctmark_update();
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _CTMARK_H
+#define _CTMARK_H
+
+/*
+ * Ruleset generation stamped into the conntrack mark.
+ * Every accepted connection carries the generation of the rules it was
+ * checked against in the bits of ct_mark_mask, the top byte by default.
+ * Adding rules bumps the generation, so the next packet of an established
+ * flow with an older stamp is checked against the blacklists once more,
+ * and its connection is killed if the source is now blacklisted.
+ * The mark may belong to CONNMARK rules or other tools, so it is off
+ * until "1" is written to /proc/simplefirewall/ctmark, and "mask <bits>"
+ * there moves the stamp to the bits that are free.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+#include <net/netfilter/nf_conntrack.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_ctmark_key);
+
+extern u32 fw_ctmark_mask;
+extern u32 fw_ctmark_cur;     /* stamp of the current generation, never 0 */
+
+#ifdef CONFIG_NF_CONNTRACK_MARK
+static inline int fw_ctmark_stale( struct nf_conn *ct )
+{
+    if( static_branch_unlikely(&fw_ctmark_key) )
+        return (READ_ONCE(ct->mark) & READ_ONCE(fw_ctmark_mask)) != READ_ONCE(fw_ctmark_cur);
+    return 0;
+}
+
+static inline void fw_ctmark_stamp( struct nf_conn *ct )
+{
+    u32 mask = READ_ONCE(fw_ctmark_mask);
+    if( static_branch_unlikely(&fw_ctmark_key) )
+        WRITE_ONCE(ct->mark, (ct->mark & ~mask) | READ_ONCE(fw_ctmark_cur));
+}
+#else
+static inline int fw_ctmark_stale( struct nf_conn *ct ) { return 0; }
+static inline void fw_ctmark_stamp( struct nf_conn *ct ) { }
+#endif
+
+void fw_ruleset_changed( void );
+
+int fw_ctmark_show( struct seq_file *m, void *v );
+int fw_ctmark_write( char *buf );
+
+int fw_ctmark_init( void );
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Verdicts of first fragments.
+ * The table of a CPU is a set of buckets of FRAG_WAYS entries, one cache
+ * line each, so a later fragment is decided by reading one line. A first
+ * fragment takes a free or expired entry of its bucket, or the oldest one.
+ * Only the CPU owning a table touches it, from the hook, so it needs
+ * no lock.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/jiffies.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/netfilter.h>
+#include <linux/seq_file.h>
+#include "log.h"
+#include "frag.h"
+
+#define FRAG_WAYS       4
+#define FRAG_BUCKETS    256       /* per CPU, power of 2 */
+
+enum frag_orphan {
+    FRAG_ORPHAN_DROP,
+    FRAG_ORPHAN_ACCEPT,
+    FRAG_ORPHAN_FILTER,
+};
+
+static const char *orphan_names[] = {
+    [FRAG_ORPHAN_DROP] = "drop",
+    [FRAG_ORPHAN_ACCEPT] = "accept",
+    [FRAG_ORPHAN_FILTER] = "filter",
+};
+
+struct frag_entry {
+    __be32 saddr;
+    __be32 daddr;
+    __be16 id;
+    u8 proto;
+    u8 state;             /* 0 free, else verdict + 1 */
+    u32 stamp;            /* jiffies of the first fragment */
+};
+
+struct frag_bucket {
+    struct frag_entry e[FRAG_WAYS];
+} ____cacheline_aligned;
+
+struct frag_table {
+    struct frag_bucket b[FRAG_BUCKETS];
+};
+
+struct frag_stat {
+    u64 first;            /* first fragments recorded */
+    u64 hit;              /* later fragments decided by their first */
+    u64 orphan;           /* later fragments without a first */
+    u64 evicted;          /* live entries taken by another datagram */
+};
+
+static struct frag_table __percpu *frag_table;
+static DEFINE_PER_CPU(struct frag_stat, frag_stat);
+static u32 frag_seed __read_mostly;
+static int frag_orphan = FRAG_ORPHAN_FILTER;
+static unsigned int frag_timeout = HZ;      /* jiffies an entry is valid */
+
+static inline struct frag_bucket *frag_bucket( const struct iphdr *iph )
+{
+    u32 h = jhash_3words((__force u32)iph->saddr, (__force u32)iph->daddr,
+            (__force u32)iph->id << 8 | iph->protocol, frag_seed);
+    return &this_cpu_ptr(frag_table)->b[h & (FRAG_BUCKETS - 1)];
+}
+
+static inline int frag_live( const struct frag_entry *e, u32 now )
+{
+    return e->state && now - e->stamp < READ_ONCE(frag_timeout);
+}
+
+static inline int frag_match( const struct frag_entry *e, const struct iphdr *iph )
+{
+    return e->saddr == iph->saddr && e->daddr == iph->daddr &&
+        e->id == iph->id && e->proto == iph->protocol;
+}
+
+/*
+ * Verdict of a later fragment, the one of its first fragment if known,
+ * else the orphan policy. FW_FRAG_FILTER if the orphan is to be filtered
+ * by its addresses like a packet without port.
+ * */
+int fw_frag_verdict( const struct iphdr *iph )
+{
+    struct frag_bucket *b = frag_bucket(iph);
+    u32 now = jiffies;
+    int i;
+    for( i=0; i<FRAG_WAYS; i++ ){
+        if( frag_live(&b->e[i], now) && frag_match(&b->e[i], iph) ){
+            this_cpu_inc(frag_stat.hit);
+            return b->e[i].state - 1;
+        }
+    }
+    this_cpu_inc(frag_stat.orphan);
+    switch( READ_ONCE(frag_orphan) ){
+        case FRAG_ORPHAN_ACCEPT:
+            return NF_ACCEPT;
+        case FRAG_ORPHAN_FILTER:
+            return FW_FRAG_FILTER;
+        default:
+            return NF_DROP;
+    }
+}
+
+/*
+ * Keep [verdict] of the first fragment [iph] for the ones that follow.
+ * */
+void fw_frag_record( const struct iphdr *iph, unsigned int verdict )
+{
+    struct frag_bucket *b = frag_bucket(iph);
+    struct frag_entry *e = NULL;
+    u32 now = jiffies;
+    int i;
+    for( i=0; i<FRAG_WAYS; i++ ){
+        /* a retransmitted first fragment updates its entry */
+        if( !frag_live(&b->e[i], now) || frag_match(&b->e[i], iph) ){
+            e = &b->e[i];
+            break;
+        }
+        if( !e || (s32)(b->e[i].stamp - e->stamp) < 0 )
+            e = &b->e[i];
+    }
+    if( i == FRAG_WAYS )
+        this_cpu_inc(frag_stat.evicted);
+    e->saddr = iph->saddr;
+    e->daddr = iph->daddr;
+    e->id = iph->id;
+    e->proto = iph->protocol;
+    e->state = verdict + 1;
+    e->stamp = now;
+    this_cpu_inc(frag_stat.first);
+}
+
+/*
+ * "orphan drop|accept|filter" decides later fragments without a first,
+ * filter checks their source against the lists like a packet without port;
+ * "timeout <ms>" a first fragment is remembered.
+ * */
+int fw_frag_write( char *buf )
+{
+    char name[8];
+    unsigned int ms;
+    int i;
+    if( sscanf(buf, "orphan %7s", name) == 1 ){
+        for( i=0; i<ARRAY_SIZE(orphan_names); i++ ){
+            if( strcmp(name, orphan_names[i]) == 0 ){
+                WRITE_ONCE(frag_orphan, i);
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+    if( sscanf(buf, "timeout %u", &ms) == 1 ){
+        if( ms == 0 || ms > 60000 ) return -EINVAL;
+        WRITE_ONCE(frag_timeout, max(msecs_to_jiffies(ms), 1UL));
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int fw_frag_show( struct seq_file *m, void *v )
+{
+    struct frag_stat sum = {0};
+    struct frag_stat *s;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&frag_stat, cpu);
+        sum.first += s->first;
+        sum.hit += s->hit;
+        sum.orphan += s->orphan;
+        sum.evicted += s->evicted;
+    }
+    seq_printf(m, "orphan %s\n", orphan_names[frag_orphan]);
+    seq_printf(m, "timeout %u\n", jiffies_to_msecs(frag_timeout));
+    seq_printf(m, "first %llu\n", sum.first);
+    seq_printf(m, "hit %llu\n", sum.hit);
+    seq_printf(m, "orphans %llu\n", sum.orphan);
+    seq_printf(m, "evicted %llu\n", sum.evicted);
+    return 0;
+}
+
+int fw_frag_init( void )
+{
+    frag_table = alloc_percpu(struct frag_table);
+    if( !frag_table ){
+        logs("Fails to alloc fragment tables");
+        return -ENOMEM;
+    }
+    frag_seed = get_random_u32();
+    return 0;
+}
+
+void fw_frag_exit( void )
+{
+    free_percpu(frag_table);
+    frag_table = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef _FRAG_H
+#define _FRAG_H
+
+/*
+ * IP fragments, seen when no defragmentation runs before the hook.
+ * Only the first fragment carries the TCP or UDP header, it is filtered
+ * like any packet and its verdict is kept in a per-CPU table keyed by
+ * (saddr, daddr, IP ID, protocol). Later fragments take the verdict of
+ * their first fragment with one probe of the table. Fragments of one
+ * datagram are steered to one CPU, RSS and RPS hash them by addresses
+ * only. A later fragment whose first fragment was not seen, reordered,
+ * lost or expired, is an orphan, checked by its source alone unless
+ * another policy is set through /proc/simplefirewall/fragment.
+ * */
+
+#include <linux/types.h>
+#include <linux/ip.h>
+#include <linux/seq_file.h>
+
+#define FW_FRAG_FILTER (-1)
+
+/*
+ * 1 if [iph] is a fragment but the first one.
+ * */
+static inline int fw_frag_later( const struct iphdr *iph )
+{
+    return unlikely( iph->frag_off & htons(IP_OFFSET) );
+}
+
+/*
+ * 1 if [iph] is the first fragment of a datagram.
+ * */
+static inline int fw_frag_first( const struct iphdr *iph )
+{
+    return unlikely( (iph->frag_off & htons(IP_MF | IP_OFFSET)) == htons(IP_MF) );
+}
+
+int fw_frag_verdict( const struct iphdr *iph );
+void fw_frag_record( const struct iphdr *iph, unsigned int verdict );
+
+int fw_frag_show( struct seq_file *m, void *v );
+int fw_frag_write( char *buf );
+
+int fw_frag_init( void );
+void fw_frag_exit( void );
+
+#endif
@@ -8,64 +8,92 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/types.h>
-#include <linux/percpu-defs.h>
+#include <linux/inet.h>
+#include <linux/percpu.h>
+#include <linux/radix-tree.h>
 #include "log.h"
 #include "ip.h"
+#include "mem.h"
+#include "trace.h"
 
-/* The tree to insert ip address, 
+/*
+ * Last hit of a cpu. The address is cached by value, not the ip_desc,
+ * and is only trusted while the table generation is unchanged,
+ * so a deleted address can neither match nor be dereferenced after free.
+ * */
+struct ip_cache {
+    u32 ip;
+    unsigned long gen;
+};
+
+/* The tree to insert ip address,
  * key: ip address
  * value: ip_desc
  * */
-struct radix_tree_root ip_tree;
+struct ip_table {
+    struct fw_table table;
+    struct radix_tree_root tree;
+    struct ip_cache __percpu *cache;
+};
 
-static DEFINE_PER_CPU(ip_desc *, ipcache) = NULL;
+#define to_ip_table(t) container_of(t, struct ip_table, table)
 
 int ip_in_whitelist( u32 ip )
 {
-    ip_desc *desc;
-    desc = this_cpu_read(ipcache);
-    if( desc && ( desc->flags & IP_WHITELIST_MASK) ){
-        if( desc->ip == ip ) return 1;
-    }
-    desc = radix_tree_lookup(&ip_tree, ip);
-    if( desc && ( desc->flags & IP_WHITELIST_MASK) ){
-        this_cpu_write(ipcache, desc);
-        return 1;
-    }
-    return 0;
+    return fw_set_test(fw_lists[F_IP_WHITELIST], ip);
 }
 
 int ip_in_blacklist( u32 ip )
 {
-    ip_desc *desc;
-    desc = this_cpu_read(ipcache);
-    if( desc && ( desc->flags & IP_BLACKLIST_MASK) ){
-        if( desc->ip == ip ) return 1;
-    }
-    desc = radix_tree_lookup(&ip_tree, ip);
-    if( desc && ( desc->flags & IP_BLACKLIST_MASK) ){
-        this_cpu_write(ipcache, desc);
-        return 1;
+    return fw_set_test(fw_lists[F_IP_BLACKLIST], ip);
+}
+
+static int ip_table_test( struct fw_table *t, u32 ip )
+{
+    struct ip_table *it = to_ip_table(t);
+    struct ip_cache *cache;
+    unsigned long gen = READ_ONCE(t->gen);
+    int ret = 1;
+    cache = get_cpu_ptr(it->cache);
+    if( cache->gen == gen && cache->ip == ip ) goto out;
+    if( radix_tree_lookup(&it->tree, ip) ){
+        cache->ip = ip;
+        cache->gen = gen;
+        goto out;
     }
-    return 0;
+    ret = 0;
+out:
+    put_cpu_ptr(it->cache);
+    return ret;
 }
 
 /*
  * Create a node to the tree if new ip comes,
  * or add mark to the ip_desc of existing node
  */
-int insert_ip( void *p )
+static int ip_table_insert( struct fw_table *t, void *p )
 {
+    struct ip_table *it = to_ip_table(t);
     int error = 0;
     ip_desc *desc = p;
     ip_desc *res;
-    res = radix_tree_lookup(&ip_tree, desc->ip);
+    res = radix_tree_lookup(&it->tree, desc->ip);
     logs("Add ip %x", desc->ip)
+    trace_fw_rule_ip(FW_RULE_ADD, desc->flags, desc->ip, 32);
     if( !res){
-        res = kmalloc(sizeof(*res), GFP_KERNEL);
+        res = fw_node_alloc(FW_NODE_IP);
+        if( !res ){
+            logs("fail insert: no memory for ip %u", desc->ip);
+            return -ENOMEM;
+        }
         *res = *desc;
-        error = radix_tree_insert( &ip_tree, desc->ip, res);
-        if( error ) logs("fail insert: ip %u error %d", desc->ip, error);
+        error = radix_tree_insert( &it->tree, desc->ip, res);
+        if( error ){
+            logs("fail insert: ip %u error %d", desc->ip, error);
+            fw_node_free(FW_NODE_IP, res);
+        }else{
+            t->num++;
+        }
     }else{
         res->flags |= desc->flags;
     }
@@ -74,166 +102,188 @@ int insert_ip( void *p )
 
 
 /*
- * Delete ip from ip whiltelist or blacklist specified by [index].
- * Notice that a tree node may contain multi status, 
- * so only when the flag is marked by no status, the node can be delete from the tree.
+ * Delete ip from the table.
  * */
-int delete_ip( void *p )
+static int ip_table_delete( struct fw_table *t, void *p )
 {
+    struct ip_table *it = to_ip_table(t);
     ip_desc *desc = p;
-    f_type flag = 0;
     ip_desc *res;
-    res = radix_tree_lookup(&ip_tree, desc->ip);
+    res = radix_tree_delete(&it->tree, desc->ip);
     if( !res){
         logs("fail delete: no ip %u", desc->ip);
-        return 1;
+        return -ENOENT;
     }
     logs("Delete %x\n", desc->ip);
-    res->flags &= (~desc->flags);
-    flag = (1 << F_MAX) - 1;
-    if( (res->flags & flag) == 0) {
-        radix_tree_delete(&ip_tree, desc->ip);
-        synchronize_rcu();
-        kfree(res);
-    }
+    trace_fw_rule_ip(FW_RULE_DELETE, desc->flags, desc->ip, 32);
+    t->num--;
+    WRITE_ONCE(t->gen, t->gen + 1);
+    fw_node_free_rcu(FW_NODE_IP, res);
     return 0;
 }
 
-
-struct ip_list{
-    enum F_LIST_TYPE type;   // whitelist or blacklist?
-    int num;   // number of ip in list
-    int maxnum;
-    u32 ip[0];
-};
-
-#define IPLISTNUM 1000
 /*
- * malloc a ip_list for given size [num], 
- * resize [list] if it is not NULL
- *
- * !!Notice: Remember to free list after call this
+ * the length of str should be enough
  * */
-static struct ip_list* build_ip_list( struct ip_list* list, int num )
+static int ip_table_dump( struct fw_table *t, char *str, int len )
 {
-    struct ip_list *old;
-    int realnum = ( num/IPLISTNUM + 1 ) * IPLISTNUM;
-    if( !list ){
-        list = kmalloc( sizeof(struct ip_list) + realnum * sizeof(u32), GFP_KERNEL);
-        list->maxnum = realnum;
-        list->num = 0;
-        return list;
-    }
-    if( num > list->maxnum ) {
-        old = list;
-        list = kmalloc( sizeof(struct ip_list) + realnum * sizeof(u32), GFP_KERNEL);
-
-        memcpy(list, old, sizeof(struct ip_list) + old->num * sizeof(u32));
-        list->maxnum = realnum;
-        kfree(old);
-        return list;
+    struct ip_table *it = to_ip_table(t);
+    struct radix_tree_iter iter;
+    void **slot;
+    char *end = str + len;
+    int i = 0;
+    str[0] = 0;
+    rcu_read_lock();
+    radix_tree_for_each_slot(slot, &it->tree, &iter, 0) {
+        if( end - str < 16 ){
+            logs("str lengh is not enough");
+            break;
+        }
+        str += sprintf(str, "%x\n", (u32)iter.index);
+        i++;
     }
-    return list;
+    rcu_read_unlock();
+    return i;
 }
 
-static struct ip_list *blacklist = NULL ;
-static struct ip_list *whitelist = NULL;
+static int ip_table_walk( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg )
+{
+    struct ip_table *it = to_ip_table(t);
+    struct radix_tree_iter iter;
+    void **slot;
+    int ret;
+    radix_tree_for_each_slot(slot, &it->tree, &iter, 0) {
+        ret = fn(*slot, arg);
+        if( ret ) return ret;
+    }
+    return 0;
+}
 
-void get_ip_list(void)
+/*
+ * Number of interior radix tree nodes, for memory accounting.
+ * Keys are visited in ascending order, so the nodes of each level
+ * are the distinct values of key >> (shift * (level+1)).
+ * */
+#define IP_TREE_LEVELS DIV_ROUND_UP(32, RADIX_TREE_MAP_SHIFT)
+static unsigned long ip_tree_nodes( struct ip_table *it )
 {
     struct radix_tree_iter iter;
     void **slot;
-    whitelist = build_ip_list( NULL, IPLISTNUM );
-    whitelist->type = F_IP_WHITELIST;
-    blacklist = build_ip_list( NULL, IPLISTNUM );
-    blacklist->type = F_IP_BLACKLIST;
+    unsigned long count[IP_TREE_LEVELS] = {0};
+    unsigned long last[IP_TREE_LEVELS];
+    unsigned long maxindex = 0;
+    unsigned long nodes = 0;
+    int first = 1;
+    int level;
+
     rcu_read_lock();
-    radix_tree_for_each_slot(slot, &ip_tree, &iter, 0) {
-        if( (*(ip_desc **)slot)->flags & IP_WHITELIST_MASK ) {
-            whitelist->ip[whitelist->num++] = iter.index;
-        } 
-        if( (*(ip_desc **)slot)->flags & IP_BLACKLIST_MASK ) {
-            blacklist->ip[blacklist->num++] = iter.index;
+    radix_tree_for_each_slot(slot, &it->tree, &iter, 0) {
+        for( level=0; level<IP_TREE_LEVELS; level++ ){
+            unsigned long prefix = iter.index >> (RADIX_TREE_MAP_SHIFT * (level+1));
+            if( first || prefix != last[level] ){
+                last[level] = prefix;
+                count[level]++;
+            }
         }
+        maxindex = iter.index;
+        first = 0;
     }
     rcu_read_unlock();
+    /* a tree only holding index 0 keeps the entry in its root */
+    for( level=0; level<IP_TREE_LEVELS; level++ ){
+        if( (maxindex >> (RADIX_TREE_MAP_SHIFT * level)) == 0 ) break;
+        nodes += count[level];
+    }
+    return nodes;
 }
 
-void print_ip_list(void)
+static size_t ip_table_memory( struct fw_table *t )
 {
-    int i;
-    get_ip_list();
-    logs("----------IP whitelist----------");
-    for(i=0; i<whitelist->num; i++){
-        logs("%d %x", i, whitelist->ip[i]);
-    }
-    logs("----------IP blacklist----------");
-    for(i=0; i<blacklist->num; i++){
-        logs("%d %x", i, blacklist->ip[i]);
-    }
-    kfree(blacklist);
-    kfree(whitelist);
-    blacklist = NULL;
-    whitelist = NULL;
+    struct ip_table *it = to_ip_table(t);
+    return sizeof(*it) + num_possible_cpus() * sizeof(struct ip_cache)
+        + ip_tree_nodes(it) * sizeof(struct radix_tree_node);
 }
 
-/*
- * the length of str should be enough
- * */
-int get_ip_whitelist(char* str, int len) 
-{   
-    int index = 0;
-    int i;
-    char *end = str + len;
-    get_ip_list();
-    str[0] = 0;
-    for(i=0; i<whitelist->num; i++){
-        index = sprintf(str, "%x\n", whitelist->ip[i]);
-        if( index > 0 ) str+= index;
-        if( str > end ){
-            logs("str lengh is not enough");
-            return i;
-        }
+int parse_str_ip( char *str, void *p)
+{
+    ip_desc *desc = p;
+    if(in4_pton(str, -1, (u8 *)&desc->ip, -1, NULL) == 0){
+        return 0;
     }
-    kfree(whitelist);
-    whitelist = NULL;
-    return i;
+    desc->ip = ntohl( desc->ip);
+    return 1;
 }
 
-int get_ip_blacklist(char* str, int len) 
-{   
-    int index = 0;
-    int i;
-    char *end = str + len;
-    str[0] = 0;
-    get_ip_list();
-    for(i=0; i<blacklist->num; i++){
-        index = sprintf(str, "%x\n", blacklist->ip[i]);
-        if( index > 0 ) str+= index;
-        if( str > end ){
-            logs("str lengh is not enough");
-            return i;
-        }
+static struct fw_table *ip_table_create( void )
+{
+    struct ip_table *it;
+    it = kzalloc(sizeof(*it), GFP_KERNEL);
+    if( !it ) return NULL;
+    it->cache = alloc_percpu(struct ip_cache);
+    if( !it->cache ){
+        kfree(it);
+        return NULL;
     }
-    kfree(blacklist);
-    blacklist = NULL;
-    return i;
+    /* the caches start zeroed, generation 0 is never valid */
+    it->table.gen = 1;
+    INIT_RADIX_TREE(&it->tree, GFP_KERNEL);
+    it->table.ops = &ip_set_ops;
+    return &it->table;
 }
 
-void fw_ip_exit( void )
+static void ip_table_destroy( struct fw_table *t )
 {
+    struct ip_table *it = to_ip_table(t);
     struct radix_tree_iter iter;
     void **slot;
-    radix_tree_for_each_slot(slot, &ip_tree, &iter, 0) {
-        radix_tree_delete(&ip_tree, iter.index);
-        synchronize_rcu();
-        kfree(*slot);
+    radix_tree_for_each_slot(slot, &it->tree, &iter, 0) {
+        fw_node_free(FW_NODE_IP, *slot);
+        radix_tree_iter_delete(&it->tree, &iter, slot);
     }
+    free_percpu(it->cache);
+    kfree(it);
 }
 
-void fw_ip_init(void )
+/*
+ * Copy the tree with nodes and entries allocated on the local node.
+ * */
+static struct fw_table *ip_table_clone( struct fw_table *t )
 {
-	INIT_RADIX_TREE(&ip_tree, GFP_KERNEL);
-    whitelist = NULL;
-    blacklist = NULL;
+    struct ip_table *it = to_ip_table(t);
+    struct fw_table *copy;
+    struct radix_tree_iter iter;
+    void **slot;
+    ip_desc *desc;
+    copy = ip_table_create();
+    if( !copy ) return NULL;
+    radix_tree_for_each_slot(slot, &it->tree, &iter, 0) {
+        desc = fw_node_alloc_node(FW_NODE_IP, numa_node_id());
+        if( !desc ) goto fail;
+        *desc = *(ip_desc *)*slot;
+        if( radix_tree_insert(&to_ip_table(copy)->tree, iter.index, desc) ){
+            fw_node_free(FW_NODE_IP, desc);
+            goto fail;
+        }
+        copy->num++;
+    }
+    return copy;
+fail:
+    ip_table_destroy(copy);
+    return NULL;
 }
+
+const struct fw_set_ops ip_set_ops = {
+    .name = IP_NAME,
+    .kind = FW_SET_IP,
+    .node = FW_NODE_IP,
+    .create = ip_table_create,
+    .clone = ip_table_clone,
+    .destroy = ip_table_destroy,
+    .insert = ip_table_insert,
+    .delete = ip_table_delete,
+    .test = ip_table_test,
+    .dump = ip_table_dump,
+    .walk = ip_table_walk,
+    .memory = ip_table_memory,
+    .parse = parse_str_ip,
+};
@@ -8,6 +8,7 @@
  * */
 
 #include "common.h"
+#include "set.h"
 
 #define f_type u8
 
@@ -15,7 +16,7 @@
  * single IP indexed by radix tree
  */
 typedef struct {
-    u8 flags;    
+    u8 flags;
     u32 ip;
 } ip_desc;
 
@@ -26,30 +27,21 @@ typedef struct {
 typedef struct  {
     struct hlist_node node;
     u8 flags;
-    u8 mask;
-    u32 __mask;   /* 1<<mask -1*/
+    u8 mask;      /* prefix length */
+    u32 __mask;   /* netmask of the prefix length */
     u32 ip;
 } cidr_desc;
 
+extern const struct fw_set_ops ip_set_ops;
+extern const struct fw_set_ops ip_hash_set_ops;
+extern const struct fw_set_ops ip_roaring_set_ops;
+extern const struct fw_set_ops cidr_set_ops;
+
 int ip_in_whitelist( u32 ip );
 int ip_in_blacklist( u32 ip );
-int get_ip_whitelist(char* str, int len) ;
-int get_ip_blacklist(char* str, int len) ;
-int insert_ip( void *desc );
-int delete_ip( void *desc );
-
-int ip_in_cidr_whitelist( u32 ip );
-int ip_in_cidr_blacklist( u32 ip );
-int insert_cidr( void *p);
-int delete_cidr( void *p);
-int get_cidr_whitelist( char *str, int len );
-int get_cidr_blacklist( char *str, int len );
 int ip_in_cidr_whitelist( u32 ip );
 int ip_in_cidr_blacklist( u32 ip );
 
-void fw_cidr_init(void );
-void fw_cidr_exit(void );
-void fw_ip_init(void );
-void fw_ip_exit(void );
+int parse_str_ip( char *str, void *desc );
 
 #endif
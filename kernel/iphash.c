@@ -0,0 +1,222 @@
+/*
+ * Exact IP backend "ip_hash", an alternative to the radix tree of ip.c.
+ * Entries live in a resizable rhashtable keyed by address,
+ * they are allocated by kmalloc and counted by the memory op.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rhashtable.h>
+#include "log.h"
+#include "ip.h"
+#include "trace.h"
+
+struct ip_hash_entry {
+    struct rhash_head node;
+    ip_desc desc;
+    struct rcu_head rcu;
+};
+
+struct ip_hash_table {
+    struct fw_table table;
+    struct rhashtable ht;
+};
+
+#define to_ip_hash_table(t) container_of(t, struct ip_hash_table, table)
+
+static const struct rhashtable_params ip_hash_params = {
+    .key_len = sizeof(u32),
+    .key_offset = offsetof(struct ip_hash_entry, desc.ip),
+    .head_offset = offsetof(struct ip_hash_entry, node),
+    .automatic_shrinking = true,
+};
+
+static int ip_hash_test( struct fw_table *t, u32 ip )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    return rhashtable_lookup(&ht->ht, &ip, ip_hash_params) != NULL;
+}
+
+static int ip_hash_insert( struct fw_table *t, void *p )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    ip_desc *desc = p;
+    struct ip_hash_entry *e;
+    int error;
+    trace_fw_rule_ip(FW_RULE_ADD, desc->flags, desc->ip, 32);
+    e = rhashtable_lookup_fast(&ht->ht, &desc->ip, ip_hash_params);
+    if( e ){
+        e->desc.flags |= desc->flags;
+        return 0;
+    }
+    e = kmalloc(sizeof(*e), GFP_KERNEL);
+    if( !e ){
+        logs("fail insert: no memory for ip %u", desc->ip);
+        return -ENOMEM;
+    }
+    e->desc = *desc;
+    error = rhashtable_insert_fast(&ht->ht, &e->node, ip_hash_params);
+    if( error ){
+        logs("fail insert: ip %u error %d", desc->ip, error);
+        kfree(e);
+        return error;
+    }
+    t->num++;
+    return 0;
+}
+
+static int ip_hash_delete( struct fw_table *t, void *p )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    ip_desc *desc = p;
+    struct ip_hash_entry *e;
+    e = rhashtable_lookup_fast(&ht->ht, &desc->ip, ip_hash_params);
+    if( !e ){
+        logs("fail delete: no ip %u", desc->ip);
+        return -ENOENT;
+    }
+    rhashtable_remove_fast(&ht->ht, &e->node, ip_hash_params);
+    trace_fw_rule_ip(FW_RULE_DELETE, desc->flags, desc->ip, 32);
+    t->num--;
+    WRITE_ONCE(t->gen, t->gen + 1);
+    kfree_rcu(e, rcu);
+    return 0;
+}
+
+/*
+ * Writers are excluded by the set lock, so the walk only restarts
+ * when the table is being resized. The walk holds rcu_read_lock, and
+ * [fn] may sleep, e.g. to insert into another table: the entries are
+ * copied out first and [fn] is called on the copies after the walk.
+ * */
+static int ip_hash_walk( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    struct rhashtable_iter iter;
+    struct ip_hash_entry *e;
+    ip_desc *all;
+    size_t n = 0, i;
+    int ret = 0;
+    all = kvmalloc_array(max(t->num, 1UL), sizeof(*all), GFP_KERNEL);
+    if( !all ) return -ENOMEM;
+    rhashtable_walk_enter(&ht->ht, &iter);
+    rhashtable_walk_start(&iter);
+    while( (e = rhashtable_walk_next(&iter)) != NULL ){
+        if( IS_ERR(e) ){
+            /* rewound to the start of the resized table */
+            if( PTR_ERR(e) == -EAGAIN ){
+                n = 0;
+                continue;
+            }
+            ret = PTR_ERR(e);
+            break;
+        }
+        if( n == t->num ) break;
+        all[n++] = e->desc;
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+    for( i=0; i<n && !ret; i++ )
+        ret = fn(&all[i], arg);
+    kvfree(all);
+    return ret;
+}
+
+struct ip_hash_dump {
+    char *str;
+    char *end;
+    int num;
+};
+
+static int ip_hash_dump_one( void *desc, void *arg )
+{
+    struct ip_hash_dump *d = arg;
+    if( d->end - d->str < 16 ){
+        logs("str lengh is not enough");
+        return -ENOSPC;
+    }
+    d->str += sprintf(d->str, "%x\n", ((ip_desc *)desc)->ip);
+    d->num++;
+    return 0;
+}
+
+static int ip_hash_dump( struct fw_table *t, char *str, int len )
+{
+    struct ip_hash_dump d = { str, str + len, 0 };
+    str[0] = 0;
+    ip_hash_walk(t, ip_hash_dump_one, &d);
+    return d.num;
+}
+
+static size_t ip_hash_memory( struct fw_table *t )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    const struct bucket_table *tbl;
+    size_t bytes;
+    rcu_read_lock();
+    tbl = rcu_dereference(ht->ht.tbl);
+    bytes = sizeof(*tbl) + tbl->size * sizeof(tbl->buckets[0]);
+    rcu_read_unlock();
+    return sizeof(*ht) + bytes + t->num * sizeof(struct ip_hash_entry);
+}
+
+static struct fw_table *ip_hash_create( void )
+{
+    struct ip_hash_table *ht;
+    ht = kzalloc(sizeof(*ht), GFP_KERNEL);
+    if( !ht ) return NULL;
+    if( rhashtable_init(&ht->ht, &ip_hash_params) ){
+        kfree(ht);
+        return NULL;
+    }
+    ht->table.ops = &ip_hash_set_ops;
+    return &ht->table;
+}
+
+static void ip_hash_free_entry( void *ptr, void *arg )
+{
+    kfree(ptr);
+}
+
+static void ip_hash_destroy( struct fw_table *t )
+{
+    struct ip_hash_table *ht = to_ip_hash_table(t);
+    rhashtable_free_and_destroy(&ht->ht, ip_hash_free_entry, NULL);
+    kfree(ht);
+}
+
+static int ip_hash_clone_one( void *desc, void *arg )
+{
+    struct fw_table *t = arg;
+    ip_desc copy = *(ip_desc *)desc;
+    return ip_hash_insert(t, &copy);
+}
+
+static struct fw_table *ip_hash_clone( struct fw_table *t )
+{
+    struct fw_table *copy;
+    copy = ip_hash_create();
+    if( !copy ) return NULL;
+    if( ip_hash_walk(t, ip_hash_clone_one, copy) ){
+        ip_hash_destroy(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+const struct fw_set_ops ip_hash_set_ops = {
+    .name = "ip_hash",
+    .kind = FW_SET_IP,
+    .node = FW_NODE_MAX,
+    .create = ip_hash_create,
+    .clone = ip_hash_clone,
+    .destroy = ip_hash_destroy,
+    .insert = ip_hash_insert,
+    .delete = ip_hash_delete,
+    .test = ip_hash_test,
+    .dump = ip_hash_dump,
+    .walk = ip_hash_walk,
+    .memory = ip_hash_memory,
+    .parse = parse_str_ip,
+};
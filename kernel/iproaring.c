@@ -0,0 +1,487 @@
+/*
+ * Exact IP backend "ip_roaring", a compressed bitmap for large feeds.
+ * The high 16 bits of an address index a flat array of containers,
+ * a container holds the low 16 bits of its /16 as a sorted array,
+ * a bitmap or a list of runs, whichever is the smallest. The flags of
+ * the addresses are kept once per container.
+ * A lookup is one load in the flat array and one in the container,
+ * plus a binary search within the container for arrays and runs. An
+ * array longer than RR_SUMMARY_STRIDE keeps every RR_SUMMARY_STRIDE-th
+ * value in a summary after its values, searched first, so a lookup reads
+ * at most 128 bytes of the summary and 128 of the values.
+ *
+ * Readers run under RCU. Setting or clearing a bit of a bitmap and
+ * appending to an array or run list with spare room are done in place,
+ * any other change builds a new container which replaces the old one.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/prefetch.h>
+#include "log.h"
+#include "ip.h"
+#include "trace.h"
+
+#define RR_TOP (1 << 16)
+#define RR_BITS (1 << 16)
+#define RR_BITMAP_BYTES (RR_BITS / 8)
+#define RR_ARRAY_MAX (RR_BITMAP_BYTES / sizeof(u16))
+#define RR_SUMMARY_STRIDE 64    /* values per summary entry */
+
+enum rr_type {
+    RR_ARRAY,
+    RR_BITMAP,
+    RR_RUN,
+};
+
+struct rr_run {
+    u16 start;
+    u16 len;       /* the run is start .. start + len */
+};
+
+struct rr_container {
+    u8 type;
+    u8 flags;      /* of all addresses in the container */
+    u32 num;       /* values of an array, runs of a run list */
+    u32 cap;       /* room for values or runs */
+    u32 card;      /* addresses */
+    struct rcu_head rcu;
+    union {
+        u16 values[0];
+        struct rr_run runs[0];
+        unsigned long bitmap[0];
+    };
+};
+
+struct rr_table {
+    struct fw_table table;
+    struct rr_container __rcu **top;
+    unsigned long *scratch;     /* bitmap of one /16 while rebuilding a container */
+};
+
+#define to_rr_table(t) container_of(t, struct rr_table, table)
+
+/* writers are serialized by the set lock */
+#define rr_top(rt, hi) rcu_dereference_protected((rt)->top[hi], 1)
+
+static size_t rr_size( enum rr_type type, u32 cap )
+{
+    switch( type ){
+        case RR_ARRAY:
+            return sizeof(struct rr_container)
+                + (cap + DIV_ROUND_UP(cap, RR_SUMMARY_STRIDE)) * sizeof(u16);
+        case RR_RUN:
+            return sizeof(struct rr_container) + cap * sizeof(struct rr_run);
+        default:
+            return sizeof(struct rr_container) + RR_BITMAP_BYTES;
+    }
+}
+
+static struct rr_container *rr_alloc( enum rr_type type, u32 cap )
+{
+    struct rr_container *c;
+    c = kzalloc(rr_size(type, cap), GFP_KERNEL);
+    if( !c ) return NULL;
+    c->type = type;
+    c->cap = cap;
+    return c;
+}
+
+/* first value of every block of RR_SUMMARY_STRIDE values of an array */
+static inline u16 *rr_summary( const struct rr_container *c )
+{
+    return (u16 *)c->values + c->cap;
+}
+
+static int rr_contains( const struct rr_container *c, u16 lo )
+{
+    const u16 *sum;
+    u32 num, l, r, m;
+    switch( c->type ){
+        case RR_BITMAP:
+            return test_bit(lo, c->bitmap);
+        case RR_ARRAY:
+            num = smp_load_acquire(&c->num);
+            l = 0;
+            r = num;
+            if( num > RR_SUMMARY_STRIDE ){
+                /* the last block starting at or before lo */
+                sum = rr_summary(c);
+                r = DIV_ROUND_UP(num, RR_SUMMARY_STRIDE);
+                while( l < r ){
+                    m = (l + r) / 2;
+                    if( sum[m] <= lo ) l = m + 1;
+                    else r = m;
+                }
+                if( l == 0 ) return 0;
+                l = (l - 1) * RR_SUMMARY_STRIDE;
+                r = min(num, l + RR_SUMMARY_STRIDE);
+            }
+            while( l < r ){
+                m = (l + r) / 2;
+                if( c->values[m] < lo ) l = m + 1;
+                else r = m;
+            }
+            return l < num && c->values[l] == lo;
+        case RR_RUN:
+            /* the last run starting at or before lo */
+            num = smp_load_acquire(&c->num);
+            l = 0;
+            r = num;
+            while( l < r ){
+                m = (l + r) / 2;
+                if( c->runs[m].start <= lo ) l = m + 1;
+                else r = m;
+            }
+            return l > 0 && lo - c->runs[l-1].start <= READ_ONCE(c->runs[l-1].len);
+        default:
+            return 0;
+    }
+}
+
+static int rr_test( struct fw_table *t, u32 ip )
+{
+    struct rr_table *rt = to_rr_table(t);
+    struct rr_container *c = rcu_dereference(rt->top[ip >> 16]);
+    return c && rr_contains(c, ip & 0xffff);
+}
+
+static void rr_prefetch( struct fw_table *t, u32 ip )
+{
+    prefetch(&to_rr_table(t)->top[ip >> 16]);
+}
+
+/*
+ * Add [lo] in place: any address to a bitmap, to an array or run list
+ * only past its last address and if there is room.
+ * */
+static int rr_append( struct rr_container *c, u16 lo )
+{
+    struct rr_run *last;
+    switch( c->type ){
+        case RR_BITMAP:
+            set_bit(lo, c->bitmap);
+            break;
+        case RR_ARRAY:
+            if( c->num == c->cap || c->values[c->num - 1] > lo ) return 0;
+            c->values[c->num] = lo;
+            if( c->num % RR_SUMMARY_STRIDE == 0 )
+                rr_summary(c)[c->num / RR_SUMMARY_STRIDE] = lo;
+            smp_store_release(&c->num, c->num + 1);
+            break;
+        case RR_RUN:
+            last = &c->runs[c->num - 1];
+            if( last->start > lo ) return 0;
+            if( lo == last->start + last->len + 1 ){
+                WRITE_ONCE(last->len, last->len + 1);
+            }else{
+                if( c->num == c->cap ) return 0;
+                c->runs[c->num].start = lo;
+                c->runs[c->num].len = 0;
+                smp_store_release(&c->num, c->num + 1);
+            }
+            break;
+        default:
+            return 0;
+    }
+    c->card++;
+    return 1;
+}
+
+static void rr_decode( const struct rr_container *c, unsigned long *bm )
+{
+    u32 i;
+    bitmap_zero(bm, RR_BITS);
+    if( !c ) return;
+    switch( c->type ){
+        case RR_BITMAP:
+            bitmap_copy(bm, c->bitmap, RR_BITS);
+            break;
+        case RR_ARRAY:
+            for( i=0; i<c->num; i++ )
+                __set_bit(c->values[i], bm);
+            break;
+        case RR_RUN:
+            for( i=0; i<c->num; i++ )
+                bitmap_set(bm, c->runs[i].start, c->runs[i].len + 1);
+            break;
+    }
+}
+
+/*
+ * The smallest container holding the addresses of [bm],
+ * arrays and run lists get some room to grow in place.
+ * */
+static struct rr_container *rr_encode( const unsigned long *bm, u8 flags )
+{
+    struct rr_container *c;
+    unsigned long w, carry = 0;
+    unsigned int start, end, bit;
+    u32 card, runs = 0, n = 0, i;
+
+    card = bitmap_weight(bm, RR_BITS);
+    for( i=0; i<BITS_TO_LONGS(RR_BITS); i++ ){
+        w = bm[i];
+        runs += hweight_long(w & ~((w << 1) | carry));
+        carry = w >> (BITS_PER_LONG - 1);
+    }
+    if( runs * sizeof(struct rr_run) < min_t(size_t, card * sizeof(u16), RR_BITMAP_BYTES) ){
+        c = rr_alloc(RR_RUN, min_t(u32, runs + runs / 4 + 2, RR_BITMAP_BYTES / sizeof(struct rr_run)));
+        if( !c ) return NULL;
+        start = find_first_bit(bm, RR_BITS);
+        while( start < RR_BITS ){
+            end = find_next_zero_bit(bm, RR_BITS, start);
+            c->runs[n].start = start;
+            c->runs[n].len = end - start - 1;
+            n++;
+            start = find_next_bit(bm, RR_BITS, end);
+        }
+    }else if( card <= RR_ARRAY_MAX ){
+        c = rr_alloc(RR_ARRAY, min_t(u32, card + card / 4 + 4, RR_ARRAY_MAX));
+        if( !c ) return NULL;
+        for_each_set_bit(bit, bm, RR_BITS){
+            if( n % RR_SUMMARY_STRIDE == 0 )
+                rr_summary(c)[n / RR_SUMMARY_STRIDE] = bit;
+            c->values[n++] = bit;
+        }
+    }else{
+        c = rr_alloc(RR_BITMAP, 0);
+        if( !c ) return NULL;
+        bitmap_copy(c->bitmap, bm, RR_BITS);
+    }
+    c->num = n;
+    c->card = card;
+    c->flags = flags;
+    return c;
+}
+
+static void rr_replace( struct rr_table *rt, u32 hi, struct rr_container *old, struct rr_container *new )
+{
+    rcu_assign_pointer(rt->top[hi], new);
+    if( old ) kfree_rcu(old, rcu);
+}
+
+/*
+ * Replace the container of [hi] by one with [lo] set or cleared.
+ * */
+static int rr_rebuild( struct rr_table *rt, u32 hi, u16 lo, int set, u8 flags )
+{
+    struct rr_container *old = rr_top(rt, hi);
+    struct rr_container *new;
+    rr_decode(old, rt->scratch);
+    if( set ) __set_bit(lo, rt->scratch);
+    else __clear_bit(lo, rt->scratch);
+    new = rr_encode(rt->scratch, flags);
+    if( !new ) return -ENOMEM;
+    rr_replace(rt, hi, old, new);
+    return 0;
+}
+
+static int rr_insert( struct fw_table *t, void *p )
+{
+    struct rr_table *rt = to_rr_table(t);
+    ip_desc *desc = p;
+    struct rr_container *c;
+    u32 hi = desc->ip >> 16;
+    u16 lo = desc->ip & 0xffff;
+    int error;
+    trace_fw_rule_ip(FW_RULE_ADD, desc->flags, desc->ip, 32);
+    c = rr_top(rt, hi);
+    if( c && rr_contains(c, lo) ){
+        c->flags |= desc->flags;
+        return 0;
+    }
+    if( c && rr_append(c, lo) ){
+        c->flags |= desc->flags;
+    }else{
+        error = rr_rebuild(rt, hi, lo, 1, (c ? c->flags : 0) | desc->flags);
+        if( error ){
+            logs("fail insert: no memory for ip %u", desc->ip);
+            return error;
+        }
+    }
+    t->num++;
+    return 0;
+}
+
+static int rr_delete( struct fw_table *t, void *p )
+{
+    struct rr_table *rt = to_rr_table(t);
+    ip_desc *desc = p;
+    struct rr_container *c;
+    u32 hi = desc->ip >> 16;
+    u16 lo = desc->ip & 0xffff;
+    int error;
+    c = rr_top(rt, hi);
+    if( !c || !rr_contains(c, lo) ){
+        logs("fail delete: no ip %u", desc->ip);
+        return -ENOENT;
+    }
+    trace_fw_rule_ip(FW_RULE_DELETE, desc->flags, desc->ip, 32);
+    if( c->card == 1 ){
+        rr_replace(rt, hi, c, NULL);
+    }else if( c->type == RR_BITMAP && c->card > RR_ARRAY_MAX / 2 ){
+        /* a bitmap shrinks to an array well below the break even point */
+        clear_bit(lo, c->bitmap);
+        c->card--;
+    }else{
+        error = rr_rebuild(rt, hi, lo, 0, c->flags);
+        if( error ) return error;
+    }
+    t->num--;
+    WRITE_ONCE(t->gen, t->gen + 1);
+    return 0;
+}
+
+static int rr_walk( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg )
+{
+    struct rr_table *rt = to_rr_table(t);
+    struct rr_container *c;
+    ip_desc desc;
+    unsigned int bit;
+    u32 hi, i, v;
+    int ret;
+    for( hi=0; hi<RR_TOP; hi++ ){
+        c = rr_top(rt, hi);
+        if( !c ) continue;
+        desc.flags = c->flags;
+        switch( c->type ){
+            case RR_ARRAY:
+                for( i=0; i<c->num; i++ ){
+                    desc.ip = hi << 16 | c->values[i];
+                    ret = fn(&desc, arg);
+                    if( ret ) return ret;
+                }
+                break;
+            case RR_RUN:
+                for( i=0; i<c->num; i++ ){
+                    for( v=c->runs[i].start; v<=c->runs[i].start+c->runs[i].len; v++ ){
+                        desc.ip = hi << 16 | v;
+                        ret = fn(&desc, arg);
+                        if( ret ) return ret;
+                    }
+                }
+                break;
+            case RR_BITMAP:
+                for_each_set_bit(bit, c->bitmap, RR_BITS) {
+                    desc.ip = hi << 16 | bit;
+                    ret = fn(&desc, arg);
+                    if( ret ) return ret;
+                }
+                break;
+        }
+    }
+    return 0;
+}
+
+struct rr_dump {
+    char *str;
+    char *end;
+    int num;
+};
+
+static int rr_dump_one( void *desc, void *arg )
+{
+    struct rr_dump *d = arg;
+    if( d->end - d->str < 16 ){
+        logs("str lengh is not enough");
+        return -ENOSPC;
+    }
+    d->str += sprintf(d->str, "%x\n", ((ip_desc *)desc)->ip);
+    d->num++;
+    return 0;
+}
+
+static int rr_dump( struct fw_table *t, char *str, int len )
+{
+    struct rr_dump d = { str, str + len, 0 };
+    str[0] = 0;
+    rr_walk(t, rr_dump_one, &d);
+    return d.num;
+}
+
+static size_t rr_memory( struct fw_table *t )
+{
+    struct rr_table *rt = to_rr_table(t);
+    struct rr_container *c;
+    size_t bytes = sizeof(*rt) + RR_TOP * sizeof(rt->top[0]) + RR_BITMAP_BYTES;
+    u32 hi;
+    for( hi=0; hi<RR_TOP; hi++ ){
+        c = rr_top(rt, hi);
+        if( c ) bytes += ksize(c);
+    }
+    return bytes;
+}
+
+static struct fw_table *rr_create( void )
+{
+    struct rr_table *rt;
+    rt = kzalloc(sizeof(*rt), GFP_KERNEL);
+    if( !rt ) return NULL;
+    rt->top = kvcalloc(RR_TOP, sizeof(rt->top[0]), GFP_KERNEL);
+    rt->scratch = bitmap_zalloc(RR_BITS, GFP_KERNEL);
+    if( !rt->top || !rt->scratch ){
+        kvfree(rt->top);
+        bitmap_free(rt->scratch);
+        kfree(rt);
+        return NULL;
+    }
+    rt->table.ops = &ip_roaring_set_ops;
+    return &rt->table;
+}
+
+static void rr_destroy( struct fw_table *t )
+{
+    struct rr_table *rt = to_rr_table(t);
+    u32 hi;
+    for( hi=0; hi<RR_TOP; hi++ )
+        kfree(rr_top(rt, hi));
+    kvfree(rt->top);
+    bitmap_free(rt->scratch);
+    kfree(rt);
+}
+
+/*
+ * Containers are copied as they are, on the local node.
+ * */
+static struct fw_table *rr_clone( struct fw_table *t )
+{
+    struct rr_table *rt = to_rr_table(t);
+    struct rr_container *c, *dup;
+    struct fw_table *copy;
+    u32 hi;
+    copy = rr_create();
+    if( !copy ) return NULL;
+    for( hi=0; hi<RR_TOP; hi++ ){
+        c = rr_top(rt, hi);
+        if( !c ) continue;
+        dup = kmemdup(c, rr_size(c->type, c->cap), GFP_KERNEL);
+        if( !dup ){
+            rr_destroy(copy);
+            return NULL;
+        }
+        RCU_INIT_POINTER(to_rr_table(copy)->top[hi], dup);
+    }
+    copy->num = t->num;
+    return copy;
+}
+
+const struct fw_set_ops ip_roaring_set_ops = {
+    .name = "ip_roaring",
+    .kind = FW_SET_IP,
+    .node = FW_NODE_MAX,
+    .create = rr_create,
+    .clone = rr_clone,
+    .destroy = rr_destroy,
+    .insert = rr_insert,
+    .delete = rr_delete,
+    .test = rr_test,
+    .prefetch_key = rr_prefetch,
+    .dump = rr_dump,
+    .walk = rr_walk,
+    .memory = rr_memory,
+    .parse = parse_str_ip,
+};
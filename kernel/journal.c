@@ -0,0 +1,294 @@
+/*
+ * Journal of ruleset changes.
+ * Records are appended under the set lock and copied out under
+ * journal_lock, which only guards the ring and the next sequence number.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include "log.h"
+#include "ip.h"
+#include "port.h"
+#include "mem.h"
+#include "journal.h"
+
+#define JOURNAL_REC     sizeof(struct fw_journal_rec)
+#define JOURNAL_BATCH   64        /* records copied per lock hold */
+
+static unsigned int journal_size = 65536;
+module_param(journal_size, uint, 0444);
+MODULE_PARM_DESC(journal_size, "Records kept by the ruleset journal, rounded up to a power of 2, 0 disables it");
+
+union fw_desc {
+    ip_desc ip;
+    cidr_desc cidr;
+    port_desc port;
+};
+
+static struct fw_journal_rec *journal_ring;
+static u64 journal_mask;
+static u64 journal_next;                /* sequence number of the next record */
+static DEFINE_SPINLOCK(journal_lock);
+
+static u64 journal_applied;             /* next record expected by apply */
+static DEFINE_MUTEX(apply_mutex);
+
+/* the oldest record still in the ring, under journal_lock */
+static inline u64 journal_first( void )
+{
+    return journal_next > journal_mask ? journal_next - journal_mask - 1 : 0;
+}
+
+/*
+ * Append a change of [set], [desc] is the entry inserted or deleted,
+ * unused for the operations on the whole set.
+ * */
+void fw_journal_add( enum fw_journal_op op, struct fw_set *set, void *desc )
+{
+    union fw_desc *d = desc;
+    struct fw_journal_rec *rec;
+    if( !journal_ring ) return;
+    spin_lock(&journal_lock);
+    rec = &journal_ring[journal_next & journal_mask];
+    memset(rec, 0, sizeof(*rec));
+    rec->seq = journal_next;
+    rec->op = op;
+    rec->kind = set->kind;
+    strscpy(rec->set, set->name, sizeof(rec->set));
+    if( op == FW_JOURNAL_INSERT || op == FW_JOURNAL_DELETE ){
+        switch( set->kind ){
+            case FW_SET_IP:
+                rec->key = d->ip.ip;
+                rec->flags = d->ip.flags;
+                break;
+            case FW_SET_CIDR:
+                rec->key = d->cidr.ip;
+                rec->prefixlen = d->cidr.mask;
+                rec->flags = d->cidr.flags;
+                break;
+            case FW_SET_PORT:
+                rec->key = d->port.start;
+                rec->port_end = d->port.end;
+                rec->flags = d->port.flags;
+                break;
+            default:
+                break;
+        }
+    }
+    journal_next++;
+    spin_unlock(&journal_lock);
+}
+
+/*
+ * The file position is the sequence number of the next record times the
+ * record size, a read returns whole records only.
+ * */
+static ssize_t journal_read( struct file *file, char __user *user_buffer, size_t count, loff_t *ppos )
+{
+    struct fw_journal_rec *buf;
+    size_t copied = 0;
+    u64 seq, n, i;
+    u32 rem;
+    ssize_t ret = 0;
+
+    if( !journal_ring ) return -ENODEV;
+    if( *ppos < 0 || count < JOURNAL_REC ) return -EINVAL;
+    seq = div_u64_rem(*ppos, JOURNAL_REC, &rem);
+    if( rem ) return -EINVAL;
+    buf = kmalloc_array(JOURNAL_BATCH, JOURNAL_REC, GFP_KERNEL);
+    if( !buf ) return -ENOMEM;
+    while( count - copied >= JOURNAL_REC ){
+        n = min_t(u64, (count - copied) / JOURNAL_REC, JOURNAL_BATCH);
+        spin_lock(&journal_lock);
+        if( seq < journal_first() ){
+            spin_unlock(&journal_lock);
+            ret = -ERANGE;
+            break;
+        }
+        /* past the last record, e.g. a follower ahead of a reloaded leader */
+        n = seq < journal_next ? min(n, journal_next - seq) : 0;
+        for( i=0; i<n; i++ )
+            buf[i] = journal_ring[(seq + i) & journal_mask];
+        spin_unlock(&journal_lock);
+        if( n == 0 ) break;
+        if( copy_to_user(user_buffer + copied, buf, n * JOURNAL_REC) ){
+            ret = -EFAULT;
+            break;
+        }
+        seq += n;
+        copied += n * JOURNAL_REC;
+    }
+    kfree(buf);
+    *ppos = seq * JOURNAL_REC;
+    return copied ? copied : ret;
+}
+
+static int apply_one( struct fw_set *set, struct fw_journal_rec *rec )
+{
+    union fw_desc desc;
+    int ret;
+    if( rec->kind != set->kind ) return -EINVAL;
+    memset(&desc, 0, sizeof(desc));
+    switch( rec->kind ){
+        case FW_SET_IP:
+            desc.ip.ip = rec->key;
+            desc.ip.flags = rec->flags;
+            break;
+        case FW_SET_CIDR:
+            if( rec->prefixlen > 32 ) return -EINVAL;
+            desc.cidr.ip = rec->key;
+            desc.cidr.mask = rec->prefixlen;
+            desc.cidr.flags = rec->flags;
+            break;
+        case FW_SET_PORT:
+            desc.port.start = rec->key;
+            desc.port.end = rec->port_end;
+            desc.port.flags = rec->flags;
+            break;
+        default:
+            return -EINVAL;
+    }
+    switch( rec->op ){
+        case FW_JOURNAL_INSERT:
+            ret = fw_set_insert(set, &desc);
+            break;
+        case FW_JOURNAL_DELETE:
+            ret = fw_set_delete(set, &desc);
+            break;
+        case FW_JOURNAL_FLUSH:
+            return fw_set_flush(set);
+        case FW_JOURNAL_RESYNC:
+            return -ESTALE;
+        default:
+            return -EINVAL;
+    }
+    /* an entry already there or already gone is not an error on replay */
+    return ret == -ENOMEM ? ret : 0;
+}
+
+static void apply_commit( struct fw_set *set, int pending )
+{
+    if( !set ) return;
+    if( pending ){
+        fw_node_commit();
+        fw_set_commit(set);
+    }
+    fw_set_put(set);
+}
+
+/*
+ * Records are applied one by one, changes of a run of records on one set
+ * are committed together. On error the records before it stay applied.
+ * */
+static ssize_t journal_apply_write( struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos )
+{
+    struct fw_journal_rec rec;
+    struct fw_set *set = NULL;
+    size_t done;
+    int pending = 0;
+    int ret = 0;
+
+    if( count % JOURNAL_REC ) return -EINVAL;
+    mutex_lock(&apply_mutex);
+    for( done=0; done<count; done+=JOURNAL_REC ){
+        if( copy_from_user(&rec, user_buffer + done, JOURNAL_REC) ){
+            ret = -EFAULT;
+            break;
+        }
+        if( rec.seq < journal_applied ) continue;
+        if( rec.seq > journal_applied ){
+            ret = -ERANGE;
+            break;
+        }
+        rec.set[FW_SET_NAMELEN - 1] = 0;
+        if( !set || strcmp(set->name, rec.set) ){
+            apply_commit(set, pending);
+            pending = 0;
+            set = fw_set_get(rec.set);
+            if( !set ){
+                ret = -ENOENT;
+                break;
+            }
+        }
+        ret = apply_one(set, &rec);
+        if( ret ){
+            logs("Fails to apply journal record %llu to set %s: %d", rec.seq, rec.set, ret);
+            break;
+        }
+        pending++;
+        journal_applied++;
+        cond_resched();
+    }
+    apply_commit(set, pending);
+    mutex_unlock(&apply_mutex);
+    *ppos += done;
+    return done ? done : ret;
+}
+
+const struct file_operations fw_journal_fops = {
+    .owner = THIS_MODULE,
+    .read = journal_read,
+    .llseek = default_llseek,
+};
+
+const struct file_operations fw_journal_apply_fops = {
+    .owner = THIS_MODULE,
+    .write = journal_apply_write,
+};
+
+/*
+ * "applied <seq>" sets the next record apply expects,
+ * after the sets were copied whole from a node at <seq>.
+ * */
+int fw_journal_write( char *buf )
+{
+    u64 seq;
+    if( sscanf(buf, "applied %llu", &seq) != 1 ) return -EINVAL;
+    mutex_lock(&apply_mutex);
+    journal_applied = seq;
+    mutex_unlock(&apply_mutex);
+    return 0;
+}
+
+int fw_journal_show( struct seq_file *m, void *v )
+{
+    u64 first, next;
+    spin_lock(&journal_lock);
+    first = journal_first();
+    next = journal_next;
+    spin_unlock(&journal_lock);
+    seq_printf(m, "size %llu\n", journal_ring ? journal_mask + 1 : 0);
+    seq_printf(m, "first %llu\n", first);
+    seq_printf(m, "next %llu\n", next);
+    seq_printf(m, "applied %llu\n", READ_ONCE(journal_applied));
+    seq_printf(m, "record %zu\n", JOURNAL_REC);
+    return 0;
+}
+
+int fw_journal_init( void )
+{
+    u64 size;
+    if( journal_size == 0 ) return 0;
+    size = roundup_pow_of_two(journal_size);
+    journal_ring = vzalloc(array_size(size, JOURNAL_REC));
+    if( !journal_ring ){
+        logs("Fails to alloc journal of %llu records", size);
+        return -ENOMEM;
+    }
+    journal_mask = size - 1;
+    return 0;
+}
+
+void fw_journal_exit( void )
+{
+    vfree(journal_ring);
+    journal_ring = NULL;
+}
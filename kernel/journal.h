@@ -0,0 +1,64 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+/*
+ * Journal of ruleset changes, for replicating the rules of one node to
+ * others by difference.
+ * Every entry inserted into or deleted from a set is appended with the
+ * next sequence number to a ring of journal_size records (module
+ * parameter, 0 disables the journal). /proc/simplefirewall/journal.bin
+ * reads the records as struct fw_journal_rec, record seq being at offset
+ * seq * sizeof(struct fw_journal_rec), so the changes since seq are
+ *   pread(fd, buf, len, seq * sizeof(struct fw_journal_rec))
+ * A read past the last record returns 0, a read of records already
+ * overwritten fails with ERANGE and the reader needs a full copy.
+ *
+ * Records written to /proc/simplefirewall/journal.apply are applied in
+ * order, those before the applied position are skipped, a gap fails with
+ * ERANGE. A flush or load of a whole set is journaled as one record, a
+ * flush is applied, a load or swap fails the apply with ESTALE: the set
+ * has to be copied whole, then "applied <seq>" written to
+ * /proc/simplefirewall/journal sets the position to resume from.
+ * Creating and destroying sets is not journaled.
+ * */
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include "set.h"
+
+#define FW_JOURNAL_FILE "journal.bin"
+#define FW_JOURNAL_APPLY_FILE "journal.apply"
+
+enum fw_journal_op {
+    FW_JOURNAL_INSERT,
+    FW_JOURNAL_DELETE,
+    FW_JOURNAL_FLUSH,      /* all entries of the set removed */
+    FW_JOURNAL_RESYNC,     /* the set replaced as a whole, by load or swap */
+};
+
+struct fw_journal_rec {
+    __u64 seq;
+    __u32 key;            /* IPv4 address or first port, host order */
+    __u16 flags;          /* list flags of the entry */
+    __u16 port_end;       /* last port of a range */
+    __u8 op;              /* enum fw_journal_op */
+    __u8 kind;            /* enum fw_set_kind */
+    __u8 prefixlen;       /* of a CIDR */
+    __u8 pad;
+    __u32 reserved;
+    char set[FW_SET_NAMELEN];
+};
+
+void fw_journal_add( enum fw_journal_op op, struct fw_set *set, void *desc );
+
+extern const struct file_operations fw_journal_fops;
+extern const struct file_operations fw_journal_apply_fops;
+
+int fw_journal_show( struct seq_file *m, void *v );
+int fw_journal_write( char *buf );
+
+int fw_journal_init( void );
+void fw_journal_exit( void );
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * Ports with a socket, kept by kprobes on the socket layer.
+ * A successful listen or bind marks its port in the opened map before
+ * the live one. A rescan clears the opened map, scans the socket tables
+ * under RCU, and clears the live ports that neither the scan nor a listen
+ * since its start holds; a listen racing the clear is caught by checking
+ * the opened map again after it, so an open port is never left clear.
+ * A port closed but still marked only costs a missed early drop.
+ * The hook runs before destination NAT, so a port forwarded by DNAT or
+ * REDIRECT to a port nothing listens on locally is seen as closed.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/netfilter.h>
+#include <net/sock.h>
+#include <net/inet_sock.h>
+#include <net/inet_hashtables.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+#include <net/route.h>
+#include "log.h"
+#include "listen.h"
+
+#define LISTEN_PORTS    65536
+#define LISTEN_WORDS    BITS_TO_LONGS(LISTEN_PORTS)
+#define LISTEN_DELAY    HZ        /* closes gathered into one rescan */
+#define LISTEN_SHOW_MAX 256       /* ports listed by show */
+
+/* first argument of a probed function */
+#if defined(CONFIG_X86_64)
+#define LISTEN_ARG0(regs)   ((struct sock *)(regs)->di)
+#elif defined(CONFIG_ARM64)
+#define LISTEN_ARG0(regs)   ((struct sock *)(regs)->regs[0])
+#endif
+
+enum {
+    LISTEN_TCP,
+    LISTEN_UDP,
+    LISTEN_PROTOS
+};
+
+static const char *proto_names[LISTEN_PROTOS] = { "tcp", "udp" };
+
+DEFINE_STATIC_KEY_FALSE(fw_listen_key);
+
+static unsigned long listen_ports[LISTEN_PROTOS][LISTEN_WORDS];
+static unsigned long listen_opened[LISTEN_PROTOS][LISTEN_WORDS];
+static unsigned long listen_seen[LISTEN_PROTOS][LISTEN_WORDS];   /* under listen_mutex */
+static DEFINE_MUTEX(listen_mutex);
+static int listen_on;
+static unsigned long listen_rescans;
+
+static void listen_work_fn( struct work_struct *work );
+static DECLARE_DELAYED_WORK(listen_work, listen_work_fn);
+
+int __fw_listen_closed( struct sk_buff *skb, u16 port )
+{
+    const struct iphdr *iph = ip_hdr(skb);
+    const struct tcphdr *th;
+    struct tcphdr _th;
+    int p = iph->protocol == IPPROTO_TCP ? LISTEN_TCP : LISTEN_UDP;
+    if( test_bit(port, listen_ports[p]) ) return 0;
+    /* only connection attempts, the rest may be of a flow conntrack missed */
+    if( p == LISTEN_TCP ){
+        th = skb_header_pointer(skb, ip_hdrlen(skb), sizeof(_th), &_th);
+        if( !th || !th->syn || th->ack ) return 0;
+    }
+    /* the closed ports are those of this host, a routed packet is not for it */
+    return inet_addr_type(&init_net, iph->daddr) == RTN_LOCAL;
+}
+
+static void listen_open( int p, struct sock *sk )
+{
+    u16 port;
+    if( !sk || !net_eq(sock_net(sk), &init_net) ) return;
+    port = inet_sk(sk)->inet_num;
+    /* autobound UDP sockets come often, write only what changes */
+    if( !test_bit(port, listen_opened[p]) ){
+        set_bit(port, listen_opened[p]);
+        smp_mb__after_atomic();
+    }
+    if( !test_bit(port, listen_ports[p]) )
+        set_bit(port, listen_ports[p]);
+}
+
+static int listen_entry( struct kretprobe_instance *ri, struct pt_regs *regs )
+{
+#ifdef LISTEN_ARG0
+    *(struct sock **)ri->data = LISTEN_ARG0(regs);
+#else
+    *(struct sock **)ri->data = NULL;
+#endif
+    return 0;
+}
+
+static int tcp_listen_ret( struct kretprobe_instance *ri, struct pt_regs *regs )
+{
+    if( regs_return_value(regs) == 0 )
+        listen_open(LISTEN_TCP, *(struct sock **)ri->data);
+    return 0;
+}
+
+static int udp_bind_ret( struct kretprobe_instance *ri, struct pt_regs *regs )
+{
+    if( regs_return_value(regs) == 0 )
+        listen_open(LISTEN_UDP, *(struct sock **)ri->data);
+    return 0;
+}
+
+static int listen_close( struct kprobe *kp, struct pt_regs *regs )
+{
+    schedule_delayed_work(&listen_work, LISTEN_DELAY);
+    return 0;
+}
+
+static struct kretprobe tcp_listen_probe = {
+    .kp.symbol_name = "inet_csk_listen_start",
+    .entry_handler = listen_entry,
+    .handler = tcp_listen_ret,
+    .data_size = sizeof(struct sock *),
+};
+
+static struct kretprobe udp_bind_probe = {
+    .kp.symbol_name = "udp_lib_get_port",
+    .entry_handler = listen_entry,
+    .handler = udp_bind_ret,
+    .data_size = sizeof(struct sock *),
+};
+
+static struct kretprobe *open_probes[] = { &tcp_listen_probe, &udp_bind_probe };
+
+static struct kprobe tcp_stop_probe = {
+    .symbol_name = "inet_csk_listen_stop",
+    .pre_handler = listen_close,
+};
+
+static struct kprobe udp_unhash_probe = {
+    .symbol_name = "udp_lib_unhash",
+    .pre_handler = listen_close,
+};
+
+static struct kprobe *close_probes[] = { &tcp_stop_probe, &udp_unhash_probe };
+
+/*
+ * Ports of the listening TCP and the hashed UDP sockets of the initial
+ * namespace into listen_seen.
+ * */
+static void listen_scan( void )
+{
+    struct inet_listen_hashbucket *ilb;
+    struct udp_hslot *hslot;
+    struct sock *sk;
+    unsigned int i;
+    bitmap_zero(listen_seen[LISTEN_TCP], LISTEN_PORTS);
+    bitmap_zero(listen_seen[LISTEN_UDP], LISTEN_PORTS);
+    rcu_read_lock();
+    for( i=0; i<INET_LHTABLE_SIZE; i++ ){
+        ilb = &tcp_hashinfo.listening_hash[i];
+        sk_for_each_rcu(sk, &ilb->head)
+            if( net_eq(sock_net(sk), &init_net) )
+                __set_bit(inet_sk(sk)->inet_num, listen_seen[LISTEN_TCP]);
+    }
+    for( i=0; i<=udp_table.mask; i++ ){
+        hslot = &udp_table.hash[i];
+        sk_for_each_rcu(sk, &hslot->head)
+            if( net_eq(sock_net(sk), &init_net) )
+                __set_bit(inet_sk(sk)->inet_num, listen_seen[LISTEN_UDP]);
+        if( (i & 1023) == 1023 ){
+            rcu_read_unlock();
+            cond_resched();
+            rcu_read_lock();
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void listen_rescan( void )
+{
+    unsigned long closed;
+    unsigned int port;
+    int p, i, b;
+    for( p=0; p<LISTEN_PROTOS; p++ )
+        for( i=0; i<LISTEN_WORDS; i++ )
+            xchg(&listen_opened[p][i], 0);
+    smp_mb();
+    listen_scan();
+    for( p=0; p<LISTEN_PROTOS; p++ ){
+        for( i=0; i<LISTEN_WORDS; i++ ){
+            closed = READ_ONCE(listen_ports[p][i]) & ~listen_seen[p][i] & ~READ_ONCE(listen_opened[p][i]);
+            for_each_set_bit(b, &closed, BITS_PER_LONG){
+                port = i * BITS_PER_LONG + b;
+                clear_bit(port, listen_ports[p]);
+                smp_mb__after_atomic();
+                /* a listen that came after the scan passed its bucket */
+                if( test_bit(port, listen_opened[p]) )
+                    set_bit(port, listen_ports[p]);
+            }
+        }
+    }
+    listen_rescans++;
+}
+
+static void listen_work_fn( struct work_struct *work )
+{
+    mutex_lock(&listen_mutex);
+    if( listen_on )
+        listen_rescan();
+    mutex_unlock(&listen_mutex);
+}
+
+/*
+ * All ports start open, the first rescan clears those without a socket,
+ * so a listen during the start is never missed.
+ * */
+static int listen_enable( void )
+{
+    int ret;
+#ifndef LISTEN_ARG0
+    return -EOPNOTSUPP;
+#endif
+    bitmap_fill(listen_ports[LISTEN_TCP], LISTEN_PORTS);
+    bitmap_fill(listen_ports[LISTEN_UDP], LISTEN_PORTS);
+    ret = register_kretprobes(open_probes, ARRAY_SIZE(open_probes));
+    if( ret ){
+        logs("Fails to probe listen and bind: %d", ret);
+        return ret;
+    }
+    ret = register_kprobes(close_probes, ARRAY_SIZE(close_probes));
+    if( ret ){
+        logs("Fails to probe socket close: %d", ret);
+        unregister_kretprobes(open_probes, ARRAY_SIZE(open_probes));
+        return ret;
+    }
+    listen_on = 1;
+    listen_rescan();
+    /* only a hint, the NAT core may be loaded without any forward */
+    if( rcu_access_pointer(nf_nat_hook) )
+        logs("NAT is loaded, forwarded ports without a local listener are dropped");
+    static_branch_enable(&fw_listen_key);
+    return 0;
+}
+
+static void listen_disable( void )
+{
+    static_branch_disable(&fw_listen_key);
+    unregister_kprobes(close_probes, ARRAY_SIZE(close_probes));
+    unregister_kretprobes(open_probes, ARRAY_SIZE(open_probes));
+    listen_on = 0;
+}
+
+/*
+ * "1" to drop packets to closed ports, "0" to stop,
+ * "rescan" to rebuild the maps from the socket tables now.
+ * */
+int fw_listen_write( char *buf )
+{
+    int ret = 0;
+    mutex_lock(&listen_mutex);
+    if( strcmp(buf, "1") == 0 ){
+        if( !listen_on )
+            ret = listen_enable();
+    }else if( strcmp(buf, "0") == 0 ){
+        if( listen_on )
+            listen_disable();
+    }else if( strcmp(buf, "rescan") == 0 ){
+        if( listen_on ) listen_rescan();
+        else ret = -EINVAL;
+    }else{
+        ret = -EINVAL;
+    }
+    mutex_unlock(&listen_mutex);
+    /* the work takes the mutex */
+    if( !listen_on )
+        cancel_delayed_work_sync(&listen_work);
+    return ret;
+}
+
+int fw_listen_show( struct seq_file *m, void *v )
+{
+    unsigned int port, n;
+    int p;
+    mutex_lock(&listen_mutex);
+    seq_printf(m, "enabled %d\n", listen_on);
+    seq_printf(m, "rescans %lu\n", listen_rescans);
+    for( p=0; listen_on && p<LISTEN_PROTOS; p++ ){
+        seq_printf(m, "%s %u", proto_names[p], bitmap_weight(listen_ports[p], LISTEN_PORTS));
+        n = 0;
+        for_each_set_bit(port, listen_ports[p], LISTEN_PORTS){
+            if( n++ == LISTEN_SHOW_MAX ){
+                seq_puts(m, " ...");
+                break;
+            }
+            seq_printf(m, " %u", port);
+        }
+        seq_putc(m, '\n');
+    }
+    mutex_unlock(&listen_mutex);
+    return 0;
+}
+
+void fw_listen_exit( void )
+{
+    mutex_lock(&listen_mutex);
+    if( listen_on )
+        listen_disable();
+    mutex_unlock(&listen_mutex);
+    cancel_delayed_work_sync(&listen_work);
+}
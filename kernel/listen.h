@@ -0,0 +1,46 @@
+#ifndef _LISTEN_H
+#define _LISTEN_H
+
+/*
+ * Early drop of packets to closed ports, switched by
+ * /proc/simplefirewall/listen.
+ * A bitmap of the TCP ports with a listening socket and one of the UDP
+ * ports with a bound socket, of the initial namespace, are kept by
+ * kprobes: a listen or bind that succeeds sets the bit of its port at
+ * once, a listener stopping or a UDP socket unhashed schedules a rescan
+ * of the socket tables that clears the ports nothing holds any more.
+ * After the blacklists, a TCP SYN or a UDP packet to a local address
+ * whose port is clear is dropped by one bit test, before conntrack
+ * confirms an entry for it. Other TCP packets and forwarded ones are left
+ * to the port lists.
+ * The check runs before destination NAT: on a gateway, a SYN or UDP
+ * packet to a local address on a DNAT or REDIRECT port forward has no
+ * local listener on that port and is dropped, so do not enable the mode
+ * where such forwards are used.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+#include <linux/skbuff.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_listen_key);
+
+int __fw_listen_closed( struct sk_buff *skb, u16 port );
+
+/*
+ * 1 if nothing listens on [port], the destination port of [skb].
+ * */
+static inline int fw_listen_closed( struct sk_buff *skb, int port )
+{
+    if( static_branch_unlikely(&fw_listen_key) && port >= 0 )
+        return __fw_listen_closed(skb, port);
+    return 0;
+}
+
+int fw_listen_show( struct seq_file *m, void *v );
+int fw_listen_write( char *buf );
+
+void fw_listen_exit( void );
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * Bulk load.
+ * The feed is cut into one chunk per cpu at token boundaries, every chunk
+ * is parsed and sorted on its own cpu, and the sorted runs are merged into
+ * one sequence without duplicates or covered entries. The new table is
+ * filled in key order, off line, and replaces the table of the set with
+ * one pointer exchange, so lookups see either the old or the new feed.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+#include "log.h"
+#include "ip.h"
+#include "port.h"
+#include "mem.h"
+#include "load.h"
+#include "journal.h"
+
+#define LOAD_CHUNK_MIN 4096    /* bytes, smaller feeds use fewer cpus */
+#define LOAD_SEP " \n\t,"
+
+/*
+ * Sort key of an entry.
+ * ip:   [key] the address
+ * cidr: [key] the network, [arg] the prefix length
+ * port: [key] the first port, [arg] the last one
+ * */
+struct load_entry {
+    u32 key;
+    u32 arg;
+};
+
+struct load_chunk {
+    struct work_struct work;
+    enum fw_set_kind kind;
+    int (*parse)( char *str, void *desc );
+    char *str;
+    int fold;       /* drop covered prefixes and merge ranges too */
+    struct load_entry *entries;
+    size_t num;
+    size_t bad;     /* tokens failing to parse */
+    int err;
+};
+
+union fw_desc {
+    ip_desc ip;
+    cidr_desc cidr;
+    port_desc port;
+};
+
+static inline u32 load_mask( u32 prefixlen )
+{
+    return prefixlen ? ~0U << (32 - prefixlen) : 0;
+}
+
+static inline int load_sep( char c )
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == ',';
+}
+
+static int load_cmp( const void *a, const void *b )
+{
+    const struct load_entry *x = a, *y = b;
+    if( x->key != y->key ) return x->key < y->key ? -1 : 1;
+    if( x->arg != y->arg ) return x->arg < y->arg ? -1 : 1;
+    return 0;
+}
+
+static int load_entry_of( enum fw_set_kind kind, union fw_desc *desc, struct load_entry *e )
+{
+    switch( kind ){
+        case FW_SET_IP:
+            e->key = desc->ip.ip;
+            e->arg = 0;
+            break;
+        case FW_SET_CIDR:
+            e->key = desc->cidr.ip & load_mask(desc->cidr.mask);
+            e->arg = desc->cidr.mask;
+            break;
+        case FW_SET_PORT:
+            e->key = desc->port.start;
+            e->arg = desc->port.end ? desc->port.end : desc->port.start;
+            if( e->arg < e->key ) return -EINVAL;
+            break;
+        default:
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static void load_desc_of( enum fw_set_kind kind, struct load_entry *e, u16 flags, union fw_desc *desc )
+{
+    memset(desc, 0, sizeof(*desc));
+    switch( kind ){
+        case FW_SET_IP:
+            desc->ip.ip = e->key;
+            desc->ip.flags = flags;
+            break;
+        case FW_SET_CIDR:
+            desc->cidr.ip = e->key;
+            desc->cidr.mask = e->arg;
+            desc->cidr.flags = flags;
+            break;
+        case FW_SET_PORT:
+            desc->port.start = e->key;
+            desc->port.end = e->arg;
+            desc->port.flags = flags;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Append [e] to the sorted run [out] of [*num] entries, dropping duplicates
+ * and, with [fold], prefixes inside the previous prefix and folding
+ * overlapping port ranges.
+ * Sorted by network then length, a covering prefix always comes first.
+ * */
+static void load_append( enum fw_set_kind kind, int fold, struct load_entry *out, size_t *num,
+        const struct load_entry *e )
+{
+    struct load_entry *last = *num ? &out[*num - 1] : NULL;
+    if( last && !fold ){
+        if( load_cmp(e, last) == 0 ) return;
+    }else if( last ){
+        switch( kind ){
+            case FW_SET_IP:
+                if( e->key == last->key ) return;
+                break;
+            case FW_SET_CIDR:
+                if( (e->key & load_mask(last->arg)) == last->key ) return;
+                break;
+            case FW_SET_PORT:
+                if( e->key <= last->arg ){
+                    last->arg = max(last->arg, e->arg);
+                    return;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    out[(*num)++] = *e;
+}
+
+static void load_parse( struct work_struct *work )
+{
+    struct load_chunk *c = container_of(work, struct load_chunk, work);
+    union fw_desc desc;
+    struct load_entry e;
+    size_t cap = 1, num = 0, i;
+    char *p;
+
+    for( p=c->str; *p; p++ )
+        if( load_sep(*p) ) cap++;
+    c->entries = kvmalloc_array(cap, sizeof(*c->entries), GFP_KERNEL);
+    if( !c->entries ){
+        c->err = -ENOMEM;
+        return;
+    }
+    while( (p = strsep(&c->str, LOAD_SEP)) != NULL ){
+        if( *p == 0 ) continue;
+        memset(&desc, 0, sizeof(desc));
+        if( c->parse(p, &desc) == 0 || load_entry_of(c->kind, &desc, &e) ){
+            c->bad++;
+            continue;
+        }
+        c->entries[num++] = e;
+        if( (num & 4095) == 0 ) cond_resched();
+    }
+    sort(c->entries, num, sizeof(*c->entries), load_cmp, NULL);
+    /* compact in place, the write index never passes the read index */
+    c->num = 0;
+    for( i=0; i<num; i++ )
+        load_append(c->kind, c->fold, c->entries, &c->num, &c->entries[i]);
+}
+
+/*
+ * Merge the sorted runs of all chunks, k is the number of cpus
+ * so a linear scan for the smallest head is good enough.
+ * */
+static struct load_entry *load_merge( struct load_chunk *chunks, int n, size_t *num )
+{
+    struct load_entry *all;
+    size_t *head;
+    size_t total = 0;
+    int i, best;
+
+    for( i=0; i<n; i++ )
+        total += chunks[i].num;
+    all = kvmalloc_array(max_t(size_t, total, 1), sizeof(*all), GFP_KERNEL);
+    head = kcalloc(n, sizeof(*head), GFP_KERNEL);
+    if( !all || !head ){
+        kvfree(all);
+        kfree(head);
+        return NULL;
+    }
+    *num = 0;
+    for( ;; ){
+        best = -1;
+        for( i=0; i<n; i++ ){
+            if( head[i] == chunks[i].num ) continue;
+            if( best < 0 || load_cmp(&chunks[i].entries[head[i]],
+                        &chunks[best].entries[head[best]]) < 0 )
+                best = i;
+        }
+        if( best < 0 ) break;
+        load_append(chunks[0].kind, chunks[0].fold, all, num, &chunks[best].entries[head[best]++]);
+    }
+    kfree(head);
+    return all;
+}
+
+/*
+ * Parse [buf][len] on all cpus into one sorted run without duplicates,
+ * folded as by load_append() with [fold], returned in [*all] with [*num]
+ * entries. [buf][len] must be writable.
+ * */
+static int load_feed( struct fw_set *set, const struct fw_set_ops *ops, char *buf, size_t len,
+        int fold, struct load_entry **all, size_t *num, size_t *bad, int *cpus )
+{
+    struct workqueue_struct *wq;
+    struct load_chunk *chunks;
+    char *p, *end;
+    int n, c, ret = 0;
+
+    buf[len] = 0;
+    *all = NULL;
+    *num = 0;
+    *bad = 0;
+    n = min_t(size_t, num_online_cpus(), len / LOAD_CHUNK_MIN + 1);
+    chunks = kcalloc(n, sizeof(*chunks), GFP_KERNEL);
+    if( !chunks ) return -ENOMEM;
+    wq = alloc_workqueue("fw_load", WQ_CPU_INTENSIVE, 0);
+    if( !wq ){
+        kfree(chunks);
+        return -ENOMEM;
+    }
+
+    p = buf;
+    for( c=0; c<n; c++ ){
+        chunks[c].kind = set->kind;
+        chunks[c].fold = fold;
+        chunks[c].parse = ops->parse;
+        chunks[c].str = p;
+        /* cut at the first separator after an even share */
+        if( c < n - 1 ){
+            end = max(p, buf + len * (c + 1) / n);
+            while( *end && !load_sep(*end) ) end++;
+            if( *end ) *end++ = 0;
+            p = end;
+        }
+        INIT_WORK(&chunks[c].work, load_parse);
+        queue_work_on(cpumask_local_spread(c, NUMA_NO_NODE), wq, &chunks[c].work);
+    }
+    flush_workqueue(wq);
+    destroy_workqueue(wq);
+
+    for( c=0; c<n; c++ ){
+        if( chunks[c].err ) ret = chunks[c].err;
+        *bad += chunks[c].bad;
+    }
+    if( !ret ){
+        *all = load_merge(chunks, n, num);
+        if( !*all ) ret = -ENOMEM;
+    }
+    for( c=0; c<n; c++ )
+        kvfree(chunks[c].entries);
+    kfree(chunks);
+    *cpus = n;
+    return ret;
+}
+
+/*
+ * Replace the content of [set] by the tokens of [buf], [buf][len] must be
+ * writable. Entries of builtin lists are marked with [flags].
+ * */
+int fw_set_load( struct fw_set *set, char *buf, size_t len, u16 flags )
+{
+    const struct fw_set_ops *ops;
+    struct load_entry *all = NULL;
+    struct fw_table *t;
+    union fw_desc desc;
+    size_t num = 0, bad = 0, i;
+    u64 start, parsed;
+    int n, ret;
+
+    start = ktime_get_ns();
+    rcu_read_lock();
+    ops = rcu_dereference(set->table)->ops;
+    rcu_read_unlock();
+
+    ret = load_feed(set, ops, buf, len, 1, &all, &num, &bad, &n);
+    if( ret ) goto out;
+    parsed = ktime_get_ns();
+
+    t = ops->create();
+    if( !t ){
+        ret = -ENOMEM;
+        goto out;
+    }
+    /* port ranges are kept in a sorted list, prepending is the cheap end */
+    for( i=0; i<num; i++ ){
+        load_desc_of(set->kind, &all[set->kind == FW_SET_PORT ? num - 1 - i : i], flags, &desc);
+        ret = ops->insert(t, &desc);
+        if( ret ){
+            ops->destroy(t);
+            goto out;
+        }
+        if( (i & 4095) == 0 ) cond_resched();
+    }
+    ret = fw_set_publish(set, t, FW_JOURNAL_RESYNC);
+    logs("Load set %s: %zu entries, %zu invalid, %d cpus, parse and merge %llu us, build %llu us",
+            set->name, num, bad, n, div_u64(parsed - start, NSEC_PER_USEC),
+            div_u64(ktime_get_ns() - parsed, NSEC_PER_USEC));
+out:
+    kvfree(all);
+    return ret;
+}
+
+struct load_run {
+    enum fw_set_kind kind;
+    struct load_entry *entries;
+    size_t num;
+    size_t cap;
+};
+
+/*
+ * Called under the set lock and, for some backends, rcu_read_lock,
+ * so the run is sized beforehand and a full run fails the walk.
+ * */
+static int load_collect( void *p, void *arg )
+{
+    struct load_run *run = arg;
+    union fw_desc desc;
+    if( run->num == run->cap ) return -ENOSPC;
+    memcpy(&desc, p, run->kind == FW_SET_IP ? sizeof(ip_desc) :
+            run->kind == FW_SET_CIDR ? sizeof(cidr_desc) : sizeof(port_desc));
+    if( load_entry_of(run->kind, &desc, &run->entries[run->num]) == 0 )
+        run->num++;
+    return 0;
+}
+
+/*
+ * The current entries of [set] in [run], retried with more room
+ * if entries were added meanwhile.
+ * */
+static int load_current( struct fw_set *set, struct load_run *run )
+{
+    int ret = -ENOSPC;
+    int tries;
+    rcu_read_lock();
+    run->cap = rcu_dereference(set->table)->num + 1024;
+    rcu_read_unlock();
+    for( tries=0; tries<4 && ret == -ENOSPC; tries++ ){
+        kvfree(run->entries);
+        run->entries = kvmalloc_array(run->cap, sizeof(*run->entries), GFP_KERNEL);
+        if( !run->entries ) return -ENOMEM;
+        run->num = 0;
+        ret = fw_set_walk(set, load_collect, run);
+        run->cap *= 2;
+    }
+    return ret;
+}
+
+/*
+ * Make [set] hold exactly the tokens of [buf], [buf][len] must be writable.
+ * The wanted entries and the current ones are sorted and merged, only the
+ * difference is inserted and deleted, then committed once. New entries go
+ * in before old ones leave, a blacklist never opens a gap while it changes.
+ * */
+int fw_set_replace( struct fw_set *set, char *buf, size_t len, u16 flags, struct fw_sync_stat *st )
+{
+    const struct fw_set_ops *ops;
+    struct load_entry *want = NULL;
+    struct load_run have = { .kind = set->kind };
+    union fw_desc desc;
+    size_t num = 0, bad = 0, i, j, k, step = 0;
+    u64 start = ktime_get_ns();
+    int n, cmp, ret;
+
+    memset(st, 0, sizeof(*st));
+    rcu_read_lock();
+    ops = rcu_dereference(set->table)->ops;
+    rcu_read_unlock();
+
+    /* compared with the entries as they are, nested or overlapping */
+    ret = load_feed(set, ops, buf, len, 0, &want, &num, &bad, &n);
+    if( ret ) goto out;
+    ret = load_current(set, &have);
+    if( ret ) goto out;
+    /* backends walk in their own order, hashes in none */
+    sort(have.entries, have.num, sizeof(*have.entries), load_cmp, NULL);
+    for( i=0, j=0; i<have.num; i++ )
+        if( j == 0 || load_cmp(&have.entries[i], &have.entries[j-1]) )
+            have.entries[j++] = have.entries[i];
+    have.num = j;
+    st->invalid = bad;
+
+    /* pass 0 inserts what is missing, pass 1 deletes what is left over */
+    for( k=0; k<2; k++ ){
+        i = j = 0;
+        while( i < num || j < have.num ){
+            if( (++step & 4095) == 0 ) cond_resched();
+            if( i == num ) cmp = 1;
+            else if( j == have.num ) cmp = -1;
+            else cmp = load_cmp(&want[i], &have.entries[j]);
+            if( cmp == 0 ){
+                if( k == 0 ) st->unchanged++;
+                i++;
+                j++;
+                continue;
+            }
+            if( cmp < 0 && k == 0 ){
+                load_desc_of(set->kind, &want[i], flags, &desc);
+                if( fw_set_insert(set, &desc) == 0 ) st->added++;
+            }else if( cmp > 0 && k == 1 ){
+                load_desc_of(set->kind, &have.entries[j], flags, &desc);
+                if( fw_set_delete(set, &desc) == 0 ) st->removed++;
+            }
+            if( cmp < 0 ) i++;
+            else j++;
+        }
+    }
+    if( st->added || st->removed ){
+        fw_node_commit();
+        fw_set_commit(set);
+    }
+    st->ns = ktime_get_ns() - start;
+    logs("Replace set %s: %lu added, %lu removed, %lu unchanged, %lu invalid, %llu us",
+            set->name, st->added, st->removed, st->unchanged, st->invalid,
+            div_u64(st->ns, NSEC_PER_USEC));
+out:
+    kvfree(want);
+    kvfree(have.entries);
+    return ret;
+}
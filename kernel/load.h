@@ -0,0 +1,19 @@
+#ifndef _LOAD_H
+#define _LOAD_H
+
+/*
+ * Bulk load of a whole feed into a set, by the load file of a list or set,
+ * e.g. "cat feed > /proc/simplefirewall/ip/blacklist/load".
+ * The feed replaces the content of the set when the file is closed.
+ * The replace file does the same by applying only the difference to the
+ * current entries, reading it reports what changed.
+ * */
+
+#include "set.h"
+
+#define FW_LOAD_MAX (256 << 20)   /* bytes of one feed */
+
+int fw_set_load( struct fw_set *set, char *buf, size_t len, u16 flags );
+int fw_set_replace( struct fw_set *set, char *buf, size_t len, u16 flags, struct fw_sync_stat *st );
+
+#endif
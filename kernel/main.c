@@ -3,13 +3,59 @@
 #include "procfs.h" 
 #include "netfilter.h" 
 #include "port.h" 
+#include "mem.h" 
+#include "set.h" 
+#include "policy.h" 
+#include "top.h" 
+#include "connlimit.h" 
+#include "capture.h" 
+#include "syncookie.h" 
+#include "ctmark.h" 
+#include "order.h" 
+#include "autoblock.h" 
+#include "scan.h" 
+#include "listen.h" 
+#include "frag.h" 
+#include "journal.h" 
 
 
 static int __init fw_module_init(void)
 {
-    fw_ip_init();
-    fw_cidr_init();
-    fw_port_init();
+    int ret;
+    /* before any set, filling one bumps the ruleset generation */
+    ret = fw_ctmark_init();
+    if( ret )
+        return ret;
+    ret = fw_mem_init();
+    if( ret )
+        return ret;
+    ret = fw_journal_init();
+    if( ret ){
+        fw_mem_exit();
+        return ret;
+    }
+    ret = fw_set_init();
+    if( ret ){
+        fw_journal_exit();
+        fw_mem_exit();
+        return ret;
+    }
+    ret = fw_top_init();
+    if( ret ){
+        fw_set_exit();
+        fw_journal_exit();
+        fw_mem_exit();
+        return ret;
+    }
+    ret = fw_frag_init();
+    if( ret ){
+        fw_top_exit();
+        fw_set_exit();
+        fw_journal_exit();
+        fw_mem_exit();
+        return ret;
+    }
+    fw_connlimit_init();
     fw_proc_init();
     fw_net_init();
     printk(KERN_INFO "simplefirewall initialized\n");
@@ -20,9 +66,19 @@ static void __exit fw_module_exit(void)
 {   
     fw_net_exit();
     fw_proc_exit();
-    fw_port_exit();
-    fw_cidr_exit();
-    fw_ip_exit();
+    fw_order_exit();
+    fw_listen_exit();
+    fw_scan_exit();
+    fw_autoblock_exit();
+    fw_syncookie_exit();
+    fw_capture_exit();
+    fw_connlimit_exit();
+    fw_frag_exit();
+    fw_top_exit();
+    fw_policy_exit();
+    fw_set_exit();
+    fw_journal_exit();
+    fw_mem_exit();
     printk(KERN_INFO "simplefirewall exited\n");
 }
 
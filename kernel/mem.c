@@ -0,0 +1,299 @@
+/*
+ * Memory of rule nodes.
+ * Each node type owns a kmem_cache and an optional reserve of objects
+ * preallocated in bulk, which is consumed before falling back to the cache.
+ * Nodes unlinked from a table are collected in batches and freed in bulk
+ * after a grace period, one call_rcu() per batch.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include "log.h"
+#include "ip.h"
+#include "port.h"
+#include "set.h"
+#include "mem.h"
+
+#define FW_BATCH_NODES 254
+
+struct fw_node_batch {
+    struct rcu_head rcu;
+    enum fw_node_type type;
+    int num;
+    void *nodes[FW_BATCH_NODES];
+};
+
+struct fw_node_cache {
+    const char *name;
+    size_t size;
+    struct kmem_cache *cache;
+    atomic_long_t used;     /* objects handed out by fw_node_alloc */
+    spinlock_t lock;        /* protects reserve and nr_reserved */
+    void **reserve;
+    int nr_reserved;
+    struct fw_node_batch *batch;    /* unlinked nodes waiting for commit */
+};
+
+static struct fw_node_cache node_caches[FW_NODE_MAX] = {
+    [FW_NODE_IP] = { .name = "fw_ip_desc", .size = sizeof(ip_desc) },
+    [FW_NODE_CIDR] = { .name = "fw_cidr_desc", .size = sizeof(cidr_desc) },
+    [FW_NODE_PORT] = { .name = "fw_port_desc", .size = sizeof(port_desc) },
+};
+
+static const char *node_names[FW_NODE_MAX] = {
+    [FW_NODE_IP] = IP_NAME,
+    [FW_NODE_CIDR] = CIDR_NAME,
+    [FW_NODE_PORT] = PORT_NAME,
+};
+
+/* serializes fw_node_reserve(), the reserve itself is under cache->lock */
+static DEFINE_MUTEX(reserve_mutex);
+
+void *fw_node_alloc( enum fw_node_type type )
+{
+    struct fw_node_cache *c = &node_caches[type];
+    void *p = NULL;
+
+    spin_lock(&c->lock);
+    if( c->nr_reserved > 0 )
+        p = c->reserve[--c->nr_reserved];
+    spin_unlock(&c->lock);
+    if( !p )
+        p = kmem_cache_alloc(c->cache, GFP_KERNEL);
+    if( p )
+        atomic_long_inc(&c->used);
+    return p;
+}
+
+/*
+ * Allocate on [node] bypassing the reserve, for NUMA replicas.
+ * */
+void *fw_node_alloc_node( enum fw_node_type type, int node )
+{
+    struct fw_node_cache *c = &node_caches[type];
+    void *p;
+
+    p = kmem_cache_alloc_node(c->cache, GFP_KERNEL, node);
+    if( p )
+        atomic_long_inc(&c->used);
+    return p;
+}
+
+size_t fw_node_size( enum fw_node_type type )
+{
+    return kmem_cache_size(node_caches[type].cache);
+}
+
+void fw_node_free( enum fw_node_type type, void *p )
+{
+    struct fw_node_cache *c = &node_caches[type];
+
+    if( !p ) return;
+    atomic_long_dec(&c->used);
+    kmem_cache_free(c->cache, p);
+}
+
+static void fw_node_batch_free( struct rcu_head *head )
+{
+    struct fw_node_batch *batch = container_of(head, struct fw_node_batch, rcu);
+    struct fw_node_cache *c = &node_caches[batch->type];
+
+    atomic_long_sub(batch->num, &c->used);
+    kmem_cache_free_bulk(c->cache, batch->num, batch->nodes);
+    kfree(batch);
+}
+
+/*
+ * Free a node unlinked from an RCU protected table without waiting
+ * for readers. The node is queued in the pending batch of its type,
+ * a full batch is handed to call_rcu() at once, the rest by fw_node_commit().
+ * */
+void fw_node_free_rcu( enum fw_node_type type, void *p )
+{
+    struct fw_node_cache *c = &node_caches[type];
+    struct fw_node_batch *batch, *full = NULL;
+
+    if( !p ) return;
+    spin_lock(&c->lock);
+    batch = c->batch;
+    if( !batch ){
+        batch = kmalloc(sizeof(*batch), GFP_ATOMIC);
+        if( batch ){
+            batch->type = type;
+            batch->num = 0;
+            c->batch = batch;
+        }
+    }
+    if( batch ){
+        batch->nodes[batch->num++] = p;
+        if( batch->num == FW_BATCH_NODES ){
+            full = batch;
+            c->batch = NULL;
+        }
+    }
+    spin_unlock(&c->lock);
+
+    if( full ){
+        call_rcu(&full->rcu, fw_node_batch_free);
+    }else if( !batch ){
+        /* no memory for a batch, wait for the readers here */
+        synchronize_rcu();
+        fw_node_free(type, p);
+    }
+}
+
+/*
+ * Queue the pending batches, called at the end of a run of deletes.
+ * */
+void fw_node_commit( void )
+{
+    struct fw_node_cache *c;
+    struct fw_node_batch *batch;
+    int i;
+
+    for( i=0; i<FW_NODE_MAX; i++ ){
+        c = &node_caches[i];
+        spin_lock(&c->lock);
+        batch = c->batch;
+        c->batch = NULL;
+        spin_unlock(&c->lock);
+        if( batch )
+            call_rcu(&batch->rcu, fw_node_batch_free);
+    }
+}
+EXPORT_SYMBOL_GPL(fw_node_commit);
+
+/*
+ * Make the reserve of [type] hold exactly [num] objects,
+ * allocating the missing ones in one bulk call or trimming the surplus.
+ * */
+int fw_node_reserve( enum fw_node_type type, int num )
+{
+    struct fw_node_cache *c = &node_caches[type];
+    void **objs, **old;
+    int nr;
+
+    if( num < 0 ) return -EINVAL;
+    objs = kvmalloc_array(max(num, 1), sizeof(void *), GFP_KERNEL);
+    if( !objs ) return -ENOMEM;
+
+    mutex_lock(&reserve_mutex);
+    spin_lock(&c->lock);
+    old = c->reserve;
+    nr = c->nr_reserved;
+    c->reserve = NULL;
+    c->nr_reserved = 0;
+    spin_unlock(&c->lock);
+
+    if( nr > num ){
+        kmem_cache_free_bulk(c->cache, nr - num, old + num);
+        nr = num;
+    }
+    if( nr ) memcpy(objs, old, nr * sizeof(void *));
+    kvfree(old);
+    if( nr < num )
+        nr += kmem_cache_alloc_bulk(c->cache, GFP_KERNEL, num - nr, objs + nr);
+
+    spin_lock(&c->lock);
+    c->reserve = objs;
+    c->nr_reserved = nr;
+    spin_unlock(&c->lock);
+    mutex_unlock(&reserve_mutex);
+
+    if( nr != num ){
+        logs("Fails to reserve %d %s nodes, got %d", num, c->name, nr);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * /proc/simplefirewall/memory
+ * Write "<ip|cidr|port> <num>" to reserve nodes before a bulk load.
+ * */
+int fw_mem_write( char *buf )
+{
+    char name[16];
+    int num;
+    int i;
+
+    if( sscanf(buf, "%15s %d", name, &num) != 2 ) return -EINVAL;
+    for( i=0; i<FW_NODE_MAX; i++ ){
+        if( strcmp(name, node_names[i]) == 0 )
+            return fw_node_reserve(i, num);
+    }
+    return -EINVAL;
+}
+
+int fw_mem_show( struct seq_file *m, void *v )
+{
+    struct fw_node_cache *c;
+    unsigned long objs, reserved;
+    size_t objsize;
+    size_t total = 0;
+    int i;
+
+    seq_printf(m, "%-16s %12s %8s %14s\n", "structure", "objects", "objsize", "bytes");
+    for( i=0; i<FW_NODE_MAX; i++ ){
+        c = &node_caches[i];
+        objsize = kmem_cache_size(c->cache);
+        objs = atomic_long_read(&c->used);
+        spin_lock(&c->lock);
+        reserved = c->nr_reserved;
+        spin_unlock(&c->lock);
+        seq_printf(m, "%-16s %12lu %8zu %14zu\n", c->name, objs, objsize, objs * objsize);
+        seq_printf(m, "%-16s %12lu %8zu %14zu\n", "  reserved", reserved, objsize, reserved * objsize);
+        total += (objs + reserved) * objsize;
+    }
+
+    /* radix tree nodes, cidr hash, port bitmap and caches of each set */
+    total += fw_set_mem_show(m);
+
+    seq_printf(m, "%-16s %12s %8s %14zu\n", "total", "-", "-", total);
+    return 0;
+}
+
+int fw_mem_init( void )
+{
+    struct fw_node_cache *c;
+    int i;
+
+    for( i=0; i<FW_NODE_MAX; i++ ){
+        c = &node_caches[i];
+        spin_lock_init(&c->lock);
+        atomic_long_set(&c->used, 0);
+        c->cache = kmem_cache_create(c->name, c->size, 0, 0, NULL);
+        if( !c->cache ){
+            logs("Fails to create cache %s", c->name);
+            fw_mem_exit();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void fw_mem_exit( void )
+{
+    struct fw_node_cache *c;
+    int i;
+
+    fw_node_commit();
+    rcu_barrier();
+    for( i=0; i<FW_NODE_MAX; i++ ){
+        c = &node_caches[i];
+        if( !c->cache ) continue;
+        if( c->nr_reserved )
+            kmem_cache_free_bulk(c->cache, c->nr_reserved, c->reserve);
+        kvfree(c->reserve);
+        c->reserve = NULL;
+        c->nr_reserved = 0;
+        kmem_cache_destroy(c->cache);
+        c->cache = NULL;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _MEM_H
+#define _MEM_H
+
+/*
+ * Memory of rule nodes.
+ * ip_desc, cidr_desc and port_desc are allocated from dedicated slab caches,
+ * so that usage can be accounted per type and reserved before bulk loads.
+ * */
+
+#include <linux/seq_file.h>
+
+enum fw_node_type {
+    FW_NODE_IP,
+    FW_NODE_CIDR,
+    FW_NODE_PORT,
+    FW_NODE_MAX
+};
+
+void *fw_node_alloc( enum fw_node_type type );
+void *fw_node_alloc_node( enum fw_node_type type, int node );
+size_t fw_node_size( enum fw_node_type type );
+void fw_node_free( enum fw_node_type type, void *p );
+void fw_node_free_rcu( enum fw_node_type type, void *p );
+void fw_node_commit( void );
+int fw_node_reserve( enum fw_node_type type, int num );
+
+int fw_mem_show( struct seq_file *m, void *v );
+int fw_mem_write( char *buf );
+
+int fw_mem_init( void );
+void fw_mem_exit( void );
+
+#endif
@@ -6,81 +6,420 @@
 #include <net/ip.h>
 #include <net/net_namespace.h>
 #include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include "log.h"
+#include "netfilter.h"
 #include "ip.h"
 #include "port.h"
+#include "stat.h"
+#include "policy.h"
+#include "top.h"
+#include "connlimit.h"
+#include "capture.h"
+#include "syncookie.h"
+#include "ctmark.h"
+#include "order.h"
+#include "autoblock.h"
+#include "frag.h"
+#include "scan.h"
+#include "listen.h"
+#include "trace.h"
 
 extern int ip_in_whitelist( u32 ip );
 extern int ip_in_blacklist( u32 ip );
 extern int ip_in_cidr_whitelist( u32 ip );
 extern int ip_in_cidr_blacklist( u32 ip );
 
+/*
+ * Recheck of an established flow after the rules changed,
+ * only rules that drop matter as the flow was accepted before.
+ * */
+static int fw_blacklisted( u32 ip, int port )
+{
+    unsigned int verdict;
+    if( fw_policy_match(FW_DIR_IN, ip, port, &verdict) )
+        return verdict == NF_DROP;
+    return ip_in_cidr_blacklist(ip) || ip_in_blacklist(ip);
+}
+
+/*
+ * One check of the blacklist or the accept group, 1 if it decides the packet.
+ * The port check decides the packets it accepts, its full result is kept in
+ * [port_ret] for the port stage: 1 whitelisted, -1 blacklisted, 0 neither.
+ * */
+static inline int fw_check( enum fw_stage stage, u32 ip, int port, int *port_ret )
+{
+    switch( stage ){
+        case FW_STAGE_CIDR_BLACKLIST:
+            return ip_in_cidr_blacklist(ip);
+        case FW_STAGE_IP_BLACKLIST:
+            return ip_in_blacklist(ip);
+        case FW_STAGE_CIDR_WHITELIST:
+            return ip_in_cidr_whitelist(ip);
+        case FW_STAGE_IP_WHITELIST:
+            return ip_in_whitelist(ip);
+        case FW_STAGE_PORT:
+            /* packets without port are accepted by the port stage */
+            if( port < 0 ) return 1;
+            *port_ret = port_in_whitelist(port);
+            if( !*port_ret && port_in_blacklist(port) )
+                *port_ret = -1;
+            return *port_ret > 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Run every check of the two groups to learn what each one decides and costs.
+ * */
+static noinline void fw_order_sample( u32 ip, int port )
+{
+    u64 cycles[FW_ORDER_CHECKS];
+    u32 hits = 0;
+    int port_ret;
+    cycles_t t;
+    int i;
+    for( i=0; i<FW_ORDER_CHECKS; i++ ){
+        t = get_cycles();
+        if( fw_check(FW_ORDER_FIRST + i, ip, port, &port_ret) )
+            hits |= 1 << i;
+        cycles[i] = get_cycles() - t;
+    }
+    /* with SYN cookies the port whitelist is not part of the accept group */
+    if( static_branch_unlikely(&fw_syncookie_key) )
+        hits &= ~(1 << (FW_STAGE_PORT - FW_ORDER_FIRST));
+    fw_order_record(hits, cycles);
+}
+
+/*
+ * Destination port of a TCP or UDP packet, -1 if there is none.
+ * */
+static int fw_skb_dport( struct sk_buff *skb )
+{
+    const struct iphdr *iph = ip_hdr(skb);
+    __be16 _port;
+    const __be16 *p;
+    if( iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP ) return -1;
+    if( iph->frag_off & htons(IP_OFFSET) ) return -1;
+    /* the destination port follows the source port in both headers */
+    p = skb_header_pointer(skb, ip_hdrlen(skb) + sizeof(__be16), sizeof(_port), &_port);
+    return p ? ntohs(*p) : -1;
+}
+
 static unsigned int
 fw_filter(void *priv, struct sk_buff *skb, const struct nf_hook_state *state)
 {
     enum ip_conntrack_info ctinfo;
-    struct nf_conn *ct;
+    struct nf_conn *ct = NULL;
     struct iphdr *ip_header;
-    struct tcphdr *tcp_header;
-    struct udphdr *udp_header;
-    __be16 dst_port;
+    u16 dst_port = 0;
     u32 ip;
     int ret;
+    enum fw_stage stage;
+    unsigned int verdict;
+    cycles_t t, ostart = 0;
+    union fw_order order;
+    int port = -1;
+    int port_ret = 0;
+    int port_done = 0;
+    int lookups = 0;
+    int sampled = 0;
+    int white = 0;
+    int i;
 
     ip_header = ip_hdr(skb);
+    ip = ntohl( ip_header->saddr );
+
+    /* read through the fragment check, a later fragment has no L4 header */
+    port = fw_skb_dport(skb);
+    if( port >= 0 )
+        dst_port = port;
+    fw_top_record(ip, port);
+
+    /* a later fragment follows its first one, unless it is an orphan to filter */
+    if( fw_frag_later(ip_header) ){
+        stage = FW_STAGE_FRAGMENT;
+        t = fw_stat_begin();
+        ret = fw_frag_verdict(ip_header);
+        fw_stat_end(stage, t);
+        if( ret != FW_FRAG_FILTER ){
+            verdict = ret;
+            goto out;
+        }
+    }
+
+    stage = FW_STAGE_CONNTRACK;
+    t = fw_stat_begin();
 	ct = nf_ct_get(skb, &ctinfo);
-    if( ct ){
-        return NF_ACCEPT;
+    fw_stat_end(stage, t);
+    /* the first packet of a connection is filtered like an untracked one */
+    if( ct && ctinfo != IP_CT_NEW ){
+        verdict = NF_ACCEPT;
+        /* stamped by an older ruleset, the source may be blacklisted since */
+        if( unlikely( fw_ctmark_stale(ct) ) ){
+            t = fw_stat_begin();
+            ret = fw_blacklisted(ip, port);
+            fw_stat_end(stage, t);
+            if( ret ){
+                nf_ct_kill(ct);
+                verdict = NF_DROP;
+            }
+        }
+        goto out;
     }
-    ip_header = ip_hdr(skb);
-    //ip = ip_header->saddr;
-    ip = ntohl( ip_header->saddr );
-    ret = ip_in_cidr_blacklist(ip);
+
+    stage = FW_STAGE_POLICY;
+    t = fw_stat_begin();
+    ret = fw_policy_match(FW_DIR_IN, ip, port, &verdict);
+    fw_stat_end(stage, t);
+    if( ret )
+        goto out;
+
+    stage = FW_STAGE_AUTOBLOCK;
+    t = fw_stat_begin();
+    ret = fw_autoblock_test(ip);
+    fw_stat_end(stage, t);
     if( unlikely( ret ) ){
-        return NF_DROP;
+        verdict = NF_DROP;
+        goto out;
     }
-    ret = ip_in_blacklist(ip);
-    if( unlikely( ret ) ){
-        return NF_DROP;
+
+    /* blacklists first, then whatever accepts, each group in adaptive order */
+    order = fw_order_get();
+    sampled = fw_order_sampling();
+    if( unlikely( sampled ) )
+        ostart = get_cycles();
+    for( i=0; i<FW_ORDER_BLACK; i++ ){
+        stage = order.black[i];
+        t = fw_stat_begin();
+        ret = fw_check(stage, ip, port, &port_ret);
+        fw_stat_end(stage, t);
+        lookups++;
+        if( unlikely( ret ) ){
+            verdict = NF_DROP;
+            goto out;
+        }
     }
-    ret = ip_in_cidr_whitelist(ip);
-    if( likely( ret ) ){
-        return NF_ACCEPT;
+    /* nothing listens on the port, whatever a whitelist says */
+    stage = FW_STAGE_LISTEN;
+    t = fw_stat_begin();
+    ret = fw_listen_closed(skb, port);
+    fw_stat_end(stage, t);
+    if( unlikely( ret ) ){
+        verdict = NF_DROP;
+        goto out;
     }
-    ret = ip_in_whitelist(ip);
-    if( likely( ret ) ){
-        return NF_ACCEPT;
+    for( i=0; i<FW_ORDER_WHITE; i++ ){
+        stage = order.white[i];
+        /* a SYN cookie is due for a port whitelist accept only */
+        if( stage == FW_STAGE_PORT ){
+            if( static_branch_unlikely(&fw_syncookie_key) ) continue;
+            port_done = 1;
+        }
+        t = fw_stat_begin();
+        ret = fw_check(stage, ip, port, &port_ret);
+        fw_stat_end(stage, t);
+        lookups++;
+        if( likely( ret ) ){
+            verdict = NF_ACCEPT;
+            goto out;
+        }
     }
 
-    if (ip_header->protocol == IPPROTO_TCP) {
-        tcp_header = tcp_hdr(skb);
-        dst_port = ntohs(tcp_header->dest);
-    }else if (ip_header->protocol == IPPROTO_UDP) {
-        udp_header = udp_hdr(skb);
-        dst_port = ntohs(udp_header->dest);
-    }else{
-        return NF_ACCEPT;
+    stage = FW_STAGE_PORT;
+    if( port < 0 ){
+        verdict = NF_ACCEPT;
+        goto out;
+    }
+    if( !port_done ){
+        t = fw_stat_begin();
+        fw_check(stage, ip, port, &port_ret);
+        fw_stat_end(stage, t);
+        lookups++;
+    }
+    if( port_ret > 0 ){
+        verdict = NF_ACCEPT;
+        t = fw_stat_begin();
+        if( fw_syncookie(skb, ct, &verdict) ){
+            stage = FW_STAGE_SYNCOOKIE;
+            fw_stat_end(stage, t);
+        }
+        goto out;
+    }
+    if( port_ret < 0 ){
+        verdict = NF_DROP;
+        goto out;
     }
-    if( port_in_whitelist( dst_port ) )
+    stage = FW_STAGE_DEFAULT;
+    verdict = NF_DROP;
+out:
+    if( lookups ){
+        fw_order_account(lookups, sampled ? get_cycles() - ostart : 0);
+        if( unlikely( sampled ) )
+            fw_order_sample(ip, port);
+    }
+    /* count a new connection once, when conntrack has not confirmed it yet */
+    if( verdict == NF_ACCEPT && ct && !nf_ct_is_confirmed(ct)
+            && ip_header->protocol == IPPROTO_TCP ){
+        t = fw_stat_begin();
+        ret = fw_connlimit_check(ip, dst_port);
+        fw_stat_end(FW_STAGE_CONNLIMIT, t);
+        if( ret ){
+            white = stage == FW_STAGE_IP_WHITELIST || stage == FW_STAGE_CIDR_WHITELIST;
+            stage = FW_STAGE_CONNLIMIT;
+            verdict = NF_DROP;
+        }
+    }
+    if( fw_frag_first(ip_header) )
+        fw_frag_record(ip_header, verdict);
+    /*
+     * sources dropped for lack of a rule or for too many connections,
+     * a whitelisted one is limited but never blocked
+     * */
+    if( verdict == NF_DROP && (stage == FW_STAGE_DEFAULT
+                || (stage == FW_STAGE_CONNLIMIT && !white)) )
+        fw_autoblock_hit(ip);
+    /* ports probed without a rule accepting them */
+    if( verdict == NF_DROP && (stage == FW_STAGE_DEFAULT || stage == FW_STAGE_PORT
+                || stage == FW_STAGE_LISTEN) )
+        fw_scan_hit(ip, port);
+    /* written only when it changes, the mark shares a cache line */
+    if( verdict == NF_ACCEPT && ct && fw_ctmark_stale(ct) )
+        fw_ctmark_stamp(ct);
+    fw_capture(skb, stage, verdict);
+    fw_stat_verdict(stage, verdict == NF_DROP);
+    trace_fw_verdict(ip, ip_header->protocol, dst_port, stage, verdict);
+    return verdict;
+}
+
+struct fw_dir_stat {
+    u64 accept;
+    u64 drop;
+};
+
+static DEFINE_PER_CPU(struct fw_dir_stat [FW_DIR_MAX], fw_dir_stat);
+
+/*
+ * Outbound and forwarded packets, matched by destination against the
+ * policy of their direction, which shares its sets with the inbound one.
+ * A packet no rule matches is accepted.
+ * */
+static unsigned int
+fw_filter_dst(void *priv, struct sk_buff *skb, const struct nf_hook_state *state)
+{
+    enum fw_dir dir = (enum fw_dir)(unsigned long)priv;
+    enum ip_conntrack_info ctinfo;
+    struct nf_conn *ct;
+    const struct iphdr *iph = ip_hdr(skb);
+    unsigned int verdict = NF_ACCEPT;
+    u32 ip;
+    int port;
+
+    ct = nf_ct_get(skb, &ctinfo);
+    if( ct && ctinfo != IP_CT_NEW )
         return NF_ACCEPT;
-    if( port_in_blacklist( dst_port ) )
-        return NF_DROP;
-    return NF_DROP;
+    ip = ntohl(iph->daddr);
+    port = fw_skb_dport(skb);
+    fw_policy_match(dir, ip, port, &verdict);
+    if( verdict == NF_DROP )
+        this_cpu_inc(fw_dir_stat[dir].drop);
+    else
+        this_cpu_inc(fw_dir_stat[dir].accept);
+    trace_fw_verdict(ip, iph->protocol, port < 0 ? 0 : port, FW_STAGE_POLICY, verdict);
+    return verdict;
 }
 
-static const struct nf_hook_ops fw_ops = {
-	.hook = fw_filter,
-	.pf = NFPROTO_IPV4,
-	.hooknum = NF_INET_PRE_ROUTING,
-	.priority = NF_IP_PRI_CONNTRACK + 1,
+static const struct nf_hook_ops fw_ops[FW_DIR_MAX] = {
+    [FW_DIR_IN] = {
+        .hook = fw_filter,
+        .pf = NFPROTO_IPV4,
+        .hooknum = NF_INET_PRE_ROUTING,
+        .priority = NF_IP_PRI_CONNTRACK + 1,
+    },
+    [FW_DIR_OUT] = {
+        .hook = fw_filter_dst,
+        .priv = (void *)FW_DIR_OUT,
+        .pf = NFPROTO_IPV4,
+        .hooknum = NF_INET_LOCAL_OUT,
+        .priority = NF_IP_PRI_CONNTRACK + 1,
+    },
+    [FW_DIR_FWD] = {
+        .hook = fw_filter_dst,
+        .priv = (void *)FW_DIR_FWD,
+        .pf = NFPROTO_IPV4,
+        .hooknum = NF_INET_FORWARD,
+        .priority = NF_IP_PRI_FILTER - 1,
+    },
+};
+
+static const char *dir_names[FW_DIR_MAX] = {
+    [FW_DIR_IN] = "in",
+    [FW_DIR_OUT] = "out",
+    [FW_DIR_FWD] = "fwd",
 };
 
+static int fw_dir_on[FW_DIR_MAX];
+static DEFINE_MUTEX(fw_dir_mutex);
+
+/*
+ * /proc/simplefirewall/hooks
+ * "out 1" filters outbound packets by policy_out, "fwd 1" forwarded
+ * ones by policy_fwd, "0" unhooks them. Inbound is always hooked.
+ * */
+int fw_hooks_write( char *buf )
+{
+    char name[8];
+    enum fw_dir dir;
+    int on, ret = 0;
+    if( sscanf(buf, "%7s %d", name, &on) != 2 ) return -EINVAL;
+    for( dir=FW_DIR_OUT; dir<FW_DIR_MAX; dir++ )
+        if( strcmp(name, dir_names[dir]) == 0 ) break;
+    if( dir == FW_DIR_MAX ) return -EINVAL;
+    mutex_lock(&fw_dir_mutex);
+    if( on && !fw_dir_on[dir] ){
+        ret = nf_register_net_hook(&init_net, &fw_ops[dir]);
+        if( !ret ) fw_dir_on[dir] = 1;
+    }else if( !on && fw_dir_on[dir] ){
+        nf_unregister_net_hook(&init_net, &fw_ops[dir]);
+        fw_dir_on[dir] = 0;
+    }
+    mutex_unlock(&fw_dir_mutex);
+    return ret;
+}
+
+int fw_hooks_show( struct seq_file *m, void *v )
+{
+    struct fw_dir_stat sum;
+    enum fw_dir dir;
+    int cpu;
+    for( dir=FW_DIR_OUT; dir<FW_DIR_MAX; dir++ ){
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu) {
+            sum.accept += per_cpu(fw_dir_stat, cpu)[dir].accept;
+            sum.drop += per_cpu(fw_dir_stat, cpu)[dir].drop;
+        }
+        seq_printf(m, "%s %d accept %llu drop %llu\n", dir_names[dir], fw_dir_on[dir],
+                sum.accept, sum.drop);
+    }
+    return 0;
+}
+
 void fw_net_init( void  )
 {
-    nf_register_net_hook(&init_net, &fw_ops);
+    nf_register_net_hook(&init_net, &fw_ops[FW_DIR_IN]);
+    fw_dir_on[FW_DIR_IN] = 1;
 }
 
 void fw_net_exit ( void )
 {
-    nf_unregister_net_hook(&init_net, &fw_ops);
+    enum fw_dir dir;
+    mutex_lock(&fw_dir_mutex);
+    for( dir=0; dir<FW_DIR_MAX; dir++ ){
+        if( fw_dir_on[dir] )
+            nf_unregister_net_hook(&init_net, &fw_ops[dir]);
+        fw_dir_on[dir] = 0;
+    }
+    mutex_unlock(&fw_dir_mutex);
 }
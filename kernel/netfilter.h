@@ -2,8 +2,13 @@
 #ifndef _NETFILTER_H
 #define _NETFILTER_H
 
+#include <linux/seq_file.h>
+
 void fw_net_init( void  );
 
 void fw_net_exit( void );
 
+int fw_hooks_show( struct seq_file *m, void *v );
+int fw_hooks_write( char *buf );
+
 #endif
@@ -0,0 +1,279 @@
+/*
+ * Adaptive check order.
+ * A sample records which checks would decide the packet as a bit mask,
+ * so the counts per mask give the joint hit distribution and the exact
+ * expected cost of any order, not only of independent checks. With two
+ * blacklists and three accepting checks all 2 + 6 orders are evaluated.
+ * The order is one word, packets read it without lock.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include "log.h"
+#include "order.h"
+
+#define ORDER_PERIOD      5       /* seconds between two orderings */
+#define ORDER_MIN_SAMPLES 64      /* fewer samples in a period keep the order */
+#define ORDER_BLACK_MASK  ((1 << FW_ORDER_BLACK) - 1)
+
+struct order_stat {
+    u64 combo[1 << FW_ORDER_CHECKS];   /* samples by mask of deciding checks */
+    u64 cycles[FW_ORDER_CHECKS];       /* cost of each check over all samples */
+    u64 samples;
+    u64 observed;                      /* cycles of the ordered checks of samples */
+    u64 packets;
+    u64 lookups;
+};
+
+/*
+ * Figures of the last period, expected per packet for the chosen order
+ * and for the fixed one, observed on the packets themselves.
+ * */
+struct order_report {
+    u64 samples;
+    u64 hits[FW_ORDER_CHECKS];
+    u64 cost[FW_ORDER_CHECKS];
+    u64 expected_cycles;
+    u64 fixed_cycles;
+    u64 expected_lookups;      /* in 1/100 */
+    u64 fixed_lookups;
+    u64 observed_cycles;
+    u64 observed_lookups;
+    unsigned long changes;
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_order_key);
+DEFINE_PER_CPU(unsigned int, fw_order_tick);
+static DEFINE_PER_CPU(struct order_stat, order_stat);
+
+#define ORDER_FIXED { \
+    .black = { FW_STAGE_CIDR_BLACKLIST, FW_STAGE_IP_BLACKLIST }, \
+    .white = { FW_STAGE_CIDR_WHITELIST, FW_STAGE_IP_WHITELIST, FW_STAGE_PORT }, \
+}
+
+static const union fw_order order_fixed = ORDER_FIXED;
+union fw_order fw_order_cur = ORDER_FIXED;
+unsigned int fw_order_rate = 256;
+
+static struct order_stat order_last;
+static struct order_report order_report;
+static DEFINE_MUTEX(order_mutex);
+static void order_adapt( struct work_struct *work );
+static DECLARE_DELAYED_WORK(order_work, order_adapt);
+
+static const u8 perms2[2][2] = { {0, 1}, {1, 0} };
+static const u8 perms3[6][3] = {
+    {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}
+};
+
+void fw_order_record( u32 hits, const u64 *cycles )
+{
+    struct order_stat *s = this_cpu_ptr(&order_stat);
+    int i;
+    s->combo[hits]++;
+    for( i=0; i<FW_ORDER_CHECKS; i++ )
+        s->cycles[i] += cycles[i];
+    s->samples++;
+}
+
+void __fw_order_account( int lookups, u64 cycles )
+{
+    struct order_stat *s = this_cpu_ptr(&order_stat);
+    s->packets++;
+    s->lookups += lookups;
+    s->observed += cycles;
+}
+
+/*
+ * Total cost over the samples [combo] of checking the [n] checks [first]
+ * + [perm] in that order, up to the first deciding one. Samples matching
+ * [skip] never reach the group.
+ * */
+static u64 order_cost( const u64 *combo, const u64 *cost, const u8 *perm,
+        int n, int first, u32 skip )
+{
+    u64 total = 0, path;
+    u32 c;
+    int k, id;
+    for( c=0; c<(1 << FW_ORDER_CHECKS); c++ ){
+        if( !combo[c] || (c & skip) ) continue;
+        path = 0;
+        for( k=0; k<n; k++ ){
+            id = first + perm[k];
+            path += cost[id];
+            if( c & (1 << id) ) break;
+        }
+        total += combo[c] * path;
+    }
+    return total;
+}
+
+static u64 order_total( const u64 *combo, const u64 *cost, const union fw_order *o )
+{
+    u8 black[FW_ORDER_BLACK], white[FW_ORDER_WHITE];
+    int i;
+    for( i=0; i<FW_ORDER_BLACK; i++ )
+        black[i] = o->black[i] - FW_ORDER_FIRST;
+    for( i=0; i<FW_ORDER_WHITE; i++ )
+        white[i] = o->white[i] - FW_ORDER_FIRST - FW_ORDER_BLACK;
+    return order_cost(combo, cost, black, FW_ORDER_BLACK, 0, 0)
+        + order_cost(combo, cost, white, FW_ORDER_WHITE, FW_ORDER_BLACK, ORDER_BLACK_MASK);
+}
+
+static void order_adapt( struct work_struct *work )
+{
+    struct order_stat now, d;
+    struct order_stat *s;
+    struct order_report *r = &order_report;
+    static const u64 unit[FW_ORDER_CHECKS] = { 1, 1, 1, 1, 1 };
+    union fw_order cur, best;
+    u64 cost, best_cost, cur_cost;
+    int cpu, i, p, c;
+
+    memset(&now, 0, sizeof(now));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&order_stat, cpu);
+        for( c=0; c<(1 << FW_ORDER_CHECKS); c++ )
+            now.combo[c] += s->combo[c];
+        for( i=0; i<FW_ORDER_CHECKS; i++ )
+            now.cycles[i] += s->cycles[i];
+        now.samples += s->samples;
+        now.observed += s->observed;
+        now.packets += s->packets;
+        now.lookups += s->lookups;
+    }
+
+    mutex_lock(&order_mutex);
+    for( c=0; c<(1 << FW_ORDER_CHECKS); c++ )
+        d.combo[c] = now.combo[c] - order_last.combo[c];
+    for( i=0; i<FW_ORDER_CHECKS; i++ )
+        d.cycles[i] = now.cycles[i] - order_last.cycles[i];
+    d.samples = now.samples - order_last.samples;
+    d.observed = now.observed - order_last.observed;
+    d.packets = now.packets - order_last.packets;
+    d.lookups = now.lookups - order_last.lookups;
+    if( d.samples < ORDER_MIN_SAMPLES ) goto out;
+    order_last = now;
+
+    r->samples = d.samples;
+    memset(r->hits, 0, sizeof(r->hits));
+    for( c=0; c<(1 << FW_ORDER_CHECKS); c++ )
+        for( i=0; i<FW_ORDER_CHECKS; i++ )
+            if( c & (1 << i) ) r->hits[i] += d.combo[c];
+    for( i=0; i<FW_ORDER_CHECKS; i++ )
+        r->cost[i] = max_t(u64, div64_u64(d.cycles[i], d.samples), 1);
+
+    /* the groups are independent, each one is ordered on its own */
+    cur = fw_order_get();
+    best = cur;
+    best_cost = U64_MAX;
+    for( p=0; p<2; p++ ){
+        cost = order_cost(d.combo, r->cost, perms2[p], FW_ORDER_BLACK, 0, 0);
+        if( cost < best_cost ){
+            best_cost = cost;
+            for( i=0; i<FW_ORDER_BLACK; i++ )
+                best.black[i] = FW_ORDER_FIRST + perms2[p][i];
+        }
+    }
+    best_cost = U64_MAX;
+    for( p=0; p<6; p++ ){
+        cost = order_cost(d.combo, r->cost, perms3[p], FW_ORDER_WHITE, FW_ORDER_BLACK, ORDER_BLACK_MASK);
+        if( cost < best_cost ){
+            best_cost = cost;
+            for( i=0; i<FW_ORDER_WHITE; i++ )
+                best.white[i] = FW_ORDER_FIRST + FW_ORDER_BLACK + perms3[p][i];
+        }
+    }
+    /* switch only for a gain of 1/16, noise would make the order flap */
+    cur_cost = order_total(d.combo, r->cost, &cur);
+    best_cost = order_total(d.combo, r->cost, &best);
+    if( best.word != cur.word && best_cost < cur_cost - cur_cost / 16 ){
+        WRITE_ONCE(fw_order_cur.word, best.word);
+        r->changes++;
+        cur = best;
+        cur_cost = best_cost;
+    }
+
+    r->expected_cycles = div64_u64(cur_cost, d.samples);
+    r->fixed_cycles = div64_u64(order_total(d.combo, r->cost, &order_fixed), d.samples);
+    r->expected_lookups = div64_u64(order_total(d.combo, unit, &cur) * 100, d.samples);
+    r->fixed_lookups = div64_u64(order_total(d.combo, unit, &order_fixed) * 100, d.samples);
+    r->observed_cycles = div64_u64(d.observed, d.samples);
+    r->observed_lookups = d.packets ? div64_u64(d.lookups * 100, d.packets) : 0;
+out:
+    mutex_unlock(&order_mutex);
+    if( static_key_enabled(&fw_order_key) )
+        schedule_delayed_work(&order_work, ORDER_PERIOD * HZ);
+}
+
+/*
+ * "1" to start adapting, "0" to stop and go back to the fixed order,
+ * "rate <n>" to check one packet in n against every list.
+ * */
+int fw_order_write( char *buf )
+{
+    unsigned int rate;
+    if( strcmp(buf, "1") == 0 ){
+        if( static_key_enabled(&fw_order_key) ) return 0;
+        static_branch_enable(&fw_order_key);
+        schedule_delayed_work(&order_work, ORDER_PERIOD * HZ);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_order_key);
+        cancel_delayed_work_sync(&order_work);
+        WRITE_ONCE(fw_order_cur.word, order_fixed.word);
+    }else if( sscanf(buf, "rate %u", &rate) == 1 ){
+        if( rate == 0 || rate > (1 << 20) ) return -EINVAL;
+        WRITE_ONCE(fw_order_rate, roundup_pow_of_two(rate));
+    }else{
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void order_print( struct seq_file *m, const char *name, const u8 *stages, int n )
+{
+    int i;
+    seq_printf(m, "%s", name);
+    for( i=0; i<n; i++ )
+        seq_printf(m, " %s", fw_stage_name(stages[i]));
+    seq_putc(m, '\n');
+}
+
+int fw_order_show( struct seq_file *m, void *v )
+{
+    union fw_order o = fw_order_get();
+    struct order_report *r = &order_report;
+    int i;
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_order_key));
+    seq_printf(m, "rate %u\n", fw_order_rate);
+    order_print(m, "drop", o.black, FW_ORDER_BLACK);
+    order_print(m, "accept", o.white, FW_ORDER_WHITE);
+    mutex_lock(&order_mutex);
+    seq_printf(m, "changes %lu\n", r->changes);
+    seq_printf(m, "samples %llu\n", r->samples);
+    for( i=0; i<FW_ORDER_CHECKS; i++ )
+        seq_printf(m, "%s hit %llu.%02llu%% cost %llu\n", fw_stage_name(FW_ORDER_FIRST + i),
+                r->samples ? div64_u64(r->hits[i] * 100, r->samples) : 0,
+                r->samples ? div64_u64(r->hits[i] * 10000, r->samples) % 100 : 0,
+                r->cost[i]);
+    seq_printf(m, "expected cycles %llu lookups %llu.%02llu\n", r->expected_cycles,
+            r->expected_lookups / 100, r->expected_lookups % 100);
+    seq_printf(m, "fixed cycles %llu lookups %llu.%02llu\n", r->fixed_cycles,
+            r->fixed_lookups / 100, r->fixed_lookups % 100);
+    seq_printf(m, "observed cycles %llu lookups %llu.%02llu\n", r->observed_cycles,
+            r->observed_lookups / 100, r->observed_lookups % 100);
+    mutex_unlock(&order_mutex);
+    return 0;
+}
+
+void fw_order_exit( void )
+{
+    static_branch_disable(&fw_order_key);
+    cancel_delayed_work_sync(&order_work);
+}
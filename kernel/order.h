@@ -0,0 +1,81 @@
+#ifndef _ORDER_H
+#define _ORDER_H
+
+/*
+ * Adaptive order of the list checks of fw_filter(),
+ * switched by /proc/simplefirewall/order.
+ * The blacklists all drop and the whitelists and the port whitelist all
+ * accept, so the checks of each group may run in any order as long as the
+ * blacklist group runs first. One packet in [rate] is checked against
+ * every list to learn how often each check decides and what it costs,
+ * and every few seconds each group is ordered for the least expected
+ * cycles per packet.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include "stat.h"
+
+#define FW_ORDER_FIRST  FW_STAGE_CIDR_BLACKLIST
+#define FW_ORDER_CHECKS 5       /* the stages cidr_blacklist to port */
+#define FW_ORDER_BLACK  2
+#define FW_ORDER_WHITE  3
+
+/*
+ * Stages of each group in the order they are checked.
+ * */
+union fw_order {
+    struct {
+        u8 black[FW_ORDER_BLACK];
+        u8 white[FW_ORDER_WHITE];
+    };
+    u64 word;
+};
+
+DECLARE_STATIC_KEY_FALSE(fw_order_key);
+DECLARE_PER_CPU(unsigned int, fw_order_tick);
+
+extern union fw_order fw_order_cur;
+extern unsigned int fw_order_rate;    /* power of 2 */
+
+static inline union fw_order fw_order_get( void )
+{
+    union fw_order o;
+    o.word = READ_ONCE(fw_order_cur.word);
+    return o;
+}
+
+/*
+ * True for the packets to check against every list.
+ * */
+static inline int fw_order_sampling( void )
+{
+    if( static_branch_unlikely(&fw_order_key) )
+        return (this_cpu_inc_return(fw_order_tick) & (READ_ONCE(fw_order_rate) - 1)) == 0;
+    return 0;
+}
+
+/*
+ * A sample: bit i of [hits] is set if check FW_ORDER_FIRST + i decides
+ * the packet, [cycles] is what each check cost.
+ * */
+void fw_order_record( u32 hits, const u64 *cycles );
+void __fw_order_account( int lookups, u64 cycles );
+
+/*
+ * [lookups] checks decided a packet, [cycles] is measured on samples only.
+ * */
+static inline void fw_order_account( int lookups, u64 cycles )
+{
+    if( static_branch_unlikely(&fw_order_key) )
+        __fw_order_account(lookups, cycles);
+}
+
+int fw_order_show( struct seq_file *m, void *v );
+int fw_order_write( char *buf );
+
+void fw_order_exit( void );
+
+#endif
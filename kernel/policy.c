@@ -0,0 +1,173 @@
+/*
+ * Policies.
+ * The whole rule list is replaced on every write and published by RCU,
+ * each rule holds a reference on its set.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/netfilter.h>
+#include "log.h"
+#include "set.h"
+#include "policy.h"
+#include "ctmark.h"
+
+struct fw_rule {
+    struct fw_set *set;
+    unsigned int verdict;
+};
+
+struct fw_policy {
+    int num;
+    struct fw_rule rules[0];
+};
+
+static struct fw_policy __rcu *fw_policy[FW_DIR_MAX];
+static DEFINE_MUTEX(policy_mutex);
+
+/*
+ * [port] is negative for packets without L4 port.
+ * Return 1 and fill [verdict] if a rule of direction [dir] matches.
+ * */
+int fw_policy_match( enum fw_dir dir, u32 ip, int port, unsigned int *verdict )
+{
+    struct fw_policy *policy;
+    struct fw_rule *rule;
+    int ret = 0;
+    int i;
+    rcu_read_lock();
+    policy = rcu_dereference(fw_policy[dir]);
+    if( !policy ) goto out;
+    for( i=0; i<policy->num; i++ ){
+        rule = &policy->rules[i];
+        if( rule->set->kind == FW_SET_PORT ){
+            if( port < 0 || !fw_set_test(rule->set, port) ) continue;
+        }else if( !fw_set_test(rule->set, ip) ){
+            continue;
+        }
+        *verdict = rule->verdict;
+        ret = 1;
+        break;
+    }
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void policy_free( struct fw_policy *policy )
+{
+    int i;
+    if( !policy ) return;
+    for( i=0; i<policy->num; i++ )
+        fw_set_put(policy->rules[i].set);
+    kfree(policy);
+}
+
+static void policy_publish( enum fw_dir dir, struct fw_policy *policy )
+{
+    struct fw_policy *old;
+    mutex_lock(&policy_mutex);
+    old = rcu_dereference_protected(fw_policy[dir], lockdep_is_held(&policy_mutex));
+    rcu_assign_pointer(fw_policy[dir], policy);
+    mutex_unlock(&policy_mutex);
+    fw_ruleset_changed();
+    synchronize_rcu();
+    policy_free(old);
+}
+
+/*
+ * /proc/simplefirewall/{policy,policy_out,policy_fwd}
+ * One rule per line, e.g. "drop scanners". Writing replaces all rules,
+ * an empty write removes them.
+ * */
+static int policy_write( enum fw_dir dir, char *buf )
+{
+    struct fw_policy *policy;
+    struct fw_rule *rule;
+    char action[8];
+    char name[FW_SET_NAMELEN];
+    char *line;
+    int num = 1;
+    char *p;
+
+    for( p=buf; *p; p++ )
+        if( *p == '\n' ) num++;
+    policy = kzalloc(sizeof(*policy) + num * sizeof(struct fw_rule), GFP_KERNEL);
+    if( !policy ) return -ENOMEM;
+
+    while( (line = strsep(&buf, "\n")) != NULL ){
+        line = strim(line);
+        if( *line == 0 || *line == '#' ) continue;
+        if( sscanf(line, "%7s %31s", action, name) != 2 ) goto invalid;
+        rule = &policy->rules[policy->num];
+        if( strcmp(action, "accept") == 0 ) rule->verdict = NF_ACCEPT;
+        else if( strcmp(action, "drop") == 0 ) rule->verdict = NF_DROP;
+        else goto invalid;
+        rule->set = fw_set_get(name);
+        if( !rule->set ){
+            logs("No set %s", name);
+            policy_free(policy);
+            return -ENOENT;
+        }
+        policy->num++;
+    }
+    policy_publish(dir, policy);
+    return 0;
+invalid:
+    logs("Fails to parse policy %s", line);
+    policy_free(policy);
+    return -EINVAL;
+}
+
+static int policy_show( enum fw_dir dir, struct seq_file *m )
+{
+    struct fw_policy *policy;
+    int i;
+    mutex_lock(&policy_mutex);
+    policy = rcu_dereference_protected(fw_policy[dir], lockdep_is_held(&policy_mutex));
+    for( i=0; policy && i<policy->num; i++ ){
+        seq_printf(m, "%s %s\n", policy->rules[i].verdict == NF_DROP ? "drop" : "accept",
+                policy->rules[i].set->name);
+    }
+    mutex_unlock(&policy_mutex);
+    return 0;
+}
+
+int fw_policy_write( char *buf )
+{
+    return policy_write(FW_DIR_IN, buf);
+}
+
+int fw_policy_show( struct seq_file *m, void *v )
+{
+    return policy_show(FW_DIR_IN, m);
+}
+
+int fw_policy_out_write( char *buf )
+{
+    return policy_write(FW_DIR_OUT, buf);
+}
+
+int fw_policy_out_show( struct seq_file *m, void *v )
+{
+    return policy_show(FW_DIR_OUT, m);
+}
+
+int fw_policy_fwd_write( char *buf )
+{
+    return policy_write(FW_DIR_FWD, buf);
+}
+
+int fw_policy_fwd_show( struct seq_file *m, void *v )
+{
+    return policy_show(FW_DIR_FWD, m);
+}
+
+void fw_policy_exit( void )
+{
+    enum fw_dir dir;
+    for( dir=0; dir<FW_DIR_MAX; dir++ )
+        policy_publish(dir, NULL);
+}
@@ -0,0 +1,35 @@
+#ifndef _POLICY_H
+#define _POLICY_H
+
+/*
+ * Policies.
+ * An ordered list of "<accept|drop> <set>" rules checked before the builtin
+ * lists, the first matching rule decides the verdict.
+ * IP and CIDR sets match the source address of inbound packets and the
+ * destination address of outbound and forwarded ones, port sets match the
+ * destination port of TCP and UDP packets.
+ * Each direction has its own rules, sets are shared between them.
+ * */
+
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+enum fw_dir {
+    FW_DIR_IN,      /* pre routing, all received packets */
+    FW_DIR_OUT,     /* local out */
+    FW_DIR_FWD,     /* forward */
+    FW_DIR_MAX
+};
+
+int fw_policy_match( enum fw_dir dir, u32 ip, int port, unsigned int *verdict );
+
+int fw_policy_show( struct seq_file *m, void *v );
+int fw_policy_write( char *buf );
+int fw_policy_out_show( struct seq_file *m, void *v );
+int fw_policy_out_write( char *buf );
+int fw_policy_fwd_show( struct seq_file *m, void *v );
+int fw_policy_fwd_write( char *buf );
+
+void fw_policy_exit( void );
+
+#endif
@@ -1,187 +1,278 @@
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/kernel.h>
 #include <linux/bitmap.h>
 #include <linux/slab.h>
+#include <linux/prefetch.h>
 #include "port.h"
 #include "log.h"
+#include "mem.h"
+#include "trace.h"
 
+/*
+ * Ports of one list are marked in a bitmap for lookup,
+ * the ranges written by user are kept sorted in a list for show.
+ * */
+struct port_table {
+    struct fw_table table;
+    long unsigned int *bitmap;
+    struct list_head ranges;
+};
 
-static long unsigned int *port_bitmap;
-static struct list_head port_lists;
+#define to_port_table(t) container_of(t, struct port_table, table)
 
-int insert_port( void *p )
+#define PORT_BITMAP_BITS (1<<16)
+
+int port_in_whitelist( u16 port )
+{
+    return fw_set_test(fw_lists[F_PORT_WHITELIST], port);
+}
+
+int port_in_blacklist( u16 port )
+{
+    return fw_set_test(fw_lists[F_PORT_BLACKLIST], port);
+}
+
+static int port_table_test( struct fw_table *t, u32 port )
+{
+    return test_bit(port, to_port_table(t)->bitmap);
+}
+
+static void port_table_prefetch( struct fw_table *t, u32 port )
+{
+    prefetch(&to_port_table(t)->bitmap[BIT_WORD(port)]);
+}
+
+static port_desc *port_desc_new( port_desc *desc )
 {
+    port_desc *desc_new;
+    desc_new = fw_node_alloc(FW_NODE_PORT);
+    if( !desc_new ){
+        logs("Fails to alloc port %d-%d", desc->start, desc->end);
+        return NULL;
+    }
+    *desc_new = *desc;
+    return desc_new;
+}
+
+static int port_table_insert( struct fw_table *t, void *p )
+{
+    struct port_table *pt = to_port_table(t);
     port_desc *desc = p;
     port_desc *desc_new;
     port_desc *desc_iter;
-    u16 end = desc->end;
+    struct list_head *pos = &pt->ranges;
 
-    int i;
     if( desc->end == 0) {
-        end = desc->start;
+        desc->end = desc->start;
     }
     else if( desc->end < desc->start ) {
         logs("Wrong port %d %d", desc->start, desc->end);
-        return 0;
+        return -EINVAL;
     }
-    if( desc->flags & PORT_WHITELIST_MASK ){
-        for( i=desc->start; i<= end; i++) {
-            set_bit( i<<1, port_bitmap);
+    trace_fw_rule_port(FW_RULE_ADD, desc->flags, desc->start, desc->end);
+    list_for_each_entry( desc_iter, &pt->ranges, node){
+        if( desc_iter->start == desc->start && desc_iter->end == desc->end ){
+            desc_iter->flags |= desc->flags;
+            return 0;
         }
-    }else if( desc->flags & PORT_BLACKLIST_MASK ){
-        for( i=desc->start; i<= end; i++) {
-            set_bit( (i<<1) + 1, port_bitmap);
-        }
-    }
-    list_for_each_entry( desc_iter, &port_lists, node){
-        if( desc_iter->start == desc->start ) {
-            if (desc_iter->end == desc->end){
-                desc_iter->flags |= desc->flags;
-                return 1;
-            }else if (desc_iter->end < desc->end){
-                desc_new = kmalloc(sizeof(port_desc), GFP_KERNEL);
-                *desc_new = *desc;
-                list_add(&desc_new->node, &desc_iter->node);
-            }else{
-                desc_new = kmalloc(sizeof(port_desc), GFP_KERNEL);
-                *desc_new = *desc;
-                list_add(&desc_new->node, desc_iter->node.prev);
-            }
-            return 1;
-        }else if( desc_iter->start < desc->start ){
-            continue;
-        }else{
-                desc_new = kmalloc(sizeof(port_desc), GFP_KERNEL);
-                *desc_new = *desc;
-                list_add(&desc_new->node, desc_iter->node.prev);
-                return 1;
+        if( desc_iter->start > desc->start ||
+            (desc_iter->start == desc->start && desc_iter->end > desc->end) ){
+            pos = &desc_iter->node;
+            break;
         }
     }
-    desc_new = kmalloc(sizeof(port_desc), GFP_KERNEL);
-    *desc_new = *desc;
-    list_add_tail(&desc_new->node, &port_lists);
-    return 1;
+    desc_new = port_desc_new(desc);
+    if( !desc_new ) return -ENOMEM;
+    list_add_tail_rcu(&desc_new->node, pos);
+    bitmap_set(pt->bitmap, desc->start, desc->end - desc->start + 1);
+    t->num++;
+    return 0;
 }
 
-
-int delete_port( void *p )
+/*
+ * Remove a range, ports still covered by other ranges keep their bit.
+ * */
+static int port_table_delete( struct fw_table *t, void *p )
 {
+    struct port_table *pt = to_port_table(t);
     port_desc *desc = p;
-    int i = 0;
     port_desc *desc_iter;
-    list_for_each_entry( desc_iter, &port_lists, node){
+    port_desc *found = NULL;
+    unsigned long *covered;
+    int i;
+
+    if( desc->end == 0 ) desc->end = desc->start;
+    trace_fw_rule_port(FW_RULE_DELETE, desc->flags, desc->start, desc->end);
+    list_for_each_entry( desc_iter, &pt->ranges, node){
         if( (desc_iter->start == desc->start) && (desc_iter->end == desc->end)) {
-            desc_iter->flags &= ~desc->flags;
-            if( desc_iter->flags == 0){
-                list_del(&desc_iter->node);
-                kfree(desc_iter);
-            }
-            i = 1;
+            found = desc_iter;
             break;
         }
-        continue;
     }
-    if( i != 1) {
+    if( !found ) {
         logs("Fails to delete port %d-%d", desc->start, desc->end);
-        return 0;
+        return -ENOENT;
     }
-    if( desc->flags & PORT_WHITELIST_MASK ){
-        for( i=desc->start; i<= desc->end; i++) {
-            clear_bit( (i<<1) , port_bitmap);
-        }
-    }else if( desc->flags & PORT_BLACKLIST_MASK ){
-        for( i=desc->start; i<= desc->end; i++) {
-            clear_bit( (i<<1) + 1, port_bitmap);
-        }
+    covered = bitmap_zalloc(PORT_BITMAP_BITS, GFP_KERNEL);
+    if( !covered ) return -ENOMEM;
+    list_del_rcu(&found->node);
+    t->num--;
+    list_for_each_entry( desc_iter, &pt->ranges, node)
+        bitmap_set(covered, desc_iter->start, desc_iter->end - desc_iter->start + 1);
+    for( i=desc->start; i<=desc->end; i++ ){
+        if( !test_bit(i, covered) )
+            clear_bit(i, pt->bitmap);
     }
-    return 1;
-}
-
-int port_in_whitelist( u16 port )
-{
-    return  test_bit( (port<<1), port_bitmap);
+    bitmap_free(covered);
+    fw_node_free_rcu(FW_NODE_PORT, found);
+    return 0;
 }
 
-int port_in_blacklist( u16 port )
+static int port_table_dump( struct fw_table *t, char *str, int len )
 {
-    return  test_bit( (port<<1)+1, port_bitmap);
-}
-
-
-int get_port_whitelist(char* str, int len) 
-{   
+    struct port_table *pt = to_port_table(t);
     int i;
-    int index;
+    int num = 0;
     port_desc *desc;
     char *end = str+len;
-    list_for_each_entry( desc, &port_lists, node){
-        if( desc->flags & PORT_WHITELIST_MASK ){
-            index = sprintf(str, "%d-%d\n", desc->start, desc->end);
-            if( index > 0 ) str+= index;
-            if( str > end ){
-                logs("str lengh is not enough");
-                return index;
-            }
+    str[0] = 0;
+    rcu_read_lock();
+    list_for_each_entry_rcu( desc, &pt->ranges, node){
+        if( end - str < 16 ){
+            logs("str lengh is not enough");
+            goto out;
         }
+        str += sprintf(str, "%d-%d\n", desc->start, desc->end);
     }
-    index = sprintf(str, "==============\n");
-    if( index > 0 ) str+= index;
-    for( i=0; i< 65535; i++) {
-        if( test_bit( (i<<1), port_bitmap) ){
-            index = sprintf(str, "%d\n", i);
-            if( index > 0 ) str+= index;
-            if( str > end ){  /* bugs here */
+    if( end - str < 16 ) goto out;
+    str += sprintf(str, "==============\n");
+    for( i=0; i<PORT_BITMAP_BITS; i++) {
+        if( test_bit( i, pt->bitmap) ){
+            if( end - str < 8 ){
                 logs("str lengh is not enough");
-                return i;
+                goto out;
             }
+            str += sprintf(str, "%d\n", i);
+            num++;
         }
     }
+out:
+    rcu_read_unlock();
+    return num;
+}
+
+static int port_table_walk( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg )
+{
+    struct port_table *pt = to_port_table(t);
+    port_desc *desc;
+    int ret;
+    list_for_each_entry( desc, &pt->ranges, node){
+        ret = fn(desc, arg);
+        if( ret ) return ret;
+    }
     return 0;
 }
 
-int get_port_blacklist(char* str, int len) 
-{   
-    int i;
-    int index;
-    port_desc *desc ;
-    char *end = str+len;
-    list_for_each_entry( desc, &port_lists, node){
-        if( desc->flags & PORT_BLACKLIST_MASK ){
-            index = sprintf(str, "%d-%d\n", desc->start, desc->end);
-            if( index > 0 ) str+= index;
-            if( str > end ){
-                logs("str lengh is not enough");
-                return index;
-            }
-        }
+static size_t port_table_memory( struct fw_table *t )
+{
+    return sizeof(struct port_table) + BITS_TO_LONGS(PORT_BITMAP_BITS) * sizeof(long);
+}
+
+int parse_str_port( char *str, void *_desc)
+{
+    port_desc *desc = _desc;
+    char *p = str;
+    int isrange = 0;
+    if(strlen(str) == 0) return 0;
+    while( (*p != '-') && (*p != 0) ){
+        p++;
     }
-    index = sprintf(str, "==============\n");
-    if( index > 0 ) str+= index;
-    for( i=0; i< 65535; i++) {
-        if( test_bit( (i<<1)+1, port_bitmap) ){
-            index = sprintf(str, "%d\n", i);
-            if( index > 0 ) str+= index;
-            if( str > end ){  /* bugs here */
-                logs("str lengh is not enough");
-                return i;
-            }
+    if( *p == '-' ){
+        *p = 0;
+        p++;
+        isrange = 1;
+    }
+    desc->start = desc->end = 0;
+    if( kstrtou16( str, 10, &desc->start) != 0 ){
+        logs("Failt to parse port %s", str);
+        return 0;
+    }
+    if( isrange ){
+        if( kstrtou16( p, 10, &desc->end) != 0 ){
+            logs("Failt to parse port %s", p);
+            return 0;
         }
     }
-    return 0;
+    return 1;
 }
 
-void fw_port_init(void)
+static struct fw_table *port_table_create( void )
 {
-    port_bitmap = bitmap_zalloc(1<<17, GFP_KERNEL); /* 2 bits represent two list, so use 17 */
-    INIT_LIST_HEAD( &port_lists );
+    struct port_table *pt;
+    pt = kzalloc(sizeof(*pt), GFP_KERNEL);
+    if( !pt ) return NULL;
+    pt->bitmap = bitmap_zalloc(PORT_BITMAP_BITS, GFP_KERNEL);
+    if( !pt->bitmap ){
+        kfree(pt);
+        return NULL;
+    }
+    INIT_LIST_HEAD( &pt->ranges );
+    pt->table.ops = &port_set_ops;
+    return &pt->table;
 }
 
-void fw_port_exit(void)
+static void port_table_destroy( struct fw_table *t )
 {
+    struct port_table *pt = to_port_table(t);
     port_desc *desc_iter, *tmp ;
-    bitmap_free(port_bitmap);
-    list_for_each_entry_safe( desc_iter, tmp, &port_lists, node){
+    bitmap_free(pt->bitmap);
+    list_for_each_entry_safe( desc_iter, tmp, &pt->ranges, node){
             list_del(&desc_iter->node);
-            kfree(desc_iter);
+            fw_node_free(FW_NODE_PORT, desc_iter);
     }
+    kfree(pt);
 }
+
+/*
+ * Copy the bitmap and ranges with memory on the local node.
+ * */
+static struct fw_table *port_table_clone( struct fw_table *t )
+{
+    struct port_table *pt = to_port_table(t);
+    struct port_table *copy;
+    struct fw_table *c;
+    port_desc *desc, *desc_new;
+    c = port_table_create();
+    if( !c ) return NULL;
+    copy = to_port_table(c);
+    bitmap_copy(copy->bitmap, pt->bitmap, PORT_BITMAP_BITS);
+    list_for_each_entry( desc, &pt->ranges, node){
+        desc_new = fw_node_alloc_node(FW_NODE_PORT, numa_node_id());
+        if( !desc_new ){
+            port_table_destroy(c);
+            return NULL;
+        }
+        *desc_new = *desc;
+        list_add_tail(&desc_new->node, &copy->ranges);
+    }
+    c->num = t->num;
+    return c;
+}
+
+const struct fw_set_ops port_set_ops = {
+    .name = PORT_NAME,
+    .kind = FW_SET_PORT,
+    .node = FW_NODE_PORT,
+    .create = port_table_create,
+    .clone = port_table_clone,
+    .destroy = port_table_destroy,
+    .insert = port_table_insert,
+    .delete = port_table_delete,
+    .test = port_table_test,
+    .prefetch_key = port_table_prefetch,
+    .dump = port_table_dump,
+    .walk = port_table_walk,
+    .memory = port_table_memory,
+    .parse = parse_str_port,
+};
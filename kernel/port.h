@@ -3,31 +3,23 @@
 /*
  * For filter network L4 port
  *
- * 
+ *
  *
  */
 
 #include "common.h"
+#include "set.h"
 
 typedef struct{
-    struct list_head node; 
+    struct list_head node;
     u16 flags;
     u16 start;
-    u16 end;  /* set to 0 if a single port, not range.*/
+    u16 end;  /* equal to start if a single port, not range.*/
 } port_desc;
 
+extern const struct fw_set_ops port_set_ops;
 
-
-
-int insert_port( void *p );
-int delete_port( void *p );
 int port_in_whitelist( u16 port );
 int port_in_blacklist( u16 port );
-int get_port_whitelist(char* str, int len);
-int get_port_blacklist(char* str, int len);
-int insert_port( void *p );
-int delete_port( void *p );
-void fw_port_exit(void);
-void fw_port_init(void);
 
 #endif
@@ -4,51 +4,98 @@
 #include <linux/mm.h>
 #include <linux/inet.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/sched.h>
 #include "log.h"
 #include "ip.h"
 #include "port.h"
+#include "mem.h"
+#include "stat.h"
+#include "set.h"
+#include "policy.h"
+#include "top.h"
+#include "connlimit.h"
+#include "load.h"
+#include "capture.h"
+#include "syncookie.h"
+#include "ctmark.h"
+#include "order.h"
+#include "autoblock.h"
+#include "scan.h"
+#include "listen.h"
+#include "frag.h"
+#include "journal.h"
+#include "netfilter.h"
 
 
 enum proc_type{
     add,
     delete,
+    flush,
+    load,
+    replace,
     show
 };
 
 struct mutex proc_mutex;
 
-static void get_path_type(struct file *file, enum F_LIST_TYPE *listtype, enum proc_type *proctype)
+/*
+ * Resolve the set behind a file of the tree
+ * /proc/simplefirewall/{ip,cidr,port}/{whitelist,blacklist}/{add,delete,flush,load,replace,show}
+ * or /proc/simplefirewall/set/<name>/{add,delete,flush,load,replace,show}.
+ * The set is returned with a reference held, [flags] marks the entries
+ * of builtin lists.
+ * */
+static struct fw_set *get_path_set(struct file *file, enum proc_type *proctype, u16 *flags)
 {
-    char *opsname;
-    char *listname;
-    char *ipname;
-    opsname = file->f_path.dentry->d_iname;
+    const char *opsname;
+    const char *listname;
+    const char *ipname;
+    enum F_LIST_TYPE listtype = F_MAX;
+    struct fw_set *set = NULL;
+    opsname = file->f_path.dentry->d_name.name;
     if( strcmp( opsname, "add") == 0) *proctype = add;
     else if( strcmp( opsname, "delete") == 0) *proctype = delete;
-    else if( strcmp( opsname, "show") == 0) *proctype = show;
-
-    listname = file->f_path.dentry->d_parent->d_iname;
-    ipname = file->f_path.dentry->d_parent->d_parent->d_iname;
+    else if( strcmp( opsname, "flush") == 0) *proctype = flush;
+    else if( strcmp( opsname, "load") == 0) *proctype = load;
+    else if( strcmp( opsname, "replace") == 0) *proctype = replace;
+    else *proctype = show;
+
+    listname = file->f_path.dentry->d_parent->d_name.name;
+    ipname = file->f_path.dentry->d_parent->d_parent->d_name.name;
+    *flags = 0;
     if( strcmp( ipname, IP_NAME) == 0){
-        if( strcmp( listname, "whitelist") == 0) *listtype= F_IP_WHITELIST;
-        else if( strcmp( listname, "blacklist") == 0) *listtype= F_IP_BLACKLIST;
+        if( strcmp( listname, "whitelist") == 0) listtype= F_IP_WHITELIST;
+        else if( strcmp( listname, "blacklist") == 0) listtype= F_IP_BLACKLIST;
+        *flags = (listtype == F_IP_WHITELIST) ? IP_WHITELIST_MASK : IP_BLACKLIST_MASK;
     } else if( strcmp( ipname, CIDR_NAME) == 0){
-        if( strcmp( listname, "whitelist") == 0) *listtype= F_CIDR_WHITELIST;
-        else if( strcmp( listname, "blacklist") == 0) *listtype= F_CIDR_BLACKLIST;
+        if( strcmp( listname, "whitelist") == 0) listtype= F_CIDR_WHITELIST;
+        else if( strcmp( listname, "blacklist") == 0) listtype= F_CIDR_BLACKLIST;
+        *flags = (listtype == F_CIDR_WHITELIST) ? CIDR_WHITELIST_MASK : CIDR_BLACKLIST_MASK;
     }else if( strcmp( ipname, PORT_NAME) == 0){
-        if( strcmp( listname, "whitelist") == 0) *listtype= F_PORT_WHITELIST;
-        else if( strcmp( listname, "blacklist") == 0) *listtype= F_PORT_BLACKLIST;
+        if( strcmp( listname, "whitelist") == 0) listtype= F_PORT_WHITELIST;
+        else if( strcmp( listname, "blacklist") == 0) listtype= F_PORT_BLACKLIST;
+        *flags = (listtype == F_PORT_WHITELIST) ? PORT_WHITELIST_MASK : PORT_BLACKLIST_MASK;
+    }else if( strcmp( ipname, SET_NAME) == 0){
+        set = fw_set_get(listname);
+    }
+    if( listtype != F_MAX ){
+        set = fw_lists[listtype];
+        fw_set_hold(set);
     }
 
     logs("%s %s %s", ipname, listname, opsname);
+    return set;
 }
 
 
 static ssize_t str_read(struct file *file, char __user *user_buffer, size_t count, loff_t *ppos)
 {
     ssize_t ret;
-    enum F_LIST_TYPE listtype;
     enum proc_type proctype;
+    struct fw_set *set;
+    u16 flags;
     struct page *pages;
     void *data;
     int pagenum = 4;
@@ -59,30 +106,22 @@ static ssize_t str_read(struct file *file, char __user *user_buffer, size_t coun
         file->private_data = 0;
         return 0;
     }
-    get_path_type(file, &listtype, &proctype);
+    set = get_path_set(file, &proctype, &flags);
+    if( !set ) return -ENOENT;
     if( proctype != show ){
         logs("Not allowed to read");
+        fw_set_put(set);
         return -EFAULT;
     }
     pages = alloc_pages(GFP_KERNEL, pagenum);
     if( !pages ){
         logs("Fails to alloc pages");
+        fw_set_put(set);
         return -EFAULT;
     }
     data = page_address(pages);
-    if( (listtype == F_IP_WHITELIST) && (proctype == show) ){
-        get_ip_whitelist(data, 4096<<pagenum);
-    } else if( (listtype == F_IP_BLACKLIST) && (proctype == show) ){
-        get_ip_blacklist(data, 4096<<pagenum);
-    }else if( (listtype == F_CIDR_WHITELIST) && (proctype == show) ){
-        get_cidr_whitelist(data, 4096<<pagenum);
-    }else if( (listtype == F_CIDR_BLACKLIST) && (proctype == show) ){
-        get_cidr_blacklist(data, 4096<<pagenum);
-    }else if( (listtype == F_PORT_WHITELIST) && (proctype == show) ){
-        get_port_whitelist(data, 4096<<pagenum);
-    }else if( (listtype == F_PORT_BLACKLIST) && (proctype == show) ){
-        get_port_blacklist(data, 4096<<pagenum);
-    }
+    fw_set_dump(set, data, 4096<<pagenum);
+    fw_set_put(set);
 
     len = strlen(data);
     if(len >= count ) {
@@ -101,176 +140,358 @@ static ssize_t str_read(struct file *file, char __user *user_buffer, size_t coun
     }
 }
 
-int parse_str_ip( char *str, void *p)
+union fw_desc {
+    ip_desc ip;
+    cidr_desc cidr;
+    port_desc port;
+};
+
+/*
+ * Writes to add and delete are parsed as a stream, a token cut between
+ * two writes is carried over in the per open file state, so input of any
+ * length is handled with one chunk buffer. Entries are committed every
+ * STREAM_BATCH entries and when the file is closed.
+ * */
+#define STREAM_TOKEN_MAX    64
+#define STREAM_CHUNK        4096
+#define STREAM_BATCH        4096
+
+struct stream_buf {
+    struct fw_set *set;
+    enum proc_type proctype;
+    u16 flags;
+    int (*parse)( char*,  void *);
+    int (*work)( struct fw_set *, void *);
+    unsigned int pending;       /* entries since the last commit */
+    int skip;                   /* token too long, dropped up to the next delimiter */
+    int len;
+    char token[STREAM_TOKEN_MAX];
+    char chunk[STREAM_CHUNK];
+};
+
+static void stream_commit( struct stream_buf *sb )
 {
-    ip_desc *desc = p;
-    if(in4_pton(str, -1, (u8 *)&desc->ip, -1, NULL) == 0){
-        return 0;
-    }
-    desc->ip = ntohl( desc->ip);
-    return 1;
+    if( !sb->pending ) return;
+    /* free the deleted nodes after one grace period for the whole batch */
+    fw_node_commit();
+    fw_set_commit(sb->set);
+    sb->pending = 0;
 }
 
-int parse_str_cidr( char *str, void *_desc)
+static void stream_token( struct stream_buf *sb )
 {
-    cidr_desc *desc = _desc;
-    char *p = str;
-    if(strlen(str) == 0) return 0;
-    while( *p != '/' ){
-        p++;
-        if( (p-str) > 18 ) return 0; /* out of bound */
+    union fw_desc desc;
+    if( sb->skip ){
+        sb->token[STREAM_TOKEN_MAX-1] = 0;
+        logs("Token too long %s...", sb->token);
+        sb->skip = 0;
+        sb->len = 0;
+        return;
     }
-    *p = 0;
-    p++;
-    if(in4_pton(str, -1, (u8 *)&desc->ip, -1, NULL) == 0){
-        return 0;
+    if( sb->len == 0 ) return;
+    sb->token[sb->len] = 0;
+    sb->len = 0;
+    memset(&desc, 0, sizeof(desc));
+    if( sb->parse(sb->token, &desc) == 0 ){
+        logs("Fails to parse %s", sb->token);
+        return;
     }
-    desc->ip = ntohl( desc->ip);
-    if( kstrtou8( p, 10, &desc->mask) == 1 ){
-        logs("Failt to parse ip/mask %d", p);
-        return 0;
+    switch( sb->set->kind ){
+        case FW_SET_IP:
+            desc.ip.flags = sb->flags;
+            break;
+        case FW_SET_CIDR:
+            desc.cidr.flags = sb->flags;
+            break;
+        case FW_SET_PORT:
+            desc.port.flags = sb->flags;
+            break;
+        default:
+            break;
     }
-    return 1;
+    sb->work(sb->set, &desc);
+    if( ++sb->pending >= STREAM_BATCH )
+        stream_commit(sb);
 }
 
-int parse_str_port( char *str, void *_desc)
+static void stream_feed( struct stream_buf *sb, const char *data, size_t n )
 {
-    port_desc *desc = _desc;
-    char *p = str;
-    int isrange = 0;
-    if(strlen(str) == 0) return 0;
-    while( (*p != '-') && (*p != 0) ){
-        p++;
+    size_t i;
+    char c;
+    for( i=0; i<n; i++ ){
+        c = data[i];
+        if( c == ' ' || c == '|' || c == '\n' || c == '\t' || c == ',' || c == 0 ){
+            stream_token(sb);
+        }else if( sb->len < STREAM_TOKEN_MAX - 1 ){
+            sb->token[sb->len++] = c;
+        }else{
+            sb->skip = 1;
+        }
     }
-    if( *p == '-' ){
-        *p = 0;
-        p++;
-        isrange = 1;
+}
+
+static struct stream_buf *stream_open( struct file *file )
+{
+    struct stream_buf *sb = file->private_data;
+    if( sb ) return sb;
+    sb = kzalloc(sizeof(*sb), GFP_KERNEL);
+    if( !sb ) return ERR_PTR(-ENOMEM);
+    sb->set = get_path_set(file, &sb->proctype, &sb->flags);
+    if( !sb->set ){
+        kfree(sb);
+        return ERR_PTR(-ENOENT);
     }
-    desc->start = desc->end = 0;
-    if( kstrtou16( str, 10, &desc->start) == 1 ){
-        logs("Failt to parse port %d", str);
-        return 0;
+    sb->work = (sb->proctype == add) ? fw_set_insert : fw_set_delete;
+    file->private_data = sb;
+    return sb;
+}
+
+static ssize_t str_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+{
+    struct stream_buf *sb;
+    size_t done = 0;
+    size_t n;
+    mutex_lock(&proc_mutex);
+    sb = stream_open(file);
+    if( IS_ERR(sb) ){
+        mutex_unlock(&proc_mutex);
+        return PTR_ERR(sb);
     }
-    if( isrange ){
-        if( kstrtou16( p, 10, &desc->end) == 1 ){
-            logs("Failt to parse port %d", p);
-            return 0;
+    /* the backend of a set may be converted between two writes */
+    rcu_read_lock();
+    sb->parse = rcu_dereference(sb->set->table)->ops->parse;
+    rcu_read_unlock();
+    while( done < count ){
+        n = min_t(size_t, count - done, STREAM_CHUNK);
+        if( copy_from_user(sb->chunk, user_buffer + done, n) ){
+            mutex_unlock(&proc_mutex);
+            return done ? done : -EFAULT;
         }
+        stream_feed(sb, sb->chunk, n);
+        done += n;
+        *ppos += n;
+        cond_resched();
     }
-    return 1;
+    mutex_unlock(&proc_mutex);
+    return count;
 }
 
-static ssize_t str_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+/*
+ * Called on close(), ends the last token and commits the rest.
+ * */
+static int str_stream_flush(struct file *file, fl_owner_t id)
+{
+    struct stream_buf *sb = file->private_data;
+    if( !sb ) return 0;
+    mutex_lock(&proc_mutex);
+    stream_token(sb);
+    stream_commit(sb);
+    mutex_unlock(&proc_mutex);
+    return 0;
+}
+
+static int str_stream_release(struct inode *inode, struct file *file)
+{
+    struct stream_buf *sb = file->private_data;
+    if( sb ){
+        fw_set_put(sb->set);
+        kfree(sb);
+    }
+    return 0;
+}
+
+static ssize_t str_flush_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
 {
-    char *buffer;
-    ssize_t ret;
-    char *p;
-    void *desc;
-    ip_desc ipdesc;
-    cidr_desc cidrdesc;
-    port_desc portdesc;
-    int size;
-    enum F_LIST_TYPE listtype;
     enum proc_type proctype;
-    int (*parse)( char*,  void *);
-    int (*work)( void *);
-    get_path_type(file, &listtype, &proctype);
-    if( proctype >= show ){
-        logs("Not allowed to write");
-        return -EFAULT;
+    struct fw_set *set;
+    u16 flags;
+    int ret;
+    set = get_path_set(file, &proctype, &flags);
+    if( !set ) return -ENOENT;
+    ret = fw_set_flush(set);
+    fw_set_put(set);
+    return ret ? ret : count;
+}
+
+/*
+ * A feed written to a load file is buffered per open file
+ * and loaded in bulk when the file is closed.
+ * */
+struct load_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    int done;       /* loaded, the closes of other descriptors skip it */
+};
+
+static ssize_t str_load_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+{
+    struct load_buf *lb = file->private_data;
+    size_t size;
+    char *data;
+    if( !lb ){
+        lb = kzalloc(sizeof(*lb), GFP_KERNEL);
+        if( !lb ) return -ENOMEM;
+        file->private_data = lb;
     }
-    size = 4096*16;
-    buffer = kmalloc(size, GFP_KERNEL);
-    if (count > size) {
-        // Limit the write count to the size of the buffer
-        count = size;
+    /* one byte more for the terminating 0 */
+    if( lb->len + count + 1 > lb->size ){
+        if( lb->len + count + 1 > FW_LOAD_MAX ) return -EFBIG;
+        size = max_t(size_t, lb->size * 2, lb->len + count + 1);
+        size = min_t(size_t, size, FW_LOAD_MAX);
+        data = kvmalloc(size, GFP_KERNEL);
+        if( !data ) return -ENOMEM;
+        if( lb->data ) memcpy(data, lb->data, lb->len);
+        kvfree(lb->data);
+        lb->data = data;
+        lb->size = size;
     }
-
-    ret = copy_from_user(buffer, user_buffer, count);
-    if (ret != 0) {
+    if( copy_from_user(lb->data + lb->len, user_buffer, count) )
         return -EFAULT;
-    } 
-    buffer[count] = 0;
-    *ppos = count;
-    switch( listtype ){
-        case F_IP_WHITELIST:
-           ipdesc.flags = IP_WHITELIST_MASK; 
-           desc = &ipdesc;
-           parse = parse_str_ip;
-           break;
-        case F_IP_BLACKLIST :
-           ipdesc.flags = IP_BLACKLIST_MASK;
-           desc = &ipdesc;
-           parse = parse_str_ip;
-           break;
-        case F_CIDR_WHITELIST:
-           cidrdesc.flags = CIDR_WHITELIST_MASK;
-           desc = &cidrdesc;
-           parse = parse_str_cidr;
-           break;
-        case F_CIDR_BLACKLIST:
-           cidrdesc.flags = CIDR_BLACKLIST_MASK;
-           desc = &cidrdesc;
-           parse = parse_str_cidr;
-           break;
-        case F_PORT_WHITELIST:
-           portdesc.flags = PORT_WHITELIST_MASK;
-           desc = &portdesc;
-           parse = parse_str_port;
-           break;
-        case F_PORT_BLACKLIST:
-           portdesc.flags = PORT_BLACKLIST_MASK;
-           desc = &portdesc;
-           parse = parse_str_port;
-           break;
-        default:
-           logs("Wrong list type");
+    lb->len += count;
+    lb->done = 0;
+    *ppos += count;
+    return count;
+}
+
+/*
+ * The feed to load on close, NULL if there is none. A file written to,
+ * even zero bytes, or opened with O_TRUNC as by "> file" has a feed, an
+ * empty one empties the set, so the buffer always holds at least the
+ * terminating 0. A descriptor only inherited, e.g. closed by a forked
+ * child, loads nothing.
+ * */
+static struct load_buf *load_buf_pending( struct file *file )
+{
+    struct load_buf *lb = file->private_data;
+    if( !(file->f_mode & FMODE_WRITE) ) return NULL;
+    if( !lb ){
+        if( !(file->f_flags & O_TRUNC) ) return NULL;
+        lb = kzalloc(sizeof(*lb), GFP_KERNEL);
+        if( !lb ) return ERR_PTR(-ENOMEM);
+        file->private_data = lb;
     }
-    switch( proctype ){
-        case add:
-            if((listtype == F_IP_WHITELIST) || (listtype == F_IP_BLACKLIST))
-                work = insert_ip;
-            else if((listtype == F_CIDR_WHITELIST) || (listtype == F_CIDR_BLACKLIST))
-                work = insert_cidr;
-            else if((listtype == F_PORT_WHITELIST) || (listtype == F_PORT_BLACKLIST))
-                work = insert_port;
-            break;
-        case delete:
-            if((listtype == F_IP_WHITELIST) || (listtype == F_IP_BLACKLIST))
-                work = delete_ip;
-            else if((listtype == F_CIDR_WHITELIST) || (listtype == F_CIDR_BLACKLIST))
-                work = delete_cidr;
-            else if((listtype == F_PORT_WHITELIST) || (listtype == F_PORT_BLACKLIST))
-                work = delete_port;
-            break;
-        case show:
-            break;
+    if( lb->done ) return NULL;
+    if( !lb->data ){
+        lb->data = kvmalloc(1, GFP_KERNEL);
+        if( !lb->data ) return ERR_PTR(-ENOMEM);
+        lb->size = 1;
     }
+    return lb;
+}
 
+/*
+ * Called on close(), whose return value is the result of the load.
+ * */
+static int str_load_flush(struct file *file, fl_owner_t id)
+{
+    struct load_buf *lb = load_buf_pending(file);
+    enum proc_type proctype;
+    struct fw_set *set;
+    u16 flags;
+    int ret;
+    if( IS_ERR_OR_NULL(lb) ) return PTR_ERR_OR_ZERO(lb);
+    set = get_path_set(file, &proctype, &flags);
+    if( !set ) return -ENOENT;
     mutex_lock(&proc_mutex);
-	while ((p = strsep(&buffer, " |\n|\t|,")) != NULL) {
+    ret = fw_set_load(set, lb->data, lb->len, flags);
+    mutex_unlock(&proc_mutex);
+    fw_set_put(set);
+    lb->len = 0;
+    lb->done = 1;
+    return ret;
+}
 
-        if(parse(p, desc) == 0){
-            if( strlen( p ) > 0 )
-                logs("Fails to parse %s", p);
-            continue;
-        }
-        work(desc);
-	}
-    kfree(buffer);
+/*
+ * A feed written to a replace file is buffered like a load one and
+ * applied as a difference to the current entries when the file is closed.
+ * */
+static int str_replace_flush(struct file *file, fl_owner_t id)
+{
+    struct load_buf *lb = load_buf_pending(file);
+    struct fw_sync_stat st;
+    enum proc_type proctype;
+    struct fw_set *set;
+    u16 flags;
+    int ret;
+    if( IS_ERR_OR_NULL(lb) ) return PTR_ERR_OR_ZERO(lb);
+    set = get_path_set(file, &proctype, &flags);
+    if( !set ) return -ENOENT;
+    mutex_lock(&proc_mutex);
+    ret = fw_set_replace(set, lb->data, lb->len, flags, &st);
+    if( !ret )
+        set->sync = st;
     mutex_unlock(&proc_mutex);
-    return count;
+    fw_set_put(set);
+    lb->len = 0;
+    lb->done = 1;
+    return ret;
+}
+
+/*
+ * Reading a replace file reports the last replace of the list.
+ * */
+static ssize_t str_replace_read(struct file *file, char __user *user_buffer, size_t count, loff_t *ppos)
+{
+    enum proc_type proctype;
+    struct fw_sync_stat st;
+    struct fw_set *set;
+    char buf[160];
+    u16 flags;
+    int len;
+    set = get_path_set(file, &proctype, &flags);
+    if( !set ) return -ENOENT;
+    mutex_lock(&proc_mutex);
+    st = set->sync;
+    mutex_unlock(&proc_mutex);
+    fw_set_put(set);
+    len = scnprintf(buf, sizeof(buf), "added %lu\nremoved %lu\nunchanged %lu\ninvalid %lu\ntime %llu us\n",
+            st.added, st.removed, st.unchanged, st.invalid, div_u64(st.ns, NSEC_PER_USEC));
+    return simple_read_from_buffer(user_buffer, count, ppos, buf, len);
+}
+
+static int str_load_release(struct inode *inode, struct file *file)
+{
+    struct load_buf *lb = file->private_data;
+    if( lb ){
+        kvfree(lb->data);
+        kfree(lb);
+    }
+    return 0;
 }
 
 static const struct file_operations str_add_fops = {
     .owner = THIS_MODULE,
     .write = str_write,
+    .flush = str_stream_flush,
+    .release = str_stream_release,
 };
 
 static const struct file_operations str_delete_fops = {
     .owner = THIS_MODULE,
     .write = str_write,
+    .flush = str_stream_flush,
+    .release = str_stream_release,
+};
+
+static const struct file_operations str_flush_fops = {
+    .owner = THIS_MODULE,
+    .write = str_flush_write,
+};
+
+static const struct file_operations str_load_fops = {
+    .owner = THIS_MODULE,
+    .write = str_load_write,
+    .flush = str_load_flush,
+    .release = str_load_release,
+};
+
+static const struct file_operations str_replace_fops = {
+    .owner = THIS_MODULE,
+    .read = str_replace_read,
+    .write = str_load_write,
+    .flush = str_replace_flush,
+    .release = str_load_release,
 };
 
 static const struct file_operations str_show_fops = {
@@ -282,6 +503,9 @@ struct fw_procfs_ops {
     char name[64];
     const struct file_operations add ;
     const struct file_operations delete;
+    const struct file_operations flush;
+    const struct file_operations load;
+    const struct file_operations replace;
     const struct file_operations show;
 };
 
@@ -289,6 +513,9 @@ struct fw_procfs_ops ip_ops = {
     .name = IP_NAME,
     .add = str_add_fops,
     .delete = str_delete_fops,
+    .flush = str_flush_fops,
+    .load = str_load_fops,
+    .replace = str_replace_fops,
     .show = str_show_fops,
 };
 
@@ -296,6 +523,9 @@ struct fw_procfs_ops cidr_ops = {
     .name = CIDR_NAME,
     .add = str_add_fops,
     .delete = str_delete_fops,
+    .flush = str_flush_fops,
+    .load = str_load_fops,
+    .replace = str_replace_fops,
     .show = str_show_fops,
 };
 
@@ -303,9 +533,157 @@ struct fw_procfs_ops port_ops = {
     .name = PORT_NAME,
     .add = str_add_fops,
     .delete = str_delete_fops,
+    .flush = str_flush_fops,
+    .load = str_load_fops,
+    .replace = str_replace_fops,
     .show = str_show_fops,
 };
 
+struct fw_procfs_ops set_ops = {
+    .name = SET_NAME,
+    .add = str_add_fops,
+    .delete = str_delete_fops,
+    .flush = str_flush_fops,
+    .load = str_load_fops,
+    .replace = str_replace_fops,
+    .show = str_show_fops,
+};
+
+static void create_list_files( struct proc_dir_entry *folder, struct fw_procfs_ops *ops )
+{
+    proc_create("add", 0222, folder, &ops->add);
+    proc_create("delete", 0222, folder, &ops->delete);
+    proc_create("flush", 0222, folder, &ops->flush);
+    proc_create("load", 0222, folder, &ops->load);
+    proc_create("replace", 0644, folder, &ops->replace);
+    proc_create("show", 0111, folder, &ops->show);
+}
+
+/*
+ * /proc/simplefirewall/set/create: "<name> <ip|cidr|port>"
+ * The new set gets /proc/simplefirewall/set/<name>/[add/delete/flush/load/replace/show]
+ * */
+static int set_create_write( char *buf )
+{
+    char name[FW_SET_NAMELEN];
+    char type[16];
+    char path[100];
+    const struct fw_set_ops *ops;
+    struct fw_set *set;
+    struct proc_dir_entry *folder;
+    if( sscanf(buf, "%31s %15s", name, type) != 2 ) return -EINVAL;
+    ops = fw_set_type(type);
+    if( !ops ) return -EINVAL;
+    set = fw_set_create(name, ops);
+    if( IS_ERR(set) ) return PTR_ERR(set);
+    sprintf(path, "%s/%s/%s", FW_PROC, SET_NAME, set->name);
+    folder = proc_mkdir(path, NULL);
+    create_list_files(folder, &set_ops);
+    return 0;
+}
+
+/*
+ * /proc/simplefirewall/set/destroy: "<name>"
+ * */
+static int set_destroy_write( char *buf )
+{
+    char path[100];
+    struct fw_set *set;
+    set = fw_set_unlink(buf);
+    if( IS_ERR(set) ) return PTR_ERR(set);
+    sprintf(path, "%s/%s/%s", FW_PROC, SET_NAME, set->name);
+    remove_proc_subtree(path, NULL);
+    fw_set_put(set);
+    return 0;
+}
+
+/*
+ * /proc/simplefirewall/set/swap: "<name> <name>"
+ * */
+static int set_swap_write( char *buf )
+{
+    char a[FW_SET_NAMELEN], b[FW_SET_NAMELEN];
+    if( sscanf(buf, "%31s %31s", a, b) != 2 ) return -EINVAL;
+    return fw_set_swap(a, b);
+}
+
+/*
+ * Control files directly under /proc/simplefirewall/.
+ * Reading prints the state through show(),
+ * a line written to the file is passed to write().
+ * */
+struct fw_ctl_entry {
+    const char *name;
+    int (*show)( struct seq_file *m, void *v );
+    int (*write)( char *buf );
+};
+
+static const struct fw_ctl_entry ctl_entries[] = {
+    { "memory", fw_mem_show, fw_mem_write },
+    { "latency", fw_stat_show, fw_stat_write },
+    { "policy", fw_policy_show, fw_policy_write },
+    { "policy_out", fw_policy_out_show, fw_policy_out_write },
+    { "policy_fwd", fw_policy_fwd_show, fw_policy_fwd_write },
+    { "hooks", fw_hooks_show, fw_hooks_write },
+    { "top", fw_top_show, fw_top_write },
+    { "connlimit", fw_connlimit_show, fw_connlimit_write },
+    { "capture", fw_capture_show, fw_capture_write },
+    { "syncookie", fw_syncookie_show, fw_syncookie_write },
+    { "ctmark", fw_ctmark_show, fw_ctmark_write },
+    { "order", fw_order_show, fw_order_write },
+    { "autoblock", fw_autoblock_show, fw_autoblock_write },
+    { "scan", fw_scan_show, fw_scan_write },
+    { "listen", fw_listen_show, fw_listen_write },
+    { "fragment", fw_frag_show, fw_frag_write },
+    { "journal", fw_journal_show, fw_journal_write },
+    { "numa", fw_numa_show, fw_numa_write },
+    { "backend", fw_backend_show, fw_backend_write },
+    { SET_NAME "/create", fw_set_show, set_create_write },
+    { SET_NAME "/destroy", fw_set_show, set_destroy_write },
+    { SET_NAME "/swap", fw_set_show, set_swap_write },
+};
+
+static int ctl_open(struct inode *inode, struct file *file)
+{
+    const struct fw_ctl_entry *entry = PDE_DATA(inode);
+    return single_open(file, entry->show, (void *)entry);
+}
+
+static ssize_t ctl_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+{
+    const struct fw_ctl_entry *entry = PDE_DATA(file_inode(file));
+    char *buffer;
+    int ret;
+    if( !entry->write ) return -EPERM;
+    if( count >= PAGE_SIZE ) return -EINVAL;
+    buffer = memdup_user_nul(user_buffer, count);
+    if( IS_ERR(buffer) ) return PTR_ERR(buffer);
+    ret = entry->write(strim(buffer));
+    kfree(buffer);
+    return ret ? ret : count;
+}
+
+static const struct file_operations ctl_fops = {
+    .owner = THIS_MODULE,
+    .open = ctl_open,
+    .read = seq_read,
+    .write = ctl_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void create_ctl_entries( void )
+{
+    const struct fw_ctl_entry *entry;
+    char path[100];
+    int i;
+    for( i=0; i<ARRAY_SIZE(ctl_entries); i++ ){
+        entry = &ctl_entries[i];
+        sprintf(path, "%s/%s", FW_PROC, entry->name);
+        proc_create_data(path, entry->write ? 0644 : 0444, NULL, &ctl_fops, (void *)entry);
+    }
+}
+
 static void create_proc_tree( struct fw_procfs_ops *ops )
 {
     struct proc_dir_entry *folder;
@@ -315,17 +693,13 @@ static void create_proc_tree( struct fw_procfs_ops *ops )
 
     sprintf(path, "%s/%s/whitelist", FW_PROC, ops->name);
     folder= proc_mkdir(path, NULL);
-    /* /proc/simplefirewall/???/whitelist/[add/delete/show] */
-    proc_create("add", 0222, folder, &ops->add);
-    proc_create("delete", 0222, folder, &ops->delete);
-    proc_create("show", 0111, folder, &ops->show);
+    /* /proc/simplefirewall/???/whitelist/[add/delete/flush/show] */
+    create_list_files(folder, ops);
 
     /* /proc/simplefirewall/???/blacklist */
     sprintf(path, "%s/%s/blacklist", FW_PROC, ops->name);
     folder= proc_mkdir(path, NULL);
-    proc_create("add", 0222, folder, &ops->add);
-    proc_create("delete", 0222, folder, &ops->delete);
-    proc_create("show", 0111, folder, &ops->show);
+    create_list_files(folder, ops);
 
 }
 
@@ -339,11 +713,21 @@ static void destroy_proc_tree( char *tree )
 
 int fw_proc_init( void )
 {
+    char path[100];
     mutex_init(&proc_mutex);
     proc_mkdir(FW_PROC, NULL);
     create_proc_tree( &ip_ops );
     create_proc_tree( &cidr_ops );
     create_proc_tree( &port_ops );
+    sprintf(path, "%s/%s", FW_PROC, SET_NAME);
+    proc_mkdir(path, NULL);
+    create_ctl_entries();
+    sprintf(path, "%s/%s", FW_PROC, FW_CAPTURE_FILE);
+    proc_create(path, 0400, NULL, &fw_capture_fops);
+    sprintf(path, "%s/%s", FW_PROC, FW_JOURNAL_FILE);
+    proc_create(path, 0400, NULL, &fw_journal_fops);
+    sprintf(path, "%s/%s", FW_PROC, FW_JOURNAL_APPLY_FILE);
+    proc_create(path, 0200, NULL, &fw_journal_apply_fops);
     return 0;
 }
 
@@ -352,6 +736,7 @@ void fw_proc_exit( void )
     destroy_proc_tree( IP_NAME );
     destroy_proc_tree( CIDR_NAME );
     destroy_proc_tree( PORT_NAME );
+    destroy_proc_tree( SET_NAME );
     remove_proc_subtree(FW_PROC, NULL);
 }
 
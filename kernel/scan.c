@@ -0,0 +1,343 @@
+/*
+ * Port scan detection.
+ * A sketch is a tag, the key in the high half and the window it counts
+ * in the low half, and a 64 bit map of hashed destination ports. The
+ * number of distinct ports is estimated by linear counting from the bits
+ * set, so a threshold is turned once into the number of bits it takes.
+ * A key takes its own slot of the bucket, else a slot of an older window,
+ * else the slot with the fewest bits; both words only ever change by
+ * cmpxchg, a bit lost to a concurrent reset only delays a flag.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include "log.h"
+#include "autoblock.h"
+#include "scan.h"
+
+#define SC_WAYS         4
+#define SC_VALID        1ULL
+#define SC_KEY(tag)     ((u32)((tag) >> 32))
+#define SC_EPOCH(tag)   ((u32)(tag) >> 1)
+#define SC_TAG(key, e)  ((u64)(key) << 32 | (u64)((e) & 0x7fffffff) << 1 | SC_VALID)
+#define SC_NET_MASK     0xffffff00
+#define SC_SHOW_MAX     256       /* flagged keys listed by show */
+
+enum {
+    SC_SRC,
+    SC_NET,
+    SC_KINDS
+};
+
+static const char *kind_names[SC_KINDS] = { "src", "net" };
+
+/* linear counting of 64 bits: distinct ports estimated from the bits set */
+static const u16 sc_estimate[64] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 9, 10, 11, 12, 13, 15, 16, 17,
+    18, 20, 21, 23, 24, 25, 27, 28, 30, 32, 33, 35, 37, 39, 40, 42,
+    44, 46, 48, 51, 53, 55, 58, 60, 63, 65, 68, 71, 74, 78, 81, 85,
+    89, 93, 97, 102, 107, 113, 119, 126, 133, 142, 151, 163, 177, 196,
+};
+#define SC_THRESHOLD_MAX 196
+
+struct sc_entry {
+    u64 tag;
+    u64 bits;
+};
+
+struct sc_bucket {
+    struct sc_entry e[SC_WAYS];
+} ____cacheline_aligned;
+
+struct sc_table {
+    u32 buckets;          /* of each kind, power of 2 */
+    u32 seed;
+    struct sc_bucket *b[SC_KINDS];
+};
+
+struct sc_stat {
+    u64 flagged[SC_KINDS];  /* keys reaching their threshold */
+    u64 blocked;          /* packets whose source was handed to autoblock */
+    u64 evicted;          /* sketches of the current window replaced */
+    u64 missed;           /* packets not counted, the slot was taken meanwhile */
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_scan_key);
+static DEFINE_PER_CPU(struct sc_stat, sc_stat);
+
+static struct sc_table __rcu *sc_table;
+static DEFINE_MUTEX(sc_mutex);
+static unsigned int sc_size = 65536;                   /* sketches of each kind */
+static unsigned int sc_window = 60 * HZ;               /* jiffies */
+static unsigned int sc_threshold[SC_KINDS] = { 32, 64 };  /* distinct ports */
+static unsigned int sc_need[SC_KINDS];                 /* bits set for the threshold */
+static int sc_block;
+
+static unsigned int sc_bits_for( unsigned int threshold )
+{
+    unsigned int w = 0;
+    while( w < ARRAY_SIZE(sc_estimate) - 1 && sc_estimate[w] < threshold )
+        w++;
+    return w;
+}
+
+static struct sc_table *sc_table_new( unsigned int size )
+{
+    struct sc_table *t;
+    int k;
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if( !t ) return NULL;
+    t->buckets = size / SC_WAYS;
+    t->seed = get_random_u32();
+    for( k=0; k<SC_KINDS; k++ ){
+        t->b[k] = kvzalloc(array_size(t->buckets, sizeof(struct sc_bucket)), GFP_KERNEL);
+        if( !t->b[k] ){
+            while( k-- ) kvfree(t->b[k]);
+            kfree(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+static void sc_table_free( struct sc_table *t )
+{
+    int k;
+    if( !t ) return;
+    for( k=0; k<SC_KINDS; k++ )
+        kvfree(t->b[k]);
+    kfree(t);
+}
+
+/*
+ * The sketch of [key] in window [epoch], claimed if the key has none.
+ * */
+static struct sc_entry *sc_entry( struct sc_table *t, int kind, u32 key, u32 epoch )
+{
+    struct sc_bucket *b;
+    struct sc_entry *e, *victim = NULL;
+    u64 tag, want = SC_TAG(key, epoch);
+    u64 old = 0;
+    int i, live = 0;
+
+    b = &t->b[kind][jhash_1word(key, t->seed) & (t->buckets - 1)];
+    for( i=0; i<SC_WAYS; i++ ){
+        e = &b->e[i];
+        tag = READ_ONCE(e->tag);
+        if( tag == want ) return e;
+        if( SC_KEY(tag) == key && (tag & SC_VALID) ){
+            /* its own sketch of an older window */
+            victim = e;
+            old = tag;
+            live = 0;
+            break;
+        }
+        if( !(tag & SC_VALID) || SC_EPOCH(tag) != (epoch & 0x7fffffff) ){
+            if( !victim || live ){
+                victim = e;
+                old = tag;
+                live = 0;
+            }
+        }else if( !victim || (live && hweight64(READ_ONCE(e->bits)) < hweight64(READ_ONCE(victim->bits))) ){
+            victim = e;
+            old = tag;
+            live = 1;
+        }
+    }
+    if( cmpxchg64(&victim->tag, old, want) != old ) return NULL;
+    WRITE_ONCE(victim->bits, 0);
+    if( live ) this_cpu_inc(sc_stat.evicted);
+    return victim;
+}
+
+/*
+ * Set [bit] in the sketch of [key], 1 if the key is over its threshold.
+ * */
+static int sc_add( struct sc_table *t, int kind, u32 key, u32 epoch, u64 bit )
+{
+    struct sc_entry *e;
+    u64 old, cur;
+    e = sc_entry(t, kind, key, epoch);
+    if( !e ){
+        this_cpu_inc(sc_stat.missed);
+        return 0;
+    }
+    old = READ_ONCE(e->bits);
+    /* a port seen before in the window costs no write */
+    while( !(old & bit) ){
+        cur = cmpxchg64(&e->bits, old, old | bit);
+        if( cur == old ){
+            if( hweight64(old | bit) == READ_ONCE(sc_need[kind]) )
+                this_cpu_inc(sc_stat.flagged[kind]);
+            old |= bit;
+            break;
+        }
+        old = cur;
+    }
+    return hweight64(old) >= READ_ONCE(sc_need[kind]);
+}
+
+void __fw_scan_hit( u32 ip, u16 port )
+{
+    struct sc_table *t;
+    u32 epoch = (u32)jiffies / READ_ONCE(sc_window);
+    u64 bit = 1ULL << hash_32(port, 6);
+    int over = 0;
+    rcu_read_lock();
+    t = rcu_dereference(sc_table);
+    if( t ){
+        over = sc_add(t, SC_SRC, ip, epoch, bit);
+        over |= sc_add(t, SC_NET, ip & SC_NET_MASK, epoch, bit);
+    }
+    rcu_read_unlock();
+    /* blocked sources are dropped before they reach here again */
+    if( over && READ_ONCE(sc_block) ){
+        fw_autoblock_block(ip);
+        this_cpu_inc(sc_stat.blocked);
+    }
+}
+
+/*
+ * Replace the table by an empty one of sc_size sketches of each kind.
+ * */
+static int sc_reset( void )
+{
+    struct sc_table *t, *old;
+    t = sc_table_new(sc_size);
+    if( !t ) return -ENOMEM;
+    old = rcu_dereference_protected(sc_table, lockdep_is_held(&sc_mutex));
+    rcu_assign_pointer(sc_table, t);
+    synchronize_rcu();
+    sc_table_free(old);
+    return 0;
+}
+
+/*
+ * "1" to detect, "0" to stop, "flush" to forget all sketches,
+ * "mode flag|block", "threshold <ports>" of a source,
+ * "net_threshold <ports>" of a /24, "window <seconds>",
+ * "size <sketches>" of each table.
+ * */
+int fw_scan_write( char *buf )
+{
+    char mode[8];
+    unsigned int n;
+    int ret = 0;
+    mutex_lock(&sc_mutex);
+    if( strcmp(buf, "1") == 0 ){
+        if( !rcu_access_pointer(sc_table) )
+            ret = sc_reset();
+        if( !ret )
+            static_branch_enable(&fw_scan_key);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_scan_key);
+    }else if( strcmp(buf, "flush") == 0 ){
+        if( rcu_access_pointer(sc_table) )
+            ret = sc_reset();
+    }else if( sscanf(buf, "mode %7s", mode) == 1 ){
+        if( strcmp(mode, "flag") == 0 ) WRITE_ONCE(sc_block, 0);
+        else if( strcmp(mode, "block") == 0 ) WRITE_ONCE(sc_block, 1);
+        else ret = -EINVAL;
+    }else if( sscanf(buf, "threshold %u", &n) == 1 ){
+        if( n < 2 || n > SC_THRESHOLD_MAX ) ret = -EINVAL;
+        else sc_threshold[SC_SRC] = n;
+    }else if( sscanf(buf, "net_threshold %u", &n) == 1 ){
+        if( n < 2 || n > SC_THRESHOLD_MAX ) ret = -EINVAL;
+        else sc_threshold[SC_NET] = n;
+    }else if( sscanf(buf, "window %u", &n) == 1 ){
+        if( n == 0 || n > 86400 ) ret = -EINVAL;
+        else WRITE_ONCE(sc_window, n * HZ);
+    }else if( sscanf(buf, "size %u", &n) == 1 ){
+        if( n < 1024 || n > (1 << 24) ){
+            ret = -EINVAL;
+        }else{
+            sc_size = roundup_pow_of_two(n);
+            if( rcu_access_pointer(sc_table) )
+                ret = sc_reset();
+        }
+    }else{
+        ret = -EINVAL;
+    }
+    WRITE_ONCE(sc_need[SC_SRC], sc_bits_for(sc_threshold[SC_SRC]));
+    WRITE_ONCE(sc_need[SC_NET], sc_bits_for(sc_threshold[SC_NET]));
+    mutex_unlock(&sc_mutex);
+    return ret;
+}
+
+int fw_scan_show( struct seq_file *m, void *v )
+{
+    struct sc_stat sum = {0};
+    struct sc_stat *st;
+    struct sc_table *t;
+    struct sc_entry *e;
+    size_t i, shown = 0;
+    u32 epoch, key;
+    u64 tag;
+    int cpu, k, j, w;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&sc_stat, cpu);
+        for( k=0; k<SC_KINDS; k++ )
+            sum.flagged[k] += st->flagged[k];
+        sum.blocked += st->blocked;
+        sum.evicted += st->evicted;
+        sum.missed += st->missed;
+    }
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_scan_key));
+    seq_printf(m, "mode %s\n", sc_block ? "block" : "flag");
+    seq_printf(m, "threshold %u\n", sc_threshold[SC_SRC]);
+    seq_printf(m, "net_threshold %u\n", sc_threshold[SC_NET]);
+    seq_printf(m, "window %u\n", sc_window / HZ);
+    seq_printf(m, "size %u\n", sc_size);
+    seq_printf(m, "flagged %llu\n", sum.flagged[SC_SRC]);
+    seq_printf(m, "flagged_net %llu\n", sum.flagged[SC_NET]);
+    seq_printf(m, "blocked %llu\n", sum.blocked);
+    seq_printf(m, "evicted %llu\n", sum.evicted);
+    seq_printf(m, "missed %llu\n", sum.missed);
+    /* keys over their threshold in the current window, with their estimate */
+    epoch = ((u32)jiffies / sc_window) & 0x7fffffff;
+    mutex_lock(&sc_mutex);
+    t = rcu_dereference_protected(sc_table, lockdep_is_held(&sc_mutex));
+    for( k=0; t && k<SC_KINDS; k++ ){
+        for( i=0; i<t->buckets && shown < SC_SHOW_MAX; i++ ){
+            for( j=0; j<SC_WAYS; j++ ){
+                e = &t->b[k][i].e[j];
+                tag = READ_ONCE(e->tag);
+                if( !(tag & SC_VALID) || SC_EPOCH(tag) != epoch ) continue;
+                w = hweight64(READ_ONCE(e->bits));
+                if( w < sc_need[k] ) continue;
+                key = SC_KEY(tag);
+                if( w < ARRAY_SIZE(sc_estimate) )
+                    seq_printf(m, "%s %pI4h %u\n", kind_names[k], &key, sc_estimate[w]);
+                else
+                    seq_printf(m, "%s %pI4h >%u\n", kind_names[k], &key, SC_THRESHOLD_MAX);
+                shown++;
+            }
+        }
+    }
+    mutex_unlock(&sc_mutex);
+    return 0;
+}
+
+void fw_scan_exit( void )
+{
+    struct sc_table *t;
+    static_branch_disable(&fw_scan_key);
+    mutex_lock(&sc_mutex);
+    t = rcu_dereference_protected(sc_table, lockdep_is_held(&sc_mutex));
+    RCU_INIT_POINTER(sc_table, NULL);
+    mutex_unlock(&sc_mutex);
+    synchronize_rcu();
+    sc_table_free(t);
+}
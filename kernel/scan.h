@@ -0,0 +1,37 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/*
+ * Port scan detection, switched by /proc/simplefirewall/scan.
+ * Packets no rule accepted feed, per source and per source /24, a 64 bit
+ * linear counting sketch of the destination ports seen in the current
+ * window. A source or /24 whose estimate of distinct ports reaches its
+ * threshold is flagged, and with "mode block" the source is handed to the
+ * auto-learned blacklist, which must be enabled. Sketches live in fixed
+ * tables of cache line buckets updated with cmpxchg, a packet costs one
+ * hash and one bit set in each table.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_scan_key);
+
+void __fw_scan_hit( u32 ip, u16 port );
+
+/*
+ * Count a packet from [ip] to [port] that no rule accepted.
+ * */
+static inline void fw_scan_hit( u32 ip, int port )
+{
+    if( static_branch_unlikely(&fw_scan_key) && port >= 0 )
+        __fw_scan_hit(ip, port);
+}
+
+int fw_scan_show( struct seq_file *m, void *v );
+int fw_scan_write( char *buf );
+
+void fw_scan_exit( void );
+
+#endif
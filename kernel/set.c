@@ -0,0 +1,739 @@
+/*
+ * Named sets.
+ * Sets live in a registry protected by set_mutex, which also serializes
+ * every change to the table of a set. The packet path only follows
+ * set->table under RCU.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+#include "log.h"
+#include "ip.h"
+#include "port.h"
+#include "set.h"
+#include "ctmark.h"
+#include "journal.h"
+
+struct fw_set *fw_lists[F_MAX];
+
+static LIST_HEAD(set_list);
+static DEFINE_MUTEX(set_mutex);
+static struct workqueue_struct *set_wq;
+static int numa_enabled;    /* replicas are kept, under set_mutex */
+
+DEFINE_STATIC_KEY_FALSE(fw_numa_key);
+EXPORT_SYMBOL_GPL(fw_numa_key);
+
+#define FW_BACKEND_MAX 16
+
+/* registered backends, the first one of each kind is its default */
+static const struct fw_set_ops *set_types[FW_BACKEND_MAX];
+static int set_types_num;
+
+static char *backends = "";
+module_param(backends, charp, 0444);
+MODULE_PARM_DESC(backends, "Backends of builtin lists, e.g. ip_blacklist=ip_hash,ip_whitelist=ip_hash");
+
+union fw_desc {
+    ip_desc ip;
+    cidr_desc cidr;
+    port_desc port;
+};
+
+static const size_t desc_size[FW_SET_KIND_MAX] = {
+    [FW_SET_IP] = sizeof(ip_desc),
+    [FW_SET_CIDR] = sizeof(cidr_desc),
+    [FW_SET_PORT] = sizeof(port_desc),
+};
+
+static const struct {
+    const char *name;
+    enum F_LIST_TYPE list;
+    const struct fw_set_ops *ops;
+} builtin_sets[] = {
+    { "ip_whitelist", F_IP_WHITELIST, &ip_set_ops },
+    { "ip_blacklist", F_IP_BLACKLIST, &ip_set_ops },
+    { "cidr_whitelist", F_CIDR_WHITELIST, &cidr_set_ops },
+    { "cidr_blacklist", F_CIDR_BLACKLIST, &cidr_set_ops },
+    { "port_whitelist", F_PORT_WHITELIST, &port_set_ops },
+    { "port_blacklist", F_PORT_BLACKLIST, &port_set_ops },
+};
+
+static const char *kind_names[FW_SET_KIND_MAX] = {
+    [FW_SET_IP] = IP_NAME,
+    [FW_SET_CIDR] = CIDR_NAME,
+    [FW_SET_PORT] = PORT_NAME,
+};
+
+static const struct fw_set_ops *__fw_set_type( const char *name )
+{
+    int i;
+    for( i=0; i<set_types_num; i++ ){
+        if( strcmp(set_types[i]->name, name) == 0 )
+            return set_types[i];
+    }
+    return NULL;
+}
+
+const struct fw_set_ops *fw_set_type( const char *name )
+{
+    const struct fw_set_ops *ops;
+    mutex_lock(&set_mutex);
+    ops = __fw_set_type(name);
+    mutex_unlock(&set_mutex);
+    return ops;
+}
+EXPORT_SYMBOL_GPL(fw_set_type);
+
+/*
+ * Make a backend available to set/create and /proc/simplefirewall/backend.
+ * Backends live as long as the module, there is no unregister.
+ * */
+int fw_backend_register( const struct fw_set_ops *ops )
+{
+    int ret = 0;
+    mutex_lock(&set_mutex);
+    if( __fw_set_type(ops->name) )
+        ret = -EEXIST;
+    else if( set_types_num == FW_BACKEND_MAX )
+        ret = -ENOSPC;
+    else
+        set_types[set_types_num++] = ops;
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+
+static struct fw_set *__fw_set_find( const char *name )
+{
+    struct fw_set *set;
+    list_for_each_entry( set, &set_list, node ){
+        if( strcmp(set->name, name) == 0 )
+            return set;
+    }
+    return NULL;
+}
+
+static inline struct fw_table *set_table( struct fw_set *set )
+{
+    return rcu_dereference_protected(set->table, lockdep_is_held(&set_mutex));
+}
+
+static void table_free_work( struct work_struct *work )
+{
+    struct fw_table *t = container_of(to_rcu_work(work), struct fw_table, free_work);
+    t->ops->destroy(t);
+}
+
+/*
+ * Destroy a table no longer reachable from any set,
+ * once the readers that may still see it are gone.
+ * */
+static void fw_table_release( struct fw_table *t )
+{
+    INIT_RCU_WORK(&t->free_work, table_free_work);
+    queue_rcu_work(set_wq, &t->free_work);
+}
+
+static size_t table_bytes( struct fw_table *t )
+{
+    size_t bytes = t->ops->memory(t);
+    if( t->ops->node < FW_NODE_MAX )
+        bytes += t->num * fw_node_size(t->ops->node);
+    return bytes;
+}
+
+static void replica_free( struct fw_replica *r )
+{
+    int node;
+    if( !r ) return;
+    for( node=0; node<nr_node_ids; node++ ){
+        if( r->tables[node] )
+            fw_table_release(r->tables[node]);
+    }
+    kfree_rcu(r, rcu);
+}
+
+struct replica_work {
+    struct fw_table *src;
+    struct fw_table *copy;
+};
+
+static long replica_build( void *arg )
+{
+    struct replica_work *w = arg;
+    w->copy = w->src->ops->clone(w->src);
+    return 0;
+}
+
+/*
+ * Rebuild the copies of the set table on every node with cpus,
+ * each one by a cpu of that node so that its memory is local,
+ * or drop them when replication is off. Called with set_mutex held.
+ * */
+static int set_replicate( struct fw_set *set )
+{
+    struct fw_table *t = set_table(set);
+    struct fw_replica *r = NULL, *old;
+    struct replica_work w;
+    u64 start;
+    int node, cpu;
+    int ret = 0;
+
+    if( numa_enabled && t->ops->clone ){
+        r = kzalloc(struct_size(r, tables, nr_node_ids), GFP_KERNEL);
+        if( !r ) return -ENOMEM;
+        start = ktime_get_ns();
+        cpus_read_lock();
+        for_each_node_state(node, N_CPU) {
+            cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+            if( cpu >= nr_cpu_ids ) continue;
+            w.src = t;
+            w.copy = NULL;
+            work_on_cpu(cpu, replica_build, &w);
+            if( !w.copy ){
+                ret = -ENOMEM;
+                break;
+            }
+            r->tables[node] = w.copy;
+        }
+        cpus_read_unlock();
+        if( ret ){
+            logs("Fails to replicate set %s", set->name);
+            replica_free(r);
+            return ret;
+        }
+        r->build_ns = ktime_get_ns() - start;
+    }
+    old = rcu_dereference_protected(set->replica, lockdep_is_held(&set_mutex));
+    rcu_assign_pointer(set->replica, r);
+    replica_free(old);
+    return 0;
+}
+
+/*
+ * Apply an insert or a delete done on the set table to its copies, each
+ * on its own desc as backends may rewrite it, so replicas follow every
+ * change at the cost of one more update per node. Entries added so come
+ * from the node of the writer until the next full rebuild. A copy that
+ * fails drops all of them, readers fall back on the set table and the
+ * next commit rebuilds them. Called with set_mutex held.
+ * */
+static void replica_apply( struct fw_set *set, int del, void *desc )
+{
+    struct fw_replica *r;
+    struct fw_table *t;
+    union fw_desc copy;
+    int node, ret;
+    r = rcu_dereference_protected(set->replica, lockdep_is_held(&set_mutex));
+    if( !r ) return;
+    for( node=0; node<nr_node_ids; node++ ){
+        t = r->tables[node];
+        if( !t ) continue;
+        memcpy(&copy, desc, desc_size[set->kind]);
+        ret = del ? t->ops->delete(t, &copy) : t->ops->insert(t, &copy);
+        if( ret ){
+            logs("Fails to update replica of set %s: %d", set->name, ret);
+            rcu_assign_pointer(set->replica, NULL);
+            replica_free(r);
+            return;
+        }
+    }
+}
+
+struct fw_set *fw_set_create( const char *name, const struct fw_set_ops *ops )
+{
+    struct fw_set *set;
+    struct fw_table *t;
+    size_t len = strlen(name);
+    if( len == 0 || len >= FW_SET_NAMELEN || strchr(name, '/') )
+        return ERR_PTR(-EINVAL);
+    set = kzalloc(sizeof(*set), GFP_KERNEL);
+    if( !set ) return ERR_PTR(-ENOMEM);
+    t = ops->create();
+    if( !t ){
+        kfree(set);
+        return ERR_PTR(-ENOMEM);
+    }
+    strscpy(set->name, name, sizeof(set->name));
+    set->kind = ops->kind;
+    refcount_set(&set->ref, 1);
+    RCU_INIT_POINTER(set->table, t);
+
+    mutex_lock(&set_mutex);
+    if( __fw_set_find(name) ){
+        mutex_unlock(&set_mutex);
+        ops->destroy(t);
+        kfree(set);
+        return ERR_PTR(-EEXIST);
+    }
+    list_add_tail(&set->node, &set_list);
+    if( numa_enabled )
+        set_replicate(set);
+    mutex_unlock(&set_mutex);
+    logs("Create set %s %s", name, ops->name);
+    return set;
+}
+EXPORT_SYMBOL_GPL(fw_set_create);
+
+/*
+ * Remove a set from the registry, the caller drops the last reference.
+ * A set still referenced by a policy or a writer can not be removed.
+ * */
+struct fw_set *fw_set_unlink( const char *name )
+{
+    struct fw_set *set;
+    mutex_lock(&set_mutex);
+    set = __fw_set_find(name);
+    if( !set ){
+        set = ERR_PTR(-ENOENT);
+    }else if( set->builtin ){
+        set = ERR_PTR(-EPERM);
+    }else if( refcount_read(&set->ref) > 1 ){
+        set = ERR_PTR(-EBUSY);
+    }else{
+        list_del(&set->node);
+    }
+    mutex_unlock(&set_mutex);
+    return set;
+}
+EXPORT_SYMBOL_GPL(fw_set_unlink);
+
+struct fw_set *fw_set_get( const char *name )
+{
+    struct fw_set *set;
+    mutex_lock(&set_mutex);
+    set = __fw_set_find(name);
+    if( set ) refcount_inc(&set->ref);
+    mutex_unlock(&set_mutex);
+    return set;
+}
+
+void fw_set_hold( struct fw_set *set )
+{
+    refcount_inc(&set->ref);
+}
+EXPORT_SYMBOL_GPL(fw_set_hold);
+
+void fw_set_put( struct fw_set *set )
+{
+    struct fw_table *t;
+    if( !refcount_dec_and_test(&set->ref) ) return;
+    t = rcu_dereference_protected(set->table, 1);
+    fw_table_release(t);
+    replica_free(rcu_dereference_protected(set->replica, 1));
+    logs("Destroy set %s", set->name);
+    kfree(set);
+}
+EXPORT_SYMBOL_GPL(fw_set_put);
+
+/*
+ * Exchange the tables of two sets of the same kind.
+ * Typical use is to fill a scratch set and swap it with the live one.
+ * */
+int fw_set_swap( const char *a, const char *b )
+{
+    struct fw_set *sa, *sb;
+    struct fw_table *ta, *tb;
+    struct fw_replica *ra, *rb;
+    int ret = 0;
+    mutex_lock(&set_mutex);
+    sa = __fw_set_find(a);
+    sb = __fw_set_find(b);
+    if( !sa || !sb ){
+        ret = -ENOENT;
+    }else if( sa->kind != sb->kind ){
+        ret = -EINVAL;
+    }else{
+        ta = set_table(sa);
+        tb = set_table(sb);
+        ra = rcu_dereference_protected(sa->replica, lockdep_is_held(&set_mutex));
+        rb = rcu_dereference_protected(sb->replica, lockdep_is_held(&set_mutex));
+        rcu_assign_pointer(sa->table, tb);
+        rcu_assign_pointer(sb->table, ta);
+        rcu_assign_pointer(sa->replica, rb);
+        rcu_assign_pointer(sb->replica, ra);
+        logs("Swap set %s %s", a, b);
+        fw_journal_add(FW_JOURNAL_RESYNC, sa, NULL);
+        fw_journal_add(FW_JOURNAL_RESYNC, sb, NULL);
+        fw_ruleset_changed();
+    }
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+
+/*
+ * Replace the table of [set] by [t], built off line by the caller, and
+ * journal it as [op], a flush or a resync, under the set lock so it is
+ * ordered with the inserts and deletes around it.
+ * The old table is destroyed after a grace period.
+ * */
+int fw_set_publish( struct fw_set *set, struct fw_table *t, int op )
+{
+    struct fw_table *old;
+    if( t->ops->kind != set->kind ) return -EINVAL;
+    mutex_lock(&set_mutex);
+    old = set_table(set);
+    rcu_assign_pointer(set->table, t);
+    if( numa_enabled )
+        set_replicate(set);
+    fw_journal_add(op, set, NULL);
+    mutex_unlock(&set_mutex);
+    fw_ruleset_changed();
+    fw_table_release(old);
+    return 0;
+}
+
+/*
+ * Replace the table of a set with an empty one in one step,
+ * the old table and its entries are freed after a grace period.
+ * */
+int fw_set_flush( struct fw_set *set )
+{
+    const struct fw_set_ops *ops;
+    struct fw_table *empty;
+    rcu_read_lock();
+    ops = rcu_dereference(set->table)->ops;
+    rcu_read_unlock();
+    empty = ops->create();
+    if( !empty ) return -ENOMEM;
+    logs("Flush set %s", set->name);
+    return fw_set_publish(set, empty, FW_JOURNAL_FLUSH);
+}
+EXPORT_SYMBOL_GPL(fw_set_flush);
+
+/*
+ * Replicas follow inserts and deletes, a commit only rebuilds those
+ * dropped by a failed update.
+ * */
+int fw_set_commit( struct fw_set *set )
+{
+    int ret = 0;
+    mutex_lock(&set_mutex);
+    if( numa_enabled && !rcu_access_pointer(set->replica) )
+        ret = set_replicate(set);
+    mutex_unlock(&set_mutex);
+    fw_ruleset_changed();
+    return ret;
+}
+EXPORT_SYMBOL_GPL(fw_set_commit);
+
+static int convert_one( void *desc, void *arg )
+{
+    struct fw_table *t = arg;
+    union fw_desc copy;
+    memcpy(&copy, desc, desc_size[t->ops->kind]);
+    return t->ops->insert(t, &copy);
+}
+
+/*
+ * Rebuild the entries of a set into a table of backend [ops]
+ * and swap it in, readers see either the old or the new table.
+ * */
+int fw_set_convert( struct fw_set *set, const struct fw_set_ops *ops )
+{
+    struct fw_table *t, *new;
+    u64 start;
+    int ret = 0;
+    if( ops->kind != set->kind ) return -EINVAL;
+    mutex_lock(&set_mutex);
+    t = set_table(set);
+    if( t->ops == ops ) goto out;
+    new = ops->create();
+    if( !new ){
+        ret = -ENOMEM;
+        goto out;
+    }
+    start = ktime_get_ns();
+    ret = t->ops->walk(t, convert_one, new);
+    if( ret ){
+        ops->destroy(new);
+        goto out;
+    }
+    rcu_assign_pointer(set->table, new);
+    if( numa_enabled )
+        set_replicate(set);
+    logs("Convert set %s from %s to %s, %lu entries in %llu us", set->name,
+            t->ops->name, ops->name, new->num, div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+    fw_table_release(t);
+out:
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+
+int fw_set_insert( struct fw_set *set, void *desc )
+{
+    struct fw_table *t;
+    int ret;
+    mutex_lock(&set_mutex);
+    t = set_table(set);
+    ret = t->ops->insert(t, desc);
+    if( !ret ){
+        replica_apply(set, 0, desc);
+        fw_journal_add(FW_JOURNAL_INSERT, set, desc);
+    }
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(fw_set_insert);
+
+int fw_set_delete( struct fw_set *set, void *desc )
+{
+    struct fw_table *t;
+    int ret;
+    mutex_lock(&set_mutex);
+    t = set_table(set);
+    ret = t->ops->delete(t, desc);
+    if( !ret ){
+        replica_apply(set, 1, desc);
+        fw_journal_add(FW_JOURNAL_DELETE, set, desc);
+    }
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(fw_set_delete);
+
+/*
+ * Call [fn] on every entry of [set], stops at the first error.
+ * */
+int fw_set_walk( struct fw_set *set, int (*fn)( void *desc, void *arg ), void *arg )
+{
+    struct fw_table *t;
+    int ret;
+    mutex_lock(&set_mutex);
+    t = set_table(set);
+    ret = t->ops->walk(t, fn, arg);
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+
+int fw_set_dump( struct fw_set *set, char *str, int len )
+{
+    struct fw_table *t;
+    int ret;
+    mutex_lock(&set_mutex);
+    t = set_table(set);
+    ret = t->ops->dump(t, str, len);
+    mutex_unlock(&set_mutex);
+    return ret;
+}
+
+/*
+ * /proc/simplefirewall/set/{create,destroy,swap}
+ * */
+int fw_set_show( struct seq_file *m, void *v )
+{
+    struct fw_set *set;
+    struct fw_table *t;
+    seq_printf(m, "%-32s %-6s %-12s %12s %6s\n", "name", "kind", "backend", "entries", "refs");
+    mutex_lock(&set_mutex);
+    list_for_each_entry( set, &set_list, node ){
+        t = set_table(set);
+        seq_printf(m, "%-32s %-6s %-12s %12lu %6u\n", set->name, kind_names[set->kind],
+                t->ops->name, t->num, refcount_read(&set->ref));
+    }
+    mutex_unlock(&set_mutex);
+    return 0;
+}
+
+/*
+ * Table memory of every set for /proc/simplefirewall/memory,
+ * the rule nodes are accounted by their slab caches.
+ * */
+size_t fw_set_mem_show( struct seq_file *m )
+{
+    struct fw_set *set;
+    struct fw_table *t;
+    struct fw_replica *r;
+    size_t bytes;
+    size_t total = 0;
+    int node;
+    mutex_lock(&set_mutex);
+    list_for_each_entry( set, &set_list, node ){
+        t = set_table(set);
+        bytes = t->ops->memory(t);
+        seq_printf(m, "set %-12s %12lu %8s %14zu\n", set->name, t->num, "-", bytes);
+        total += bytes;
+        r = rcu_dereference_protected(set->replica, lockdep_is_held(&set_mutex));
+        if( !r ) continue;
+        bytes = 0;
+        for( node=0; node<nr_node_ids; node++ ){
+            if( r->tables[node] )
+                bytes += r->tables[node]->ops->memory(r->tables[node]);
+        }
+        seq_printf(m, "replica %-8s %12s %8s %14zu\n", set->name, "-", "-", bytes);
+        total += bytes;
+    }
+    mutex_unlock(&set_mutex);
+    return total;
+}
+
+/*
+ * /proc/simplefirewall/backend
+ * Write "<set> <backend>" to move a set to another backend of its kind.
+ * */
+int fw_backend_write( char *buf )
+{
+    char name[FW_SET_NAMELEN];
+    char type[16];
+    const struct fw_set_ops *ops;
+    struct fw_set *set;
+    int ret;
+    if( sscanf(buf, "%31s %15s", name, type) != 2 ) return -EINVAL;
+    ops = fw_set_type(type);
+    if( !ops ) return -EINVAL;
+    set = fw_set_get(name);
+    if( !set ) return -ENOENT;
+    ret = fw_set_convert(set, ops);
+    fw_set_put(set);
+    return ret;
+}
+
+int fw_backend_show( struct seq_file *m, void *v )
+{
+    int i;
+    seq_printf(m, "%-12s %-6s\n", "backend", "kind");
+    mutex_lock(&set_mutex);
+    for( i=0; i<set_types_num; i++ )
+        seq_printf(m, "%-12s %-6s\n", set_types[i]->name, kind_names[set_types[i]->kind]);
+    mutex_unlock(&set_mutex);
+    seq_putc(m, '\n');
+    return fw_set_show(m, v);
+}
+
+/*
+ * /proc/simplefirewall/numa
+ * Write "1" to keep a copy of every set on each NUMA node, "0" to drop them.
+ * Copies are refreshed by fw_set_commit(), i.e. at the end of each write.
+ * */
+int fw_numa_write( char *buf )
+{
+    struct fw_set *set;
+    int enable;
+    int ret = 0;
+    if( strcmp(buf, "1") == 0 ) enable = 1;
+    else if( strcmp(buf, "0") == 0 ) enable = 0;
+    else return -EINVAL;
+
+    if( !enable )
+        static_branch_disable(&fw_numa_key);
+    mutex_lock(&set_mutex);
+    numa_enabled = enable;
+    list_for_each_entry( set, &set_list, node ){
+        ret = set_replicate(set);
+        if( ret ) break;
+    }
+    mutex_unlock(&set_mutex);
+    if( ret ){
+        fw_numa_write("0");
+        return ret;
+    }
+    if( enable )
+        static_branch_enable(&fw_numa_key);
+    return 0;
+}
+
+int fw_numa_show( struct seq_file *m, void *v )
+{
+    struct fw_set *set;
+    struct fw_replica *r;
+    size_t bytes;
+    int copies, node;
+    seq_printf(m, "enabled %d nodes %d\n", static_key_enabled(&fw_numa_key),
+            num_node_state(N_CPU));
+    seq_printf(m, "%-32s %6s %12s %14s\n", "name", "copies", "build_us", "bytes");
+    mutex_lock(&set_mutex);
+    list_for_each_entry( set, &set_list, node ){
+        r = rcu_dereference_protected(set->replica, lockdep_is_held(&set_mutex));
+        if( !r ) continue;
+        copies = 0;
+        bytes = 0;
+        for( node=0; node<nr_node_ids; node++ ){
+            if( !r->tables[node] ) continue;
+            copies++;
+            bytes += table_bytes(r->tables[node]);
+        }
+        seq_printf(m, "%-32s %6d %12llu %14zu\n", set->name, copies,
+                div_u64(r->build_ns, NSEC_PER_USEC), bytes);
+    }
+    mutex_unlock(&set_mutex);
+    return 0;
+}
+
+int fw_set_init( void )
+{
+    struct fw_set *set;
+    int i;
+    char *buf, *p, *tok;
+    int ret = 0;
+    set_wq = alloc_workqueue("fw_set", WQ_UNBOUND, 0);
+    if( !set_wq ) return -ENOMEM;
+    fw_backend_register(&ip_set_ops);
+    fw_backend_register(&cidr_set_ops);
+    fw_backend_register(&port_set_ops);
+    fw_backend_register(&ip_hash_set_ops);
+    fw_backend_register(&ip_roaring_set_ops);
+    for( i=0; i<ARRAY_SIZE(builtin_sets); i++ ){
+        set = fw_set_create(builtin_sets[i].name, builtin_sets[i].ops);
+        if( IS_ERR(set) ){
+            fw_set_exit();
+            return PTR_ERR(set);
+        }
+        set->builtin = 1;
+        fw_lists[builtin_sets[i].list] = set;
+    }
+
+    /* backends=<list>=<backend>,... */
+    p = buf = kstrdup(backends, GFP_KERNEL);
+    if( !buf ){
+        fw_set_exit();
+        return -ENOMEM;
+    }
+    while( (tok = strsep(&p, ",")) != NULL ){
+        if( *tok == 0 ) continue;
+        strreplace(tok, '=', ' ');
+        ret = fw_backend_write(tok);
+        if( ret ){
+            logs("Fails to apply backend %s: %d", tok, ret);
+            break;
+        }
+    }
+    kfree(buf);
+    if( ret ) fw_set_exit();
+    return ret;
+}
+
+/*
+ * Called after the hooks and policies are gone, drops every set
+ * and waits for the tables to be destroyed.
+ * */
+void fw_set_exit( void )
+{
+    struct fw_set *set, *tmp;
+    LIST_HEAD(sets);
+    int i;
+    mutex_lock(&set_mutex);
+    list_splice_init(&set_list, &sets);
+    mutex_unlock(&set_mutex);
+    for( i=0; i<ARRAY_SIZE(fw_lists); i++ )
+        fw_lists[i] = NULL;
+    list_for_each_entry_safe( set, tmp, &sets, node ){
+        list_del(&set->node);
+        fw_set_put(set);
+    }
+    if( set_wq ){
+        /* the grace periods queue the last works, then drain them */
+        rcu_barrier();
+        destroy_workqueue(set_wq);
+        set_wq = NULL;
+    }
+}
@@ -0,0 +1,168 @@
+#ifndef _SET_H
+#define _SET_H
+
+/*
+ * Named sets.
+ * A set is an exact IP, CIDR or port table referenced by name.
+ * The six builtin lists are sets too, policies refer to sets by reference,
+ * and the table behind a set is published by RCU so that two sets of the
+ * same kind can be swapped with one pointer exchange.
+ * A table taken out of a set is destroyed from a workqueue after
+ * a grace period, so flush and destroy never block on readers.
+ * With /proc/simplefirewall/numa enabled every set also carries a copy of
+ * its table on each NUMA node, built when the table is replaced and
+ * updated by every insert and delete, and lookups read the copy of the
+ * local node.
+ * */
+
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/jump_label.h>
+#include <linux/topology.h>
+#include "common.h"
+#include "mem.h"
+
+#define SET_NAME "set"
+#define FW_SET_NAMELEN 32
+
+enum fw_set_kind {
+    FW_SET_IP,
+    FW_SET_CIDR,
+    FW_SET_PORT,
+    FW_SET_KIND_MAX
+};
+
+struct fw_table;
+
+/*
+ * Operations of one table type, i.e. a lookup backend.
+ * Several backends may serve one kind, they share the desc of the kind.
+ * insert, delete and walk are serialized by the set lock,
+ * test runs under rcu_read_lock on the packet path.
+ * */
+struct fw_set_ops {
+    const char *name;
+    enum fw_set_kind kind;
+    enum fw_node_type node;    /* slab cache of the entries, FW_NODE_MAX if memory() counts them */
+    struct fw_table *(*create)( void );
+    struct fw_table *(*clone)( struct fw_table *t );  /* copy on the local node */
+    void (*destroy)( struct fw_table *t );   /* no reader may be left */
+    int (*insert)( struct fw_table *t, void *desc );
+    int (*delete)( struct fw_table *t, void *desc );
+    int (*test)( struct fw_table *t, u32 key );
+    void (*prefetch_key)( struct fw_table *t, u32 key );  /* optional, warms what test of key reads */
+    int (*dump)( struct fw_table *t, char *str, int len );
+    int (*walk)( struct fw_table *t, int (*fn)( void *desc, void *arg ), void *arg );
+    size_t (*memory)( struct fw_table *t );  /* bytes besides the rule nodes */
+    int (*parse)( char *str, void *desc );
+};
+
+struct fw_table {
+    const struct fw_set_ops *ops;
+    unsigned long num;   /* number of entries */
+    unsigned long gen;   /* bumped on every delete, invalidates lookup caches */
+    struct rcu_work free_work;
+};
+
+struct fw_replica {
+    struct rcu_head rcu;
+    u64 build_ns;        /* time to build all copies */
+    struct fw_table *tables[];   /* by node id, NULL reads the set table */
+};
+
+/* result of the last replace of a set */
+struct fw_sync_stat {
+    unsigned long added;
+    unsigned long removed;
+    unsigned long unchanged;
+    unsigned long invalid;
+    u64 ns;
+};
+
+struct fw_set {
+    struct list_head node;
+    char name[FW_SET_NAMELEN];
+    enum fw_set_kind kind;
+    int builtin;
+    refcount_t ref;      /* the registry, policies and writers in flight */
+    struct fw_table __rcu *table;
+    struct fw_replica __rcu *replica;
+    struct fw_sync_stat sync;
+};
+
+extern struct fw_set *fw_lists[F_MAX];
+
+DECLARE_STATIC_KEY_FALSE(fw_numa_key);
+
+/*
+ * The table to read under rcu_read_lock.
+ * */
+static inline struct fw_table *fw_set_table( struct fw_set *set )
+{
+    struct fw_replica *r;
+    struct fw_table *t;
+    if( static_branch_unlikely(&fw_numa_key) ){
+        r = rcu_dereference(set->replica);
+        if( r ){
+            t = READ_ONCE(r->tables[numa_node_id()]);
+            if( t ) return t;
+        }
+    }
+    return rcu_dereference(set->table);
+}
+
+static inline int fw_set_test( struct fw_set *set, u32 key )
+{
+    struct fw_table *t;
+    int ret = 0;
+    rcu_read_lock();
+    t = fw_set_table(set);
+    if( t )
+        ret = t->ops->test(t, key);
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Start the loads of a later fw_set_test of [key], so that the lookups
+ * of a batch overlap. Under rcu_read_lock.
+ * */
+static inline void fw_set_prefetch( struct fw_set *set, u32 key )
+{
+    struct fw_table *t = fw_set_table(set);
+    if( t && t->ops->prefetch_key )
+        t->ops->prefetch_key(t, key);
+}
+
+int fw_backend_register( const struct fw_set_ops *ops );
+const struct fw_set_ops *fw_set_type( const char *name );
+struct fw_set *fw_set_create( const char *name, const struct fw_set_ops *ops );
+struct fw_set *fw_set_unlink( const char *name );
+struct fw_set *fw_set_get( const char *name );
+void fw_set_hold( struct fw_set *set );
+void fw_set_put( struct fw_set *set );
+int fw_set_swap( const char *a, const char *b );
+int fw_set_publish( struct fw_set *set, struct fw_table *t, int op );
+int fw_set_flush( struct fw_set *set );
+int fw_set_commit( struct fw_set *set );
+int fw_set_convert( struct fw_set *set, const struct fw_set_ops *ops );
+
+int fw_set_insert( struct fw_set *set, void *desc );
+int fw_set_delete( struct fw_set *set, void *desc );
+int fw_set_dump( struct fw_set *set, char *str, int len );
+int fw_set_walk( struct fw_set *set, int (*fn)( void *desc, void *arg ), void *arg );
+
+int fw_set_show( struct seq_file *m, void *v );
+size_t fw_set_mem_show( struct seq_file *m );
+int fw_backend_show( struct seq_file *m, void *v );
+int fw_backend_write( char *buf );
+int fw_numa_show( struct seq_file *m, void *v );
+int fw_numa_write( char *buf );
+
+int fw_set_init( void );
+void fw_set_exit( void );
+
+#endif
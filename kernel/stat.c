@@ -0,0 +1,103 @@
+/*
+ * Hot path statistics of fw_filter(), exported by /proc/simplefirewall/latency.
+ * The tracepoints of trace.h are instantiated here as well.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/cpumask.h>
+#include <linux/seq_file.h>
+#include "log.h"
+#include "stat.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+DEFINE_STATIC_KEY_FALSE(fw_stat_key);
+DEFINE_PER_CPU(struct fw_stat, fw_stat);
+
+static const char *stage_names[FW_STAGE_MAX] = {
+    [FW_STAGE_FRAGMENT] = "fragment",
+    [FW_STAGE_CONNTRACK] = "conntrack",
+    [FW_STAGE_POLICY] = "policy",
+    [FW_STAGE_AUTOBLOCK] = "autoblock",
+    [FW_STAGE_CIDR_BLACKLIST] = "cidr_blacklist",
+    [FW_STAGE_IP_BLACKLIST] = "ip_blacklist",
+    [FW_STAGE_CIDR_WHITELIST] = "cidr_whitelist",
+    [FW_STAGE_IP_WHITELIST] = "ip_whitelist",
+    [FW_STAGE_PORT] = "port",
+    [FW_STAGE_LISTEN] = "listen",
+    [FW_STAGE_SYNCOOKIE] = "syncookie",
+    [FW_STAGE_CONNLIMIT] = "connlimit",
+    [FW_STAGE_DEFAULT] = "default",
+};
+
+const char *fw_stage_name( enum fw_stage stage )
+{
+    return stage < FW_STAGE_MAX ? stage_names[stage] : "unknown";
+}
+
+/*
+ * Sum the per-CPU counters into [sum].
+ * Counters are read without stopping writers, so a snapshot may be
+ * a few increments behind.
+ * */
+static void fw_stat_sum( struct fw_stat *sum )
+{
+    struct fw_stat *s;
+    int cpu, i, j;
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&fw_stat, cpu);
+        for( i=0; i<FW_STAGE_MAX; i++ ){
+            for( j=0; j<FW_HIST_BUCKETS; j++ )
+                sum->hist[i][j] += s->hist[i][j];
+            sum->accept[i] += s->accept[i];
+            sum->drop[i] += s->drop[i];
+        }
+    }
+}
+
+/*
+ * Write "1" to enable, "0" to disable, "reset" to clear the counters.
+ * */
+int fw_stat_write( char *buf )
+{
+    int cpu;
+    if( strcmp(buf, "1") == 0 ){
+        static_branch_enable(&fw_stat_key);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_stat_key);
+    }else if( strcmp(buf, "reset") == 0 ){
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(&fw_stat, cpu), 0, sizeof(struct fw_stat));
+    }else{
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * One line per stage: verdicts decided by the stage, then
+ * "<log2 cycles>:<samples>" for each non-empty histogram bucket.
+ * */
+int fw_stat_show( struct seq_file *m, void *v )
+{
+    struct fw_stat *sum;
+    int i, j;
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if( !sum ) return -ENOMEM;
+    fw_stat_sum(sum);
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_stat_key));
+    for( i=0; i<FW_STAGE_MAX; i++ ){
+        seq_printf(m, "%-16s accept %llu drop %llu cycles", stage_names[i], sum->accept[i], sum->drop[i]);
+        for( j=0; j<FW_HIST_BUCKETS; j++ ){
+            if( sum->hist[i][j] )
+                seq_printf(m, " %d:%llu", j, sum->hist[i][j]);
+        }
+        seq_putc(m, '\n');
+    }
+    kfree(sum);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _STAT_H
+#define _STAT_H
+
+/*
+ * Hot path statistics of fw_filter().
+ * Per-CPU log2 histograms of the cycles spent in each lookup stage
+ * and the verdicts each stage decided, switched by a static key.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/percpu-defs.h>
+#include <linux/seq_file.h>
+#include <linux/timex.h>
+
+enum fw_stage {
+    FW_STAGE_FRAGMENT,
+    FW_STAGE_CONNTRACK,
+    FW_STAGE_POLICY,
+    FW_STAGE_AUTOBLOCK,
+    FW_STAGE_CIDR_BLACKLIST,
+    FW_STAGE_IP_BLACKLIST,
+    FW_STAGE_CIDR_WHITELIST,
+    FW_STAGE_IP_WHITELIST,
+    FW_STAGE_PORT,
+    FW_STAGE_LISTEN,
+    FW_STAGE_SYNCOOKIE,
+    FW_STAGE_CONNLIMIT,
+    FW_STAGE_DEFAULT,
+    FW_STAGE_MAX
+};
+
+#define FW_HIST_BUCKETS 32
+
+struct fw_stat {
+    u64 hist[FW_STAGE_MAX][FW_HIST_BUCKETS];   /* bucket i: cycles in [2^(i-1), 2^i) */
+    u64 accept[FW_STAGE_MAX];
+    u64 drop[FW_STAGE_MAX];
+};
+
+DECLARE_STATIC_KEY_FALSE(fw_stat_key);
+DECLARE_PER_CPU(struct fw_stat, fw_stat);
+
+static inline cycles_t fw_stat_begin( void )
+{
+    if( static_branch_unlikely(&fw_stat_key) )
+        return get_cycles();
+    return 0;
+}
+
+static inline void fw_stat_end( enum fw_stage stage, cycles_t start )
+{
+    int bucket;
+    if( static_branch_unlikely(&fw_stat_key) ){
+        bucket = fls64(get_cycles() - start);
+        if( bucket >= FW_HIST_BUCKETS ) bucket = FW_HIST_BUCKETS - 1;
+        this_cpu_inc(fw_stat.hist[stage][bucket]);
+    }
+}
+
+static inline void fw_stat_verdict( enum fw_stage stage, int drop )
+{
+    if( static_branch_unlikely(&fw_stat_key) ){
+        if( drop ) this_cpu_inc(fw_stat.drop[stage]);
+        else this_cpu_inc(fw_stat.accept[stage]);
+    }
+}
+
+const char *fw_stage_name( enum fw_stage stage );
+int fw_stat_show( struct seq_file *m, void *v );
+int fw_stat_write( char *buf );
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * SYN cookie mode.
+ * Cookies are made and checked by the kernel syncookie functions with
+ * the secret of the TCP stack, so a cookie answered by this module is
+ * accepted by the listener itself. The SYN-ACK is sent untracked and
+ * the SYN dropped, the validated ACK is picked up by conntrack and
+ * reaches the listener, which is marked as overflowed for the moment
+ * so that it checks the cookie instead of looking for a request socket.
+ * Needs net.ipv4.tcp_syncookies set, the listener ignores cookies otherwise.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/netdevice.h>
+#include <asm/unaligned.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/route.h>
+#include <net/inet_hashtables.h>
+#include <net/netfilter/nf_conntrack.h>
+#include "log.h"
+#include "syncookie.h"
+
+struct syncookie_stat {
+    u64 sent;         /* SYN-ACKs with a cookie */
+    u64 valid;        /* ACKs returning a valid cookie */
+    u64 invalid;      /* bare ACKs without state nor valid cookie, dropped */
+    u64 fail;         /* SYNs dropped without answer, no route or memory */
+};
+
+DEFINE_STATIC_KEY_FALSE(fw_syncookie_key);
+static DEFINE_PER_CPU(struct syncookie_stat, syncookie_stat);
+
+#ifdef CONFIG_SYN_COOKIES
+
+/*
+ * MSS option of a SYN, the default MSS of TCP if missing.
+ * */
+static u16 syncookie_peer_mss( struct sk_buff *skb, const struct tcphdr *th )
+{
+    u8 buf[MAX_TCP_OPTION_SPACE];
+    const u8 *opt;
+    int len = th->doff * 4 - sizeof(*th);
+    int i = 0;
+
+    if( len <= 0 ) return TCP_MSS_DEFAULT;
+    opt = skb_header_pointer(skb, ip_hdrlen(skb) + sizeof(*th), len, buf);
+    if( !opt ) return TCP_MSS_DEFAULT;
+    while( i < len ){
+        if( opt[i] == TCPOPT_EOL ) break;
+        if( opt[i] == TCPOPT_NOP ){
+            i++;
+            continue;
+        }
+        if( i + 1 >= len || opt[i+1] < 2 ) break;
+        if( opt[i] == TCPOPT_MSS && opt[i+1] == TCPOLEN_MSS && i + TCPOLEN_MSS <= len )
+            return get_unaligned_be16(&opt[i+2]);
+        i += opt[i+1];
+    }
+    return TCP_MSS_DEFAULT;
+}
+
+/*
+ * Answer the SYN [iph]/[th] with a SYN-ACK of sequence [cookie].
+ * */
+static int syncookie_send( struct net *net, const struct iphdr *iph,
+        const struct tcphdr *th, u32 cookie )
+{
+    unsigned int tcp_len = sizeof(struct tcphdr) + TCPOLEN_MSS_ALIGNED;
+    struct sk_buff *nskb;
+    struct iphdr *niph;
+    struct tcphdr *nth;
+    struct rtable *rt;
+    u16 mss;
+
+    rt = ip_route_output(net, iph->saddr, iph->daddr, 0, 0);
+    if( IS_ERR(rt) ) return PTR_ERR(rt);
+    nskb = alloc_skb(LL_MAX_HEADER + sizeof(*niph) + tcp_len, GFP_ATOMIC);
+    if( !nskb ){
+        ip_rt_put(rt);
+        return -ENOMEM;
+    }
+    skb_reserve(nskb, LL_MAX_HEADER);
+    skb_dst_set(nskb, &rt->dst);
+    nskb->protocol = htons(ETH_P_IP);
+
+    skb_reset_network_header(nskb);
+    niph = skb_put_zero(nskb, sizeof(*niph));
+    niph->version = 4;
+    niph->ihl = sizeof(*niph) / 4;
+    niph->tot_len = htons(sizeof(*niph) + tcp_len);
+    niph->frag_off = htons(IP_DF);
+    niph->ttl = net->ipv4.sysctl_ip_default_ttl;
+    niph->protocol = IPPROTO_TCP;
+    niph->saddr = iph->daddr;
+    niph->daddr = iph->saddr;
+
+    skb_set_transport_header(nskb, sizeof(*niph));
+    nth = skb_put_zero(nskb, tcp_len);
+    nth->source = th->dest;
+    nth->dest = th->source;
+    nth->seq = htonl(cookie);
+    nth->ack_seq = htonl(ntohl(th->seq) + 1);
+    nth->doff = tcp_len / 4;
+    nth->syn = 1;
+    nth->ack = 1;
+    nth->window = htons(U16_MAX);
+    mss = dst_mtu(&rt->dst) - sizeof(*niph) - sizeof(*nth);
+    *(__be32 *)(nth + 1) = htonl((TCPOPT_MSS << 24) | (TCPOLEN_MSS << 16) | mss);
+    nth->check = tcp_v4_check(tcp_len, niph->saddr, niph->daddr,
+            csum_partial(nth, tcp_len, 0));
+    nskb->ip_summed = CHECKSUM_NONE;
+
+    /* the answer leaves no conntrack state either */
+    nf_ct_set(nskb, NULL, IP_CT_UNTRACKED);
+    return ip_local_out(net, NULL, nskb);
+}
+
+/*
+ * An ACK that can only complete a handshake, with neither payload nor FIN.
+ * Other segments without state may be of a flow conntrack picked up late.
+ * */
+static int syncookie_bare_ack( const struct iphdr *iph, const struct tcphdr *th )
+{
+    return !th->fin && ntohs(iph->tot_len) == iph->ihl * 4 + th->doff * 4;
+}
+
+/*
+ * Make the listener of a validated ACK check cookies,
+ * it only does so after a recent overflow of its SYN queue.
+ * */
+static void syncookie_arm_listener( struct net *net, struct sk_buff *skb,
+        const struct iphdr *iph, const struct tcphdr *th )
+{
+    struct sock *sk;
+    rcu_read_lock();
+    sk = inet_lookup_listener(net, &tcp_hashinfo, skb, th->doff * 4,
+            iph->saddr, th->source, iph->daddr, th->dest,
+            inet_iif(skb), inet_sdif(skb));
+    if( sk )
+        tcp_synq_overflow(sk);
+    rcu_read_unlock();
+}
+
+int __fw_syncookie( struct sk_buff *skb, unsigned int *verdict )
+{
+    const struct iphdr *iph = ip_hdr(skb);
+    struct net *net = dev_net(skb->dev);
+    struct tcphdr _th;
+    const struct tcphdr *th;
+    u32 cookie;
+    u16 mss;
+
+    th = skb_header_pointer(skb, ip_hdrlen(skb), sizeof(_th), &_th);
+    if( !th || th->rst ) return 0;
+
+    if( th->syn && !th->ack ){
+        mss = syncookie_peer_mss(skb, th);
+        cookie = __cookie_v4_init_sequence(iph, th, &mss);
+        if( syncookie_send(net, iph, th, cookie) )
+            this_cpu_inc(syncookie_stat.fail);
+        else
+            this_cpu_inc(syncookie_stat.sent);
+        *verdict = NF_DROP;
+        return 1;
+    }
+    if( th->ack && !th->syn ){
+        /* the cookie is checked against seq - 1 and ack_seq - 1 */
+        if( !__cookie_v4_check(iph, th, ntohl(th->ack_seq) - 1) ){
+            if( !syncookie_bare_ack(iph, th) ) return 0;
+            this_cpu_inc(syncookie_stat.invalid);
+            *verdict = NF_DROP;
+            return 1;
+        }
+        syncookie_arm_listener(net, skb, iph, th);
+        this_cpu_inc(syncookie_stat.valid);
+        *verdict = NF_ACCEPT;
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+int __fw_syncookie( struct sk_buff *skb, unsigned int *verdict )
+{
+    return 0;
+}
+
+#endif
+
+/*
+ * "1" to answer SYNs to whitelisted ports with cookies, "0" to stop.
+ * */
+int fw_syncookie_write( char *buf )
+{
+    if( strcmp(buf, "1") == 0 ){
+#ifdef CONFIG_SYN_COOKIES
+        if( !init_net.ipv4.sysctl_tcp_syncookies )
+            logs("net.ipv4.tcp_syncookies is 0, listeners will reject cookies");
+        static_branch_enable(&fw_syncookie_key);
+#else
+        return -EOPNOTSUPP;
+#endif
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_syncookie_key);
+    }else{
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int fw_syncookie_show( struct seq_file *m, void *v )
+{
+    struct syncookie_stat sum = {0};
+    struct syncookie_stat *s;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&syncookie_stat, cpu);
+        sum.sent += s->sent;
+        sum.valid += s->valid;
+        sum.invalid += s->invalid;
+        sum.fail += s->fail;
+    }
+    seq_printf(m, "enabled %d\n", static_key_enabled(&fw_syncookie_key));
+    seq_printf(m, "sent %llu\n", sum.sent);
+    seq_printf(m, "valid %llu\n", sum.valid);
+    seq_printf(m, "invalid %llu\n", sum.invalid);
+    seq_printf(m, "fail %llu\n", sum.fail);
+    return 0;
+}
+
+void fw_syncookie_exit( void )
+{
+    static_branch_disable(&fw_syncookie_key);
+}
@@ -0,0 +1,43 @@
+#ifndef _SYNCOOKIE_H
+#define _SYNCOOKIE_H
+
+/*
+ * SYN cookie mode, switched by /proc/simplefirewall/syncookie.
+ * A SYN without conntrack state to a port of the port whitelist is
+ * answered with a SYN-ACK carrying a kernel syncookie and dropped, so
+ * neither conntrack nor the listener keep state for it. A bare ACK, with
+ * no payload nor FIN, is let through only if it returns a valid cookie;
+ * the listener is then told to accept cookies and builds the socket from
+ * it. Other segments without state get the port verdict.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <net/netfilter/nf_conntrack.h>
+
+DECLARE_STATIC_KEY_FALSE(fw_syncookie_key);
+
+int __fw_syncookie( struct sk_buff *skb, unsigned int *verdict );
+
+/*
+ * Decide a TCP packet accepted by the port whitelist.
+ * Return 1 with [verdict] set if the packet belongs to a cookie handshake.
+ * */
+static inline int fw_syncookie( struct sk_buff *skb, struct nf_conn *ct, unsigned int *verdict )
+{
+    if( static_branch_unlikely(&fw_syncookie_key)
+            && ip_hdr(skb)->protocol == IPPROTO_TCP
+            && (!ct || !nf_ct_is_confirmed(ct)) )
+        return __fw_syncookie(skb, verdict);
+    return 0;
+}
+
+int fw_syncookie_show( struct seq_file *m, void *v );
+int fw_syncookie_write( char *buf );
+
+void fw_syncookie_exit( void );
+
+#endif
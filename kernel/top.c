@@ -0,0 +1,271 @@
+/*
+ * Heavy hitter telemetry.
+ * Each cpu only writes its own sketch, so the packet path takes no lock.
+ * Counters are halved every FW_TOP_DECAY seconds by the cpu owning them,
+ * which keeps the view on recent traffic and the counters from overflowing.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/jiffies.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+#include "log.h"
+#include "top.h"
+
+#define FW_TOP_DEPTH 4
+#define FW_TOP_WIDTH 512      /* estimates exceed the truth by ~N/256 at most */
+#define FW_TOP_K 16
+#define FW_TOP_DECAY 10
+
+enum fw_top_dim {
+    FW_TOP_SRC,
+    FW_TOP_NET,
+    FW_TOP_PORT,
+    FW_TOP_DIM_MAX
+};
+
+static const char *dim_names[FW_TOP_DIM_MAX] = {
+    [FW_TOP_SRC] = "source",
+    [FW_TOP_NET] = "prefix",
+    [FW_TOP_PORT] = "dport",
+};
+
+struct fw_top_entry {
+    u32 key;
+    u32 count;     /* 0 if the slot is empty */
+};
+
+struct fw_top {
+    u32 sketch[FW_TOP_DIM_MAX][FW_TOP_DEPTH][FW_TOP_WIDTH];
+    struct fw_top_entry top[FW_TOP_DIM_MAX][FW_TOP_K];
+    u32 top_min[FW_TOP_DIM_MAX];   /* smallest count in top, 0 until full */
+    unsigned long next_decay;
+    unsigned int reset;            /* last top_reset seen by this cpu */
+};
+
+DEFINE_STATIC_KEY_TRUE(fw_top_key);
+
+static struct fw_top __percpu *fw_top;
+static u32 top_seed __read_mostly;
+static unsigned int top_reset;
+
+/*
+ * Column of [key] in each row, derived from one hash.
+ * */
+static inline void top_columns( int dim, u32 key, u32 *col )
+{
+    u32 h = jhash_2words(key, dim, top_seed);
+    u32 step = rol32(h, 16) | 1;
+    int i;
+    for( i=0; i<FW_TOP_DEPTH; i++ )
+        col[i] = (h + i * step) & (FW_TOP_WIDTH - 1);
+}
+
+static void top_count( struct fw_top *s, int dim, u32 key )
+{
+    struct fw_top_entry *e = s->top[dim];
+    u32 col[FW_TOP_DEPTH];
+    u32 est = U32_MAX;
+    u32 low;
+    int i, slot = -1;
+
+    top_columns(dim, key, col);
+    for( i=0; i<FW_TOP_DEPTH; i++ )
+        est = min(est, ++s->sketch[dim][i][col[i]]);
+    if( likely(est <= s->top_min[dim]) ) return;
+
+    /* a candidate: refresh its slot or take the smallest one */
+    for( i=0; i<FW_TOP_K; i++ ){
+        if( e[i].count && e[i].key == key ){
+            slot = i;
+            break;
+        }
+    }
+    if( slot < 0 ){
+        slot = 0;
+        for( i=1; i<FW_TOP_K; i++ )
+            if( e[i].count < e[slot].count ) slot = i;
+        e[slot].key = key;
+    }
+    e[slot].count = est;
+    low = e[0].count;
+    for( i=1; i<FW_TOP_K; i++ )
+        low = min(low, e[i].count);
+    s->top_min[dim] = low;
+}
+
+static void top_decay( struct fw_top *s )
+{
+    u32 *c = &s->sketch[0][0][0];
+    int i, j;
+    for( i=0; i<FW_TOP_DIM_MAX * FW_TOP_DEPTH * FW_TOP_WIDTH; i++ )
+        c[i] >>= 1;
+    for( i=0; i<FW_TOP_DIM_MAX; i++ ){
+        for( j=0; j<FW_TOP_K; j++ )
+            s->top[i][j].count >>= 1;
+        s->top_min[i] >>= 1;
+    }
+}
+
+static void top_clear( struct fw_top *s, unsigned int reset )
+{
+    memset(s->sketch, 0, sizeof(s->sketch));
+    memset(s->top, 0, sizeof(s->top));
+    memset(s->top_min, 0, sizeof(s->top_min));
+    s->reset = reset;
+    s->next_decay = jiffies + FW_TOP_DECAY * HZ;
+}
+
+void __fw_top_record( u32 ip, int port )
+{
+    struct fw_top *s;
+    unsigned int reset = READ_ONCE(top_reset);
+
+    s = get_cpu_ptr(fw_top);
+    if( unlikely(s->reset != reset) ){
+        top_clear(s, reset);
+    }else if( unlikely(time_after(jiffies, s->next_decay)) ){
+        top_decay(s);
+        s->next_decay = jiffies + FW_TOP_DECAY * HZ;
+    }
+    top_count(s, FW_TOP_SRC, ip);
+    top_count(s, FW_TOP_NET, ip & 0xffffff00);
+    if( port >= 0 )
+        top_count(s, FW_TOP_PORT, port);
+    put_cpu_ptr(fw_top);
+}
+
+static int top_cmp_key( const void *a, const void *b )
+{
+    u32 ka = ((const struct fw_top_entry *)a)->key;
+    u32 kb = ((const struct fw_top_entry *)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static int top_cmp_count( const void *a, const void *b )
+{
+    u32 ca = ((const struct fw_top_entry *)a)->count;
+    u32 cb = ((const struct fw_top_entry *)b)->count;
+    return ca > cb ? -1 : ca < cb;
+}
+
+/*
+ * Rank the candidates of all cpus for one dimension,
+ * each estimated from the summed sketch.
+ * */
+static void top_show_dim( struct seq_file *m, int dim, u32 (*sum)[FW_TOP_WIDTH],
+        struct fw_top_entry *cand, unsigned int reset )
+{
+    struct fw_top *s;
+    u32 col[FW_TOP_DEPTH];
+    int cpu, i, j;
+    int n = 0, num = 0;
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(fw_top, cpu);
+        if( READ_ONCE(s->reset) != reset ) continue;
+        for( i=0; i<FW_TOP_K; i++ ){
+            if( READ_ONCE(s->top[dim][i].count) )
+                cand[n++].key = READ_ONCE(s->top[dim][i].key);
+        }
+    }
+    sort(cand, n, sizeof(*cand), top_cmp_key, NULL);
+    for( i=0; i<n; i++ ){
+        if( num && cand[num-1].key == cand[i].key ) continue;
+        cand[num].key = cand[i].key;
+        cand[num].count = U32_MAX;
+        top_columns(dim, cand[num].key, col);
+        for( j=0; j<FW_TOP_DEPTH; j++ )
+            cand[num].count = min(cand[num].count, sum[j][col[j]]);
+        num++;
+    }
+    sort(cand, num, sizeof(*cand), top_cmp_count, NULL);
+
+    seq_printf(m, "%s\n", dim_names[dim]);
+    for( i=0; i<num && i<FW_TOP_K; i++ ){
+        if( dim == FW_TOP_SRC )
+            seq_printf(m, "%4d %-18pI4h %12u\n", i+1, &cand[i].key, cand[i].count);
+        else if( dim == FW_TOP_NET )
+            seq_printf(m, "%4d %15pI4h/24 %12u\n", i+1, &cand[i].key, cand[i].count);
+        else
+            seq_printf(m, "%4d %-18u %12u\n", i+1, cand[i].key, cand[i].count);
+    }
+}
+
+/*
+ * Packets per key, decayed by half every FW_TOP_DECAY seconds.
+ * */
+int fw_top_show( struct seq_file *m, void *v )
+{
+    u32 (*sum)[FW_TOP_DEPTH][FW_TOP_WIDTH];
+    struct fw_top_entry *cand;
+    struct fw_top *s;
+    unsigned int reset = READ_ONCE(top_reset);
+    int cpu, dim, i, j;
+
+    sum = kvzalloc(sizeof(*sum) * FW_TOP_DIM_MAX, GFP_KERNEL);
+    cand = kvmalloc_array(num_possible_cpus() * FW_TOP_K, sizeof(*cand), GFP_KERNEL);
+    if( !sum || !cand ){
+        kvfree(sum);
+        kvfree(cand);
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(fw_top, cpu);
+        if( READ_ONCE(s->reset) != reset ) continue;
+        for( dim=0; dim<FW_TOP_DIM_MAX; dim++ )
+            for( i=0; i<FW_TOP_DEPTH; i++ )
+                for( j=0; j<FW_TOP_WIDTH; j++ )
+                    sum[dim][i][j] += READ_ONCE(s->sketch[dim][i][j]);
+    }
+    seq_printf(m, "enabled %d decay %ds\n", static_key_enabled(&fw_top_key), FW_TOP_DECAY);
+    for( dim=0; dim<FW_TOP_DIM_MAX; dim++ )
+        top_show_dim(m, dim, sum[dim], cand, reset);
+    kvfree(sum);
+    kvfree(cand);
+    return 0;
+}
+
+/*
+ * Write "1" to enable, "0" to disable, "reset" to clear the counters.
+ * */
+int fw_top_write( char *buf )
+{
+    if( strcmp(buf, "1") == 0 ){
+        static_branch_enable(&fw_top_key);
+    }else if( strcmp(buf, "0") == 0 ){
+        static_branch_disable(&fw_top_key);
+    }else if( strcmp(buf, "reset") == 0 ){
+        /* every cpu clears its own sketch on its next packet */
+        WRITE_ONCE(top_reset, top_reset + 1);
+    }else{
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int fw_top_init( void )
+{
+    int cpu;
+    fw_top = alloc_percpu(struct fw_top);
+    if( !fw_top ){
+        logs("Fails to alloc heavy hitter sketches");
+        return -ENOMEM;
+    }
+    get_random_bytes(&top_seed, sizeof(top_seed));
+    for_each_possible_cpu(cpu)
+        per_cpu_ptr(fw_top, cpu)->next_decay = jiffies + FW_TOP_DECAY * HZ;
+    return 0;
+}
+
+void fw_top_exit( void )
+{
+    free_percpu(fw_top);
+    fw_top = NULL;
+}
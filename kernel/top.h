@@ -0,0 +1,34 @@
+#ifndef _TOP_H
+#define _TOP_H
+
+/*
+ * Heavy hitters seen by fw_filter(), exported by /proc/simplefirewall/top.
+ * Every cpu counts source addresses, source /24 prefixes and destination
+ * ports in its own count-min sketch and keeps its own top-K candidates,
+ * the sketches are summed and the candidates ranked on read.
+ * */
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/seq_file.h>
+
+DECLARE_STATIC_KEY_TRUE(fw_top_key);
+
+void __fw_top_record( u32 ip, int port );
+
+/*
+ * [port] is negative for packets without L4 port.
+ * */
+static inline void fw_top_record( u32 ip, int port )
+{
+    if( static_branch_likely(&fw_top_key) )
+        __fw_top_record(ip, port);
+}
+
+int fw_top_show( struct seq_file *m, void *v );
+int fw_top_write( char *buf );
+
+int fw_top_init( void );
+void fw_top_exit( void );
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * Torture and scalability test of the set tables, a module of its own:
+ *   insmod simplefirewall.ko && insmod simplefirewall_torture.ko [params]
+ * Two scratch sets, one exact IP set of backend [backend] and one CIDR
+ * set of /24 prefixes, are churned by writer threads with inserts,
+ * deletes and, now and then, a flush of both, while reader threads bound
+ * to CPUs look up addresses with fw_set_test(), as the hook does.
+ *
+ * Every key has a sequence count, odd while a writer changes it, and a
+ * reference state set once the change is committed; a flush makes a
+ * global count odd. A lookup made while neither count moved must agree
+ * with the reference, any other answer is a bug of the table or of its
+ * lookup caches. Use after free is left to KASAN, build the kernel with
+ * CONFIG_KASAN to catch it.
+ *
+ * Readers run in phases of 1, 2, 4 ... up to [readers] CPUs, each for
+ * [phase] seconds under the same churn, and the lookup rate of each phase
+ * is printed. The last line is "simplefirewall torture: END SUCCESS" or
+ * "END FAILURE". The sets and their entries go through the journal like
+ * any other change.
+ * */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/rwsem.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include "ip.h"
+#include "mem.h"
+#include "set.h"
+
+#define TT_NAME         "simplefirewall torture"
+#define TT_ERR_SHOW     10        /* mismatches printed */
+#define TT_BASE         0x0a000000  /* 10.0.0.0, keys are addresses above */
+
+static int readers;
+module_param(readers, int, 0444);
+MODULE_PARM_DESC(readers, "Most reader CPUs of the last phase, 0 for all online CPUs");
+static int writers = 2;
+module_param(writers, int, 0444);
+MODULE_PARM_DESC(writers, "Writer threads churning the sets");
+static int keys = 4096;
+module_param(keys, int, 0444);
+MODULE_PARM_DESC(keys, "Keys of each set, 1 to 65536");
+static int phase = 5;
+module_param(phase, int, 0444);
+MODULE_PARM_DESC(phase, "Seconds of each reader phase");
+static int flush_every = 10000;
+module_param(flush_every, int, 0444);
+MODULE_PARM_DESC(flush_every, "Writes of writer 0 between two flushes, 0 never flushes");
+static char *backend = "ip";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Backend of the exact IP set: ip, ip_hash or ip_roaring");
+
+enum {
+    TT_IP,
+    TT_CIDR,
+    TT_SETS
+};
+
+static const char *set_names[TT_SETS] = { "torture_ip", "torture_cidr" };
+
+struct tt_key {
+    atomic_t seq;         /* odd while a writer changes the key */
+    int present;          /* reference state */
+};
+
+struct tt_set {
+    struct fw_set *set;
+    struct tt_key *keys;
+};
+
+struct tt_reader {
+    struct task_struct *task;
+    u64 lookups;
+};
+
+static struct tt_set tt_sets[TT_SETS];
+static atomic_t tt_flush_seq;         /* odd while both sets are flushed */
+static DECLARE_RWSEM(tt_flush_sem);   /* writes shared, flush exclusive */
+static atomic64_t tt_errors;
+static atomic64_t tt_writes;
+static struct task_struct **tt_writers;
+static struct tt_reader *tt_readers;
+static struct task_struct *tt_control;
+
+/*
+ * Address of key [k], an address inside the prefix for a CIDR set.
+ * */
+static inline u32 tt_addr( int s, int k, u32 rnd )
+{
+    if( s == TT_IP ) return TT_BASE + k;
+    return TT_BASE + ((u32)k << 8) + (rnd & 0xff);
+}
+
+static int tt_write( int s, int k, int present )
+{
+    union {
+        ip_desc ip;
+        cidr_desc cidr;
+    } desc;
+    struct fw_set *set = tt_sets[s].set;
+    memset(&desc, 0, sizeof(desc));
+    if( s == TT_IP ){
+        desc.ip.ip = tt_addr(s, k, 0);
+    }else{
+        desc.cidr.ip = tt_addr(s, k, 0);
+        desc.cidr.mask = 24;
+    }
+    return present ? fw_set_delete(set, &desc) : fw_set_insert(set, &desc);
+}
+
+static void tt_flush( void )
+{
+    int s, k;
+    down_write(&tt_flush_sem);
+    atomic_inc(&tt_flush_seq);
+    smp_mb__after_atomic();
+    for( s=0; s<TT_SETS; s++ ){
+        if( fw_set_flush(tt_sets[s].set) ){
+            pr_err(TT_NAME ": flush of %s failed\n", set_names[s]);
+            atomic64_inc(&tt_errors);
+        }
+        for( k=0; k<keys; k++ )
+            WRITE_ONCE(tt_sets[s].keys[k].present, 0);
+    }
+    smp_mb__before_atomic();
+    atomic_inc(&tt_flush_seq);
+    up_write(&tt_flush_sem);
+}
+
+/*
+ * Writer [id] flips the keys k with k % writers == id.
+ * */
+static int tt_writer( void *arg )
+{
+    long id = (long)arg;
+    struct rnd_state rnd;
+    struct tt_key *key;
+    unsigned long n = 0;
+    int s, k, ret;
+
+    prandom_seed_state(&rnd, get_random_u64());
+    while( !kthread_should_stop() ){
+        s = prandom_u32_state(&rnd) % TT_SETS;
+        k = prandom_u32_state(&rnd) % keys;
+        k -= k % writers;
+        k += id;
+        if( k >= keys ) continue;
+        key = &tt_sets[s].keys[k];
+        down_read(&tt_flush_sem);
+        atomic_inc(&key->seq);
+        smp_mb__after_atomic();
+        ret = tt_write(s, k, key->present);
+        fw_node_commit();
+        fw_set_commit(tt_sets[s].set);
+        if( ret == 0 ){
+            WRITE_ONCE(key->present, !key->present);
+        }else if( ret == -ENOMEM ){
+            /* the reference stays, the table must too */
+        }else{
+            pr_err(TT_NAME ": %s of key %d in %s failed %d\n",
+                    key->present ? "delete" : "insert", k, set_names[s], ret);
+            atomic64_inc(&tt_errors);
+        }
+        smp_mb__before_atomic();
+        atomic_inc(&key->seq);
+        up_read(&tt_flush_sem);
+        atomic64_inc(&tt_writes);
+        if( id == 0 && flush_every && ++n % flush_every == 0 )
+            tt_flush();
+        cond_resched();
+    }
+    return 0;
+}
+
+static int tt_reader( void *arg )
+{
+    struct tt_reader *rd = arg;
+    struct rnd_state rnd;
+    struct tt_key *key;
+    u32 r, s1, g1;
+    int s, k, expect, got;
+
+    prandom_seed_state(&rnd, get_random_u64());
+    while( !kthread_should_stop() ){
+        r = prandom_u32_state(&rnd);
+        s = r & 1;
+        k = (r >> 1) % keys;
+        key = &tt_sets[s].keys[k];
+        g1 = atomic_read(&tt_flush_seq);
+        s1 = atomic_read(&key->seq);
+        smp_rmb();
+        expect = READ_ONCE(key->present);
+        got = fw_set_test(tt_sets[s].set, tt_addr(s, k, r >> 24));
+        smp_rmb();
+        rd->lookups++;
+        if( (s1 | g1) & 1 ) goto next;
+        if( s1 != atomic_read(&key->seq) || g1 != atomic_read(&tt_flush_seq) ) goto next;
+        if( !!got != expect ){
+            if( atomic64_inc_return(&tt_errors) <= TT_ERR_SHOW )
+                pr_err(TT_NAME ": %s key %d found %d, reference %d\n",
+                        set_names[s], k, got, expect);
+        }
+next:
+        if( (rd->lookups & 1023) == 0 )
+            cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * One phase of [n] readers on the first [n] online CPUs,
+ * returns the number of readers that ran, 0 if none could start.
+ * */
+static int tt_phase( int n )
+{
+    u64 lookups = 0, writes;
+    ktime_t start;
+    s64 ns;
+    int i, cpu = -1;
+
+    for( i=0; i<n; i++ ){
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        tt_readers[i].lookups = 0;
+        tt_readers[i].task = kthread_create_on_node(tt_reader, &tt_readers[i],
+                cpu_to_node(cpu), "fw_torture_r/%d", cpu);
+        if( IS_ERR(tt_readers[i].task) ){
+            n = i;
+            break;
+        }
+        kthread_bind(tt_readers[i].task, cpu);
+    }
+    if( n == 0 ){
+        pr_err(TT_NAME ": no reader started\n");
+        return 0;
+    }
+    writes = atomic64_read(&tt_writes);
+    start = ktime_get();
+    for( i=0; i<n; i++ )
+        wake_up_process(tt_readers[i].task);
+    for( i=0; i<phase * 10 && !kthread_should_stop(); i++ )
+        msleep_interruptible(100);
+    for( i=0; i<n; i++ ){
+        kthread_stop(tt_readers[i].task);
+        lookups += tt_readers[i].lookups;
+    }
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    writes = atomic64_read(&tt_writes) - writes;
+    pr_info(TT_NAME ": %d readers %llu lookups/s, %llu per reader, %llu writes/s, errors %lld\n",
+            n, div64_u64(lookups * NSEC_PER_SEC, ns),
+            div64_u64(lookups * NSEC_PER_SEC, ns * n),
+            div64_u64(writes * NSEC_PER_SEC, ns), atomic64_read(&tt_errors));
+    return n;
+}
+
+static int tt_control_fn( void *arg )
+{
+    int n = 1, max = (long)arg;
+    int failed = 0;
+    while( !kthread_should_stop() ){
+        if( tt_phase(n) == 0 ){
+            failed = 1;
+            break;
+        }
+        if( n == max ) break;
+        n = min(n * 2, max);
+    }
+    pr_info(TT_NAME ": END %s\n", failed || atomic64_read(&tt_errors) ? "FAILURE" : "SUCCESS");
+    /* wait for rmmod */
+    while( !kthread_should_stop() )
+        msleep_interruptible(1000);
+    return 0;
+}
+
+static void tt_cleanup( void )
+{
+    struct fw_set *set;
+    int i;
+    if( tt_writers ){
+        for( i=0; i<writers; i++ )
+            if( !IS_ERR_OR_NULL(tt_writers[i]) )
+                kthread_stop(tt_writers[i]);
+        kfree(tt_writers);
+        tt_writers = NULL;
+    }
+    for( i=0; i<TT_SETS; i++ ){
+        if( tt_sets[i].set ){
+            fw_set_put(tt_sets[i].set);
+            set = fw_set_unlink(set_names[i]);
+            if( !IS_ERR(set) )
+                fw_set_put(set);
+        }
+        kvfree(tt_sets[i].keys);
+        tt_sets[i].set = NULL;
+        tt_sets[i].keys = NULL;
+    }
+    kfree(tt_readers);
+    tt_readers = NULL;
+}
+
+static int __init fw_torture_init( void )
+{
+    const struct fw_set_ops *ops[TT_SETS];
+    struct fw_set *set;
+    int i, max;
+
+    if( keys < 1 || keys > 65536 || writers < 1 || phase < 1 ) return -EINVAL;
+    max = num_online_cpus();
+    if( readers > 0 && readers < max ) max = readers;
+    ops[TT_IP] = fw_set_type(backend);
+    ops[TT_CIDR] = fw_set_type("cidr");
+    if( !ops[TT_IP] || ops[TT_IP]->kind != FW_SET_IP || !ops[TT_CIDR] ) return -EINVAL;
+
+    tt_readers = kcalloc(max, sizeof(*tt_readers), GFP_KERNEL);
+    tt_writers = kcalloc(writers, sizeof(*tt_writers), GFP_KERNEL);
+    if( !tt_readers || !tt_writers ) goto nomem;
+    for( i=0; i<TT_SETS; i++ ){
+        tt_sets[i].keys = kvcalloc(keys, sizeof(struct tt_key), GFP_KERNEL);
+        if( !tt_sets[i].keys ) goto nomem;
+        set = fw_set_create(set_names[i], ops[i]);
+        if( IS_ERR(set) ){
+            tt_cleanup();
+            return PTR_ERR(set);
+        }
+        /* the registry keeps its own reference until the unlink */
+        fw_set_hold(set);
+        tt_sets[i].set = set;
+    }
+    for( i=0; i<writers; i++ ){
+        tt_writers[i] = kthread_run(tt_writer, (void *)(long)i, "fw_torture_w/%d", i);
+        if( IS_ERR(tt_writers[i]) ){
+            tt_cleanup();
+            return -ENOMEM;
+        }
+    }
+    pr_info(TT_NAME ": %s and cidr sets of %d keys, %d writers, up to %d readers, %d s phases\n",
+            backend, keys, writers, max, phase);
+    tt_control = kthread_run(tt_control_fn, (void *)(long)max, "fw_torture");
+    if( IS_ERR(tt_control) ){
+        tt_cleanup();
+        return PTR_ERR(tt_control);
+    }
+    return 0;
+nomem:
+    tt_cleanup();
+    return -ENOMEM;
+}
+
+static void __exit fw_torture_exit( void )
+{
+    kthread_stop(tt_control);
+    tt_cleanup();
+}
+
+module_init(fw_torture_init);
+module_exit(fw_torture_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("simplefirewall set torture and scalability test");
@@ -0,0 +1,134 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefirewall
+
+#if !defined(_FW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FW_TRACE_H
+
+/*
+ * Static tracepoints, see /sys/kernel/debug/tracing/events/simplefirewall/
+ * fw_verdict:   the verdict of fw_filter() and the stage deciding it
+ * fw_rule_ip:   insert or delete of a single IP or CIDR rule
+ * fw_rule_port: insert or delete of a port rule
+ * */
+
+#include <linux/tracepoint.h>
+#include <linux/netfilter.h>
+#include "stat.h"
+
+TRACE_DEFINE_ENUM(FW_STAGE_FRAGMENT);
+TRACE_DEFINE_ENUM(FW_STAGE_CONNTRACK);
+TRACE_DEFINE_ENUM(FW_STAGE_POLICY);
+TRACE_DEFINE_ENUM(FW_STAGE_AUTOBLOCK);
+TRACE_DEFINE_ENUM(FW_STAGE_CIDR_BLACKLIST);
+TRACE_DEFINE_ENUM(FW_STAGE_IP_BLACKLIST);
+TRACE_DEFINE_ENUM(FW_STAGE_CIDR_WHITELIST);
+TRACE_DEFINE_ENUM(FW_STAGE_IP_WHITELIST);
+TRACE_DEFINE_ENUM(FW_STAGE_PORT);
+TRACE_DEFINE_ENUM(FW_STAGE_LISTEN);
+TRACE_DEFINE_ENUM(FW_STAGE_SYNCOOKIE);
+TRACE_DEFINE_ENUM(FW_STAGE_CONNLIMIT);
+TRACE_DEFINE_ENUM(FW_STAGE_DEFAULT);
+
+#define show_fw_stage(stage) __print_symbolic(stage, \
+    { FW_STAGE_FRAGMENT, "fragment" }, \
+    { FW_STAGE_CONNTRACK, "conntrack" }, \
+    { FW_STAGE_POLICY, "policy" }, \
+    { FW_STAGE_AUTOBLOCK, "autoblock" }, \
+    { FW_STAGE_CIDR_BLACKLIST, "cidr_blacklist" }, \
+    { FW_STAGE_IP_BLACKLIST, "ip_blacklist" }, \
+    { FW_STAGE_CIDR_WHITELIST, "cidr_whitelist" }, \
+    { FW_STAGE_IP_WHITELIST, "ip_whitelist" }, \
+    { FW_STAGE_PORT, "port" }, \
+    { FW_STAGE_LISTEN, "listen" }, \
+    { FW_STAGE_SYNCOOKIE, "syncookie" }, \
+    { FW_STAGE_CONNLIMIT, "connlimit" }, \
+    { FW_STAGE_DEFAULT, "default" })
+
+#define FW_RULE_ADD 0
+#define FW_RULE_DELETE 1
+
+TRACE_EVENT(fw_verdict,
+
+    TP_PROTO(u32 saddr, u8 protocol, u16 dport, int stage, unsigned int verdict),
+
+    TP_ARGS(saddr, protocol, dport, stage, verdict),
+
+    TP_STRUCT__entry(
+        __field(u32, saddr)
+        __field(u8, protocol)
+        __field(u16, dport)
+        __field(int, stage)
+        __field(unsigned int, verdict)
+    ),
+
+    TP_fast_assign(
+        __entry->saddr = saddr;
+        __entry->protocol = protocol;
+        __entry->dport = dport;
+        __entry->stage = stage;
+        __entry->verdict = verdict;
+    ),
+
+    TP_printk("saddr=%x protocol=%u dport=%u stage=%s verdict=%s",
+        __entry->saddr, __entry->protocol, __entry->dport,
+        show_fw_stage(__entry->stage),
+        __entry->verdict == NF_DROP ? "drop" : "accept")
+);
+
+TRACE_EVENT(fw_rule_ip,
+
+    TP_PROTO(int op, u8 flags, u32 ip, u8 mask),
+
+    TP_ARGS(op, flags, ip, mask),
+
+    TP_STRUCT__entry(
+        __field(int, op)
+        __field(u8, flags)
+        __field(u32, ip)
+        __field(u8, mask)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->flags = flags;
+        __entry->ip = ip;
+        __entry->mask = mask;
+    ),
+
+    TP_printk("%s flags=%x ip=%x/%u",
+        __entry->op == FW_RULE_DELETE ? "delete" : "add",
+        __entry->flags, __entry->ip, __entry->mask)
+);
+
+TRACE_EVENT(fw_rule_port,
+
+    TP_PROTO(int op, u16 flags, u16 start, u16 end),
+
+    TP_ARGS(op, flags, start, end),
+
+    TP_STRUCT__entry(
+        __field(int, op)
+        __field(u16, flags)
+        __field(u16, start)
+        __field(u16, end)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->flags = flags;
+        __entry->start = start;
+        __entry->end = end;
+    ),
+
+    TP_printk("%s flags=%x port=%u-%u",
+        __entry->op == FW_RULE_DELETE ? "delete" : "add",
+        __entry->flags, __entry->start, __entry->end)
+);
+
+#endif /* _FW_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
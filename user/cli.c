@@ -0,0 +1,457 @@
+/*
+ * fwclassify, runs flow logs through the lists of simplefirewall.
+ *
+ * fwclassify [-b ip|ip_roaring] [-n top] [-p auto|on|off] -l <list>=<file>... <input>
+ *
+ * <list> is one of the builtin set names, ip_blacklist, cidr_whitelist...
+ * <input> is a pcap or pcapng file, e.g. /proc/simplefirewall/capture.pcapng,
+ * or a CSV flow log of "saddr,proto,dport" lines, proto as a number or
+ * tcp/udp/icmp; lines that do not parse, like a header, are skipped.
+ * "-" reads stdin.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include "fwclassify.h"
+
+#define CHUNK 65536           /* flows classified at once */
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NS   0xa1b23c4d
+#define PCAPNG_SHB      0x0a0d0d0a
+#define PCAPNG_IDB      1
+#define PCAPNG_SPB      3
+#define PCAPNG_EPB      6
+#define PCAPNG_MAGIC    0x1a2b3c4d
+#define PCAPNG_IFS      16        /* interfaces of a section */
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_LINUX_SLL2 276
+
+enum input_format {
+    INPUT_CSV,
+    INPUT_PCAP,
+    INPUT_PCAPNG,
+};
+
+struct input {
+    const unsigned char *p;
+    const unsigned char *end;
+    enum input_format format;
+    int swap;
+    unsigned int linktype;
+    unsigned int linktypes[PCAPNG_IFS];   /* pcapng, by interface id */
+    unsigned int ifs;
+    unsigned long skipped;
+};
+
+static struct fw_flow flows[CHUNK];
+static struct fw_verdict verdicts[CHUNK];
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint32_t get32( const unsigned char *p, int swap )
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t get16( const unsigned char *p, int swap )
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+static inline unsigned int be16( const unsigned char *p )
+{
+    return p[0] << 8 | p[1];
+}
+
+/*
+ * The flow of an IPv4 packet at [p], 0 if it is not one.
+ * */
+static int parse_ipv4( const unsigned char *p, size_t len, struct fw_flow *f )
+{
+    size_t ihl;
+    if( len < 20 || (p[0] >> 4) != 4 ) return 0;
+    ihl = (p[0] & 0xf) * 4;
+    if( ihl < 20 ) return 0;
+    f->saddr = (uint32_t)p[12] << 24 | p[13] << 16 | p[14] << 8 | p[15];
+    f->proto = p[9];
+    f->dport = 0;
+    if( (f->proto == IPPROTO_TCP || f->proto == IPPROTO_UDP) && len >= ihl + 4 )
+        f->dport = be16(p + ihl + 2);
+    return 1;
+}
+
+static int parse_frame( unsigned int linktype, const unsigned char *p, size_t len, struct fw_flow *f )
+{
+    unsigned int type;
+    switch( linktype ){
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            return parse_ipv4(p, len, f);
+        case LINKTYPE_ETHERNET:
+            if( len < 14 ) return 0;
+            type = be16(p + 12);
+            p += 14;
+            len -= 14;
+            /* 802.1Q and 802.1ad tags */
+            while( (type == 0x8100 || type == 0x88a8) && len >= 4 ){
+                type = be16(p + 2);
+                p += 4;
+                len -= 4;
+            }
+            return type == 0x0800 && parse_ipv4(p, len, f);
+        case LINKTYPE_LINUX_SLL:
+            return len >= 16 && be16(p + 14) == 0x0800 && parse_ipv4(p + 16, len - 16, f);
+        case LINKTYPE_LINUX_SLL2:
+            return len >= 20 && be16(p) == 0x0800 && parse_ipv4(p + 20, len - 20, f);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Up to [max] flows of the pcap records at in->p.
+ * */
+static size_t read_pcap( struct input *in, struct fw_flow *f, size_t max )
+{
+    uint32_t caplen;
+    size_t n = 0;
+    while( n < max && in->end - in->p >= 16 ){
+        caplen = get32(in->p + 8, in->swap);
+        if( (size_t)(in->end - in->p - 16) < caplen ){
+            in->p = in->end;
+            break;
+        }
+        if( parse_frame(in->linktype, in->p + 16, caplen, &f[n]) ) n++;
+        else in->skipped++;
+        in->p += 16 + caplen;
+    }
+    return n;
+}
+
+/*
+ * Up to [max] flows of the pcapng blocks at in->p, a section header
+ * sets the byte order and drops the interfaces of the previous section.
+ * */
+static size_t read_pcapng( struct input *in, struct fw_flow *f, size_t max )
+{
+    const unsigned char *b;
+    uint32_t type, len, caplen, id;
+    size_t n = 0;
+    while( n < max && in->end - in->p >= 12 ){
+        b = in->p;
+        type = get32(b, in->swap);
+        if( type == PCAPNG_SHB ){
+            in->swap = get32(b + 8, 0) != PCAPNG_MAGIC;
+            in->ifs = 0;
+        }
+        len = get32(b + 4, in->swap);
+        if( len < 12 || len % 4 || (size_t)(in->end - b) < len ){
+            in->p = in->end;
+            break;
+        }
+        in->p += len;
+        switch( type ){
+            case PCAPNG_IDB:
+                if( in->ifs < PCAPNG_IFS )
+                    in->linktypes[in->ifs] = get16(b + 8, in->swap);
+                in->ifs++;
+                break;
+            case PCAPNG_EPB:
+                if( len < 32 ) break;
+                id = get32(b + 8, in->swap);
+                caplen = get32(b + 20, in->swap);
+                if( caplen > len - 32 || id >= in->ifs || id >= PCAPNG_IFS ||
+                    !parse_frame(in->linktypes[id], b + 28, caplen, &f[n]) ){
+                    in->skipped++;
+                    break;
+                }
+                n++;
+                break;
+            case PCAPNG_SPB:
+                if( in->ifs == 0 || !parse_frame(in->linktypes[0], b + 12, len - 16, &f[n]) ){
+                    in->skipped++;
+                    break;
+                }
+                n++;
+                break;
+        }
+    }
+    return n;
+}
+
+static inline const unsigned char *parse_u32( const unsigned char *p, const unsigned char *end, uint32_t *v )
+{
+    const unsigned char *s = p;
+    *v = 0;
+    while( p < end && *p >= '0' && *p <= '9' && p - s < 10 )
+        *v = *v * 10 + (*p++ - '0');
+    return p == s ? NULL : p;
+}
+
+static int parse_csv( const unsigned char *p, const unsigned char *end, struct fw_flow *f )
+{
+    uint32_t b[4], v;
+    int i;
+    for( i=0; i<4; i++ ){
+        p = parse_u32(p, end, &b[i]);
+        if( !p || b[i] > 255 || p == end || *p != (i < 3 ? '.' : ',') ) return 0;
+        p++;
+    }
+    f->saddr = b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    if( end - p >= 4 && memcmp(p, "tcp,", 4) == 0 ){
+        f->proto = IPPROTO_TCP;
+        p += 3;
+    }else if( end - p >= 4 && memcmp(p, "udp,", 4) == 0 ){
+        f->proto = IPPROTO_UDP;
+        p += 3;
+    }else if( end - p >= 5 && memcmp(p, "icmp,", 5) == 0 ){
+        f->proto = IPPROTO_ICMP;
+        p += 4;
+    }else{
+        p = parse_u32(p, end, &v);
+        if( !p || v > 255 ) return 0;
+        f->proto = v;
+    }
+    if( p == end || *p++ != ',' ) return 0;
+    p = parse_u32(p, end, &v);
+    if( !p || v > 65535 ) return 0;
+    f->dport = v;
+    return 1;
+}
+
+/*
+ * Up to [max] flows of the CSV lines at in->p.
+ * */
+static size_t read_csv( struct input *in, struct fw_flow *f, size_t max )
+{
+    const unsigned char *eol;
+    size_t n = 0;
+    while( n < max && in->p < in->end ){
+        eol = memchr(in->p, '\n', in->end - in->p);
+        if( !eol ) eol = in->end;
+        if( parse_csv(in->p, eol, &f[n]) ) n++;
+        else if( eol > in->p ) in->skipped++;
+        in->p = eol + 1;
+    }
+    if( in->p > in->end ) in->p = in->end;
+    return n;
+}
+
+/*
+ * Map the file at [path], or read stdin for "-".
+ * */
+static int open_input( const char *path, struct input *in )
+{
+    struct stat st;
+    unsigned char *buf = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t r;
+    uint32_t magic;
+    int fd;
+
+    memset(in, 0, sizeof(*in));
+    if( strcmp(path, "-") == 0 ){
+        st.st_size = 0;
+        for( ;; ){
+            if( len == cap ){
+                cap = cap ? 2 * cap : 1 << 20;
+                buf = realloc(buf, cap);
+                if( !buf ) return -ENOMEM;
+            }
+            r = read(0, buf + len, cap - len);
+            if( r < 0 ) return -errno;
+            if( r == 0 ) break;
+            len += r;
+        }
+        st.st_size = len;
+        goto detect;
+    }
+    fd = open(path, O_RDONLY);
+    if( fd < 0 ) return -errno;
+    if( fstat(fd, &st) < 0 ){
+        close(fd);
+        return -errno;
+    }
+    if( st.st_size > 0 ){
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if( buf == MAP_FAILED ){
+            close(fd);
+            return -errno;
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+detect:
+    in->p = buf;
+    in->end = buf + st.st_size;
+    if( st.st_size < 24 ) return 0;
+    magic = get32(in->p, 0);
+    if( magic == PCAPNG_SHB ){
+        in->format = INPUT_PCAPNG;
+        return 0;
+    }
+    if( magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS) )
+        in->swap = 1;
+    else if( magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS )
+        return 0;
+    in->format = INPUT_PCAP;
+    in->linktype = get32(in->p + 20, in->swap) & 0xffff;   /* FCS bits above */
+    in->p += 24;
+    return 0;
+}
+
+static struct fw_result *sort_result;
+static int sort_list;
+
+static int hits_cmp( const void *a, const void *b )
+{
+    uint64_t x = sort_result->hits[sort_list][*(const size_t *)a];
+    uint64_t y = sort_result->hits[sort_list][*(const size_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_result( struct fw_result *r, size_t top )
+{
+    char text[32];
+    size_t *order;
+    size_t i, n, shown;
+    int list, s;
+
+    printf("%-16s %14s %14s\n", "stage", "accept", "drop");
+    for( s=0; s<FW_STAGE_MAX; s++ ){
+        if( !r->accept[s] && !r->drop[s] ) continue;
+        printf("%-16s %14llu %14llu\n", fw_user_stage_name(s),
+                (unsigned long long)r->accept[s], (unsigned long long)r->drop[s]);
+    }
+    for( list=0; list<F_MAX; list++ ){
+        n = fw_user_rules(list);
+        if( n == 0 ) continue;
+        order = malloc(n * sizeof(*order));
+        if( !order ) return;
+        for( i=0; i<n; i++ )
+            order[i] = i;
+        sort_result = r;
+        sort_list = list;
+        qsort(order, n, sizeof(*order), hits_cmp);
+        printf("\n%s: %zu rules\n", fw_user_list_name(list), n);
+        for( i=0, shown=0; i<n && shown<top; i++, shown++ ){
+            if( r->hits[list][order[i]] == 0 ) break;
+            fw_user_rule_text(list, order[i], text, sizeof(text));
+            printf("  %-20s %14llu\n", text, (unsigned long long)r->hits[list][order[i]]);
+        }
+        for( ; i<n && r->hits[list][order[i]]; i++ );
+        printf("  %zu rules matched, %zu never\n", i, n - i);
+        free(order);
+    }
+}
+
+static void usage( void )
+{
+    fprintf(stderr, "usage: fwclassify [-b ip|ip_roaring] [-n top] [-p auto|on|off] -l <list>=<file>... <pcap|csv|->\n");
+    exit(2);
+}
+
+int main( int argc, char **argv )
+{
+    struct fw_result result;
+    struct input in;
+    const char *backend = NULL;
+    char *loads[64];
+    char *file;
+    unsigned long invalid = 0;
+    size_t top = 10, n, nloads = 0, i;
+    double t0, t1, tc = 0;
+    int list, ret, c;
+
+    while( (c = getopt(argc, argv, "b:l:n:p:v")) != -1 ){
+        switch( c ){
+            case 'b': backend = optarg; break;
+            case 'l':
+                if( nloads == sizeof(loads) / sizeof(loads[0]) ) usage();
+                loads[nloads++] = optarg;
+                break;
+            case 'n': top = strtoul(optarg, NULL, 10); break;
+            case 'p':
+                if( strcmp(optarg, "on") == 0 ) fw_user_prefetch(FW_PREFETCH_ON);
+                else if( strcmp(optarg, "off") == 0 ) fw_user_prefetch(FW_PREFETCH_OFF);
+                else if( strcmp(optarg, "auto") != 0 ) usage();
+                break;
+            case 'v': fw_user_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if( optind != argc - 1 ) usage();
+
+    ret = fw_user_init(backend);
+    if( ret ){
+        fprintf(stderr, "fwclassify: backend %s: %s\n", backend, strerror(-ret));
+        return 1;
+    }
+    t0 = now();
+    for( i=0; i<nloads; i++ ){
+        file = strchr(loads[i], '=');
+        if( !file ) usage();
+        *file++ = 0;
+        list = fw_user_list(loads[i]);
+        if( list < 0 ){
+            fprintf(stderr, "fwclassify: no list %s\n", loads[i]);
+            return 1;
+        }
+        ret = fw_user_load(list, file, &invalid);
+        if( ret ){
+            fprintf(stderr, "fwclassify: %s: %s\n", file, strerror(-ret));
+            return 1;
+        }
+    }
+    t1 = now();
+    fprintf(stderr, "loaded %zu files in %.3f s, %lu invalid entries\n", nloads, t1 - t0, invalid);
+
+    ret = open_input(argv[optind], &in);
+    if( ret ){
+        fprintf(stderr, "fwclassify: %s: %s\n", argv[optind], strerror(-ret));
+        return 1;
+    }
+    if( fw_result_init(&result) ) return 1;
+    t0 = now();
+    for( ;; ){
+        switch( in.format ){
+            case INPUT_PCAP: n = read_pcap(&in, flows, CHUNK); break;
+            case INPUT_PCAPNG: n = read_pcapng(&in, flows, CHUNK); break;
+            default: n = read_csv(&in, flows, CHUNK); break;
+        }
+        if( n == 0 ) break;
+        t1 = now();
+        fw_user_classify(flows, verdicts, n);
+        tc += now() - t1;
+        fw_result_add(&result, flows, verdicts, n);
+    }
+    t1 = now();
+    print_result(&result, top);
+    fprintf(stderr, "\n%llu flows, %lu records skipped, %.3f s, %.2f M flows/s, classify %.2f M flows/s\n",
+            (unsigned long long)result.flows, in.skipped, t1 - t0,
+            result.flows / (t1 - t0) / 1e6, tc > 0 ? result.flows / tc / 1e6 : 0);
+    fw_result_free(&result);
+    fw_user_exit();
+    return 0;
+}
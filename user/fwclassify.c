@@ -0,0 +1,588 @@
+/*
+ * libsimplefirewall, the builtin lists of the module in userspace.
+ * The sets are those of set.c without the registry, the rule nodes are
+ * those of mem.c without the slab caches.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "kernel_shim.h"
+#include "ip.h"
+#include "port.h"
+#include "mem.h"
+#include "fwclassify.h"
+
+#define FW_BATCH 256
+
+union fw_desc {
+    ip_desc ip;
+    cidr_desc cidr;
+    port_desc port;
+};
+
+/*
+ * Rules of a list, found again by the attribution of a verdict.
+ * A rule is a key, the address of an IP rule, prefix length << 32 |
+ * network of a CIDR rule, start << 16 | end of a port rule. IP and CIDR
+ * keys are hashed into slots of one cache line fetch each, ports map to
+ * the first rule of the table covering them.
+ * */
+struct fw_slot {
+    u64 key;
+    u64 rule;            /* index + 1, 0 if free */
+};
+
+struct fw_index {
+    u64 *keys;
+    size_t num;
+    size_t cap;
+    u64 prefixes;        /* CIDR, bit n set if some rule is a /n */
+    struct fw_slot *slots;
+    unsigned int shift;  /* 64 - log2 of the slots */
+    u32 *port_rule;      /* port, rule index + 1 of each port */
+    int prefetch;        /* the batch prefetches lookups of the list */
+};
+
+struct fw_set *fw_lists[F_MAX];
+static struct fw_index fw_index[F_MAX];
+static int fw_prefetch_mode = FW_PREFETCH_AUTO;
+
+static const struct {
+    const char *name;
+    enum F_LIST_TYPE list;
+    enum fw_set_kind kind;
+} builtin_sets[] = {
+    { "ip_whitelist", F_IP_WHITELIST, FW_SET_IP },
+    { "ip_blacklist", F_IP_BLACKLIST, FW_SET_IP },
+    { "cidr_whitelist", F_CIDR_WHITELIST, FW_SET_CIDR },
+    { "cidr_blacklist", F_CIDR_BLACKLIST, FW_SET_CIDR },
+    { "port_whitelist", F_PORT_WHITELIST, FW_SET_PORT },
+    { "port_blacklist", F_PORT_BLACKLIST, FW_SET_PORT },
+};
+
+static const char *stage_names[FW_STAGE_MAX] = {
+    [FW_STAGE_FRAGMENT] = "fragment",
+    [FW_STAGE_CONNTRACK] = "conntrack",
+    [FW_STAGE_POLICY] = "policy",
+    [FW_STAGE_AUTOBLOCK] = "autoblock",
+    [FW_STAGE_CIDR_BLACKLIST] = "cidr_blacklist",
+    [FW_STAGE_IP_BLACKLIST] = "ip_blacklist",
+    [FW_STAGE_CIDR_WHITELIST] = "cidr_whitelist",
+    [FW_STAGE_IP_WHITELIST] = "ip_whitelist",
+    [FW_STAGE_PORT] = "port",
+    [FW_STAGE_LISTEN] = "listen",
+    [FW_STAGE_SYNCOOKIE] = "syncookie",
+    [FW_STAGE_CONNLIMIT] = "connlimit",
+    [FW_STAGE_DEFAULT] = "default",
+};
+
+/* the address checks of fw_filter(), in its default order */
+static const struct {
+    enum fw_stage stage;
+    enum F_LIST_TYPE list;
+    int drop;
+} fw_checks[] = {
+    { FW_STAGE_CIDR_BLACKLIST, F_CIDR_BLACKLIST, 1 },
+    { FW_STAGE_IP_BLACKLIST, F_IP_BLACKLIST, 1 },
+    { FW_STAGE_CIDR_WHITELIST, F_CIDR_WHITELIST, 0 },
+    { FW_STAGE_IP_WHITELIST, F_IP_WHITELIST, 0 },
+};
+
+/* rule nodes, see mem.h */
+static const size_t node_size[FW_NODE_MAX] = {
+    [FW_NODE_IP] = sizeof(ip_desc),
+    [FW_NODE_CIDR] = sizeof(cidr_desc),
+    [FW_NODE_PORT] = sizeof(port_desc),
+};
+
+void *fw_node_alloc( enum fw_node_type type )
+{
+    return calloc(1, node_size[type]);
+}
+
+void *fw_node_alloc_node( enum fw_node_type type, int node )
+{
+    return fw_node_alloc(type);
+}
+
+size_t fw_node_size( enum fw_node_type type )
+{
+    return node_size[type];
+}
+
+void fw_node_free( enum fw_node_type type, void *p )
+{
+    free(p);
+}
+
+void fw_node_free_rcu( enum fw_node_type type, void *p )
+{
+    free(p);
+}
+
+void fw_node_commit( void )
+{
+}
+
+int fw_node_reserve( enum fw_node_type type, int num )
+{
+    return 0;
+}
+
+static inline struct fw_table *fw_list_table( int list )
+{
+    return rcu_dereference(fw_lists[list]->table);
+}
+
+/*
+ * Create the six lists, the IP lists with the backend [ip_backend],
+ * "ip" or "ip_roaring", NULL for "ip".
+ * */
+int fw_user_init( const char *ip_backend )
+{
+    const struct fw_set_ops *ip_ops = &ip_set_ops;
+    const struct fw_set_ops *ops;
+    struct fw_set *set;
+    size_t i;
+    if( ip_backend && strcmp(ip_backend, ip_roaring_set_ops.name) == 0 )
+        ip_ops = &ip_roaring_set_ops;
+    else if( ip_backend && strcmp(ip_backend, ip_set_ops.name) != 0 )
+        return -EINVAL;
+    for( i=0; i<ARRAY_SIZE(builtin_sets); i++ ){
+        switch( builtin_sets[i].kind ){
+            case FW_SET_IP: ops = ip_ops; break;
+            case FW_SET_CIDR: ops = &cidr_set_ops; break;
+            default: ops = &port_set_ops; break;
+        }
+        set = calloc(1, sizeof(*set));
+        if( !set ) goto fail;
+        snprintf(set->name, sizeof(set->name), "%s", builtin_sets[i].name);
+        set->kind = builtin_sets[i].kind;
+        set->builtin = 1;
+        set->table = ops->create();
+        if( !set->table ){
+            free(set);
+            goto fail;
+        }
+        fw_lists[builtin_sets[i].list] = set;
+    }
+    return 0;
+fail:
+    fw_user_exit();
+    return -ENOMEM;
+}
+
+static void fw_index_free( struct fw_index *x )
+{
+    free(x->keys);
+    free(x->slots);
+    free(x->port_rule);
+    memset(x, 0, sizeof(*x));
+}
+
+void fw_user_exit( void )
+{
+    struct fw_table *t;
+    int i;
+    for( i=0; i<F_MAX; i++ ){
+        if( !fw_lists[i] ) continue;
+        t = fw_list_table(i);
+        t->ops->destroy(t);
+        free(fw_lists[i]);
+        fw_lists[i] = NULL;
+        fw_index_free(&fw_index[i]);
+    }
+}
+
+int fw_user_list( const char *name )
+{
+    size_t i;
+    for( i=0; i<ARRAY_SIZE(builtin_sets); i++ )
+        if( strcmp(name, builtin_sets[i].name) == 0 )
+            return builtin_sets[i].list;
+    return -ENOENT;
+}
+
+const char *fw_user_list_name( int list )
+{
+    size_t i;
+    for( i=0; i<ARRAY_SIZE(builtin_sets); i++ )
+        if( builtin_sets[i].list == list )
+            return builtin_sets[i].name;
+    return "unknown";
+}
+
+const char *fw_user_stage_name( int stage )
+{
+    return stage < FW_STAGE_MAX ? stage_names[stage] : "unknown";
+}
+
+struct index_walk {
+    struct fw_index *x;
+    enum fw_set_kind kind;
+};
+
+static int index_add( void *p, void *arg )
+{
+    struct index_walk *w = arg;
+    struct fw_index *x = w->x;
+    union fw_desc *desc = p;
+    u64 *keys;
+    if( x->num == x->cap ){
+        keys = realloc(x->keys, (x->cap ? 2 * x->cap : 1024) * sizeof(*keys));
+        if( !keys ) return -ENOMEM;
+        x->keys = keys;
+        x->cap = x->cap ? 2 * x->cap : 1024;
+    }
+    switch( w->kind ){
+        case FW_SET_IP:
+            x->keys[x->num] = desc->ip.ip;
+            break;
+        case FW_SET_CIDR:
+            x->keys[x->num] = (u64)desc->cidr.mask << 32 | desc->cidr.ip;
+            x->prefixes |= 1ULL << desc->cidr.mask;
+            break;
+        default:
+            x->keys[x->num] = (u64)desc->port.start << 16 | desc->port.end;
+            break;
+    }
+    x->num++;
+    return 0;
+}
+
+static inline size_t index_slot( const struct fw_index *x, u64 key )
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> x->shift;
+}
+
+/*
+ * Whether to prefetch lookups of [t]. A table in the last level cache
+ * costs a few tens of cycles a miss, which out of order execution
+ * already overlaps across the independent flows of a batch, and the
+ * prefetch would only repeat the hashing of the lookup.
+ * */
+static int index_prefetch( struct fw_table *t )
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    size_t bytes = t->ops->memory(t);
+    if( fw_prefetch_mode != FW_PREFETCH_AUTO )
+        return fw_prefetch_mode == FW_PREFETCH_ON;
+    if( t->ops->node < FW_NODE_MAX )
+        bytes += t->num * node_size[t->ops->node];
+    if( llc <= 0 ) llc = FW_PREFETCH_LLC;
+    return bytes > (size_t)llc;
+}
+
+/*
+ * Rebuild the rule index of [list] from its table.
+ * */
+static int index_build( int list )
+{
+    struct fw_table *t = fw_list_table(list);
+    struct fw_index *x = &fw_index[list];
+    struct index_walk w = { x, fw_lists[list]->kind };
+    unsigned int bits;
+    size_t i, j;
+    u32 port;
+    int ret;
+
+    fw_index_free(x);
+    ret = t->ops->walk(t, index_add, &w);
+    if( ret ) return ret;
+    x->prefetch = index_prefetch(t);
+    if( w.kind != FW_SET_PORT ){
+        /* at most half of the slots taken */
+        for( bits=1; (1UL << bits) < 2 * x->num; bits++ );
+        x->shift = 64 - bits;
+        x->slots = calloc(1UL << bits, sizeof(*x->slots));
+        if( !x->slots ) return -ENOMEM;
+        for( i=0; i<x->num; i++ ){
+            for( j=index_slot(x, x->keys[i]); x->slots[j].rule; j=(j + 1) & ((1UL << bits) - 1) );
+            x->slots[j].key = x->keys[i];
+            x->slots[j].rule = i + 1;
+        }
+        return 0;
+    }
+    /* the first range of the table covering a port is its rule */
+    x->port_rule = calloc(1 << 16, sizeof(u32));
+    if( !x->port_rule ) return -ENOMEM;
+    for( i=x->num; i-- > 0; )
+        for( port=x->keys[i] >> 16; port<=(x->keys[i] & 0xffff); port++ )
+            x->port_rule[port] = i + 1;
+    return 0;
+}
+
+/*
+ * Add the rules of the file at [path] to [list], one per line as they
+ * are written to the list under /proc/simplefirewall, empty lines and
+ * lines starting with # are skipped. Lines that do not parse are counted
+ * in [invalid].
+ * */
+int fw_user_load( int list, const char *path, unsigned long *invalid )
+{
+    struct fw_table *t = fw_list_table(list);
+    union fw_desc desc;
+    char line[256];
+    char *s, *e;
+    FILE *f;
+    int ret = 0;
+
+    f = fopen(path, "r");
+    if( !f ) return -errno;
+    while( fgets(line, sizeof(line), f) ){
+        for( s=line; isspace((unsigned char)*s); s++ );
+        for( e=s+strlen(s); e>s && isspace((unsigned char)e[-1]); e-- );
+        *e = 0;
+        if( *s == 0 || *s == '#' ) continue;
+        memset(&desc, 0, sizeof(desc));
+        if( t->ops->parse(s, &desc) == 0 ){
+            (*invalid)++;
+            continue;
+        }
+        switch( fw_lists[list]->kind ){
+            case FW_SET_IP: desc.ip.flags = 1 << list; break;
+            case FW_SET_CIDR: desc.cidr.flags = 1 << list; break;
+            default: desc.port.flags = 1 << list; break;
+        }
+        ret = t->ops->insert(t, &desc);
+        if( ret == -EINVAL ){
+            (*invalid)++;
+            ret = 0;
+        }else if( ret ){
+            break;
+        }
+    }
+    fclose(f);
+    if( ret ) return ret;
+    return index_build(list);
+}
+
+/*
+ * FW_PREFETCH_AUTO, _ON or _OFF for the lists loaded afterwards.
+ * */
+void fw_user_prefetch( int mode )
+{
+    fw_prefetch_mode = mode;
+}
+
+size_t fw_user_rules( int list )
+{
+    return fw_index[list].num;
+}
+
+/*
+ * Rule [i] of [list] as it is written to the list, 1.2.3.0/24 or 80-90.
+ * */
+void fw_user_rule_text( int list, size_t i, char *buf, size_t len )
+{
+    u64 key = fw_index[list].keys[i];
+    u32 ip = htonl((u32)key);
+    switch( fw_lists[list]->kind ){
+        case FW_SET_IP:
+            inet_ntop(AF_INET, &ip, buf, len);
+            break;
+        case FW_SET_CIDR:
+            inet_ntop(AF_INET, &ip, buf, len);
+            snprintf(buf + strlen(buf), len - strlen(buf), "/%u", (u32)(key >> 32));
+            break;
+        default:
+            if( key >> 16 == (key & 0xffff) )
+                snprintf(buf, len, "%u", (u32)(key >> 16));
+            else
+                snprintf(buf, len, "%u-%u", (u32)(key >> 16), (u32)(key & 0xffff));
+            break;
+    }
+}
+
+static inline int fw_has_port( u8 proto )
+{
+    return proto == IPPROTO_TCP || proto == IPPROTO_UDP;
+}
+
+static void classify_batch( const struct fw_flow *flows, struct fw_verdict *v, size_t n )
+{
+    u16 idx[FW_BATCH];
+    struct fw_set *white = fw_lists[F_PORT_WHITELIST];
+    struct fw_set *black = fw_lists[F_PORT_BLACKLIST];
+    struct fw_set *set;
+    const struct fw_flow *f;
+    size_t i, j, k, m = n;
+    size_t ahead;
+    int stage;
+    u16 port;
+
+    for( i=0; i<n; i++ )
+        idx[i] = i;
+    rcu_read_lock();
+    for( stage=0; stage<(int)ARRAY_SIZE(fw_checks) && m; stage++ ){
+        set = fw_lists[fw_checks[stage].list];
+        if( fw_set_table(set)->num == 0 ) continue;
+        ahead = fw_index[fw_checks[stage].list].prefetch ? FW_BATCH_AHEAD : FW_BATCH;
+        for( j=0, k=0; j<m; j++ ){
+            if( j + ahead < m )
+                fw_set_prefetch(set, flows[idx[j + FW_BATCH_AHEAD]].saddr);
+            i = idx[j];
+            if( fw_set_test(set, flows[i].saddr) ){
+                v[i].stage = fw_checks[stage].stage;
+                v[i].drop = fw_checks[stage].drop;
+            }else{
+                idx[k++] = i;
+            }
+        }
+        m = k;
+    }
+    /* the port stage, as at the end of fw_filter() */
+    ahead = fw_index[F_PORT_WHITELIST].prefetch || fw_index[F_PORT_BLACKLIST].prefetch ?
+        FW_BATCH_AHEAD : FW_BATCH;
+    for( j=0; j<m; j++ ){
+        if( j + ahead < m ){
+            port = flows[idx[j + FW_BATCH_AHEAD]].dport;
+            fw_set_prefetch(white, port);
+            fw_set_prefetch(black, port);
+        }
+        i = idx[j];
+        f = &flows[i];
+        v[i].stage = FW_STAGE_PORT;
+        v[i].drop = 0;
+        if( !fw_has_port(f->proto) || fw_set_test(white, f->dport) ) continue;
+        v[i].drop = 1;
+        if( !fw_set_test(black, f->dport) )
+            v[i].stage = FW_STAGE_DEFAULT;
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Verdicts of [n] flows into [v].
+ * */
+void fw_user_classify( const struct fw_flow *flows, struct fw_verdict *v, size_t n )
+{
+    size_t i;
+    for( i=0; i<n; i+=FW_BATCH )
+        classify_batch(flows + i, v + i, min_t(size_t, n - i, FW_BATCH));
+}
+
+/*
+ * Counters for the rules loaded so far, load all lists first.
+ * */
+int fw_result_init( struct fw_result *r )
+{
+    int i;
+    memset(r, 0, sizeof(*r));
+    for( i=0; i<F_MAX; i++ ){
+        r->hits[i] = calloc(fw_index[i].num + 1, sizeof(u64));
+        if( !r->hits[i] ){
+            fw_result_free(r);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void fw_result_free( struct fw_result *r )
+{
+    int i;
+    for( i=0; i<F_MAX; i++ ){
+        free(r->hits[i]);
+        r->hits[i] = NULL;
+    }
+}
+
+static long index_find( const struct fw_index *x, u64 key )
+{
+    size_t mask = (1UL << (64 - x->shift)) - 1;
+    size_t j;
+    if( !x->slots ) return -1;
+    for( j=index_slot(x, key); x->slots[j].rule; j=(j + 1) & mask )
+        if( x->slots[j].key == key ) return x->slots[j].rule - 1;
+    return -1;
+}
+
+/*
+ * The rule of [list] matching [f], the longest prefix for CIDR lists
+ * as cidr_table_test() finds it.
+ * */
+static long rule_of( int list, const struct fw_flow *f )
+{
+    const struct fw_index *x = &fw_index[list];
+    u64 prefixes;
+    long ret;
+    u8 mask;
+    switch( fw_lists[list]->kind ){
+        case FW_SET_IP:
+            return index_find(x, f->saddr);
+        case FW_SET_CIDR:
+            prefixes = x->prefixes;
+            while( prefixes ){
+                mask = fls64(prefixes) - 1;
+                prefixes &= ~(1ULL << mask);
+                ret = index_find(x, (u64)mask << 32 | (f->saddr & (mask ? ~0U << (32 - mask) : 0)));
+                if( ret >= 0 ) return ret;
+            }
+            return -1;
+        default:
+            return (long)x->port_rule[f->dport] - 1;
+    }
+}
+
+/*
+ * The list whose rule decided [v], -1 if none did.
+ * */
+static inline int list_of( const struct fw_flow *f, const struct fw_verdict *v )
+{
+    switch( v->stage ){
+        case FW_STAGE_CIDR_BLACKLIST: return F_CIDR_BLACKLIST;
+        case FW_STAGE_IP_BLACKLIST: return F_IP_BLACKLIST;
+        case FW_STAGE_CIDR_WHITELIST: return F_CIDR_WHITELIST;
+        case FW_STAGE_IP_WHITELIST: return F_IP_WHITELIST;
+        case FW_STAGE_PORT:
+            if( !fw_has_port(f->proto) ) return -1;
+            return v->drop ? F_PORT_BLACKLIST : F_PORT_WHITELIST;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Count the verdicts [v] of [n] flows, and the rule behind each one.
+ * */
+void fw_result_add( struct fw_result *r, const struct fw_flow *flows,
+        const struct fw_verdict *v, size_t n )
+{
+    const struct fw_index *x;
+    size_t i;
+    int list;
+    long rule;
+    for( i=0; i<n; i++ ){
+        if( i + FW_BATCH_AHEAD < n ){
+            list = list_of(&flows[i + FW_BATCH_AHEAD], &v[i + FW_BATCH_AHEAD]);
+            x = list >= 0 ? &fw_index[list] : NULL;
+            if( x && x->slots && fw_lists[list]->kind == FW_SET_IP )
+                prefetch(&x->slots[index_slot(x, flows[i + FW_BATCH_AHEAD].saddr)]);
+        }
+        if( v[i].drop ) r->drop[v[i].stage]++;
+        else r->accept[v[i].stage]++;
+        list = list_of(&flows[i], &v[i]);
+        if( list < 0 ) continue;
+        rule = rule_of(list, &flows[i]);
+        if( rule >= 0 ) r->hits[list][rule]++;
+    }
+    r->flows += n;
+}
+
+void fw_result_merge( struct fw_result *dst, const struct fw_result *src )
+{
+    size_t i, j;
+    dst->flows += src->flows;
+    for( i=0; i<FW_STAGE_MAX; i++ ){
+        dst->accept[i] += src->accept[i];
+        dst->drop[i] += src->drop[i];
+    }
+    for( i=0; i<F_MAX; i++ )
+        for( j=0; j<fw_index[i].num; j++ )
+            dst->hits[i][j] += src->hits[i][j];
+}
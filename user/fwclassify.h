@@ -0,0 +1,74 @@
+#ifndef _FWCLASSIFY_H
+#define _FWCLASSIFY_H
+
+/*
+ * Userspace classifier, libsimplefirewall.
+ * Links ip.c, cidr.c, port.c and iproaring.c of the module and runs the
+ * builtin lists in the order fw_filter() checks them: CIDR and IP
+ * blacklists, CIDR and IP whitelists, port whitelist, port blacklist,
+ * default drop. Policies, conntrack and the other optional stages of the
+ * module are not modelled.
+ *
+ * A batch is classified stage by stage, the flows still undecided after
+ * a stage are compacted and the next stage may prefetch the lines of
+ * flow i + FW_BATCH_AHEAD while testing flow i, so the cache misses of a
+ * batch overlap instead of being taken one after the other. By default
+ * only lists larger than the last level cache are prefetched.
+ *
+ * The tables are filled by fw_user_load() and then only read, any number
+ * of threads may classify at the same time, each with its own fw_result.
+ * */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "stat.h"
+
+#define FW_BATCH_AHEAD 8
+#define FW_PREFETCH_LLC (32 << 20)   /* if the cache size is unknown */
+
+enum {
+    FW_PREFETCH_AUTO,
+    FW_PREFETCH_OFF,
+    FW_PREFETCH_ON,
+};
+
+struct fw_flow {
+    uint32_t saddr;     /* host order */
+    uint16_t dport;
+    uint8_t proto;
+};
+
+/* the verdict of a flow, as fw_filter() reports it in trace_fw_verdict */
+struct fw_verdict {
+    uint8_t stage;      /* enum fw_stage */
+    uint8_t drop;
+};
+
+struct fw_result {
+    uint64_t flows;
+    uint64_t accept[FW_STAGE_MAX];
+    uint64_t drop[FW_STAGE_MAX];
+    uint64_t *hits[F_MAX];   /* matches of each rule of a list */
+};
+
+int fw_user_init( const char *ip_backend );
+void fw_user_exit( void );
+int fw_user_list( const char *name );
+int fw_user_load( int list, const char *path, unsigned long *invalid );
+void fw_user_prefetch( int mode );
+
+void fw_user_classify( const struct fw_flow *flows, struct fw_verdict *v, size_t n );
+
+int fw_result_init( struct fw_result *r );
+void fw_result_add( struct fw_result *r, const struct fw_flow *flows,
+        const struct fw_verdict *v, size_t n );
+void fw_result_merge( struct fw_result *dst, const struct fw_result *src );
+void fw_result_free( struct fw_result *r );
+
+size_t fw_user_rules( int list );
+void fw_user_rule_text( int list, size_t i, char *buf, size_t len );
+const char *fw_user_list_name( int list );
+const char *fw_user_stage_name( int stage );
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _COMMON_H
+#define _COMMON_H
+
+/*
+ * Names shared by the lookup code, used when ../kernel/common.h
+ * is not in the tree.
+ * */
+
+enum F_LIST_TYPE {
+    F_IP_WHITELIST,
+    F_IP_BLACKLIST,
+    F_CIDR_WHITELIST,
+    F_CIDR_BLACKLIST,
+    F_PORT_WHITELIST,
+    F_PORT_BLACKLIST,
+    F_MAX
+};
+
+#define IP_WHITELIST_MASK   (1<<F_IP_WHITELIST)
+#define IP_BLACKLIST_MASK   (1<<F_IP_BLACKLIST)
+#define CIDR_WHITELIST_MASK (1<<F_CIDR_WHITELIST)
+#define CIDR_BLACKLIST_MASK (1<<F_CIDR_BLACKLIST)
+#define PORT_WHITELIST_MASK (1<<F_PORT_WHITELIST)
+#define PORT_BLACKLIST_MASK (1<<F_PORT_BLACKLIST)
+
+#define FW_PROC "simplefirewall"
+#define IP_NAME "ip"
+#define CIDR_NAME "cidr"
+#define PORT_NAME "port"
+
+#endif
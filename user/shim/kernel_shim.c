@@ -0,0 +1,211 @@
+/*
+ * Userspace versions of the kernel helpers declared in kernel_shim.h.
+ * */
+
+#include "kernel_shim.h"
+
+int fw_user_verbose;
+
+static int fw_user_cpus;
+static __thread int fw_user_cpu_id = -1;
+
+/*
+ * Per-cpu slot of the calling thread, taken on first use.
+ * */
+int fw_user_cpu( void )
+{
+    if( unlikely( fw_user_cpu_id < 0 ) )
+        fw_user_cpu_id = __atomic_fetch_add(&fw_user_cpus, 1, __ATOMIC_RELAXED) % FW_USER_CPUS;
+    return fw_user_cpu_id;
+}
+
+/*
+ * Radix tree of 32 bit keys, RADIX_TREE_MAP_SHIFT bits per level.
+ * Interior levels hold child nodes, the last level holds the items.
+ * */
+#define RT_LEVELS DIV_ROUND_UP(32, RADIX_TREE_MAP_SHIFT)
+#define RT_MASK (RADIX_TREE_MAP_SIZE - 1)
+
+static inline unsigned int rt_offset( unsigned long index, int level )
+{
+    return (index >> (RADIX_TREE_MAP_SHIFT * (RT_LEVELS - 1 - level))) & RT_MASK;
+}
+
+void *radix_tree_lookup( const struct radix_tree_root *root, unsigned long index )
+{
+    struct radix_tree_node *node = root->rnode;
+    int level;
+    for( level=0; node && level<RT_LEVELS-1; level++ )
+        node = node->slots[rt_offset(index, level)];
+    return node ? node->slots[rt_offset(index, RT_LEVELS - 1)] : NULL;
+}
+
+int radix_tree_insert( struct radix_tree_root *root, unsigned long index, void *item )
+{
+    struct radix_tree_node **pnode = &root->rnode;
+    struct radix_tree_node *node;
+    unsigned int off;
+    int level;
+    if( index > 0xffffffffUL ) return -EINVAL;
+    for( level=0; level<RT_LEVELS; level++ ){
+        if( !*pnode ){
+            *pnode = calloc(1, sizeof(struct radix_tree_node));
+            if( !*pnode ) return -ENOMEM;
+        }
+        node = *pnode;
+        off = rt_offset(index, level);
+        if( level == RT_LEVELS - 1 ){
+            if( node->slots[off] ) return -EEXIST;
+            node->slots[off] = item;
+            node->count++;
+            return 0;
+        }
+        if( !node->slots[off] ) node->count++;
+        pnode = (struct radix_tree_node **)&node->slots[off];
+    }
+    return 0;
+}
+
+static void *rt_delete( struct radix_tree_node **pnode, unsigned long index, int level )
+{
+    struct radix_tree_node *node = *pnode;
+    unsigned int off;
+    void *item;
+    if( !node ) return NULL;
+    off = rt_offset(index, level);
+    if( level == RT_LEVELS - 1 ){
+        item = node->slots[off];
+        if( item ){
+            node->slots[off] = NULL;
+            node->count--;
+        }
+    }else{
+        item = rt_delete((struct radix_tree_node **)&node->slots[off], index, level + 1);
+        if( item && !node->slots[off] ) node->count--;
+    }
+    if( node->count == 0 ){
+        free(node);
+        *pnode = NULL;
+    }
+    return item;
+}
+
+void *radix_tree_delete( struct radix_tree_root *root, unsigned long index )
+{
+    return rt_delete(&root->rnode, index, 0);
+}
+
+static void **rt_find( struct radix_tree_node *node, unsigned long start,
+        int level, unsigned long prefix, unsigned long *index )
+{
+    unsigned int off, first;
+    unsigned long base;
+    void **slot;
+    int shift = RADIX_TREE_MAP_SHIFT * (RT_LEVELS - 1 - level);
+    first = rt_offset(start, level);
+    for( off=first; off<RADIX_TREE_MAP_SIZE; off++ ){
+        if( !node->slots[off] ) continue;
+        base = prefix | ((unsigned long)off << shift);
+        if( level == RT_LEVELS - 1 ){
+            *index = base;
+            return &node->slots[off];
+        }
+        /* past the first slot the whole subtree is after start */
+        slot = rt_find(node->slots[off], off == first ? start : base, level + 1, base, index);
+        if( slot ) return slot;
+    }
+    return NULL;
+}
+
+/*
+ * First slot at or after [start], or NULL.
+ * */
+void **radix_tree_iter_find( const struct radix_tree_root *root,
+        struct radix_tree_iter *iter, unsigned long start )
+{
+    if( !root->rnode || start > 0xffffffffUL ) return NULL;
+    return rt_find(root->rnode, start, 0, 0, &iter->index);
+}
+
+/* bitmaps */
+unsigned long *bitmap_zalloc( unsigned int nbits, gfp_t flags )
+{
+    return calloc(BITS_TO_LONGS(nbits), sizeof(long));
+}
+
+void bitmap_free( const unsigned long *bitmap )
+{
+    free((void *)bitmap);
+}
+
+void bitmap_set( unsigned long *map, unsigned int start, unsigned int len )
+{
+    unsigned int i;
+    for( i=start; i<start+len; i++ )
+        set_bit(i, map);
+}
+
+void bitmap_clear( unsigned long *map, unsigned int start, unsigned int len )
+{
+    unsigned int i;
+    for( i=start; i<start+len; i++ )
+        clear_bit(i, map);
+}
+
+int bitmap_weight( const unsigned long *src, unsigned int nbits )
+{
+    unsigned int i;
+    int w = 0;
+    for( i=0; i<nbits/BITS_PER_LONG; i++ )
+        w += hweight_long(src[i]);
+    if( nbits % BITS_PER_LONG )
+        w += hweight_long(src[i] & (BIT_MASK(nbits) - 1));
+    return w;
+}
+
+static unsigned long find_next( const unsigned long *addr, unsigned long size,
+        unsigned long offset, unsigned long invert )
+{
+    unsigned long word;
+    if( offset >= size ) return size;
+    word = (addr[BIT_WORD(offset)] ^ invert) & (~0UL << (offset % BITS_PER_LONG));
+    offset -= offset % BITS_PER_LONG;
+    while( !word ){
+        offset += BITS_PER_LONG;
+        if( offset >= size ) return size;
+        word = addr[BIT_WORD(offset)] ^ invert;
+    }
+    return min(offset + __builtin_ctzl(word), size);
+}
+
+unsigned long find_next_bit( const unsigned long *addr, unsigned long size, unsigned long offset )
+{
+    return find_next(addr, size, offset, 0);
+}
+
+unsigned long find_next_zero_bit( const unsigned long *addr, unsigned long size, unsigned long offset )
+{
+    return find_next(addr, size, offset, ~0UL);
+}
+
+/* parsing */
+int in4_pton( const char *src, int srclen, u8 *dst, int delim, const char **end )
+{
+    char buf[16];
+    size_t len = srclen < 0 ? strlen(src) : (size_t)srclen;
+    if( len >= sizeof(buf) ) return 0;
+    memcpy(buf, src, len);
+    buf[len] = 0;
+    return inet_pton(AF_INET, buf, dst) == 1;
+}
+
+int kstrtoul( const char *s, unsigned int base, unsigned long *res )
+{
+    char *end;
+    if( *s < '0' || *s > '9' ) return -EINVAL;
+    errno = 0;
+    *res = strtoul(s, &end, base);
+    if( errno ) return -ERANGE;
+    if( *end == '\n' ) end++;
+    return *end ? -EINVAL : 0;
+}
@@ -0,0 +1,427 @@
+#ifndef _KERNEL_SHIM_H
+#define _KERNEL_SHIM_H
+
+/*
+ * The kernel API used by the lookup code of ../kernel, mapped to libc,
+ * so that ip.c, cidr.c, port.c and iproaring.c compile unchanged in
+ * userspace. Tables are filled first and only read afterwards, so RCU is
+ * a no-op and deferred frees are immediate. Per-cpu data has one copy
+ * per thread slot, see fw_user_cpu().
+ * */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <malloc.h>
+#include <arpa/inet.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint16_t __be16;
+typedef uint32_t __be32;
+typedef unsigned int gfp_t;
+typedef struct { int refs; } refcount_t;
+typedef u64 cycles_t;
+
+#define __rcu
+#define __percpu
+#define __init
+#define __exit
+#define __read_mostly
+#define __user
+
+#define GFP_KERNEL  0
+#define GFP_ATOMIC  0
+#define NUMA_NO_NODE (-1)
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)        (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)    (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_load_acquire(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b)           ((a) < (b) ? (a) : (b))
+#define max(a, b)           ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)      ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)      ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define DIV_ROUND_UP(n, d)  (((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a)       (sizeof(a) / sizeof((a)[0]))
+
+#define BITS_PER_LONG       (8 * sizeof(long))
+#define BITS_TO_LONGS(n)    DIV_ROUND_UP(n, BITS_PER_LONG)
+#define BIT_WORD(n)         ((n) / BITS_PER_LONG)
+#define BIT_MASK(n)         (1UL << ((n) % BITS_PER_LONG))
+
+#define IS_ERR(p)           ((unsigned long)(p) >= (unsigned long)-4095)
+#define PTR_ERR(p)          ((long)(p))
+#define ERR_PTR(e)          ((void *)(long)(e))
+
+/* logs() of log.h formats into a buffer, printing is up to fw_user_verbose */
+extern int fw_user_verbose;
+#define KERN_INFO ""
+#define printk(fmt, ...) \
+    do { if( fw_user_verbose ) fprintf(stderr, fmt, ##__VA_ARGS__); } while( 0 )
+
+/* memory */
+#define kmalloc(n, f)               malloc(n)
+#define kzalloc(n, f)               calloc(1, n)
+#define kcalloc(n, s, f)            calloc(n, s)
+#define kvmalloc(n, f)              malloc(n)
+#define kvzalloc(n, f)              calloc(1, n)
+#define kvmalloc_array(n, s, f)     calloc(n, s)
+#define kvcalloc(n, s, f)           calloc(n, s)
+#define kfree(p)                    free((void *)(p))
+#define kvfree(p)                   free((void *)(p))
+#define kfree_rcu(p, member)        free(p)
+#define ksize(p)                    malloc_usable_size(p)
+#define kmemdup(p, n, f)            memcpy(malloc(n), p, n)
+#define array_size(a, b)            ((size_t)(a) * (b))
+
+/* rcu, readers never overlap writers here */
+struct rcu_head { void *next; };
+struct work_struct { void *data; };
+struct rcu_work { struct work_struct work; };
+#define rcu_read_lock()                     do { } while( 0 )
+#define rcu_read_unlock()                   do { } while( 0 )
+#define rcu_dereference(p)                  READ_ONCE(p)
+#define rcu_dereference_protected(p, c)     (p)
+#define rcu_access_pointer(p)               READ_ONCE(p)
+#define rcu_assign_pointer(p, v)            smp_store_release(&(p), v)
+#define RCU_INIT_POINTER(p, v)              ((p) = (v))
+#define synchronize_rcu()                   do { } while( 0 )
+#define lockdep_is_held(l)                  1
+
+/* per-cpu: FW_USER_CPUS copies, a thread uses the slot of fw_user_cpu() */
+#define FW_USER_CPUS 64
+int fw_user_cpu( void );
+#define alloc_percpu(type)          ((type *)calloc(FW_USER_CPUS, sizeof(type)))
+#define free_percpu(p)              free(p)
+#define per_cpu_ptr(p, cpu)         (&(p)[cpu])
+#define this_cpu_ptr(p)             per_cpu_ptr(p, fw_user_cpu())
+#define get_cpu_ptr(p)              this_cpu_ptr(p)
+#define put_cpu_ptr(p)              do { } while( 0 )
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) name
+#define DEFINE_PER_CPU(type, name)  __typeof__(type) name
+#define this_cpu_inc(x)             ((x)++)
+#define this_cpu_add(x, v)          ((x) += (v))
+#define num_possible_cpus()         FW_USER_CPUS
+#define numa_node_id()              0
+
+/* static keys are off, sizeof keeps the key unreferenced */
+struct static_key_false { int enabled; };
+struct static_key_true { int enabled; };
+#define DECLARE_STATIC_KEY_FALSE(name)  extern struct static_key_false name
+#define DECLARE_STATIC_KEY_TRUE(name)   extern struct static_key_true name
+#define static_branch_unlikely(k)       ((void)sizeof(k), 0)
+#define static_branch_likely(k)         ((void)sizeof(k), 0)
+
+#define prefetch(x)     __builtin_prefetch(x)
+
+static inline u64 get_cycles( void )
+{
+    return __builtin_ia32_rdtsc();
+}
+
+/* bit operations */
+static inline int fls64( u64 x )
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline int hweight_long( unsigned long w )
+{
+    return __builtin_popcountl(w);
+}
+
+static inline int test_bit( unsigned long nr, const unsigned long *addr )
+{
+    return (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline void set_bit( unsigned long nr, unsigned long *addr )
+{
+    addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void clear_bit( unsigned long nr, unsigned long *addr )
+{
+    addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+#define __set_bit(nr, addr)     set_bit(nr, addr)
+#define __clear_bit(nr, addr)   clear_bit(nr, addr)
+
+static inline int __test_and_set_bit( unsigned long nr, unsigned long *addr )
+{
+    int old = test_bit(nr, addr);
+    set_bit(nr, addr);
+    return old;
+}
+
+static inline int __test_and_clear_bit( unsigned long nr, unsigned long *addr )
+{
+    int old = test_bit(nr, addr);
+    clear_bit(nr, addr);
+    return old;
+}
+
+unsigned long *bitmap_zalloc( unsigned int nbits, gfp_t flags );
+void bitmap_free( const unsigned long *bitmap );
+void bitmap_set( unsigned long *map, unsigned int start, unsigned int len );
+void bitmap_clear( unsigned long *map, unsigned int start, unsigned int len );
+int bitmap_weight( const unsigned long *src, unsigned int nbits );
+unsigned long find_next_bit( const unsigned long *addr, unsigned long size, unsigned long offset );
+unsigned long find_next_zero_bit( const unsigned long *addr, unsigned long size, unsigned long offset );
+#define find_first_bit(addr, size)  find_next_bit(addr, size, 0)
+#define for_each_set_bit(bit, addr, size) \
+    for( (bit) = find_first_bit(addr, size); \
+         (bit) < (size); \
+         (bit) = find_next_bit(addr, size, (bit) + 1) )
+
+static inline void bitmap_zero( unsigned long *dst, unsigned int nbits )
+{
+    memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline void bitmap_copy( unsigned long *dst, const unsigned long *src, unsigned int nbits )
+{
+    memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+/* lists */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD( struct list_head *list )
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add( struct list_head *new, struct list_head *prev, struct list_head *next )
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add( struct list_head *new, struct list_head *head )
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void list_add_tail( struct list_head *new, struct list_head *head )
+{
+    __list_add(new, head->prev, head);
+}
+
+static inline void list_del( struct list_head *entry )
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+}
+
+static inline int list_empty( const struct list_head *head )
+{
+    return head->next == head;
+}
+
+#define list_add_rcu        list_add
+#define list_add_tail_rcu   list_add_tail
+#define list_del_rcu        list_del
+
+#define list_entry(ptr, type, member)   container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) \
+    list_entry((pos)->member.next, __typeof__(*(pos)), member)
+
+#define list_for_each_entry(pos, head, member) \
+    for( pos = list_first_entry(head, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = list_next_entry(pos, member) )
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for( pos = list_first_entry(head, __typeof__(*pos), member), \
+         n = list_next_entry(pos, member); \
+         &pos->member != (head); \
+         pos = n, n = list_next_entry(n, member) )
+
+#define list_for_each_entry_rcu list_for_each_entry
+
+#define INIT_HLIST_HEAD(ptr) ((ptr)->first = NULL)
+
+static inline void hlist_add_head( struct hlist_node *n, struct hlist_head *h )
+{
+    struct hlist_node *first = h->first;
+    n->next = first;
+    if( first )
+        first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del( struct hlist_node *n )
+{
+    struct hlist_node *next = n->next;
+    *n->pprev = next;
+    if( next )
+        next->pprev = n->pprev;
+}
+
+#define hlist_add_head_rcu  hlist_add_head
+#define hlist_del_rcu       hlist_del
+
+#define hlist_entry_safe(ptr, type, member) \
+    ({ __typeof__(ptr) ____ptr = (ptr); \
+       ____ptr ? container_of(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry(pos, head, member) \
+    for( pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); \
+         pos; \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member) )
+
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+    for( pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+         pos && ({ n = pos->member.next; 1; }); \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member) )
+
+#define hlist_for_each_entry_rcu hlist_for_each_entry
+
+/* radix tree of u32 keys, RADIX_TREE_MAP_SHIFT bits per level */
+#define RADIX_TREE_MAP_SHIFT    8
+#define RADIX_TREE_MAP_SIZE     (1 << RADIX_TREE_MAP_SHIFT)
+
+struct radix_tree_node {
+    void *slots[RADIX_TREE_MAP_SIZE];
+    unsigned int count;
+};
+
+struct radix_tree_root {
+    struct radix_tree_node *rnode;
+};
+
+struct radix_tree_iter {
+    unsigned long index;
+};
+
+#define INIT_RADIX_TREE(root, mask) ((root)->rnode = NULL)
+
+void *radix_tree_lookup( const struct radix_tree_root *root, unsigned long index );
+int radix_tree_insert( struct radix_tree_root *root, unsigned long index, void *item );
+void *radix_tree_delete( struct radix_tree_root *root, unsigned long index );
+void **radix_tree_iter_find( const struct radix_tree_root *root,
+        struct radix_tree_iter *iter, unsigned long start );
+
+#define radix_tree_iter_delete(root, iter, slot) radix_tree_delete(root, (iter)->index)
+#define radix_tree_for_each_slot(slot, root, iter, start) \
+    for( slot = radix_tree_iter_find(root, iter, start); \
+         slot; \
+         slot = (iter)->index == 0xffffffffUL ? NULL : \
+                radix_tree_iter_find(root, iter, (iter)->index + 1) )
+
+/* hashing, the lookup3 functions of the kernel */
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 rol32( u32 word, unsigned int shift )
+{
+    return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_final(a, b, c) \
+{ \
+    c ^= b; c -= rol32(b, 14); \
+    a ^= c; a -= rol32(c, 11); \
+    b ^= a; b -= rol32(a, 25); \
+    c ^= b; c -= rol32(b, 16); \
+    a ^= c; a -= rol32(c, 4); \
+    b ^= a; b -= rol32(a, 14); \
+    c ^= b; c -= rol32(b, 24); \
+}
+
+static inline u32 __jhash_nwords( u32 a, u32 b, u32 c, u32 initval )
+{
+    a += initval;
+    b += initval;
+    c += initval;
+    __jhash_final(a, b, c);
+    return c;
+}
+
+static inline u32 jhash_3words( u32 a, u32 b, u32 c, u32 initval )
+{
+    return __jhash_nwords(a, b, c, initval + JHASH_INITVAL + (3 << 2));
+}
+
+static inline u32 jhash_2words( u32 a, u32 b, u32 initval )
+{
+    return __jhash_nwords(a, b, 0, initval + JHASH_INITVAL + (2 << 2));
+}
+
+static inline u32 jhash_1word( u32 a, u32 initval )
+{
+    return __jhash_nwords(a, 0, 0, initval + JHASH_INITVAL + (1 << 2));
+}
+
+/* parsing */
+int in4_pton( const char *src, int srclen, u8 *dst, int delim, const char **end );
+int kstrtoul( const char *s, unsigned int base, unsigned long *res );
+
+static inline int kstrtou16( const char *s, unsigned int base, u16 *res )
+{
+    unsigned long v;
+    if( kstrtoul(s, base, &v) ) return -EINVAL;
+    if( v > 0xffff ) return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+static inline int kstrtou8( const char *s, unsigned int base, u8 *res )
+{
+    unsigned long v;
+    if( kstrtoul(s, base, &v) ) return -EINVAL;
+    if( v > 0xff ) return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+/* verdicts */
+#define NF_DROP     0
+#define NF_ACCEPT   1
+
+/* tracepoints compile to nothing */
+#define TRACE_DEFINE_ENUM(x)
+#define TP_PROTO(...)           __VA_ARGS__
+#define TRACE_EVENT(name, proto, ...) \
+    static inline void trace_##name( proto ) { }
+
+struct seq_file;
+
+#endif
@@ -0,0 +1 @@
+/* tracepoints are empty inlines, see TRACE_EVENT in kernel_shim.h */